@@ -0,0 +1,88 @@
+/* compare Poller dispatch cost with the poll() and epoll backends
+   as the number of (mostly idle) file descriptors grows */
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "poller.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* allow as many fds as the hard limit permits */
+static void raise_fd_limit()
+{
+  rlimit limit;
+  SystemCall( "getrlimit", getrlimit( RLIMIT_NOFILE, &limit ) );
+  limit.rlim_cur = limit.rlim_max;
+  SystemCall( "setrlimit", setrlimit( RLIMIT_NOFILE, &limit ) );
+}
+
+/* average nanoseconds per Poller::poll() call when one of fd_count fds is ready */
+static double ns_per_poll( const Poller::Backend backend,
+			   const size_t fd_count,
+			   const unsigned int rounds )
+{
+  vector<FileDescriptor> fds;
+  fds.reserve( fd_count ); /* actions hold references, so never reallocate */
+
+  Poller poller( backend );
+
+  for ( size_t i = 0; i < fd_count; i++ ) {
+    fds.emplace_back( SystemCall( "eventfd", eventfd( 0, EFD_NONBLOCK ) ) );
+    FileDescriptor & fd = fds.back();
+    poller.add_action( Action( fd, Direction::In, [&fd] () {
+	  fd.read( sizeof( uint64_t ) );
+	  return ResultType::Continue;
+	} ) );
+  }
+
+  const uint64_t one = 1;
+  const auto start = chrono::steady_clock::now();
+
+  for ( unsigned int round = 0; round < rounds; round++ ) {
+    const FileDescriptor & ready = fds[ (round * 7919) % fd_count ];
+    SystemCall( "write", ::write( ready.fd_num(), &one, sizeof( one ) ) );
+
+    if ( poller.poll( -1 ).result != PollResult::Success ) {
+      throw runtime_error( "unexpected poll result" );
+    }
+  }
+
+  const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count() / rounds;
+}
+
+int main()
+{
+  try {
+    raise_fd_limit();
+
+    cout << setw( 8 ) << "fds" << setw( 16 ) << "poll (ns)" << setw( 16 ) << "epoll (ns)"
+	 << setw( 10 ) << "speedup" << endl;
+
+    for ( const size_t fd_count : { 10, 1000, 10000 } ) {
+      const unsigned int rounds = fd_count >= 10000 ? 2000 : 20000;
+
+      const double poll_ns = ns_per_poll( Poller::Backend::Poll, fd_count, rounds );
+      const double epoll_ns = ns_per_poll( Poller::Backend::Epoll, fd_count, rounds );
+
+      cout << setw( 8 ) << fd_count
+	   << setw( 16 ) << fixed << setprecision( 0 ) << poll_ns
+	   << setw( 16 ) << epoll_ns
+	   << setw( 9 ) << setprecision( 1 ) << poll_ns / epoll_ns << "x" << endl;
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,380 @@
+/* compare tcpserver's two models as the number of connected clients grows:
+   a thread per connection (blocking reads and writes) against a few
+   reactors (one event loop per core, non-blocking sockets). Both answer
+   each message as tcpserver does; the clients live in this process too,
+   on one epoll Poller. Before measuring, it checks that a client that
+   resets its connection leaves the reactor's other clients alone. */
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "socket.hh"
+#include "poller.hh"
+#include "reactor_server.hh"
+#include "cpu_affinity.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* each client's message, and the reply to it */
+static const string MESSAGE = "hello, server\n";
+static const string REPLY = "Received " + to_string( MESSAGE.size() ) + " bytes from you.\n";
+
+/* how many clients connect before waiting for the server to accept them */
+static const size_t CONNECT_BATCH = 1000;
+
+/* clients per source address (the ephemeral ports run out not far above this) */
+static const size_t CLIENTS_PER_SOURCE = 20000;
+
+/* fds kept back for everything else (pollers, listeners, stdio) */
+static const size_t FD_MARGIN = 64;
+
+/* allow as many fds as the hard limit permits; returns the limit */
+static size_t raise_fd_limit()
+{
+  rlimit limit;
+  SystemCall( "getrlimit", getrlimit( RLIMIT_NOFILE, &limit ) );
+  limit.rlim_cur = limit.rlim_max;
+  SystemCall( "setrlimit", setrlimit( RLIMIT_NOFILE, &limit ) );
+  return limit.rlim_cur;
+}
+
+/* a number from /proc/self/status or /proc/meminfo (e.g., "VmRSS:" in kB) */
+static uint64_t proc_field( const string & filename, const string & field )
+{
+  ifstream status( filename );
+  string name;
+  uint64_t value;
+  while ( status >> name ) {
+    if ( name == field and status >> value ) {
+      return value;
+    }
+    status.ignore( 1024, '\n' );
+  }
+  throw runtime_error( "no " + field + " in " + filename );
+}
+
+/* the server under test */
+class Server
+{
+public:
+  virtual ~Server() {}
+  virtual Address address() const = 0;
+  virtual size_t accepted() const = 0;
+};
+
+/* the original tcpserver: accept, then a thread per client */
+class ThreadServer : public Server
+{
+private:
+  TCPSocket listener_;
+  atomic<size_t> accepted_;
+  vector<thread> client_threads_;
+  thread accept_thread_;
+
+  void accept_loop()
+  {
+    while ( true ) {
+      TCPSocket client = listener_.accept();
+      client_threads_.emplace_back( [] ( TCPSocket connection ) {
+	  while ( true ) {
+	    const string chunk = connection.read();
+	    if ( connection.eof() ) { break; }
+	    connection.write( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
+	  }
+	}, move( client ) );
+      accepted_++;
+    }
+  }
+
+public:
+  ThreadServer()
+    : listener_(), accepted_( 0 ), client_threads_(), accept_thread_()
+  {
+    listener_.bind( Address( "127.0.0.1", 0 ) );
+    listener_.listen( SOMAXCONN );
+    accept_thread_ = thread( [this] () {
+	try {
+	  accept_loop();
+	} catch ( const unix_error & ) {} /* the listener was shut down */
+      } );
+  }
+
+  ~ThreadServer()
+  {
+    /* wakes accept() with an error */
+    shutdown( listener_.fd_num(), SHUT_RDWR );
+    accept_thread_.join();
+
+    /* the clients are gone by now, so each thread has seen EOF */
+    for ( auto & client_thread : client_threads_ ) {
+      client_thread.join();
+    }
+  }
+
+  Address address() const override { return listener_.local_address(); }
+  size_t accepted() const override { return accepted_; }
+
+  ThreadServer( const ThreadServer & other ) = delete;
+  const ThreadServer & operator=( const ThreadServer & other ) = delete;
+};
+
+/* the reactor-based tcpserver */
+class ReactorsServer : public Server
+{
+private:
+  atomic<size_t> accepted_;
+  unique_ptr<ReactorServer> server_;
+
+public:
+  ReactorsServer()
+    : accepted_( 0 ), server_()
+  {
+    ReactorServer::Handlers handlers;
+    handlers.on_open = [this] ( ReactorServer::Connection & ) { accepted_++; };
+    handlers.on_data = [] ( ReactorServer::Connection & client, const string & chunk ) {
+      client.send( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
+    };
+
+    const vector<int> cpus = allowed_cpus();
+    server_.reset( new ReactorServer( Address( "127.0.0.1", 0 ), handlers, cpus.size(), cpus ) );
+  }
+
+  Address address() const override { return server_->local_address(); }
+  size_t accepted() const override { return accepted_; }
+
+  ReactorsServer( const ReactorsServer & other ) = delete;
+  const ReactorsServer & operator=( const ReactorsServer & other ) = delete;
+};
+
+/* send message and wait (briefly) for the server to echo it */
+static void expect_echo( TCPSocket & client, const string & message )
+{
+  client.write( message );
+
+  string reply;
+  while ( reply.size() < message.size() ) {
+    pollfd readable = { client.fd_num(), POLLIN, 0 };
+    if ( SystemCall( "poll", poll( &readable, 1, 1000 ) ) == 0 ) {
+      throw runtime_error( "no echo of \"" + message + "\" (got \"" + reply + "\")" );
+    }
+    reply += client.read();
+    if ( client.eof() ) {
+      throw runtime_error( "server closed the connection" );
+    }
+  }
+
+  if ( reply != message ) {
+    throw runtime_error( "echo of \"" + message + "\" came back as \"" + reply + "\"" );
+  }
+}
+
+/* a client that floods an echo reactor without reading (so the reactor
+   stops reading it) and then resets must be closed, without disturbing
+   the reactor's connected clients or its new ones */
+static void check_reset_isolation()
+{
+  atomic<unsigned int> closed( 0 );
+  ReactorServer::Handlers handlers;
+  handlers.on_data = [] ( ReactorServer::Connection & client, const string & chunk ) {
+    client.send( chunk );
+  };
+  handlers.on_close = [&closed] ( ReactorServer::Connection & ) { closed++; };
+  ReactorServer server( Address( "127.0.0.1", 0 ), handlers, 1 );
+
+  TCPSocket connected;
+  connected.connect( server.local_address() );
+  expect_echo( connected, "hello" );
+
+  {
+    TCPSocket flooder;
+    flooder.connect( server.local_address() );
+
+    /* write until the reactor (having buffered all it will) stops reading */
+    const string chunk( 65536, 'x' );
+    for ( unsigned int stalls = 0; stalls < 2; ) {
+      if ( send( flooder.fd_num(), chunk.data(), chunk.size(), MSG_DONTWAIT ) < 0 ) {
+	if ( errno != EAGAIN ) {
+	  throw unix_error( "send" );
+	}
+	stalls++;
+	this_thread::sleep_for( chrono::milliseconds( 50 ) );
+      }
+    }
+
+    /* close with a reset */
+    const linger reset = { 1, 0 };
+    SystemCall( "setsockopt", setsockopt( flooder.fd_num(), SOL_SOCKET, SO_LINGER, &reset, sizeof( reset ) ) );
+  }
+
+  for ( unsigned int waits = 0; closed == 0; waits++ ) {
+    if ( waits == 100 ) {
+      throw runtime_error( "reactor never closed the connection that was reset" );
+    }
+    this_thread::sleep_for( chrono::milliseconds( 10 ) );
+  }
+
+  expect_echo( connected, "still there" );
+
+  TCPSocket newcomer;
+  newcomer.connect( server.local_address() );
+  expect_echo( newcomer, "hello" );
+}
+
+struct Measurement
+{
+  double connects_per_s, round_trips_per_s, round_ms;
+  double rss_per_connection_kb;
+  uint64_t threads;
+};
+
+/* connect client_count clients, then have every client send a message
+   and wait for every reply, rounds times */
+static Measurement measure( Server & server, const size_t client_count, const unsigned int rounds )
+{
+  Measurement ret;
+  const uint64_t rss_before = proc_field( "/proc/self/status", "VmRSS:" );
+  const Address server_address = server.address();
+
+  vector< unique_ptr<TCPSocket> > clients;
+  clients.reserve( client_count );
+
+  const auto connect_start = chrono::steady_clock::now();
+  while ( clients.size() < client_count ) {
+    const size_t batch_end = min( client_count, clients.size() + CONNECT_BATCH );
+    while ( clients.size() < batch_end ) {
+      unique_ptr<TCPSocket> client( new TCPSocket );
+      if ( client_count > CLIENTS_PER_SOURCE ) {
+	client->bind( Address( "127.0.0." + to_string( 2 + clients.size() / CLIENTS_PER_SOURCE ), 0 ) );
+      }
+      client->connect( server_address );
+      client->set_blocking( false );
+      clients.push_back( move( client ) );
+    }
+
+    while ( server.accepted() < clients.size() ) {
+      this_thread::yield();
+    }
+  }
+  const chrono::duration<double> connect_time = chrono::steady_clock::now() - connect_start;
+  ret.connects_per_s = client_count / connect_time.count();
+
+  ret.threads = proc_field( "/proc/self/status", "Threads:" );
+
+  /* each round: every client sends, then all the replies come back */
+  Poller poller( Poller::Backend::Epoll );
+  size_t bytes_received = 0;
+  for ( auto & client : clients ) {
+    TCPSocket * const socket = client.get();
+    poller.add_action( Action( *socket, Direction::In, [socket, &bytes_received] () {
+	  const string reply = socket->read();
+	  if ( socket->eof() ) {
+	    throw runtime_error( "server closed a connection" );
+	  }
+	  bytes_received += reply.size();
+	  return ResultType::Continue;
+	} ) );
+  }
+
+  const auto rounds_start = chrono::steady_clock::now();
+  for ( unsigned int round = 0; round < rounds; round++ ) {
+    for ( auto & client : clients ) {
+      client->write( MESSAGE );
+    }
+
+    const size_t expected = (round + 1) * client_count * REPLY.size();
+    while ( bytes_received < expected ) {
+      if ( poller.poll( -1 ).result != PollResult::Success ) {
+	throw runtime_error( "unexpected poll result" );
+      }
+    }
+  }
+  const chrono::duration<double> rounds_time = chrono::steady_clock::now() - rounds_start;
+  ret.round_trips_per_s = client_count * rounds / rounds_time.count();
+  ret.round_ms = rounds_time.count() * 1000 / rounds;
+
+  ret.rss_per_connection_kb = (double( proc_field( "/proc/self/status", "VmRSS:" ) ) - rss_before)
+    / client_count;
+
+  return ret;
+}
+
+static void print( const string & model, const size_t client_count, const Measurement & m )
+{
+  cout << setw( 10 ) << model << setw( 9 ) << client_count
+       << setw( 12 ) << fixed << setprecision( 0 ) << m.connects_per_s
+       << setw( 14 ) << m.round_trips_per_s
+       << setw( 11 ) << setprecision( 1 ) << m.round_ms
+       << setw( 14 ) << m.rss_per_connection_kb
+       << setw( 9 ) << m.threads << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const unsigned int rounds = argc > 1 ? atoi( argv[ 1 ] ) : 10;
+
+  try {
+    check_reset_isolation();
+
+    /* each connection takes two fds here (the client's and the server's) */
+    const size_t fd_limit = raise_fd_limit();
+    const size_t most_clients = (fd_limit - FD_MARGIN) / 2;
+
+    cout << setw( 10 ) << "model" << setw( 9 ) << "clients" << setw( 12 ) << "connects/s"
+	 << setw( 14 ) << "round trips/s" << setw( 11 ) << "round (ms)"
+	 << setw( 14 ) << "RSS/conn (kB)" << setw( 9 ) << "threads" << endl;
+
+    double thread_rss_per_connection_kb = 0;
+
+    for ( const size_t wanted : { 1000, 10000, 100000 } ) {
+      const size_t client_count = min( wanted, most_clients );
+      if ( client_count < wanted ) {
+	cout << "(" << wanted << " clients need " << 2 * wanted + FD_MARGIN
+	     << " fds; the limit is " << fd_limit << ")" << endl;
+      }
+
+      /* the thread model can take more memory than the machine has */
+      const uint64_t available_kb = proc_field( "/proc/meminfo", "MemAvailable:" );
+      if ( thread_rss_per_connection_kb * client_count > available_kb / 2 ) {
+	cout << setw( 10 ) << "threads" << setw( 9 ) << client_count
+	     << "  skipped: would need about "
+	     << uint64_t( thread_rss_per_connection_kb * client_count / 1024 ) << " MB" << endl;
+      } else {
+	ThreadServer server;
+	const Measurement m = measure( server, client_count, rounds );
+	thread_rss_per_connection_kb = max( thread_rss_per_connection_kb, m.rss_per_connection_kb );
+	print( "threads", client_count, m );
+      }
+
+      {
+	ReactorsServer server;
+	print( "reactors", client_count, measure( server, client_count, rounds ) );
+      }
+
+      if ( client_count < wanted ) {
+	break;
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/* relay a stream from one loopback TCP connection to another, as a proxy
+   does, and compare ways of moving the bytes through the relay: read()
+   into a new string and write() it, read_into() a reused RingBuffer and
+   write_from() it, or splice() it through a pipe. Then compare ways of
+   sending a file (pread() + write(), or sendfile()) and a buffer in
+   memory (write(), or MSG_ZEROCOPY) over one connection. */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socket.hh"
+#include "ring_buffer.hh"
+#include "splice_pipe.hh"
+#include "poller.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* what the source writes at a time */
+static const size_t CHUNK_SIZE = 65536;
+
+/* the file that is sent (over and over, up to the total) */
+static const size_t FILE_SIZE = 64 * 1024 * 1024;
+
+/* what a sender hands the kernel at a time */
+static const size_t SEND_SIZE = 256 * 1024;
+
+/* most zerocopy data in flight (not yet reported complete) */
+static const size_t ZEROCOPY_IN_FLIGHT = 16 * 1024 * 1024;
+
+/* the two ends of a loopback TCP connection */
+static pair<TCPSocket, TCPSocket> connected_pair()
+{
+  TCPSocket listener;
+  listener.bind( Address( "127.0.0.1", 0 ) );
+  listener.listen();
+
+  TCPSocket client;
+  client.connect( listener.local_address() );
+  return make_pair( move( client ), listener.accept() );
+}
+
+/* CPU time the calling thread has used, in seconds */
+static double thread_cpu_s()
+{
+  rusage usage;
+  SystemCall( "getrusage", getrusage( RUSAGE_THREAD, &usage ) );
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct Measurement
+{
+  double megabytes_per_s, relay_cpu_ms_per_gb;
+};
+
+/* read everything from socket, returning how many bytes that was */
+static size_t drain( TCPSocket & socket )
+{
+  size_t received = 0;
+  RingBuffer buffer;
+  while ( true ) {
+    received += socket.read_into( buffer );
+    if ( socket.eof() ) {
+      return received;
+    }
+    buffer.pop( buffer.size() );
+  }
+}
+
+/* send total bytes from a source thread through the relay (this thread)
+   to a sink thread, moving them with relay_once until the source is done */
+template <typename Relay>
+static Measurement measure( const size_t total, Relay && relay_once )
+{
+  auto inbound = connected_pair(), outbound = connected_pair();
+  TCPSocket & from_source = inbound.second, & to_sink = outbound.first;
+
+  thread source( [&inbound, total] () {
+      const string chunk( CHUNK_SIZE, 'x' );
+      for ( size_t sent = 0; sent < total; sent += CHUNK_SIZE ) {
+	inbound.first.write( chunk );
+      }
+      shutdown( inbound.first.fd_num(), SHUT_WR );
+    } );
+
+  size_t received = 0;
+  thread sink( [&outbound, &received] () { received = drain( outbound.second ); } );
+
+  const auto start = chrono::steady_clock::now();
+  const double cpu_start = thread_cpu_s();
+
+  while ( not from_source.eof() ) {
+    relay_once( from_source, to_sink );
+  }
+  shutdown( to_sink.fd_num(), SHUT_WR );
+
+  const double relay_cpu = thread_cpu_s() - cpu_start;
+  source.join();
+  sink.join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  if ( received != total ) {
+    throw runtime_error( "sink got " + to_string( received ) + " of " + to_string( total ) + " bytes" );
+  }
+
+  return { total / elapsed.count() / 1e6, relay_cpu * 1000 / (total / 1e9) };
+}
+
+/* send total bytes over a connection with send_all (in this thread) to a sink thread */
+template <typename Sender>
+static Measurement measure_send( const size_t total, Sender && send_all )
+{
+  auto connection = connected_pair();
+
+  size_t received = 0;
+  thread sink( [&connection, &received] () { received = drain( connection.second ); } );
+
+  const auto start = chrono::steady_clock::now();
+  const double cpu_start = thread_cpu_s();
+
+  send_all( connection.first );
+  shutdown( connection.first.fd_num(), SHUT_WR );
+
+  const double sender_cpu = thread_cpu_s() - cpu_start;
+  sink.join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  if ( received != total ) {
+    throw runtime_error( "sink got " + to_string( received ) + " of " + to_string( total ) + " bytes" );
+  }
+
+  return { total / elapsed.count() / 1e6, sender_cpu * 1000 / (total / 1e9) };
+}
+
+/* an unlinked temporary file of FILE_SIZE bytes (in the page cache, having just been written) */
+static FileDescriptor temporary_file()
+{
+  char name[] = "/tmp/tcp_stream_benchmark.XXXXXX";
+  FileDescriptor file( SystemCall( "mkstemp", mkstemp( name ) ) );
+  SystemCall( "unlink", unlink( name ) );
+
+  const string block( SEND_SIZE, 'f' );
+  for ( size_t written = 0; written < FILE_SIZE; written += block.size() ) {
+    file.write( block );
+  }
+  return file;
+}
+
+/* send total bytes of buffer (over and over) with MSG_ZEROCOPY, from a
+   Poller: sending while the socket has room and not too much is in
+   flight, and reading completions as they arrive on the error queue */
+static void send_zerocopy( TCPSocket & socket, const string & buffer, const size_t total )
+{
+  socket.set_zerocopy();
+  socket.set_blocking( false );
+
+  const uint32_t most_pending = ZEROCOPY_IN_FLIGHT / buffer.size();
+  size_t sent = 0, in_chunk = 0;
+
+  Poller poller( Poller::Backend::Epoll );
+  poller.add_action( Action( socket, Direction::Out,
+			     [&] () {
+			       const size_t length = min( buffer.size() - in_chunk, total - sent );
+			       const size_t bytes_sent = socket.send_zerocopy( buffer.data() + in_chunk, length );
+			       sent += bytes_sent;
+			       in_chunk = (in_chunk + bytes_sent) % buffer.size();
+			       return ResultType::Continue;
+			     },
+			     [&] () { return sent < total and socket.zerocopy_pending() < most_pending; } ) );
+  poller.add_action( Action( socket, Direction::Error,
+			     [&] () {
+			       socket.recv_zerocopy_completions();
+			       return ResultType::Continue;
+			     } ) );
+
+  /* the buffer must outlive every send that uses it */
+  while ( sent < total or socket.zerocopy_pending() > 0 ) {
+    if ( poller.poll( -1 ).result != PollResult::Success ) {
+      throw runtime_error( "unexpected poll result" );
+    }
+  }
+
+  socket.set_blocking( true );
+}
+
+static void print( const string & path, const Measurement & m )
+{
+  cout << setw( 24 ) << path << setw( 10 ) << fixed << setprecision( 0 ) << m.megabytes_per_s
+       << setw( 18 ) << setprecision( 1 ) << m.relay_cpu_ms_per_gb << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const size_t megabytes = argc > 1 ? atoi( argv[ 1 ] ) : 1024;
+  const size_t total = megabytes * 1024 * 1024 / CHUNK_SIZE * CHUNK_SIZE;
+
+  try {
+    cout << setw( 24 ) << "relay path" << setw( 10 ) << "MB/s" << setw( 18 ) << "relay CPU ms/GB" << endl;
+
+    print( "read() + write()", measure( total, [] ( TCPSocket & in, TCPSocket & out ) {
+	  const string chunk = in.read();
+	  if ( not chunk.empty() ) {
+	    out.write( chunk );
+	  }
+	} ) );
+
+    RingBuffer buffer;
+    print( "read_into + write_from", measure( total, [&buffer] ( TCPSocket & in, TCPSocket & out ) {
+	  in.read_into( buffer, CHUNK_SIZE * 4 );
+	  while ( not buffer.empty() ) {
+	    out.write_from( buffer );
+	  }
+	} ) );
+
+    SplicePipe pipe;
+    print( "splice", measure( total, [&pipe] ( TCPSocket & in, TCPSocket & out ) {
+	  pipe.fill( in );
+	  pipe.drain( out );
+	} ) );
+
+    cout << endl << setw( 24 ) << "send path" << setw( 10 ) << "MB/s" << setw( 18 ) << "sender CPU ms/GB" << endl;
+
+    FileDescriptor file = temporary_file();
+    print( "pread() + write()", measure_send( total, [&file, total] ( TCPSocket & socket ) {
+	  string chunk( SEND_SIZE, 0 );
+	  for ( size_t sent = 0; sent < total; sent += chunk.size() ) {
+	    const off_t offset = sent % FILE_SIZE;
+	    chunk.resize( min( SEND_SIZE, total - sent ) );
+	    const ssize_t bytes_read = pread( file.fd_num(), &chunk.front(), chunk.size(), offset );
+	    if ( SystemCall( "pread", bytes_read ) != ssize_t( chunk.size() ) ) {
+	      throw runtime_error( "short read of file" );
+	    }
+	    socket.write( chunk );
+	  }
+	} ) );
+
+    print( "sendfile", measure_send( total, [&file, total] ( TCPSocket & socket ) {
+	  for ( size_t sent = 0; sent < total; ) {
+	    const off_t offset = sent % FILE_SIZE;
+	    sent += socket.send_file( file, offset, min( FILE_SIZE - offset, total - sent ) );
+	  }
+	} ) );
+
+    const string memory( SEND_SIZE, 'm' );
+    print( "write() from memory", measure_send( total, [&memory, total] ( TCPSocket & socket ) {
+	  for ( size_t sent = 0; sent < total; sent += memory.size() ) {
+	    socket.write( total - sent >= memory.size() ? memory : memory.substr( 0, total - sent ) );
+	  }
+	} ) );
+
+    bool copied = false;
+    print( "MSG_ZEROCOPY", measure_send( total, [&memory, &copied, total] ( TCPSocket & socket ) {
+	  send_zerocopy( socket, memory, total );
+	  copied = socket.zerocopy_copied();
+	} ) );
+    if ( copied ) {
+      cout << "(the kernel copied the zerocopy sends after all, as it does over loopback)" << endl;
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* CPU cost of moving datagrams over loopback with plain sendmmsg/recvmmsg,
+   with segmentation offload on send (UDP GSO), and with receive
+   coalescing as well (UDP GRO) */
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include "socket.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* the contest's datagram size (48-byte header plus 1424-byte payload) */
+static const size_t DATAGRAM_SIZE = 1472;
+static const size_t BATCH_SIZE = 64;
+
+/* CPU seconds (user and system) used by the whole process so far */
+static double cpu_seconds()
+{
+  rusage usage;
+  SystemCall( "getrusage", getrusage( RUSAGE_SELF, &usage ) );
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+    + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct Measurement
+{
+  double cpu_per_gbit; /* CPU seconds per gigabit delivered */
+  double gbps;         /* delivered */
+};
+
+static Measurement measure( const bool gso, const bool gro, const chrono::milliseconds duration )
+{
+  UDPSocket receiver;
+  receiver.bind( Address( "127.0.0.1", 0 ) );
+  if ( gro ) {
+    receiver.set_gro();
+  }
+
+  UDPSocket sender;
+  sender.connect( receiver.local_address() );
+
+  atomic<bool> finished( false );
+  uint64_t bytes_received = 0;
+
+  /* count full-size datagrams until a one-byte end marker arrives */
+  thread receive_thread( [&] () {
+      DatagramPool incoming( BATCH_SIZE, 65536 );
+      while ( true ) {
+	receiver.recv_into( incoming );
+	for ( const auto & datagram : incoming ) {
+	  if ( datagram.length == 1 ) {
+	    finished = true;
+	    return;
+	  }
+	  bytes_received += datagram.length;
+	}
+      }
+    } );
+
+  DatagramPool outgoing( BATCH_SIZE, DATAGRAM_SIZE );
+  while ( not outgoing.full() ) {
+    DatagramPool::Datagram & datagram = outgoing.push_back();
+    memset( datagram.data, 'x', DATAGRAM_SIZE );
+    datagram.length = DATAGRAM_SIZE;
+  }
+
+  const double cpu_start = cpu_seconds();
+  const auto start = chrono::steady_clock::now();
+
+  while ( chrono::steady_clock::now() - start < duration ) {
+    gso ? sender.send_batch_segmented( outgoing ) : sender.send_batch( outgoing );
+  }
+
+  /* the marker may be dropped if the receive buffer is full, so repeat it */
+  while ( not finished ) {
+    sender.send( "!" );
+    this_thread::sleep_for( chrono::milliseconds( 1 ) );
+  }
+  receive_thread.join();
+
+  const double cpu = cpu_seconds() - cpu_start;
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  const double gigabits = bytes_received * 8 / 1e9;
+
+  return { cpu / gigabits, gigabits / elapsed.count() };
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const chrono::milliseconds duration( argc > 1 ? atoi( argv[ 1 ] ) : 2000 );
+
+  try {
+    cout << setw( 24 ) << "mode" << setw( 18 ) << "CPU s per Gbit" << setw( 12 ) << "Gbit/s" << endl;
+
+    const struct { const char * name; bool gso, gro; } modes[] = {
+      { "sendmmsg/recvmmsg", false, false },
+      { "GSO", true, false },
+      { "GSO + GRO", true, true } };
+
+    for ( const auto & mode : modes ) {
+      const Measurement result = measure( mode.gso, mode.gro, duration );
+      cout << setw( 24 ) << mode.name
+	   << setw( 18 ) << fixed << setprecision( 3 ) << result.cpu_per_gbit
+	   << setw( 12 ) << setprecision( 2 ) << result.gbps << endl;
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+#include <stdexcept>
+
+#include "ack_aggregator.hh"
+
+using namespace std;
+
+/* how long a sender goes unheard before its flow is forgotten, and how
+   often (at most) the flows are looked through for such senders */
+static const uint64_t FLOW_IDLE_TIMEOUT_US = 60000000;
+static const uint64_t FLOW_EXPIRY_INTERVAL_US = 10000000;
+
+/* FNV-1a over the socket address */
+size_t AckAggregator::AddressHash::operator()( const Address & address ) const
+{
+  const unsigned char * const bytes
+    = reinterpret_cast<const unsigned char *>( &address.to_sockaddr() );
+
+  uint64_t hash = 14695981039346656037ULL;
+  for ( socklen_t i = 0; i < address.size(); i++ ) {
+    hash = (hash ^ bytes[ i ]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+AckAggregator::AckAggregator( const size_t ack_every )
+  : ack_every_( ack_every ),
+    sequence_number_( 0 ),
+    flows_(),
+    pending_flows_(),
+    last_expiry_( 0 )
+{
+  if ( ack_every_ == 0 or ack_every_ > ContestMessage::AckBatch::MAX_ACKED + 1 ) {
+    throw runtime_error( "can't ack every " + to_string( ack_every_ ) + " datagrams" );
+  }
+}
+
+/* find (or start) the sender's flow, and count the datagram */
+unordered_map<Address, AckAggregator::Flow, AckAggregator::AddressHash>::iterator
+AckAggregator::arrived( const DatagramPool::Datagram & recd )
+{
+  auto found = flows_.find( recd.address );
+  if ( found == flows_.end() ) {
+    expire_idle_flows( recd.timestamp );
+    found = flows_.emplace( recd.address, Flow() ).first;
+  }
+
+  found->second.last_heard = recd.timestamp;
+  found->second.datagrams_received++;
+  return found;
+}
+
+uint64_t AckAggregator::count_arrival( const DatagramPool::Datagram & recd )
+{
+  return arrived( recd )->second.datagrams_received;
+}
+
+void AckAggregator::datagram_received( const DatagramPool::Datagram & recd, DatagramPool & acks )
+{
+  const ContestMessage::Header header( recd.data, recd.length );
+
+  const auto found = arrived( recd );
+  Flow & flow = found->second;
+
+  /* the previous latest joins the batch */
+  if ( flow.pending ) {
+    flow.batch.acked[ flow.batch.acked_count++ ] = flow.latest;
+  }
+
+  flow.latest = { header.sequence_number, header.send_timestamp, recd.timestamp };
+  flow.latest_payload_length = recd.length - header.wire_size;
+  flow.pending = true;
+  add_to_ranges( flow, header.sequence_number );
+
+  if ( flow.batch.acked_count + 1 >= ack_every_ ) {
+    queue_ack( found->first, flow, acks );
+  } else if ( not flow.listed ) {
+    flow.listed = true;
+    pending_flows_.emplace_back( &found->first, &flow );
+  }
+}
+
+bool AckAggregator::flush( DatagramPool & acks )
+{
+  while ( not pending_flows_.empty() and not acks.full() ) {
+    Flow & flow = *pending_flows_.back().second;
+    if ( flow.pending ) {
+      queue_ack( *pending_flows_.back().first, flow, acks );
+    }
+    flow.listed = false;
+    pending_flows_.pop_back();
+  }
+
+  return pending();
+}
+
+/* forget the senders that have gone quiet (when a new one turns up, so
+   churning addresses can't grow the table without bound) */
+void AckAggregator::expire_idle_flows( const uint64_t now )
+{
+  /* (datagrams' timestamps needn't be quite in order) */
+  if ( now < last_expiry_ + FLOW_EXPIRY_INTERVAL_US ) {
+    return;
+  }
+  last_expiry_ = now;
+
+  for ( auto flow = flows_.begin(); flow != flows_.end(); ) {
+    if ( not flow->second.listed and now > flow->second.last_heard + FLOW_IDLE_TIMEOUT_US ) {
+      flow = flows_.erase( flow );
+    } else {
+      ++flow;
+    }
+  }
+}
+
+/* the ranges are kept newest first, and once there are as many as an ack
+   can carry, a datagram older than all of them is forgotten (the sender
+   never resends a sequence number, so a gap is never filled in) */
+void AckAggregator::add_to_ranges( Flow & flow, const uint64_t sequence_number )
+{
+  ContestMessage::AckBatch::Range * const ranges = flow.batch.ranges;
+  size_t & count = flow.batch.range_count;
+
+  for ( size_t i = 0; i < count; i++ ) {
+    ContestMessage::AckBatch::Range & range = ranges[ i ];
+
+    if ( sequence_number > range.end ) {
+      /* a new range, newer than this one */
+      count = min( count + 1, ContestMessage::AckBatch::MAX_RANGES );
+      for ( size_t j = count - 1; j > i; j-- ) {
+	ranges[ j ] = ranges[ j - 1 ];
+      }
+      range = { sequence_number, sequence_number + 1 };
+      return;
+    }
+
+    if ( sequence_number == range.end ) {
+      range.end++;
+      if ( i > 0 and ranges[ i - 1 ].first == range.end ) {
+	/* the gap above filled in (after reordering) */
+	ranges[ i - 1 ].first = range.first;
+	for ( size_t j = i; j + 1 < count; j++ ) {
+	  ranges[ j ] = ranges[ j + 1 ];
+	}
+	count--;
+      }
+      return;
+    }
+
+    if ( sequence_number >= range.first ) {
+      return; /* a duplicate */
+    }
+
+    if ( sequence_number + 1 == range.first ) {
+      range.first--;
+      if ( i + 1 < count and ranges[ i + 1 ].end == range.first ) {
+	range.first = ranges[ i + 1 ].first;
+	for ( size_t j = i + 1; j + 1 < count; j++ ) {
+	  ranges[ j ] = ranges[ j + 1 ];
+	}
+	count--;
+      }
+      return;
+    }
+  }
+
+  if ( count < ContestMessage::AckBatch::MAX_RANGES ) {
+    ranges[ count++ ] = { sequence_number, sequence_number + 1 };
+  }
+}
+
+/* ack the flow's latest datagram in the header, and the rest in the batch */
+void AckAggregator::queue_ack( const Address & address, Flow & flow, DatagramPool & acks )
+{
+  ContestMessage::Header header( flow.latest.sequence_number );
+  header.send_timestamp = flow.latest.send_timestamp;
+  header.transform_into_ack( sequence_number_++, flow.latest.recv_timestamp,
+			     flow.latest_payload_length, flow.datagrams_received );
+  header.ack_batch = true;
+
+  /* timestamp the ack just before sending (so the sender can tell how
+     long each datagram's ack was held back) */
+  header.set_send_timestamp();
+
+  DatagramPool::Datagram & ack = acks.push_back();
+  ack.address = address;
+  ack.length = header.serialize( ack.data, ContestMessage::Header::Format::Compact );
+  ack.length += flow.batch.serialize( header, ack.data + ack.length );
+
+  flow.batch.acked_count = 0;
+  flow.pending = false;
+}
@@ -0,0 +1,80 @@
+#ifndef ACK_AGGREGATOR_HH
+#define ACK_AGGREGATOR_HH
+
+#include <unordered_map>
+#include <vector>
+
+#include "address.hh"
+#include "contest_message.hh"
+#include "datagram_pool.hh"
+
+/* the receiver's delayed, cumulative acks: each sender's datagrams are
+   acked ack_every at a time (or whatever has arrived when the receiver's
+   timer calls flush()), with one ack carrying every datagram's timestamps
+   and the ranges of sequence numbers that sender has had received lately
+   (a sender not heard from for a minute is forgotten); each ack reports
+   how many of its sender's datagrams have been received */
+class AckAggregator
+{
+private:
+  struct AddressHash
+  {
+    size_t operator()( const Address & address ) const;
+  };
+
+  struct Flow
+  {
+    ContestMessage::AckBatch::Acked latest;
+    uint64_t latest_payload_length;
+    ContestMessage::AckBatch batch; /* the datagrams before latest, and the ranges */
+    bool pending; /* latest (at least) is unacked */
+    bool listed; /* in pending_flows_ */
+    uint64_t last_heard; /* when its latest datagram arrived */
+    uint64_t datagrams_received;
+
+    Flow() : latest(), latest_payload_length( 0 ), batch(), pending( false ), listed( false ),
+	     last_heard( 0 ), datagrams_received( 0 ) {}
+  };
+
+  size_t ack_every_;
+
+  /* acks sent (over all flows) */
+  uint64_t sequence_number_;
+
+  std::unordered_map<Address, Flow, AddressHash> flows_;
+  std::vector< std::pair< const Address *, Flow * > > pending_flows_;
+
+  /* when idle flows were last forgotten */
+  uint64_t last_expiry_;
+
+  void expire_idle_flows( const uint64_t now );
+  std::unordered_map<Address, Flow, AddressHash>::iterator arrived( const DatagramPool::Datagram & recd );
+  void add_to_ranges( Flow & flow, const uint64_t sequence_number );
+  void queue_ack( const Address & address, Flow & flow, DatagramPool & acks );
+
+public:
+  /* what an ack slot must hold */
+  const static size_t ACK_MTU = ContestMessage::Header::MAX_WIRE_SIZE
+    + ContestMessage::AckBatch::MAX_WIRE_SIZE;
+
+  /* throws runtime_error unless 1 <= ack_every <= AckBatch::MAX_ACKED + 1 */
+  AckAggregator( const size_t ack_every );
+
+  /* a datagram arrived; if that fills its sender's batch, queue an ack
+     in the next free slot of acks (which must have one) */
+  void datagram_received( const DatagramPool::Datagram & recd, DatagramPool & acks );
+
+  /* count a datagram's arrival from its sender without acking it (for a
+     receiver that acks each datagram itself); returns the sender's count
+     so far, this one included */
+  uint64_t count_arrival( const DatagramPool::Datagram & recd );
+
+  /* queue acks of the datagrams still waiting, until acks is full;
+     returns true if some are still waiting */
+  bool flush( DatagramPool & acks );
+
+  /* are datagrams waiting to be acked? */
+  bool pending() const { return not pending_flows_.empty(); }
+};
+
+#endif /* ACK_AGGREGATOR_HH */
@@ -0,0 +1,338 @@
+/* scores an mm-link-style log (e.g. /tmp/contest_uplink_log, or the
+   relay's) in one streaming pass over a memory mapping, as
+   mm-throughput-graph would: capacity, throughput, per-packet and
+   signal delay, and optionally a CSV time series of windowed throughput */
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_descriptor.hh"
+#include "link_stats.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* how much of the log to read before letting go of the pages behind us,
+   so that memory use stays bounded however large the log is */
+static const size_t RELEASE_CHUNK = 64 * 1024 * 1024;
+
+/* a whole file mapped read-only */
+class MappedFile
+{
+private:
+  FileDescriptor fd_;
+  size_t size_;
+  char * data_;
+
+public:
+  MappedFile( const string & filename );
+  ~MappedFile();
+
+  const char * data() const { return data_; }
+  size_t size() const { return size_; }
+
+  /* the pages before offset won't be needed again */
+  void release_before( const size_t offset );
+
+  MappedFile( const MappedFile & other ) = delete;
+  const MappedFile & operator=( const MappedFile & other ) = delete;
+};
+
+MappedFile::MappedFile( const string & filename )
+  : fd_( SystemCall( "open " + filename, open( filename.c_str(), O_RDONLY ) ) ),
+    size_( 0 ),
+    data_( nullptr )
+{
+  struct stat info;
+  SystemCall( "fstat", fstat( fd_.fd_num(), &info ) );
+  size_ = info.st_size;
+
+  if ( size_ == 0 ) {
+    return;
+  }
+
+  void * const mapping = mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd_.fd_num(), 0 );
+  if ( mapping == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+  data_ = static_cast<char *>( mapping );
+
+  /* read ahead aggressively */
+  SystemCall( "madvise", madvise( data_, size_, MADV_SEQUENTIAL ) );
+}
+
+MappedFile::~MappedFile()
+{
+  if ( data_ ) {
+    munmap( data_, size_ );
+  }
+}
+
+void MappedFile::release_before( const size_t offset )
+{
+  const size_t page_size = sysconf( _SC_PAGESIZE );
+  const size_t length = offset / page_size * page_size;
+  if ( length ) {
+    SystemCall( "madvise", madvise( data_, length, MADV_DONTNEED ) );
+  }
+}
+
+/* throughput and delay over consecutive windows of the log, as CSV rows */
+class TimeSeries
+{
+private:
+  ostream & output_;
+  uint64_t window_ms_;
+  uint64_t window_start_ms_;
+  uint64_t capacity_bytes_, delivered_bytes_;
+  uint64_t delay_sum_ms_, deliveries_;
+
+  void emit();
+
+public:
+  TimeSeries( ostream & output, const uint64_t window_ms, const uint64_t start_ms );
+
+  /* every event is first passed here, in time order */
+  void advance_to( const uint64_t time_ms );
+
+  void opportunity( const uint64_t bytes ) { capacity_bytes_ += bytes; }
+  void delivery( const uint64_t bytes, const uint64_t delay_ms )
+  {
+    delivered_bytes_ += bytes;
+    delay_sum_ms_ += delay_ms;
+    deliveries_++;
+  }
+
+  /* the log ended at end_ms */
+  void finish( const uint64_t end_ms );
+};
+
+TimeSeries::TimeSeries( ostream & output, const uint64_t window_ms, const uint64_t start_ms )
+  : output_( output ),
+    window_ms_( window_ms ),
+    window_start_ms_( start_ms ),
+    capacity_bytes_( 0 ),
+    delivered_bytes_( 0 ),
+    delay_sum_ms_( 0 ),
+    deliveries_( 0 )
+{
+  output_ << "time_s,capacity_mbps,throughput_mbps,mean_packet_delay_ms\n";
+  output_ << fixed;
+}
+
+void TimeSeries::emit()
+{
+  const double seconds = window_ms_ / 1000.0;
+  output_ << setprecision( 3 ) << window_start_ms_ / 1000.0 << ","
+	  << capacity_bytes_ * 8 / 1e6 / seconds << ","
+	  << delivered_bytes_ * 8 / 1e6 / seconds << ",";
+  if ( deliveries_ ) {
+    output_ << setprecision( 1 ) << double( delay_sum_ms_ ) / deliveries_;
+  }
+  output_ << "\n";
+
+  window_start_ms_ += window_ms_;
+  capacity_bytes_ = delivered_bytes_ = delay_sum_ms_ = deliveries_ = 0;
+}
+
+void TimeSeries::advance_to( const uint64_t time_ms )
+{
+  while ( time_ms >= window_start_ms_ + window_ms_ ) {
+    emit();
+  }
+}
+
+void TimeSeries::finish( const uint64_t end_ms )
+{
+  advance_to( end_ms );
+  if ( end_ms > window_start_ms_ ) {
+    emit(); /* (the last window is partial, but is scaled as a full one) */
+  }
+}
+
+/* read an unsigned decimal number, and the space after it */
+static uint64_t parse_number( const char * & p, const char * const end )
+{
+  if ( p == end or *p < '0' or *p > '9' ) {
+    throw runtime_error( "expected a number" );
+  }
+
+  uint64_t value = 0;
+  while ( p != end and *p >= '0' and *p <= '9' ) {
+    value = value * 10 + (*p++ - '0');
+  }
+
+  if ( p != end and *p == ' ' ) {
+    p++;
+  }
+
+  return value;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc < 2 ) {
+    cerr << "Usage: " << argv[ 0 ] << " LOG [window=MS] [csv=FILE]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    uint64_t window_ms = 500;
+    string csv_filename;
+
+    for ( int i = 2; i < argc; i++ ) {
+      const string argument( argv[ i ] );
+      if ( argument.compare( 0, 7, "window=" ) == 0 ) {
+	window_ms = stoull( argument.substr( 7 ) );
+      } else if ( argument.compare( 0, 4, "csv=" ) == 0 ) {
+	csv_filename = argument.substr( 4 );
+      } else {
+	throw runtime_error( "unknown option \"" + argument + "\"" );
+      }
+    }
+
+    if ( window_ms == 0 ) {
+      throw runtime_error( "window must be at least 1 ms" );
+    }
+
+    MappedFile log( argv[ 1 ] );
+
+    ofstream csv_file;
+    if ( not csv_filename.empty() ) {
+      csv_file.open( csv_filename );
+      if ( not csv_file.is_open() ) {
+	throw runtime_error( "cannot open " + csv_filename );
+      }
+    }
+
+    /* both start at the log's first event */
+    unique_ptr<LinkStats> stats;
+    unique_ptr<TimeSeries> series;
+
+    const string base_header = "# base timestamp: ";
+    uint64_t base_ms = 0, last_ms = 0;
+    uint64_t line_number = 0;
+    size_t released = 0;
+
+    const char * const start = log.data();
+    const char * const end = start + log.size();
+    const char * p = start;
+
+    while ( p < end ) {
+      const char * const line_end = static_cast<const char *>( memchr( p, '\n', end - p ) );
+      if ( not line_end ) {
+	break; /* a last line cut off as the log was being written */
+      }
+      const char * const next = line_end + 1;
+      line_number++;
+
+      try {
+	if ( *p == '#' ) {
+	  if ( size_t( next - p ) > base_header.size()
+	       and memcmp( p, base_header.data(), base_header.size() ) == 0 ) {
+	    p += base_header.size();
+	    base_ms = parse_number( p, next );
+	  }
+	} else if ( *p != '\n' ) {
+	  const uint64_t time_ms = parse_number( p, next ) - base_ms;
+	  if ( p == next ) {
+	    throw runtime_error( "missing event" );
+	  }
+	  const char event = *p++;
+	  if ( p != next and *p == ' ' ) {
+	    p++;
+	  }
+	  const uint64_t bytes = parse_number( p, next );
+
+	  if ( not stats ) {
+	    stats.reset( new LinkStats( time_ms ) );
+	    if ( csv_file.is_open() ) {
+	      series.reset( new TimeSeries( csv_file, window_ms, time_ms ) );
+	    }
+	  }
+
+	  if ( time_ms < last_ms ) {
+	    throw runtime_error( "time went backwards" );
+	  }
+	  last_ms = time_ms;
+
+	  if ( series ) {
+	    series->advance_to( time_ms );
+	  }
+
+	  switch ( event ) {
+	  case '#':
+	    stats->opportunity( time_ms, bytes );
+	    if ( series ) { series->opportunity( bytes ); }
+	    break;
+	  case '+':
+	    break;
+	  case '-': {
+	    const uint64_t delay_ms = parse_number( p, next );
+	    if ( delay_ms > time_ms ) {
+	      throw runtime_error( "packet arrived before the base timestamp" );
+	    }
+	    stats->delivery( time_ms, bytes, time_ms - delay_ms );
+	    if ( series ) { series->delivery( bytes, delay_ms ); }
+	    break;
+	  }
+	  default:
+	    throw runtime_error( string( "unknown event type " ) + event );
+	  }
+	}
+      } catch ( const exception & e ) {
+	throw runtime_error( string( argv[ 1 ] ) + ":" + to_string( line_number ) + ": " + e.what() );
+      }
+
+      p = next;
+
+      if ( size_t( p - start ) - released >= RELEASE_CHUNK ) {
+	released = p - start;
+	log.release_before( released );
+      }
+    }
+
+    if ( not stats ) {
+      throw runtime_error( string( argv[ 1 ] ) + ": no events" );
+    }
+
+    if ( series ) {
+      series->finish( last_ms );
+    }
+
+    const LinkStats::Summary summary = stats->summarize( last_ms );
+    if ( not summary.duration_s ) {
+      throw runtime_error( string( argv[ 1 ] ) + ": events span no time, so there are no rates to report" );
+    }
+
+    cout << fixed << setprecision( 2 )
+	 << "Average capacity: " << summary.capacity_mbps << " Mbits/s" << endl
+	 << "Average throughput: " << summary.throughput_mbps << " Mbits/s ("
+	 << setprecision( 1 )
+	 << (summary.capacity_mbps ? 100 * summary.throughput_mbps / summary.capacity_mbps : 0)
+	 << "% utilization)" << endl
+	 << "95th percentile per-packet queueing delay: " << summary.packet_delay_p95_ms << " ms" << endl
+	 << "95th percentile signal delay: " << summary.signal_delay_p95_ms << " ms" << endl
+	 << setprecision( 2 ) << "Power: " << summary.power << endl;
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
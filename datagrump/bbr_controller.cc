@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "bbr_controller.hh"
+#include "tracer.hh"
+
+using namespace std;
+
+/* a datagram on the wire, for converting the model's bytes to datagrams */
+static const uint64_t DATAGRAM_BYTES = 1500;
+
+/* window before there is a model, in datagrams */
+static const unsigned int INITIAL_WINDOW = 10;
+
+/* the bandwidth estimate is the max over this many round trips */
+static const uint64_t BTLBW_WINDOW_ROUNDS = 10;
+
+/* ProbeBW's pacing gains, one phase per min RTT: probe for more
+   bandwidth, drain the queue that made, then cruise */
+static const double PROBE_BW_GAINS[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+static const unsigned int PROBE_BW_PHASES = sizeof( PROBE_BW_GAINS ) / sizeof( PROBE_BW_GAINS[ 0 ] );
+
+BBRController::BBRController( const bool debug, const Parameters & parameters )
+  : Controller( debug ),
+    high_gain_( parameter( parameters, "high_gain", 2 / log( 2 ) ) ),
+    cwnd_gain_( parameter( parameters, "cwnd_gain", 2 ) ),
+    min_window_( parameter( parameters, "min_window", 4 ) ),
+    rtprop_expiry_us_( parameter( parameters, "probe_rtt_interval_ms", 10000 ) * 1000 ),
+    probe_rtt_duration_us_( parameter( parameters, "probe_rtt_duration_ms", 200 ) * 1000 ),
+    mode_( Mode::Startup ),
+    pacing_gain_( high_gain_ ),
+    current_cwnd_gain_( high_gain_ ),
+    btlbw_( BTLBW_WINDOW_ROUNDS ),
+    rtprop_( rtprop_expiry_us_ ),
+    rtprop_stamp_( 0 ),
+    delivered_( 0 ),
+    next_round_delivered_( 0 ),
+    round_count_( 0 ),
+    round_start_( false ),
+    full_bw_( 0 ),
+    full_bw_count_( 0 ),
+    filled_pipe_( false ),
+    cycle_index_( 0 ),
+    cycle_stamp_( 0 ),
+    probe_rtt_done_stamp_( 0 ),
+    probe_rtt_round_done_( false ),
+    next_sequence_number_( 0 ),
+    next_ack_expected_( 0 ),
+    cwnd_( INITIAL_WINDOW ),
+    prior_cwnd_( 0 ),
+    pacing_rate_( 0 )
+{
+  check_parameters( parameters, { "high_gain", "cwnd_gain", "min_window",
+	"probe_rtt_interval_ms", "probe_rtt_duration_ms" } );
+}
+
+unsigned int BBRController::window_size()
+{
+  return cwnd_;
+}
+
+uint64_t BBRController::pacing_rate_bps()
+{
+  return pacing_rate_; /* unpaced until the first bandwidth sample */
+}
+
+void BBRController::datagram_was_sent( const uint64_t sequence_number,
+				       const uint64_t send_timestamp,
+				       const bool after_timeout )
+{
+  next_sequence_number_ = max( next_sequence_number_, sequence_number + 1 );
+  Controller::datagram_was_sent( sequence_number, send_timestamp, after_timeout );
+}
+
+void BBRController::ack_received( const uint64_t sequence_number_acked,
+				  const uint64_t,
+				  const uint64_t,
+				  const uint64_t )
+{
+  /* the model is updated from the ack's rate sample, which follows */
+  next_ack_expected_ = max( next_ack_expected_, sequence_number_acked + 1 );
+}
+
+uint64_t BBRController::target_window( const double gain ) const
+{
+  if ( btlbw_.empty() or rtprop_.empty() ) {
+    return INITIAL_WINDOW;
+  }
+
+  const double bdp_bytes = btlbw_.best() / 8.0 * rtprop_.best() / 1e6;
+  return ceil( gain * bdp_bytes / DATAGRAM_BYTES );
+}
+
+void BBRController::enter_probe_bw( const uint64_t timestamp )
+{
+  mode_ = Mode::ProbeBW;
+  current_cwnd_gain_ = cwnd_gain_;
+
+  /* start cruising (not draining, which would only follow a probe) */
+  cycle_index_ = 2;
+  cycle_stamp_ = timestamp;
+  pacing_gain_ = PROBE_BW_GAINS[ cycle_index_ ];
+}
+
+void BBRController::update_model( const RateSample & sample, const uint64_t timestamp )
+{
+  delivered_ = sample.total_delivered;
+
+  /* a round trip ends when a datagram sent after the last one began is acked */
+  round_start_ = false;
+  if ( sample.prior_delivered >= next_round_delivered_ ) {
+    next_round_delivered_ = delivered_;
+    round_count_++;
+    round_start_ = true;
+  }
+
+  /* samples over less than a min RTT are distorted by bunched-up acks */
+  if ( sample.interval_us and (rtprop_.empty() or sample.interval_us >= rtprop_.best()) ) {
+    btlbw_.update( round_count_, sample.delivery_rate_bps );
+  }
+
+  if ( rtprop_.empty() or sample.rtt_us <= rtprop_.best() ) {
+    rtprop_stamp_ = timestamp;
+  }
+  rtprop_.update( timestamp, sample.rtt_us );
+
+  /* Startup is done when three round trips raise bandwidth less than 25% */
+  if ( not filled_pipe_ and round_start_ and not btlbw_.empty() ) {
+    if ( btlbw_.best() >= full_bw_ * 5 / 4 ) {
+      full_bw_ = btlbw_.best();
+      full_bw_count_ = 0;
+    } else if ( ++full_bw_count_ >= 3 ) {
+      filled_pipe_ = true;
+    }
+  }
+}
+
+void BBRController::update_mode( const uint64_t timestamp, const bool rtprop_expired )
+{
+  if ( mode_ == Mode::Startup and filled_pipe_ ) {
+    /* drain the queue Startup built */
+    mode_ = Mode::Drain;
+    pacing_gain_ = 1 / high_gain_;
+    current_cwnd_gain_ = high_gain_;
+  }
+
+  if ( mode_ == Mode::Drain and in_flight() <= target_window( 1 ) ) {
+    enter_probe_bw( timestamp );
+  }
+
+  if ( mode_ == Mode::ProbeBW ) {
+    /* each phase lasts a min RTT; probing also waits for the extra data
+       to be in flight, and draining stops early once the queue is gone */
+    const bool full_length = timestamp - cycle_stamp_ > rtprop_.best();
+    bool next_phase = full_length;
+    if ( pacing_gain_ > 1 ) {
+      next_phase = full_length and in_flight() >= target_window( pacing_gain_ );
+    } else if ( pacing_gain_ < 1 ) {
+      next_phase = full_length or in_flight() <= target_window( 1 );
+    }
+
+    if ( next_phase ) {
+      cycle_index_ = (cycle_index_ + 1) % PROBE_BW_PHASES;
+      cycle_stamp_ = timestamp;
+      pacing_gain_ = PROBE_BW_GAINS[ cycle_index_ ];
+    }
+  }
+
+  /* re-measure the min RTT (with the queue drained) if it hasn't been seen lately */
+  if ( mode_ != Mode::ProbeRTT and rtprop_expired ) {
+    mode_ = Mode::ProbeRTT;
+    pacing_gain_ = 1;
+    probe_rtt_done_stamp_ = 0;
+    prior_cwnd_ = cwnd_;
+  }
+
+  if ( mode_ == Mode::ProbeRTT ) {
+    if ( probe_rtt_done_stamp_ == 0 and in_flight() <= min_window_ ) {
+      /* hold the small window for a while and at least one round trip */
+      probe_rtt_done_stamp_ = timestamp + probe_rtt_duration_us_;
+      probe_rtt_round_done_ = false;
+      next_round_delivered_ = delivered_;
+    } else if ( probe_rtt_done_stamp_ ) {
+      if ( round_start_ ) {
+	probe_rtt_round_done_ = true;
+      }
+
+      if ( probe_rtt_round_done_ and timestamp > probe_rtt_done_stamp_ ) {
+	/* pick up where it left off, rather than regrowing from the small window */
+	rtprop_stamp_ = timestamp;
+	cwnd_ = max( cwnd_, prior_cwnd_ );
+	if ( filled_pipe_ ) {
+	  enter_probe_bw( timestamp );
+	} else {
+	  mode_ = Mode::Startup;
+	  pacing_gain_ = current_cwnd_gain_ = high_gain_;
+	}
+      }
+    }
+  }
+}
+
+void BBRController::update_controls()
+{
+  if ( not btlbw_.empty() ) {
+    const uint64_t rate = pacing_gain_ * btlbw_.best();
+
+    /* in Startup, don't slow down on one low sample */
+    if ( filled_pipe_ or rate > pacing_rate_ ) {
+      pacing_rate_ = rate;
+    }
+  }
+
+  if ( mode_ == Mode::ProbeRTT ) {
+    cwnd_ = min_window_;
+    return;
+  }
+
+  /* grow by one datagram per ack towards the target (headroom of a few
+     datagrams for batching), or without limit until the pipe is full */
+  const uint64_t target = target_window( current_cwnd_gain_ ) + 3;
+  if ( filled_pipe_ ) {
+    cwnd_ = min<uint64_t>( cwnd_ + 1, target );
+  } else if ( cwnd_ < target or delivered_ < INITIAL_WINDOW * DATAGRAM_BYTES ) {
+    cwnd_++;
+  }
+
+  cwnd_ = max( cwnd_, min_window_ );
+}
+
+void BBRController::delivery_rate_sampled( const RateSample & sample,
+					   const uint64_t timestamp )
+{
+  const bool rtprop_expired = not rtprop_.empty()
+    and timestamp > rtprop_stamp_ + rtprop_expiry_us_;
+
+  update_model( sample, timestamp );
+  update_mode( timestamp, rtprop_expired );
+  update_controls();
+
+  trace( TraceEvent::BBR, timestamp, static_cast<uint64_t>( mode_ ),
+	 btlbw_.empty() ? 0 : btlbw_.best(), rtprop_.empty() ? 0 : rtprop_.best() );
+
+  if ( debug_ ) {
+    cerr << "At time " << timestamp << " BBR mode " << int( mode_ )
+	 << " btlbw " << (btlbw_.empty() ? 0 : btlbw_.best()) << " bps"
+	 << " rtprop " << (rtprop_.empty() ? 0 : rtprop_.best()) << " us"
+	 << " cwnd " << cwnd_ << " pacing " << pacing_rate_ << " bps" << endl;
+  }
+}
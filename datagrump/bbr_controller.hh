@@ -0,0 +1,83 @@
+#ifndef BBR_CONTROLLER_HH
+#define BBR_CONTROLLER_HH
+
+#include "controller.hh"
+#include "windowed_filter.hh"
+
+/* model-based congestion control in the style of BBR: estimates the
+   bottleneck bandwidth (windowed max of delivery-rate samples, over round
+   trips) and the propagation RTT (windowed min of RTT samples, over
+   time), then paces at gain x bandwidth with a window of gain x their
+   product, cycling through the Startup, Drain, ProbeBW and ProbeRTT phases */
+class BBRController : public Controller
+{
+private:
+  enum class Mode { Startup, Drain, ProbeBW, ProbeRTT };
+
+  /* tunable constants */
+  double high_gain_; /* Startup's pacing and window gain */
+  double cwnd_gain_; /* ProbeBW's window gain */
+  unsigned int min_window_; /* datagrams (and ProbeRTT's window) */
+  uint64_t rtprop_expiry_us_; /* how long a min RTT is trusted before ProbeRTT */
+  uint64_t probe_rtt_duration_us_;
+
+  Mode mode_;
+  double pacing_gain_, current_cwnd_gain_;
+
+  /* the path model */
+  WindowedMaxFilter<uint64_t> btlbw_; /* bits per second, over round trips */
+  WindowedMinFilter<uint64_t> rtprop_; /* microseconds, over time */
+  uint64_t rtprop_stamp_; /* when the min RTT was last confirmed */
+
+  /* round trips, counted in delivered bytes */
+  uint64_t delivered_, next_round_delivered_, round_count_;
+  bool round_start_;
+
+  /* Startup ends when bandwidth stops growing */
+  uint64_t full_bw_;
+  unsigned int full_bw_count_;
+  bool filled_pipe_;
+
+  /* ProbeBW gain cycling, and the ProbeRTT exit condition */
+  unsigned int cycle_index_;
+  uint64_t cycle_stamp_;
+  uint64_t probe_rtt_done_stamp_;
+  bool probe_rtt_round_done_;
+
+  /* datagrams outstanding: [next_ack_expected_, next_sequence_number_) */
+  uint64_t next_sequence_number_, next_ack_expected_;
+
+  unsigned int cwnd_;
+  unsigned int prior_cwnd_; /* the window before ProbeRTT, restored after it */
+  uint64_t pacing_rate_;
+
+  uint64_t in_flight() const { return next_sequence_number_ - next_ack_expected_; }
+
+  /* bandwidth-delay product x gain, in datagrams */
+  uint64_t target_window( const double gain ) const;
+
+  void enter_probe_bw( const uint64_t timestamp );
+  void update_model( const RateSample & sample, const uint64_t timestamp );
+  void update_mode( const uint64_t timestamp, const bool rtprop_expired );
+  void update_controls();
+
+public:
+  BBRController( const bool debug, const Parameters & parameters );
+
+  unsigned int window_size() override;
+  uint64_t pacing_rate_bps() override;
+
+  void datagram_was_sent( const uint64_t sequence_number,
+			  const uint64_t send_timestamp,
+			  const bool after_timeout ) override;
+
+  void ack_received( const uint64_t sequence_number_acked,
+		     const uint64_t send_timestamp_acked,
+		     const uint64_t recv_timestamp_acked,
+		     const uint64_t timestamp_ack_received ) override;
+
+  void delivery_rate_sampled( const RateSample & sample,
+			      const uint64_t timestamp ) override;
+};
+
+#endif /* BBR_CONTROLLER_HH */
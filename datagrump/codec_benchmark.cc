@@ -0,0 +1,314 @@
+/* check that ContestMessage headers (and ack batches) survive a round
+   trip through the wire formats, then measure encode and decode cost
+   per packet */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "contest_message.hh"
+
+using namespace std;
+
+typedef ContestMessage::Header Header;
+typedef ContestMessage::AckBatch AckBatch;
+
+/* a field that is absent (-1), or random with a random number of significant bits */
+static uint64_t random_field( mt19937_64 & prng )
+{
+  const uint64_t choice = prng() % 8;
+  if ( choice == 0 ) {
+    return -1;
+  }
+
+  const unsigned int bits = prng() % 64 + 1;
+  return prng() >> (64 - bits);
+}
+
+static Header random_header( mt19937_64 & prng )
+{
+  Header header( random_field( prng ) );
+  header.send_timestamp = random_field( prng );
+  header.ack_sequence_number = random_field( prng );
+  header.ack_send_timestamp = random_field( prng );
+  header.ack_recv_timestamp = random_field( prng );
+  header.ack_payload_length = random_field( prng );
+  header.ack_recv_count = random_field( prng );
+  return header;
+}
+
+static bool same_fields( const Header & a, const Header & b )
+{
+  return a.sequence_number == b.sequence_number
+    and a.send_timestamp == b.send_timestamp
+    and a.ack_sequence_number == b.ack_sequence_number
+    and a.ack_send_timestamp == b.ack_send_timestamp
+    and a.ack_recv_timestamp == b.ack_recv_timestamp
+    and a.ack_payload_length == b.ack_payload_length
+    and a.ack_recv_count == b.ack_recv_count;
+}
+
+/* encode random headers, decode them (whole and truncated), and compare */
+static void round_trip( const unsigned int iterations )
+{
+  mt19937_64 prng( 20161016 );
+  char buffer[ Header::MAX_WIRE_SIZE ];
+
+  for ( unsigned int i = 0; i < iterations; i++ ) {
+    Header original = random_header( prng );
+
+    /* a Full header's sequence number must leave the marker bit clear,
+       and it has no room for the receive count */
+    for ( const auto format : { Header::Format::Full, Header::Format::Compact } ) {
+      Header expected = original;
+      if ( format == Header::Format::Full ) {
+	original.sequence_number &= ~(uint64_t( 1 ) << 63);
+	expected = original;
+	expected.ack_recv_count = -1;
+      }
+
+      const size_t length = original.serialize( buffer, format );
+      const Header decoded( buffer, length );
+
+      if ( not same_fields( expected, decoded ) or decoded.wire_size != length ) {
+	throw runtime_error( "header changed in round trip" );
+      }
+
+      /* every truncation must be rejected */
+      for ( size_t short_length = 0; short_length < length; short_length++ ) {
+	try {
+	  Header truncated( buffer, short_length );
+	  throw logic_error( "truncated header was accepted" );
+	} catch ( const runtime_error & ) {}
+      }
+    }
+  }
+
+  /* random bytes must either parse (within bounds) or be rejected */
+  for ( unsigned int i = 0; i < iterations; i++ ) {
+    const size_t length = prng() % sizeof( buffer );
+    for ( size_t j = 0; j < length; j++ ) {
+      buffer[ j ] = prng();
+    }
+    buffer[ 0 ] = prng() % 2 ? 0x81 : buffer[ 0 ];
+
+    try {
+      const Header parsed( buffer, length );
+      if ( parsed.wire_size > length ) {
+	throw logic_error( "header parsed past the end of the buffer" );
+      }
+    } catch ( const runtime_error & ) {}
+  }
+}
+
+/* an ack of a random run of datagrams (with some missing and some
+   reordered), and the ranges the receiver would report */
+static void random_batch( mt19937_64 & prng, Header & header, AckBatch & batch )
+{
+  uint64_t sequence_number = prng() >> (prng() % 64 + 1);
+  uint64_t send_timestamp = prng() >> 20, recv_timestamp = prng() >> 20;
+
+  batch = AckBatch();
+  batch.acked_count = prng() % (AckBatch::MAX_ACKED + 1);
+  for ( size_t i = 0; i < batch.acked_count; i++ ) {
+    batch.acked[ i ] = { sequence_number, send_timestamp, recv_timestamp };
+    sequence_number += prng() % 4 - 1;
+    send_timestamp += prng() % 2000;
+    recv_timestamp += prng() % 2000;
+  }
+
+  header = Header( sequence_number );
+  header.send_timestamp = send_timestamp;
+  header.transform_into_ack( 0, recv_timestamp, 1424, prng() % 100000 );
+  header.send_timestamp = recv_timestamp + prng() % 1000;
+  header.ack_batch = true;
+
+  /* newest first, up to the header's (as they are sent) */
+  batch.range_count = prng() % (AckBatch::MAX_RANGES + 1);
+  uint64_t below = sequence_number + 1;
+  for ( size_t i = 0; i < batch.range_count; i++ ) {
+    const uint64_t end = below - min<uint64_t>( below, prng() % 50 );
+    const uint64_t first = end - min<uint64_t>( end, prng() % 100 );
+    batch.ranges[ i ] = { first, end };
+    below = first;
+  }
+}
+
+static bool same_batch( const AckBatch & a, const AckBatch & b )
+{
+  if ( a.acked_count != b.acked_count or a.range_count != b.range_count ) {
+    return false;
+  }
+
+  for ( size_t i = 0; i < a.acked_count; i++ ) {
+    if ( a.acked[ i ].sequence_number != b.acked[ i ].sequence_number
+	 or a.acked[ i ].send_timestamp != b.acked[ i ].send_timestamp
+	 or a.acked[ i ].recv_timestamp != b.acked[ i ].recv_timestamp ) {
+      return false;
+    }
+  }
+
+  for ( size_t i = 0; i < a.range_count; i++ ) {
+    if ( a.ranges[ i ].first != b.ranges[ i ].first or a.ranges[ i ].end != b.ranges[ i ].end ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* encode random ack batches behind their headers, decode them (whole and truncated), and compare */
+static void batch_round_trip( const unsigned int iterations )
+{
+  mt19937_64 prng( 20161017 );
+  char buffer[ Header::MAX_WIRE_SIZE + AckBatch::MAX_WIRE_SIZE ];
+
+  for ( unsigned int i = 0; i < iterations; i++ ) {
+    Header header( 0 );
+    AckBatch batch;
+    random_batch( prng, header, batch );
+
+    const size_t header_length = header.serialize( buffer, Header::Format::Compact );
+    const size_t length = header_length + batch.serialize( header, buffer + header_length );
+
+    const Header decoded_header( buffer, length );
+    if ( not same_fields( header, decoded_header ) or not decoded_header.ack_batch ) {
+      throw runtime_error( "batch header changed in round trip" );
+    }
+
+    const AckBatch decoded( decoded_header, buffer + header_length, length - header_length );
+    if ( not same_batch( batch, decoded ) or header_length + decoded.wire_size != length ) {
+      throw runtime_error( "ack batch changed in round trip" );
+    }
+
+    for ( size_t short_length = header_length; short_length < length; short_length++ ) {
+      try {
+	AckBatch truncated( decoded_header, buffer + header_length, short_length - header_length );
+	throw logic_error( "truncated ack batch was accepted" );
+      } catch ( const runtime_error & ) {}
+    }
+  }
+}
+
+/* ranges reaching past the header's sequence number (as the receiver's
+   can after reordering) are cut off when sent, and rejected when received */
+static void batch_ranges_bounded()
+{
+  Header header( 100 );
+  header.transform_into_ack( 0, 0, 1424 );
+  header.ack_batch = true;
+
+  AckBatch batch;
+  batch.range_count = 3;
+  batch.ranges[ 0 ] = { 104, 106 };
+  batch.ranges[ 1 ] = { 95, 103 }; /* straddles the header's */
+  batch.ranges[ 2 ] = { 80, 90 };
+
+  char buffer[ AckBatch::MAX_WIRE_SIZE ];
+  const AckBatch sent( header, buffer, batch.serialize( header, buffer ) );
+  if ( sent.range_count != 2 or sent.ranges[ 0 ].first != 95 or sent.ranges[ 0 ].end != 101
+       or sent.ranges[ 1 ].first != 80 or sent.ranges[ 1 ].end != 90 ) {
+    throw runtime_error( "ack batch ranges weren't cut off at the header's sequence number" );
+  }
+
+  /* no datagrams, one range: a gap of -5 (zigzagged) and a length of 3 */
+  const char bogus[] = { 0, 1, 9, 3 };
+  try {
+    AckBatch beyond( header, bogus, sizeof( bogus ) );
+    throw logic_error( "ack batch range past the header's sequence number was accepted" );
+  } catch ( const runtime_error & ) {}
+}
+
+/* a typical ack: small sequence numbers, nearby millisecond timestamps */
+static Header typical_ack( const uint64_t i )
+{
+  Header header( i );
+  header.send_timestamp = 60000 + i;
+  header.transform_into_ack( i, 60000 + i + 20, 1424, i + 1 );
+  header.send_timestamp = 60000 + i + 21;
+  return header;
+}
+
+template <typename Function>
+static double ns_per_call( const unsigned int rounds, Function && function )
+{
+  const auto start = chrono::steady_clock::now();
+  for ( unsigned int i = 0; i < rounds; i++ ) {
+    function( i );
+  }
+  const auto end = chrono::steady_clock::now();
+  return chrono::duration<double, nano>( end - start ).count() / rounds;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const unsigned int rounds = argc > 1 ? atoi( argv[ 1 ] ) : 10000000;
+
+  round_trip( 100000 );
+  batch_round_trip( 100000 );
+  batch_ranges_bounded();
+  cout << "round trip: ok" << endl;
+
+  char buffer[ Header::MAX_WIRE_SIZE ];
+  uint64_t checksum = 0;
+
+  const size_t full_size = typical_ack( 1000 ).serialize( buffer, Header::Format::Full );
+  const size_t compact_size = typical_ack( 1000 ).serialize( buffer, Header::Format::Compact );
+
+  cout << fixed << setprecision( 1 );
+  cout << "typical ack header: " << full_size << " bytes full, "
+       << compact_size << " bytes compact" << endl;
+
+  /* eight datagrams 1 ms apart, acked together */
+  {
+    Header header = typical_ack( 1007 );
+    header.ack_batch = true;
+    AckBatch batch;
+    batch.acked_count = 7;
+    for ( size_t i = 0; i < batch.acked_count; i++ ) {
+      const uint64_t sequence_number = 1000 + i;
+      batch.acked[ i ] = { sequence_number, 60000 + 1000 * sequence_number,
+			   60000 + 1000 * sequence_number + 20 };
+    }
+    batch.range_count = 1;
+    batch.ranges[ 0 ] = { 0, 1008 };
+
+    const size_t header_length = header.serialize( buffer, Header::Format::Compact );
+    char batch_buffer[ AckBatch::MAX_WIRE_SIZE ];
+    cout << "ack of 8 datagrams: " << header_length + batch.serialize( header, batch_buffer )
+	 << " bytes compact (vs. " << 8 * compact_size << " in 8 acks)" << endl;
+  }
+
+  const string payload( 1424, 'x' );
+  cout << "to_string (header and payload): " << ns_per_call( rounds / 10, [&] ( const unsigned int i ) {
+      ContestMessage message( i, payload );
+      checksum += message.to_string().size();
+    } ) << " ns/packet" << endl;
+
+  for ( const auto format : { Header::Format::Full, Header::Format::Compact } ) {
+    const char * const name = format == Header::Format::Full ? "full" : "compact";
+
+    cout << "encode " << name << ": " << ns_per_call( rounds, [&] ( const unsigned int i ) {
+	checksum += typical_ack( i ).serialize( buffer, format );
+      } ) << " ns/packet" << endl;
+
+    const size_t length = typical_ack( 1000 ).serialize( buffer, format );
+    cout << "decode " << name << ": " << ns_per_call( rounds, [&] ( const unsigned int i ) {
+	buffer[ length - 1 ] ^= i & 1; /* keep the compiler from hoisting the parse */
+	checksum += Header( buffer, length ).ack_payload_length;
+      } ) << " ns/packet" << endl;
+  }
+
+  /* print the checksum so that none of the work is optimized away */
+  cerr << "checksum " << checksum << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -1,62 +1,206 @@
+#include <algorithm>
 #include <stdexcept>
+#include <cstring>
 
 #include "contest_message.hh"
 #include "timestamp.hh"
 
 using namespace std;
 
+/* first byte of a Compact header: high bit set (a Full header's first
+   byte is the top of its sequence number, so it's clear in practice),
+   then the format version */
+static const uint8_t COMPACT_MARKER = 0x80;
+static const uint8_t COMPACT_VERSION = 1;
+
+/* largest encoding of a uint64_t as a varint */
+static const size_t MAX_VARINT_SIZE = 10;
+
+/* LEB128 varint: seven bits per byte, least significant first */
+static size_t put_varint( uint64_t value, char * const dest )
+{
+  size_t n = 0;
+  while ( value >= 0x80 ) {
+    dest[ n++ ] = char( (value & 0x7f) | 0x80 );
+    value >>= 7;
+  }
+  dest[ n++ ] = char( value );
+  return n;
+}
+
+static uint64_t get_varint( const char * const data, const size_t length, size_t & offset )
+{
+  uint64_t value = 0;
+  for ( size_t i = 0; i < MAX_VARINT_SIZE; i++ ) {
+    if ( offset >= length ) {
+      throw runtime_error( "contest message too small to contain header" );
+    }
+
+    const uint8_t byte = data[ offset++ ];
+    value |= uint64_t( byte & 0x7f ) << (7 * i);
+    if ( not (byte & 0x80) ) {
+      return value;
+    }
+  }
+
+  throw runtime_error( "contest message has malformed varint" );
+}
+
+/* zigzag encoding keeps small negative deltas small */
+static uint64_t zigzag( const uint64_t delta )
+{
+  return (delta << 1) ^ -(delta >> 63);
+}
+
+static uint64_t unzigzag( const uint64_t value )
+{
+  return (value >> 1) ^ -(value & 1);
+}
+
 /* helper to get the nth uint64_t field (in network byte order) */
-uint64_t get_header_field( const size_t n, const string & str )
+static uint64_t get_header_field( const size_t n, const char * const data, const size_t length )
 {
-  if ( str.size() < (n + 1) * sizeof( uint64_t ) ) {
+  if ( length < (n + 1) * sizeof( uint64_t ) ) {
     throw runtime_error( "contest message too small to contain header" );
   }
 
-  const uint64_t * const data_ptr
-    = reinterpret_cast<const uint64_t *>( str.data() ) + n;
+  uint64_t network_order;
+  memcpy( &network_order, data + n * sizeof( uint64_t ), sizeof( network_order ) );
 
-  return be64toh( *data_ptr );
+  return be64toh( network_order );
 }
 
 /* Parse header from wire */
 ContestMessage::Header::Header( const string & str )
-  : sequence_number( get_header_field( 0, str ) ),
-    send_timestamp( get_header_field( 1, str ) ),
-    ack_sequence_number( get_header_field( 2, str ) ),
-    ack_send_timestamp( get_header_field( 3, str ) ),
-    ack_recv_timestamp( get_header_field( 4, str ) ),
-    ack_payload_length( get_header_field( 5, str ) )
+  : Header( str.data(), str.size() )
 {}
 
+/* Parse header (in either format) in place from a received buffer */
+ContestMessage::Header::Header( const char * const data, const size_t length )
+  : sequence_number(),
+    send_timestamp(),
+    ack_sequence_number(),
+    ack_send_timestamp(),
+    ack_recv_timestamp(),
+    ack_payload_length(),
+    ack_recv_count( -1 ),
+    ack_batch( false ),
+    wire_size()
+{
+  if ( length == 0 or not (data[ 0 ] & COMPACT_MARKER) ) {
+    sequence_number = get_header_field( 0, data, length );
+    send_timestamp = get_header_field( 1, data, length );
+    ack_sequence_number = get_header_field( 2, data, length );
+    ack_send_timestamp = get_header_field( 3, data, length );
+    ack_recv_timestamp = get_header_field( 4, data, length );
+    ack_payload_length = get_header_field( 5, data, length );
+    wire_size = WIRE_SIZE;
+    return;
+  }
+
+  if ( uint8_t( data[ 0 ] ) != (COMPACT_MARKER | COMPACT_VERSION) ) {
+    throw runtime_error( "contest message has unsupported header version" );
+  }
+
+  if ( length < 2 ) {
+    throw runtime_error( "contest message too small to contain header" );
+  }
+
+  /* bit n set: field n is present (absent fields are -1); bit 7, a batch follows */
+  const uint8_t present = data[ 1 ];
+  size_t offset = 2;
+
+  uint64_t * const fields[] = { &sequence_number, &send_timestamp, &ack_sequence_number,
+				&ack_send_timestamp, &ack_recv_timestamp, &ack_payload_length,
+				&ack_recv_count };
+  for ( size_t n = 0; n < 7; n++ ) {
+    *fields[ n ] = (present & (1 << n)) ? get_varint( data, length, offset ) : -1;
+  }
+
+  /* the receive timestamp travels as a delta from the send timestamp */
+  if ( (present & (1 << 3)) and (present & (1 << 4)) ) {
+    ack_recv_timestamp = ack_send_timestamp + unzigzag( ack_recv_timestamp );
+  }
+
+  ack_batch = present & (1 << 7);
+
+  wire_size = offset;
+}
+
 /* Parse incoming message from wire */
 ContestMessage::ContestMessage( const string & str )
   : header( str ),
-    payload( str.begin() + sizeof( header ), str.end() )
+    payload( str.begin() + header.wire_size, str.end() )
 {}
 
+/* Fill in the send_timestamp */
+void ContestMessage::Header::set_send_timestamp()
+{
+  send_timestamp = timestamp_us();
+}
+
 /* Fill in the send_timestamp for an outgoing message */
 void ContestMessage::set_send_timestamp()
 {
-  header.send_timestamp = timestamp_ms();
+  header.set_send_timestamp();
 }
 
 /* helper to put a uint64_t field (in network byte order) */
-string put_header_field( const uint64_t n )
+static void put_header_field( const size_t n, const uint64_t value, char * const dest )
 {
-  const uint64_t network_order = htobe64( n );
-  return string( reinterpret_cast<const char *>( &network_order ),
-		 sizeof( network_order ) );
+  const uint64_t network_order = htobe64( value );
+  memcpy( dest + n * sizeof( uint64_t ), &network_order, sizeof( network_order ) );
+}
+
+/* Write wire representation into a caller buffer */
+size_t ContestMessage::Header::serialize( char * const dest, const Format format ) const
+{
+  if ( format == Format::Full ) {
+    put_header_field( 0, sequence_number, dest );
+    put_header_field( 1, send_timestamp, dest );
+    put_header_field( 2, ack_sequence_number, dest );
+    put_header_field( 3, ack_send_timestamp, dest );
+    put_header_field( 4, ack_recv_timestamp, dest );
+    put_header_field( 5, ack_payload_length, dest );
+    return WIRE_SIZE;
+  }
+
+  /* the sequence number is always sent; other fields only if not -1 */
+  const uint64_t fields[] = { sequence_number, send_timestamp, ack_sequence_number,
+			      ack_send_timestamp, ack_recv_timestamp, ack_payload_length,
+			      ack_recv_count };
+  uint8_t present = ack_batch ? 0x81 : 1;
+  for ( size_t n = 1; n < 7; n++ ) {
+    if ( fields[ n ] != uint64_t( -1 ) ) {
+      present |= 1 << n;
+    }
+  }
+
+  dest[ 0 ] = char( COMPACT_MARKER | COMPACT_VERSION );
+  dest[ 1 ] = char( present );
+  size_t offset = 2;
+
+  for ( size_t n = 0; n < 7; n++ ) {
+    if ( not (present & (1 << n)) ) {
+      continue;
+    }
+
+    uint64_t value = fields[ n ];
+    if ( n == 4 and (present & (1 << 3)) ) {
+      value = zigzag( ack_recv_timestamp - ack_send_timestamp );
+    }
+    offset += put_varint( value, dest + offset );
+  }
+
+  return offset;
 }
 
 /* Make wire representation of header */
 string ContestMessage::Header::to_string() const
 {
-  return put_header_field( sequence_number )
-    + put_header_field( send_timestamp )
-    + put_header_field( ack_sequence_number )
-    + put_header_field( ack_send_timestamp )
-    + put_header_field( ack_recv_timestamp )
-    + put_header_field( ack_payload_length );
+  string ret( WIRE_SIZE, 0 );
+  serialize( &ret[ 0 ] );
+  return ret;
 }
 
 /* Make wire representation of message */
@@ -65,20 +209,30 @@ string ContestMessage::to_string() const
   return header.to_string() + payload;
 }
 
-/* Transform into an ack of the ContestMessage */
-void ContestMessage::transform_into_ack( const uint64_t sequence_number,
-					 const uint64_t recv_timestamp )
+/* Transform into an ack of the header's datagram */
+void ContestMessage::Header::transform_into_ack( const uint64_t s_sequence_number,
+						 const uint64_t recv_timestamp,
+						 const uint64_t payload_length,
+						 const uint64_t recv_count )
 {
   /* ack the old sequence number */
-  header.ack_sequence_number = header.sequence_number;
+  ack_sequence_number = sequence_number;
 
   /* now assign a new sequence number for the outgoing ack */
-  header.sequence_number = sequence_number;
+  sequence_number = s_sequence_number;
 
   /* ack the other fields */
-  header.ack_send_timestamp = header.send_timestamp;
-  header.ack_recv_timestamp = recv_timestamp;
-  header.ack_payload_length = payload.length();
+  ack_send_timestamp = send_timestamp;
+  ack_recv_timestamp = recv_timestamp;
+  ack_payload_length = payload_length;
+  ack_recv_count = recv_count;
+}
+
+/* Transform into an ack of the ContestMessage */
+void ContestMessage::transform_into_ack( const uint64_t sequence_number,
+					 const uint64_t recv_timestamp )
+{
+  header.transform_into_ack( sequence_number, recv_timestamp, payload.length() );
 
   /* delete the payload */
   payload.clear();
@@ -98,11 +252,113 @@ ContestMessage::Header::Header( const uint64_t s_sequence_number )
     ack_sequence_number( -1 ),
     ack_send_timestamp( -1 ),
     ack_recv_timestamp( -1 ),
-    ack_payload_length( -1 )
+    ack_payload_length( -1 ),
+    ack_recv_count( -1 ),
+    ack_batch( false ),
+    wire_size( 0 )
 {}
 
+/* Is this header an ack? */
+bool ContestMessage::Header::is_ack() const
+{
+  return ack_sequence_number != uint64_t( -1 );
+}
+
 /* Is this message an ack? */
 bool ContestMessage::is_ack() const
 {
-  return header.ack_sequence_number != uint64_t( -1 );
+  return header.is_ack();
+}
+
+/* Empty batch */
+ContestMessage::AckBatch::AckBatch()
+  : acked(),
+    acked_count( 0 ),
+    ranges(),
+    range_count( 0 ),
+    wire_size( 0 )
+{}
+
+/* Parse the batch that follows header: a count, then each datagram's
+   sequence number and timestamps as deltas from the one before (the
+   header's first), then a count, then each range as the gap below the
+   previous one's first sequence number (at first, below the header's plus
+   one) and its length */
+ContestMessage::AckBatch::AckBatch( const Header & header,
+				    const char * const data, const size_t length )
+  : AckBatch()
+{
+  size_t offset = 0;
+
+  acked_count = get_varint( data, length, offset );
+  if ( acked_count > MAX_ACKED ) {
+    throw runtime_error( "contest ack batch has too many datagrams" );
+  }
+
+  Acked previous = { header.ack_sequence_number, header.ack_send_timestamp,
+		     header.ack_recv_timestamp };
+  for ( size_t i = 0; i < acked_count; i++ ) {
+    acked[ i ].sequence_number = previous.sequence_number + unzigzag( get_varint( data, length, offset ) );
+    acked[ i ].send_timestamp = previous.send_timestamp + unzigzag( get_varint( data, length, offset ) );
+    acked[ i ].recv_timestamp = previous.recv_timestamp + unzigzag( get_varint( data, length, offset ) );
+    previous = acked[ i ];
+  }
+
+  range_count = get_varint( data, length, offset );
+  if ( range_count > MAX_RANGES ) {
+    throw runtime_error( "contest ack batch has too many ranges" );
+  }
+
+  uint64_t below = header.ack_sequence_number + 1;
+  for ( size_t i = 0; i < range_count; i++ ) {
+    const uint64_t gap = unzigzag( get_varint( data, length, offset ) );
+    const uint64_t size = get_varint( data, length, offset );
+    ranges[ i ].end = below - gap;
+
+    /* a range never reaches past the header's sequence number or the
+       range before it (a zigzagged gap can come out negative) */
+    if ( ranges[ i ].end > below or size > ranges[ i ].end ) {
+      throw runtime_error( "contest ack batch has a malformed range" );
+    }
+
+    ranges[ i ].first = below = ranges[ i ].end - size;
+  }
+
+  wire_size = offset;
+}
+
+/* Write the batch to follow header (with the ranges cut off above the
+   header's sequence number: after reordering, the receiver's newest range
+   can reach past it, but the datagrams up there are acked by the acks of
+   later datagrams) */
+size_t ContestMessage::AckBatch::serialize( const Header & header, char * const dest ) const
+{
+  size_t offset = put_varint( acked_count, dest );
+
+  Acked previous = { header.ack_sequence_number, header.ack_send_timestamp,
+		     header.ack_recv_timestamp };
+  for ( size_t i = 0; i < acked_count; i++ ) {
+    offset += put_varint( zigzag( acked[ i ].sequence_number - previous.sequence_number ), dest + offset );
+    offset += put_varint( zigzag( acked[ i ].send_timestamp - previous.send_timestamp ), dest + offset );
+    offset += put_varint( zigzag( acked[ i ].recv_timestamp - previous.recv_timestamp ), dest + offset );
+    previous = acked[ i ];
+  }
+
+  uint64_t below = header.ack_sequence_number + 1;
+
+  size_t first_range = 0;
+  while ( first_range < range_count and ranges[ first_range ].end > below
+	  and ranges[ first_range ].first >= below ) {
+    first_range++;
+  }
+  offset += put_varint( range_count - first_range, dest + offset );
+
+  for ( size_t i = first_range; i < range_count; i++ ) {
+    const uint64_t end = min( ranges[ i ].end, below );
+    offset += put_varint( zigzag( below - end ), dest + offset );
+    offset += put_varint( end - ranges[ i ].first, dest + offset );
+    below = ranges[ i ].first;
+  }
+
+  return offset;
 }
@@ -6,6 +6,7 @@
 
 struct ContestMessage
 {
+  /* timestamps are in microseconds (each host's own clock) */
   struct Header {
     uint64_t sequence_number;
     uint64_t send_timestamp;
@@ -15,16 +16,100 @@ struct ContestMessage
     uint64_t ack_recv_timestamp;
     uint64_t ack_payload_length;
 
+    /* datagrams the receiver had received from this sender, including
+       the acked one (only carried by the Compact format) */
+    uint64_t ack_recv_count;
+
+    /* an AckBatch follows the header (only in the Compact format) */
+    bool ack_batch;
+
+    /* Wire formats: Full is six big-endian 64-bit fields; Compact is a
+       marker byte (high bit set, then the version), a byte of presence
+       flags (the last for ack_batch), then varints, and is what acks use
+       on the reverse path */
+    enum class Format { Full, Compact };
+
+    /* Size of a Full header on the wire */
+    const static size_t WIRE_SIZE = 6 * sizeof( uint64_t );
+
+    /* Largest header in either format */
+    const static size_t MAX_WIRE_SIZE = 2 + 7 * 10;
+
+    /* Bytes the header occupied on the wire (if it was parsed) */
+    size_t wire_size;
+
     /* Header for new message */
     Header( const uint64_t s_sequence_number );
 
     /* Parse header from wire */
     Header( const std::string & str );
 
+    /* Parse header (in either format) in place from a received buffer */
+    Header( const char * const data, const size_t length );
+
     /* Make wire representation of header */
     std::string to_string() const;
+
+    /* Write wire representation into a caller buffer (of at least MAX_WIRE_SIZE
+       bytes, or WIRE_SIZE for the Full format); returns the bytes written */
+    size_t serialize( char * const dest, const Format format = Format::Full ) const;
+
+    /* Fill in the send_timestamp */
+    void set_send_timestamp();
+
+    /* Transform into an ack of the header's datagram */
+    void transform_into_ack( const uint64_t sequence_number,
+			     const uint64_t recv_timestamp,
+			     const uint64_t payload_length,
+			     const uint64_t recv_count = -1 );
+
+    /* Is this header an ack? */
+    bool is_ack() const;
   } header;
 
+  /* What an ack of several datagrams carries after its header (which acks
+     the latest of them): the others, oldest first, with their send and
+     receive timestamps, then the ranges of sequence numbers received
+     lately, newest first and up to the header's (so datagrams whose acks
+     were lost are still reported); all as varint deltas from what came
+     before */
+  struct AckBatch {
+    struct Acked {
+      uint64_t sequence_number;
+      uint64_t send_timestamp; /* sender's clock */
+      uint64_t recv_timestamp; /* receiver's clock */
+    };
+
+    struct Range {
+      uint64_t first, end; /* [first, end) */
+    };
+
+    const static size_t MAX_ACKED = 31;
+    const static size_t MAX_RANGES = 4;
+
+    /* Largest batch on the wire */
+    const static size_t MAX_WIRE_SIZE = (2 + 3 * MAX_ACKED + 2 * MAX_RANGES) * 10;
+
+    Acked acked[ MAX_ACKED ];
+    size_t acked_count;
+
+    Range ranges[ MAX_RANGES ];
+    size_t range_count;
+
+    /* Bytes the batch occupied on the wire (if it was parsed) */
+    size_t wire_size;
+
+    /* Empty batch */
+    AckBatch();
+
+    /* Parse the batch that follows header in a received buffer */
+    AckBatch( const Header & header, const char * const data, const size_t length );
+
+    /* Write the batch to follow header into a caller buffer (of at
+       least MAX_WIRE_SIZE bytes); returns the bytes written */
+    size_t serialize( const Header & header, char * const dest ) const;
+  };
+
   std::string payload;
 
   /* New message */
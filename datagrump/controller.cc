@@ -1,32 +1,89 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
 
 #include "controller.hh"
+#include "bbr_controller.hh"
+#include "sprout_controller.hh"
+#include "learned_controller.hh"
 #include "timestamp.hh"
 
 using namespace std;
 
+/* a tunable constant, or its default if it wasn't given */
+double Controller::parameter( const Parameters & parameters,
+			      const string & name, const double default_value )
+{
+  const auto it = parameters.find( name );
+  return it == parameters.end() ? default_value : it->second;
+}
+
+void Controller::check_parameters( const Parameters & parameters,
+				   const vector<string> & known_names )
+{
+  for ( const auto & given : parameters ) {
+    if ( find( known_names.begin(), known_names.end(), given.first ) == known_names.end() ) {
+      throw runtime_error( "unknown controller parameter: " + given.first );
+    }
+  }
+}
+
 /* Default constructor */
-Controller::Controller( const bool debug )
-  : debug_( debug ), current_window( 20 )
-{}
+Controller::Controller( const bool debug, const Parameters & parameters )
+  : debug_( debug ),
+    current_window( parameter( parameters, "initial_window", 20 ) ),
+    delay_threshold_us_( parameter( parameters, "delay_threshold_ms", 160 ) * 1000 ),
+    min_window_( parameter( parameters, "min_window", 4 ) ),
+    last_decrease_( 0 )
+{
+  check_parameters( parameters, { "initial_window", "delay_threshold_ms", "min_window" } );
+}
+
+/* The controller called name */
+unique_ptr<Controller> Controller::make( const string & name, const bool debug,
+					 const Parameters & parameters )
+{
+  if ( name == "aimd" ) {
+    return unique_ptr<Controller>( new Controller( debug, parameters ) );
+  } else if ( name == "bbr" ) {
+    return unique_ptr<Controller>( new BBRController( debug, parameters ) );
+  } else if ( name == "sprout" ) {
+    return unique_ptr<Controller>( new SproutController( debug, parameters ) );
+  } else if ( name.compare( 0, 8, "learned:" ) == 0 ) {
+    ifstream weights( name.substr( 8 ) );
+    if ( not weights ) {
+      throw runtime_error( "can't read learned policy: " + name.substr( 8 ) );
+    }
+    return unique_ptr<Controller>( new LearnedController( debug, MLP( weights ), parameters ) );
+  }
+
+  throw runtime_error( "unknown controller: " + name );
+}
 
 /* Get current window size, in datagrams */
 unsigned int Controller::window_size()
 {
 
   if ( debug_ ) {
-    cerr << "At time " << timestamp_ms()
+    cerr << "At time " << timestamp_us()
 	 << " window size is " << current_window << endl;
   }
 
   return current_window;
 }
 
+/* Get current pacing rate, in bits per second */
+uint64_t Controller::pacing_rate_bps()
+{
+  return 0; /* Default: unpaced */
+}
+
 /* A datagram was sent */
 void Controller::datagram_was_sent( const uint64_t sequence_number,
 				    /* of the sent datagram */
 				    const uint64_t send_timestamp,
-                                    /* in milliseconds */
+                                    /* in microseconds */
 				    const bool after_timeout
 				    /* datagram was sent because of a timeout */ )
 {
@@ -38,11 +95,25 @@ void Controller::datagram_was_sent( const uint64_t sequence_number,
   }
 }
 
+/* A sent datagram left the host */
+void Controller::datagram_was_transmitted( const uint64_t sequence_number,
+					   /* of the sent datagram */
+					   const uint64_t transmit_timestamp )
+                                           /* when the kernel handed it to the device */
+{
+  /* Default: take no action */
+
+  if ( debug_ ) {
+    cerr << "At time " << transmit_timestamp
+	 << " datagram " << sequence_number << " left the host\n";
+  }
+}
+
 /* An ack was received */
 void Controller::ack_received( const uint64_t sequence_number_acked,
 			       /* what sequence number was acknowledged */
 			       const uint64_t send_timestamp_acked,
-			       /* when the acknowledged datagram was sent (sender's clock) */
+			       /* when the acknowledged datagram was sent (sender's clock, in microseconds) */
 			       const uint64_t recv_timestamp_acked,
 			       /* when the acknowledged datagram was received (receiver's clock)*/
 			       const uint64_t timestamp_ack_received )
@@ -51,13 +122,13 @@ void Controller::ack_received( const uint64_t sequence_number_acked,
   /* Default: take no action */
   uint64_t rtt = timestamp_ack_received - send_timestamp_acked;
   
-  if (rtt > 160) {
+  if (rtt > delay_threshold_us_) {
     current_window /= 2;
   } else {
     current_window ++;
   }
-  if (current_window < 4) {
-    current_window = 4;
+  if (current_window < min_window_) {
+    current_window = min_window_;
   }
 
 
@@ -70,9 +141,84 @@ void Controller::ack_received( const uint64_t sequence_number_acked,
   }
 }
 
-/* How long to wait (in milliseconds) if there are no acks
+/* The same ack, as a delivery-rate sample */
+void Controller::delivery_rate_sampled( const RateSample & sample,
+					const uint64_t timestamp )
+{
+  /* Default: take no action */
+
+  if ( debug_ ) {
+    cerr << "At time " << timestamp
+	 << " delivery rate " << sample.delivery_rate_bps << " bps over "
+	 << sample.interval_us << " us" << endl;
+  }
+}
+
+/* The same ack's report of the receiver's datagram count */
+void Controller::receive_count_reported( const uint64_t datagrams_received,
+					 const uint64_t timestamp )
+{
+  /* Default: take no action */
+
+  if ( debug_ ) {
+    cerr << "At time " << timestamp
+	 << " receiver has received " << datagrams_received << " datagrams" << endl;
+  }
+}
+
+/* A sent datagram was declared lost */
+void Controller::datagram_was_lost( const uint64_t sequence_number,
+				    /* of the lost datagram */
+				    const uint64_t send_timestamp,
+				    /* when it was sent */
+				    const uint64_t timestamp )
+                                    /* when it was declared lost */
+{
+  /* halve the window, once for all the datagrams that were
+     already in flight when it was last halved */
+  if ( send_timestamp > last_decrease_ ) {
+    current_window = max( current_window / 2, min_window_ );
+    last_decrease_ = timestamp;
+  }
+
+  if ( debug_ ) {
+    cerr << "At time " << timestamp
+	 << " datagram " << sequence_number << " (sent @ time " << send_timestamp
+	 << ") was lost" << endl;
+  }
+}
+
+/* A datagram stands in for a lost one */
+void Controller::datagram_was_retransmitted( const uint64_t sequence_number,
+					     const uint64_t lost_sequence_number,
+					     const uint64_t send_timestamp )
+{
+  /* Default: take no action */
+
+  if ( debug_ ) {
+    cerr << "At time " << send_timestamp
+	 << " datagram " << sequence_number << " retransmits "
+	 << lost_sequence_number << endl;
+  }
+}
+
+/* How long to wait (in microseconds) if there are no acks
    before sending one more datagram */
-unsigned int Controller::timeout_ms()
+uint64_t Controller::timeout_us()
 {
-  return 1000; /* timeout of one second */
+  return 1000000; /* timeout of one second */
+}
+
+/* How often (in microseconds) the controller wants tick() to be called */
+uint64_t Controller::tick_interval_us()
+{
+  return 0; /* no ticks */
+}
+
+/* A periodic tick */
+void Controller::tick( const uint64_t timestamp )
+{
+  if ( debug_ ) {
+    cerr << "At time " << timestamp << " controller tick" << endl;
+  }
 }
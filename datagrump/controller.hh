@@ -2,42 +2,110 @@
 #define CONTROLLER_HH
 
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
-/* Congestion controller interface */
+#include "delivery_rate.hh"
+
+/* Congestion controller interface (and a simple delay-triggered AIMD
+   controller; other controllers override its methods) */
 
 class Controller
 {
-private:
+public:
+  /* Tunable constants by name (e.g. from the simulator's parameter
+     sweeps); unset ones keep their defaults */
+  typedef std::map<std::string, double> Parameters;
+
+protected:
   bool debug_; /* Enables debugging output */
 
+  /* a tunable constant, or default_value if it wasn't given */
+  static double parameter( const Parameters & parameters,
+			   const std::string & name, const double default_value );
+
+  /* catch misspelled names rather than silently using the defaults */
+  static void check_parameters( const Parameters & parameters,
+				const std::vector<std::string> & known_names );
+
+private:
   /* Add member variables here */
   unsigned int current_window;
 
+  /* tunable constants */
+  uint64_t delay_threshold_us_; /* back off when an RTT exceeds this */
+  unsigned int min_window_;
+  uint64_t last_decrease_; /* when the window was last halved for a loss */
+
 public:
   /* Public interface for the congestion controller */
   /* You can change these if you prefer, but will need to change
      the call site as well (in sender.cc) */
 
   /* Default constructor */
-  Controller( const bool debug );
+  Controller( const bool debug, const Parameters & parameters = Parameters() );
+  virtual ~Controller() {}
+
+  /* The controller called name ("aimd" for this one, "bbr", "sprout",
+     or "learned:FILE" for the policy in FILE) */
+  static std::unique_ptr<Controller> make( const std::string & name, const bool debug,
+					   const Parameters & parameters = Parameters() );
 
   /* Get current window size, in datagrams */
-  unsigned int window_size();
+  virtual unsigned int window_size();
+
+  /* Get current pacing rate, in bits per second (0 means unpaced:
+     send whenever the window is open) */
+  virtual uint64_t pacing_rate_bps();
 
   /* A datagram was sent */
-  void datagram_was_sent( const uint64_t sequence_number,
+  virtual void datagram_was_sent( const uint64_t sequence_number,
 			  const uint64_t send_timestamp,
 			  const bool after_timeout );
 
-  /* An ack was received */
-  void ack_received( const uint64_t sequence_number_acked,
-		     const uint64_t send_timestamp_acked,
-		     const uint64_t recv_timestamp_acked,
-		     const uint64_t timestamp_ack_received );
+  /* A sent datagram left the host (kernel transmit timestamp, in microseconds) */
+  virtual void datagram_was_transmitted( const uint64_t sequence_number,
+				 const uint64_t transmit_timestamp );
+
+  /* An ack was received (all timestamps in microseconds) */
+  virtual void ack_received( const uint64_t sequence_number_acked,
+			     const uint64_t send_timestamp_acked,
+			     const uint64_t recv_timestamp_acked,
+			     const uint64_t timestamp_ack_received );
+
+  /* The same ack, as a delivery-rate sample (delivered and
+     delivered-time accounting kept by the sender) */
+  virtual void delivery_rate_sampled( const RateSample & sample,
+				      const uint64_t timestamp );
+
+  /* The same ack's report of how many of this sender's datagrams
+     the receiver has received so far */
+  virtual void receive_count_reported( const uint64_t datagrams_received,
+				       const uint64_t timestamp );
+
+  /* A sent datagram was declared lost (see scoreboard.hh) */
+  virtual void datagram_was_lost( const uint64_t sequence_number,
+				  const uint64_t send_timestamp,
+				  const uint64_t timestamp );
+
+  /* A datagram (just sent) stands in for the lost one */
+  virtual void datagram_was_retransmitted( const uint64_t sequence_number,
+					   const uint64_t lost_sequence_number,
+					   const uint64_t send_timestamp );
+
+  /* How long to wait (in microseconds) if there are no acks
+     before sending one more datagram, when none are in flight
+     (otherwise the scoreboard's retransmission timeout applies) */
+  virtual uint64_t timeout_us();
+
+  /* How often (in microseconds) the controller wants tick() to be
+     called, e.g. for pacing; zero means never */
+  virtual uint64_t tick_interval_us();
 
-  /* How long to wait (in milliseconds) if there are no acks
-     before sending one more datagram */
-  unsigned int timeout_ms();
+  /* A periodic tick */
+  virtual void tick( const uint64_t timestamp );
 };
 
 #endif
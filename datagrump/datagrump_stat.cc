@@ -0,0 +1,167 @@
+/* reads a running sender's live stats (sender ... stats=NAME) from shared
+   memory, printing each interval's counters and percentiles without
+   disturbing the sender */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "live_stats.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* a copy of everything in the segment at one moment */
+struct Snapshot
+{
+  uint64_t time_us;
+  vector<uint64_t> counters;
+  vector< vector<uint64_t> > histograms;
+
+  Snapshot() : time_us( 0 ), counters( LiveStats::COUNTERS ),
+	       histograms( LiveStats::HISTOGRAMS, vector<uint64_t>( LogHistogram::BUCKETS ) ) {}
+};
+
+static uint64_t now_us()
+{
+  timeval now;
+  SystemCall( "gettimeofday", gettimeofday( &now, nullptr ) );
+  return uint64_t( now.tv_sec ) * 1000000 + now.tv_usec;
+}
+
+static void take( const LiveStats::Segment & segment, Snapshot & snapshot )
+{
+  snapshot.time_us = now_us();
+  for ( unsigned int i = 0; i < LiveStats::COUNTERS; i++ ) {
+    snapshot.counters[ i ] = segment.counters[ i ].load( memory_order_relaxed );
+  }
+  for ( unsigned int i = 0; i < LiveStats::HISTOGRAMS; i++ ) {
+    for ( size_t b = 0; b < LogHistogram::BUCKETS; b++ ) {
+      snapshot.histograms[ i ][ b ] = segment.histograms[ i ].counts[ b ].load( memory_order_relaxed );
+    }
+  }
+}
+
+/* the largest value in the bucket holding the given fraction of counts */
+static uint64_t percentile( const vector<uint64_t> & counts, const uint64_t total,
+			    const double fraction )
+{
+  const uint64_t rank = max<uint64_t>( 1, fraction * total + 0.5 );
+  uint64_t seen = 0;
+  for ( size_t b = 0; b < counts.size(); b++ ) {
+    seen += counts[ b ];
+    if ( seen >= rank ) {
+      return LogHistogram::highest( b );
+    }
+  }
+  return 0;
+}
+
+/* what happened between two snapshots (from the segment's start if
+   before has no time) */
+static void report( const LiveStats::Segment & segment, const Snapshot & before,
+		    const Snapshot & after )
+{
+  const double elapsed_s = (after.time_us - (before.time_us ? before.time_us : segment.start_us)) / 1e6;
+
+  cout << "[" << fixed << setprecision( 1 ) << setw( 8 )
+       << (after.time_us - segment.start_us) / 1e6 << " s] pid " << segment.pid << "\n";
+
+  for ( unsigned int i = 0; i < LiveStats::COUNTERS; i++ ) {
+    const uint64_t delta = after.counters[ i ] - before.counters[ i ];
+    cout << "  " << left << setw( 18 ) << LiveStats::name( LiveStats::Counter( i ) ) << right
+	 << setw( 12 ) << after.counters[ i ]
+	 << setw( 12 ) << setprecision( 0 ) << (elapsed_s > 0 ? delta / elapsed_s : 0) << "/s\n";
+  }
+
+  for ( unsigned int i = 0; i < LiveStats::HISTOGRAMS; i++ ) {
+    vector<uint64_t> counts( LogHistogram::BUCKETS );
+    uint64_t total = 0, max_bucket = 0;
+    for ( size_t b = 0; b < LogHistogram::BUCKETS; b++ ) {
+      counts[ b ] = after.histograms[ i ][ b ] - before.histograms[ i ][ b ];
+      total += counts[ b ];
+      if ( counts[ b ] ) {
+	max_bucket = b;
+      }
+    }
+
+    cout << "  " << left << setw( 18 ) << LiveStats::name( LiveStats::Histogram( i ) ) << right
+	 << " n=" << setw( 8 ) << total;
+    if ( total ) {
+      cout << "  p50=" << percentile( counts, total, 0.5 )
+	   << "  p90=" << percentile( counts, total, 0.9 )
+	   << "  p99=" << percentile( counts, total, 0.99 )
+	   << "  max=" << LogHistogram::highest( max_bucket );
+    }
+    cout << "\n";
+  }
+
+  cout << flush;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  uint64_t interval_ms = 1000;
+  bool once = false;
+  bool usage_error = argc < 2;
+
+  for ( int i = 2; i < argc; i++ ) {
+    const string option( argv[ i ] );
+    if ( option.compare( 0, 9, "interval=" ) == 0 ) {
+      interval_ms = stoull( option.substr( 9 ) );
+      usage_error |= interval_ms == 0;
+    } else if ( option == "once" ) {
+      once = true;
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " NAME [interval=MS] [once]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const string name( argv[ 1 ] );
+    unique_ptr<LiveStats> stats = LiveStats::open( name );
+
+    Snapshot before, after;
+    if ( once ) {
+      take( stats->segment(), after );
+      report( stats->segment(), before, after );
+      return EXIT_SUCCESS;
+    }
+
+    take( stats->segment(), before );
+
+    while ( true ) {
+      this_thread::sleep_for( chrono::milliseconds( interval_ms ) );
+
+      /* a restarted sender makes a new segment; follow it */
+      const uint64_t identity = LiveStats::identity( name );
+      if ( identity and identity != stats->identity() ) {
+	stats = LiveStats::open( name );
+	before = Snapshot();
+      }
+
+      take( stats->segment(), after );
+      report( stats->segment(), before, after );
+      swap( before, after );
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,156 @@
+/* decodes a binary trace (sender ... trace=FILE) into text, one line per
+   event like the controllers' debug output, or into CSV; optionally only
+   one kind of event (whose argument names then head the CSV columns),
+   and optionally sorted by time across threads */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "tracer.hh"
+#include "util.hh"
+
+using namespace std;
+
+static void print_arg( ostream & output, const TraceEventInfo::Format format, const uint64_t value )
+{
+  switch ( format ) {
+  case TraceEventInfo::Format::None:
+    break;
+  case TraceEventInfo::Format::Unsigned:
+    output << value;
+    break;
+  case TraceEventInfo::Format::Signed:
+    output << int64_t( value );
+    break;
+  case TraceEventInfo::Format::Double:
+    double number;
+    memcpy( &number, &value, sizeof( number ) );
+    output << number;
+    break;
+  }
+}
+
+static void print_text( ostream & output, const TraceRecord & record )
+{
+  const TraceEventInfo & info = TraceEventInfo::of( record.event );
+  output << "At time " << record.timestamp << " thread " << record.thread << " " << info.name;
+  for ( unsigned int i = 0; i < 3; i++ ) {
+    if ( info.formats[ i ] != TraceEventInfo::Format::None ) {
+      output << " " << info.arg_names[ i ] << "=";
+      print_arg( output, info.formats[ i ], record.args[ i ] );
+    }
+  }
+  output << "\n";
+}
+
+static void print_csv( ostream & output, const TraceRecord & record )
+{
+  const TraceEventInfo & info = TraceEventInfo::of( record.event );
+  output << record.timestamp << "," << record.thread << "," << info.name;
+  for ( unsigned int i = 0; i < 3; i++ ) {
+    output << ",";
+    print_arg( output, info.formats[ i ], record.args[ i ] );
+  }
+  output << "\n";
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  bool csv = false, sort_by_time = false;
+  string only_event;
+  bool usage_error = argc < 2;
+
+  for ( int i = 2; i < argc; i++ ) {
+    const string option( argv[ i ] );
+    if ( option == "csv" ) {
+      csv = true;
+    } else if ( option == "sort" ) {
+      sort_by_time = true;
+    } else if ( option.compare( 0, 6, "event=" ) == 0 ) {
+      only_event = option.substr( 6 );
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " FILE [csv] [sort] [event=NAME]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    ifstream input( argv[ 1 ], ios::binary );
+    if ( not input ) {
+      throw runtime_error( string( "can't open " ) + argv[ 1 ] );
+    }
+
+    TraceFileHeader header;
+    if ( not input.read( reinterpret_cast<char *>( &header ), sizeof( header ) )
+	 or not header.readable() ) {
+      throw runtime_error( string( argv[ 1 ] ) + " is not a trace (or is from another version)" );
+    }
+
+    /* the event to keep, if only one */
+    uint32_t only = uint32_t( -1 );
+    if ( not only_event.empty() ) {
+      for ( uint32_t event = 0; event < static_cast<uint32_t>( TraceEvent::Count ); event++ ) {
+	if ( only_event == TraceEventInfo::of( event ).name ) {
+	  only = event;
+	}
+      }
+      if ( only == uint32_t( -1 ) ) {
+	throw runtime_error( "no such event: " + only_event );
+      }
+    }
+
+    if ( csv ) {
+      cout << "timestamp,thread,event";
+      for ( unsigned int i = 0; i < 3; i++ ) {
+	cout << "," << (only == uint32_t( -1 ) ? string( 1, 'a' + i ) : TraceEventInfo::of( only ).arg_names[ i ]);
+      }
+      cout << "\n";
+    }
+
+    const auto print = csv ? print_csv : print_text;
+    vector<TraceRecord> records;
+    TraceRecord record;
+
+    while ( input.read( reinterpret_cast<char *>( &record ), sizeof( record ) ) ) {
+      if ( only != uint32_t( -1 ) and record.event != only ) {
+	continue;
+      }
+
+      if ( sort_by_time ) {
+	records.push_back( record );
+      } else {
+	print( cout, record );
+      }
+    }
+
+    /* each thread's records are in order, so a stable sort keeps ties in order */
+    stable_sort( records.begin(), records.end(),
+		 [] ( const TraceRecord & a, const TraceRecord & b ) { return a.timestamp < b.timestamp; } );
+    for ( const auto & sorted : records ) {
+      print( cout, sorted );
+    }
+
+    if ( input.gcount() != 0 ) {
+      cerr << "warning: trace ends in a partial record" << endl;
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
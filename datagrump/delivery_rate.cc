@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "delivery_rate.hh"
+
+using namespace std;
+
+DeliveryRateEstimator::DeliveryRateEstimator( const size_t history )
+  : sent_( history ),
+    delivered_( 0 ),
+    delivered_time_( 0 ),
+    first_sent_time_( 0 )
+{
+  if ( history == 0 or (history & (history - 1)) ) {
+    throw runtime_error( "delivery-rate history must be a power of two" );
+  }
+}
+
+void DeliveryRateEstimator::datagram_was_sent( const uint64_t sequence_number, const uint64_t size,
+					       const uint64_t timestamp, const uint64_t in_flight )
+{
+  /* after an idle period, start the intervals afresh */
+  if ( in_flight == 0 ) {
+    first_sent_time_ = delivered_time_ = timestamp;
+  }
+
+  sent_[ sequence_number & (sent_.size() - 1) ]
+    = { sequence_number, size, timestamp, delivered_, delivered_time_, first_sent_time_, true };
+}
+
+bool DeliveryRateEstimator::ack_received( const uint64_t sequence_number, const uint64_t timestamp,
+					  RateSample & sample )
+{
+  SendState & state = sent_[ sequence_number & (sent_.size() - 1) ];
+  if ( state.sequence_number != sequence_number or not state.outstanding ) {
+    return false;
+  }
+  state.outstanding = false;
+
+  delivered_ += state.size;
+  delivered_time_ = timestamp;
+
+  /* the next interval starts where this one's sends ended */
+  first_sent_time_ = state.sent_time;
+
+  /* the longer of the two intervals, so that neither bunched-up sends
+     nor bunched-up acks overstate the rate */
+  const uint64_t send_elapsed = state.sent_time - state.first_sent_time;
+  const uint64_t ack_elapsed = timestamp - state.delivered_time;
+  const uint64_t interval = max( send_elapsed, ack_elapsed );
+
+  sample.interval_us = interval;
+  sample.delivered = delivered_ - state.delivered;
+  sample.prior_delivered = state.delivered;
+  sample.total_delivered = delivered_;
+  sample.rtt_us = timestamp - state.sent_time;
+  sample.delivery_rate_bps = interval ? sample.delivered * 8 * 1000000 / interval : 0;
+
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef DELIVERY_RATE_HH
+#define DELIVERY_RATE_HH
+
+#include <cstdint>
+#include <vector>
+
+/* what one ack says about the path (all times in microseconds) */
+struct RateSample
+{
+  uint64_t delivery_rate_bps; /* over the sample's interval */
+  uint64_t interval_us;
+  uint64_t delivered; /* bytes acked during the interval */
+  uint64_t prior_delivered; /* total bytes acked when the acked datagram was sent */
+  uint64_t total_delivered; /* total bytes acked so far, including this one */
+  uint64_t rtt_us; /* of the acked datagram */
+};
+
+/* per-datagram delivered/delivered-time accounting, turning each ack
+   into a delivery-rate sample (draft-cheng-iccrg-delivery-rate-estimation):
+   the rate is the bytes acked between a datagram's send and its ack,
+   over the longer of the send and ack intervals they span */
+class DeliveryRateEstimator
+{
+private:
+  /* what the sender knew when it sent a datagram */
+  struct SendState
+  {
+    uint64_t sequence_number;
+    uint64_t size;
+    uint64_t sent_time;
+    uint64_t delivered; /* as of the send */
+    uint64_t delivered_time;
+    uint64_t first_sent_time; /* send time of the datagram the interval starts with */
+    bool outstanding;
+  };
+
+  /* recent datagrams, indexed by sequence number (a power of two; datagrams
+     that fall out unacked give no sample when they are finally acked) */
+  std::vector<SendState> sent_;
+
+  uint64_t delivered_; /* total bytes acked */
+  uint64_t delivered_time_; /* when delivered_ last grew */
+  uint64_t first_sent_time_;
+
+public:
+  /* throws runtime_error unless history is a power of two */
+  DeliveryRateEstimator( const size_t history = 65536 );
+
+  /* a datagram was sent with in_flight datagrams already unacked */
+  void datagram_was_sent( const uint64_t sequence_number, const uint64_t size,
+			  const uint64_t timestamp, const uint64_t in_flight );
+
+  /* a datagram was acked; returns false (and leaves sample alone) if the
+     datagram is unknown or was already acked */
+  bool ack_received( const uint64_t sequence_number, const uint64_t timestamp,
+		     RateSample & sample );
+};
+
+#endif /* DELIVERY_RATE_HH */
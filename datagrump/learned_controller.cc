@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+#include "learned_controller.hh"
+#include "tracer.hh"
+
+using namespace std;
+
+/* a datagram on the wire, for turning the ack rate into bits per second */
+static const uint64_t DATAGRAM_BYTES = 1500;
+
+/* the min RTT is the smallest seen over this long */
+static const uint64_t MIN_RTT_WINDOW_US = 10000000;
+
+/* weight of each new inter-send or inter-ack time (as in Remy) */
+static const double EWMA_GAIN = 1.0 / 8;
+
+static void update_ewma( double & ewma, const double sample )
+{
+  ewma = ewma == 0 ? sample : (1 - EWMA_GAIN) * ewma + EWMA_GAIN * sample;
+}
+
+LearnedController::LearnedController( const bool debug, const MLP & policy,
+				      const Parameters & parameters )
+  : Controller( debug ),
+    policy_( policy ),
+    min_window_( parameter( parameters, "min_window", 2 ) ),
+    max_window_( parameter( parameters, "max_window", 10000 ) ),
+    min_rtt_( MIN_RTT_WINDOW_US ),
+    send_ewma_us_( 0 ),
+    ack_ewma_us_( 0 ),
+    last_send_( 0 ),
+    last_ack_( 0 ),
+    window_( parameter( parameters, "initial_window", 10 ) ),
+    pacing_rate_( 0 )
+{
+  check_parameters( parameters, { "min_window", "max_window", "initial_window" } );
+
+  if ( policy_.inputs() != 3 or policy_.outputs() != 2 ) {
+    throw runtime_error( "learned policy must take 3 features and give 2 actions" );
+  }
+}
+
+unsigned int LearnedController::window_size()
+{
+  return window_;
+}
+
+uint64_t LearnedController::pacing_rate_bps()
+{
+  return pacing_rate_; /* unpaced until there is an ack rate */
+}
+
+void LearnedController::datagram_was_sent( const uint64_t,
+					   const uint64_t send_timestamp,
+					   const bool )
+{
+  if ( last_send_ ) {
+    update_ewma( send_ewma_us_, send_timestamp - last_send_ );
+  }
+  last_send_ = send_timestamp;
+}
+
+void LearnedController::ack_received( const uint64_t sequence_number_acked,
+				      const uint64_t send_timestamp_acked,
+				      const uint64_t,
+				      const uint64_t timestamp_ack_received )
+{
+  const uint64_t rtt = timestamp_ack_received - send_timestamp_acked;
+  min_rtt_.update( timestamp_ack_received, rtt );
+
+  if ( last_ack_ ) {
+    update_ewma( ack_ewma_us_, timestamp_ack_received - last_ack_ );
+  }
+  last_ack_ = timestamp_ack_received;
+
+  const float features[] = {
+    float( double( rtt ) / max<uint64_t>( min_rtt_.best(), 1 ) ),
+    float( send_ewma_us_ > 0 and ack_ewma_us_ > 0 ? ack_ewma_us_ / send_ewma_us_ : 1 ),
+    float( ack_ewma_us_ / 1000 ) };
+
+  const float * const actions = policy_.evaluate( features );
+  const double window_action = max( -1.0f, min( actions[ 0 ], 1.0f ) );
+  const double pacing_action = max( -1.0f, min( actions[ 1 ], 1.0f ) );
+
+  window_ = max( min_window_, min( window_ * exp( window_action / window_ ), max_window_ ) );
+  if ( ack_ewma_us_ > 0 ) {
+    pacing_rate_ = DATAGRAM_BYTES * 8 * 1e6 / ack_ewma_us_ * exp( pacing_action );
+  }
+
+  trace( TraceEvent::LearnedFeatures, timestamp_ack_received, trace_double( features[ 0 ] ),
+	 trace_double( features[ 1 ] ), trace_double( features[ 2 ] ) );
+  trace( TraceEvent::LearnedActions, timestamp_ack_received, trace_double( actions[ 0 ] ),
+	 trace_double( actions[ 1 ] ), trace_double( window_ ) );
+
+  if ( debug_ ) {
+    cerr << "At time " << timestamp_ack_received
+	 << " ack for datagram " << sequence_number_acked
+	 << " features " << features[ 0 ] << " " << features[ 1 ] << " " << features[ 2 ]
+	 << " actions " << actions[ 0 ] << " " << actions[ 1 ]
+	 << " window " << window_ << " pacing " << pacing_rate_ << " bps" << endl;
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef LEARNED_CONTROLLER_HH
+#define LEARNED_CONTROLLER_HH
+
+#include "controller.hh"
+#include "mlp.hh"
+#include "windowed_filter.hh"
+
+/* a learned policy in the style of Remy and Aurora: on every ack, a small
+   network maps what the acks show -- the RTT over the min RTT, the send
+   rate over the ack rate, and the EWMA of the time between acks (in
+   milliseconds) -- to two actions, each clamped to [-1, 1]: one scales
+   the window by e^a per window's worth of acks, the other sets the pacing
+   rate to e^a times the ack rate */
+class LearnedController : public Controller
+{
+private:
+  MLP policy_;
+
+  /* tunable constants */
+  double min_window_;
+  double max_window_;
+
+  /* features, kept up to date as datagrams go and acks come */
+  WindowedMinFilter<uint64_t> min_rtt_;
+  double send_ewma_us_, ack_ewma_us_; /* of the time between sends, and between acks */
+  uint64_t last_send_, last_ack_; /* 0 until the first */
+
+  double window_;
+  uint64_t pacing_rate_;
+
+public:
+  /* throws runtime_error unless the policy takes three features and gives two actions */
+  LearnedController( const bool debug, const MLP & policy,
+		     const Parameters & parameters );
+
+  unsigned int window_size() override;
+  uint64_t pacing_rate_bps() override;
+
+  void datagram_was_sent( const uint64_t sequence_number,
+			  const uint64_t send_timestamp,
+			  const bool after_timeout ) override;
+
+  void ack_received( const uint64_t sequence_number_acked,
+		     const uint64_t send_timestamp_acked,
+		     const uint64_t recv_timestamp_acked,
+		     const uint64_t timestamp_ack_received ) override;
+};
+
+#endif /* LEARNED_CONTROLLER_HH */
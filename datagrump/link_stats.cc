@@ -0,0 +1,89 @@
+#include <algorithm>
+
+#include "link_stats.hh"
+
+using namespace std;
+
+void Histogram::add( const uint64_t value, const uint64_t count )
+{
+  if ( value >= counts_.size() ) {
+    counts_.resize( value + 1 );
+  }
+
+  counts_[ value ] += count;
+  total_ += count;
+}
+
+uint64_t Histogram::percentile( const double fraction ) const
+{
+  const double target = fraction * total_;
+  uint64_t so_far = 0;
+
+  for ( uint64_t value = 0; value < counts_.size(); value++ ) {
+    so_far += counts_[ value ];
+    if ( so_far > 0 and so_far >= target ) {
+      return value;
+    }
+  }
+
+  return 0;
+}
+
+LinkStats::LinkStats( const uint64_t start_ms )
+  : start_ms_( start_ms ),
+    capacity_bytes_( 0 ),
+    delivered_bytes_( 0 ),
+    packet_delay_(),
+    signal_delay_(),
+    delivered_any_( false ),
+    latest_sent_ms_( 0 ),
+    signal_ms_( 0 )
+{}
+
+void LinkStats::opportunity( const uint64_t, const uint64_t bytes )
+{
+  capacity_bytes_ += bytes;
+}
+
+/* every millisecond before until_ms sees the newest packet delivered so far */
+void LinkStats::count_signal_delay( const uint64_t until_ms )
+{
+  for ( ; signal_ms_ < until_ms; signal_ms_++ ) {
+    signal_delay_.add( signal_ms_ - latest_sent_ms_ );
+  }
+}
+
+void LinkStats::delivery( const uint64_t time_ms, const uint64_t bytes, const uint64_t sent_ms )
+{
+  delivered_bytes_ += bytes;
+  packet_delay_.add( time_ms - sent_ms );
+
+  if ( not delivered_any_ ) {
+    /* signal delay is undefined until something has been delivered */
+    delivered_any_ = true;
+    latest_sent_ms_ = sent_ms;
+    signal_ms_ = time_ms;
+    return;
+  }
+
+  count_signal_delay( time_ms );
+  latest_sent_ms_ = max( latest_sent_ms_, sent_ms );
+}
+
+LinkStats::Summary LinkStats::summarize( const uint64_t end_ms )
+{
+  if ( delivered_any_ ) {
+    count_signal_delay( end_ms );
+  }
+
+  Summary summary;
+  summary.duration_s = (end_ms - start_ms_) / 1000.0;
+  summary.capacity_mbps = summary.duration_s ? capacity_bytes_ * 8 / 1e6 / summary.duration_s : 0;
+  summary.throughput_mbps = summary.duration_s ? delivered_bytes_ * 8 / 1e6 / summary.duration_s : 0;
+  summary.packet_delay_p95_ms = packet_delay_.percentile( 0.95 );
+  summary.signal_delay_p95_ms = signal_delay_.percentile( 0.95 );
+  summary.power = summary.signal_delay_p95_ms
+    ? summary.throughput_mbps / (summary.signal_delay_p95_ms / 1000.0) : 0;
+
+  return summary;
+}
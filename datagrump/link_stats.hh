@@ -0,0 +1,71 @@
+#ifndef LINK_STATS_HH
+#define LINK_STATS_HH
+
+#include <cstdint>
+#include <vector>
+
+/* counts of whole-millisecond values, for percentiles */
+class Histogram
+{
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t total_;
+
+public:
+  Histogram() : counts_(), total_( 0 ) {}
+
+  void add( const uint64_t value, const uint64_t count = 1 );
+
+  uint64_t total() const { return total_; }
+
+  /* smallest value with at least fraction of the counts at or below it
+     (0 if empty) */
+  uint64_t percentile( const double fraction ) const;
+};
+
+/* the contest's measures of a run, from what an mm-link-style bottleneck
+   delivered (the same way mm-throughput-graph scores an mm-link log);
+   events must be reported in time order, in milliseconds */
+class LinkStats
+{
+public:
+  struct Summary
+  {
+    double duration_s;
+    /* rates are 0 if the run spans no time */
+    double capacity_mbps;   /* what the link could have delivered */
+    double throughput_mbps; /* what it did deliver */
+    uint64_t packet_delay_p95_ms; /* per-packet time from arrival to delivery */
+    uint64_t signal_delay_p95_ms;
+    double power; /* throughput (Mbit/s) over 95th-percentile signal delay (s) */
+  };
+
+private:
+  uint64_t start_ms_;
+  uint64_t capacity_bytes_, delivered_bytes_;
+  Histogram packet_delay_, signal_delay_;
+
+  /* signal delay at a moment is how old the newest information the
+     receiver has is: the time since the latest-sent packet delivered
+     so far was sent; it is counted for each millisecond up to
+     signal_ms_ */
+  bool delivered_any_;
+  uint64_t latest_sent_ms_;
+  uint64_t signal_ms_;
+
+  void count_signal_delay( const uint64_t until_ms );
+
+public:
+  LinkStats( const uint64_t start_ms );
+
+  /* the link could have delivered bytes at time_ms */
+  void opportunity( const uint64_t time_ms, const uint64_t bytes );
+
+  /* the link delivered a packet at time_ms that arrived at it at sent_ms */
+  void delivery( const uint64_t time_ms, const uint64_t bytes, const uint64_t sent_ms );
+
+  /* the run ended at end_ms */
+  Summary summarize( const uint64_t end_ms );
+};
+
+#endif /* LINK_STATS_HH */
@@ -0,0 +1,146 @@
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "live_stats.hh"
+#include "util.hh"
+
+using namespace std;
+
+uint64_t LogHistogram::lowest( const size_t bucket )
+{
+  if ( bucket < (size_t( 1 ) << SUB_BITS) ) {
+    return bucket;
+  }
+
+  const unsigned int magnitude = (bucket >> SUB_BITS) + SUB_BITS - 1;
+  const uint64_t leading = (uint64_t( 1 ) << SUB_BITS) | (bucket & ((1 << SUB_BITS) - 1));
+  return leading << (magnitude - SUB_BITS);
+}
+
+uint64_t LogHistogram::highest( const size_t bucket )
+{
+  return bucket + 1 < BUCKETS ? lowest( bucket + 1 ) - 1 : uint64_t( -1 );
+}
+
+const char * LiveStats::name( const Histogram which )
+{
+  switch ( which ) {
+  case Histogram::RTT: return "rtt_us";
+  case Histogram::OneWayDelay: return "one_way_delay_us";
+  case Histogram::InterAck: return "inter_ack_us";
+  case Histogram::Window: return "window";
+  case Histogram::InFlight: return "in_flight";
+  default: return "?";
+  }
+}
+
+const char * LiveStats::name( const Counter which )
+{
+  switch ( which ) {
+  case Counter::DatagramsSent: return "datagrams_sent";
+  case Counter::AcksReceived: return "acks_received";
+  case Counter::DatagramsLost: return "datagrams_lost";
+  case Counter::SendCalls: return "send_calls";
+  case Counter::RecvCalls: return "recv_calls";
+  default: return "?";
+  }
+}
+
+/* shm_open's name for the segment */
+static string shm_name( const string & name )
+{
+  if ( name.empty() or name.find( '/' ) != string::npos ) {
+    throw runtime_error( "invalid stats segment name: " + name );
+  }
+  return "/" + name;
+}
+
+LiveStats::LiveStats( FileDescriptor && fd, const bool writable )
+  : fd_( move( fd ) ),
+    segment_( nullptr )
+{
+  void * const mapping = mmap( nullptr, sizeof( Segment ),
+			       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			       MAP_SHARED, fd_.fd_num(), 0 );
+  if ( mapping == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+  segment_ = static_cast<Segment *>( mapping );
+}
+
+LiveStats::~LiveStats()
+{
+  munmap( segment_, sizeof( Segment ) );
+}
+
+unique_ptr<LiveStats> LiveStats::create( const string & name )
+{
+  /* a new segment each time, so a reader of the old one never sees it shrink */
+  const string path = shm_name( name );
+  if ( shm_unlink( path.c_str() ) < 0 and errno != ENOENT ) {
+    throw unix_error( "shm_unlink " + path );
+  }
+
+  FileDescriptor fd( SystemCall( "shm_open " + path,
+				 shm_open( path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644 ) ) );
+  SystemCall( "ftruncate", ftruncate( fd.fd_num(), sizeof( Segment ) ) );
+
+  unique_ptr<LiveStats> ret( new LiveStats( move( fd ), true ) );
+  Segment & segment = *new ( ret->segment_ ) Segment();
+
+  timeval now;
+  SystemCall( "gettimeofday", gettimeofday( &now, nullptr ) );
+
+  segment.version = LAYOUT_VERSION;
+  segment.pid = getpid();
+  segment.start_us = uint64_t( now.tv_sec ) * 1000000 + now.tv_usec;
+  segment.magic.store( MAGIC, memory_order_release );
+
+  return ret;
+}
+
+unique_ptr<LiveStats> LiveStats::open( const string & name )
+{
+  const string path = shm_name( name );
+  FileDescriptor fd( SystemCall( "shm_open " + path, shm_open( path.c_str(), O_RDONLY, 0 ) ) );
+
+  struct stat info;
+  SystemCall( "fstat", fstat( fd.fd_num(), &info ) );
+  if ( info.st_size < off_t( sizeof( Segment ) ) ) {
+    throw runtime_error( path + " is not a stats segment (or is still being created)" );
+  }
+
+  unique_ptr<LiveStats> ret( new LiveStats( move( fd ), false ) );
+  if ( ret->segment_->magic.load( memory_order_acquire ) != MAGIC
+       or ret->segment_->version != LAYOUT_VERSION ) {
+    throw runtime_error( path + " is not a version " + to_string( LAYOUT_VERSION ) + " stats segment" );
+  }
+
+  return ret;
+}
+
+uint64_t LiveStats::identity( const string & name )
+{
+  const int fd_num = shm_open( shm_name( name ).c_str(), O_RDONLY, 0 );
+  if ( fd_num < 0 ) {
+    return 0;
+  }
+  const FileDescriptor fd( fd_num );
+
+  struct stat info;
+  SystemCall( "fstat", fstat( fd.fd_num(), &info ) );
+  return info.st_ino;
+}
+
+uint64_t LiveStats::identity() const
+{
+  struct stat info;
+  SystemCall( "fstat", fstat( fd_.fd_num(), &info ) );
+  return info.st_ino;
+}
@@ -0,0 +1,124 @@
+#ifndef LIVE_STATS_HH
+#define LIVE_STATS_HH
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "file_descriptor.hh"
+
+/* HDR-style histogram: values below 2^SUB_BITS are counted exactly, and
+   each power of two above that is split into 2^SUB_BITS buckets, so a
+   bucket is within 1/2^SUB_BITS of its values. There is one writer;
+   readers in other processes may see a sample or two still in flight. */
+struct LogHistogram
+{
+  static const unsigned int SUB_BITS = 4;
+  static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+  std::atomic<uint64_t> counts[ BUCKETS ];
+
+  static size_t bucket( const uint64_t value )
+  {
+    if ( value < (uint64_t( 1 ) << SUB_BITS) ) {
+      return value;
+    }
+
+    const unsigned int magnitude = 63 - __builtin_clzll( value );
+    return ((magnitude - SUB_BITS + 1) << SUB_BITS)
+      | ((value >> (magnitude - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+  }
+
+  /* the smallest and largest values counted in a bucket */
+  static uint64_t lowest( const size_t bucket );
+  static uint64_t highest( const size_t bucket );
+
+  /* with only one writer, a plain load and store (no locked instruction) */
+  void record( const uint64_t value )
+  {
+    std::atomic<uint64_t> & count = counts[ bucket( value ) ];
+    count.store( count.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+  }
+};
+
+/* the sender's live instrumentation, in a shared-memory segment
+   (/dev/shm/NAME) that datagrump-stat reads while the sender runs */
+class LiveStats
+{
+public:
+  enum class Histogram : unsigned int {
+    RTT, OneWayDelay, InterAck, /* microseconds */
+    Window, InFlight, /* datagrams, sampled per ack */
+    Count
+  };
+
+  enum class Counter : unsigned int {
+    DatagramsSent, AcksReceived, DatagramsLost,
+    SendCalls, RecvCalls, /* the socket's write_count() and read_count() */
+    Count
+  };
+
+  static const unsigned int HISTOGRAMS = static_cast<unsigned int>( Histogram::Count );
+  static const unsigned int COUNTERS = static_cast<unsigned int>( Counter::Count );
+
+  static const char * name( const Histogram which );
+  static const char * name( const Counter which );
+
+  /* the segment's layout (magic is set last, once the rest is ready) */
+  struct Segment
+  {
+    std::atomic<uint64_t> magic;
+    uint64_t version;
+    uint64_t pid;
+    uint64_t start_us; /* CLOCK_REALTIME when the writer started */
+    std::atomic<uint64_t> counters[ COUNTERS ];
+    LogHistogram histograms[ HISTOGRAMS ];
+  };
+
+  static const uint64_t MAGIC = 0x7374617467727570; /* "pugrtats" */
+  static const uint64_t LAYOUT_VERSION = 1;
+
+private:
+  FileDescriptor fd_;
+  Segment * segment_;
+
+  LiveStats( FileDescriptor && fd, const bool writable );
+
+public:
+  /* create (or replace) the segment called name, for writing */
+  static std::unique_ptr<LiveStats> create( const std::string & name );
+
+  /* map an existing segment read-only; throws runtime_error if it
+     isn't a LiveStats segment of this version */
+  static std::unique_ptr<LiveStats> open( const std::string & name );
+
+  ~LiveStats();
+
+  const Segment & segment() const { return *segment_; }
+
+  /* the segment's inode, to notice when a new writer replaces it */
+  static uint64_t identity( const std::string & name );
+  uint64_t identity() const;
+
+  void record( const Histogram which, const uint64_t value )
+  {
+    segment_->histograms[ static_cast<unsigned int>( which ) ].record( value );
+  }
+
+  void add( const Counter which, const uint64_t amount = 1 )
+  {
+    std::atomic<uint64_t> & counter = segment_->counters[ static_cast<unsigned int>( which ) ];
+    counter.store( counter.load( std::memory_order_relaxed ) + amount, std::memory_order_relaxed );
+  }
+
+  void set( const Counter which, const uint64_t value )
+  {
+    segment_->counters[ static_cast<unsigned int>( which ) ].store( value, std::memory_order_relaxed );
+  }
+
+  LiveStats( const LiveStats & other ) = delete;
+  const LiveStats & operator=( const LiveStats & other ) = delete;
+};
+
+#endif /* LIVE_STATS_HH */
@@ -0,0 +1,80 @@
+/* check the histogram's buckets, then measure what recording a sample
+   costs the sender (into a real shared-memory segment) */
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "live_stats.hh"
+
+using namespace std;
+
+/* every value falls in the bucket whose bounds contain it, within 1/16 of them */
+static void check_buckets()
+{
+  for ( size_t b = 0; b < LogHistogram::BUCKETS; b++ ) {
+    const uint64_t lowest = LogHistogram::lowest( b ), highest = LogHistogram::highest( b );
+    if ( LogHistogram::bucket( lowest ) != b or LogHistogram::bucket( highest ) != b
+	 or (b + 1 < LogHistogram::BUCKETS and LogHistogram::lowest( b + 1 ) != highest + 1)
+	 or highest - lowest > lowest / 16 ) {
+      throw runtime_error( "histogram bucket " + to_string( b ) + " is wrong" );
+    }
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const unsigned int rounds = argc > 1 ? atoi( argv[ 1 ] ) : 100000000;
+
+  check_buckets();
+  cout << "histogram buckets: ok" << endl;
+
+  const string name = "live_stats_benchmark." + to_string( getpid() );
+  unique_ptr<LiveStats> stats = LiveStats::create( name );
+  const unique_ptr<LiveStats> reader = LiveStats::open( name );
+  shm_unlink( ("/" + name).c_str() );
+
+  /* RTT-like values, precomputed so only the recording is timed */
+  mt19937 prng( 20161016 );
+  lognormal_distribution<double> rtt( 10.5, 0.5 );
+  vector<uint64_t> values( 4096 );
+  for ( auto & value : values ) {
+    value = rtt( prng );
+  }
+
+  const auto start = chrono::steady_clock::now();
+  for ( unsigned int i = 0; i < rounds; i++ ) {
+    stats->record( LiveStats::Histogram::RTT, values[ i & (values.size() - 1) ] );
+    stats->add( LiveStats::Counter::AcksReceived );
+  }
+  const auto end = chrono::steady_clock::now();
+
+  /* the reader's mapping sees every sample */
+  uint64_t total = 0;
+  for ( const auto & count : reader->segment().histograms[ 0 ].counts ) {
+    total += count.load();
+  }
+  if ( total != rounds or reader->segment().counters[ 1 ].load() != rounds ) {
+    throw runtime_error( "reader saw " + to_string( total ) + " of " + to_string( rounds ) + " samples" );
+  }
+  cout << "reader sees every sample: ok" << endl;
+
+  cout << fixed << setprecision( 2 ) << "record + add: "
+       << chrono::duration<double, nano>( end - start ).count() / rounds
+       << " ns/sample" << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "mlp.hh"
+#include "vector_math.hh"
+
+using namespace std;
+
+MLP::MLP( istream & input )
+  : layers_(),
+    scratch_()
+{
+  /* the first line gives the shape, the rest the weights */
+  string line, shape;
+  vector<float> numbers;
+  while ( getline( input, line ) ) {
+    line = line.substr( 0, line.find( '#' ) );
+    if ( shape.empty() ) {
+      if ( line.find_first_not_of( " \t\r" ) != string::npos ) {
+	shape = line;
+      }
+      continue;
+    }
+
+    istringstream fields( line );
+    float value;
+    while ( fields >> value ) {
+      numbers.push_back( value );
+    }
+    if ( not fields.eof() ) {
+      throw runtime_error( "MLP weights contain a non-number" );
+    }
+  }
+
+  istringstream fields( shape );
+  string magic;
+  vector<size_t> widths;
+  int width;
+  bool positive = true;
+  fields >> magic;
+  while ( fields >> width ) {
+    positive = positive and width > 0;
+    widths.push_back( width );
+  }
+
+  if ( magic != "mlp" or not fields.eof() or widths.size() < 2 or not positive ) {
+    throw runtime_error( "MLP weights must start with \"mlp\" and at least two nonzero layer widths" );
+  }
+
+  size_t next = 0;
+  for ( size_t l = 0; l + 1 < widths.size(); l++ ) {
+    Layer layer = { widths[ l ], widths[ l + 1 ], round_up_to_vector( widths[ l + 1 ] ), {}, {} };
+    layer.weights.resize( layer.inputs * layer.width );
+    layer.biases.resize( layer.width );
+
+    if ( numbers.size() - next < (layer.inputs + 1) * layer.outputs ) {
+      throw runtime_error( "MLP weights end early" );
+    }
+
+    for ( size_t neuron = 0; neuron < layer.outputs; neuron++ ) {
+      for ( size_t i = 0; i < layer.inputs; i++ ) {
+	layer.weights[ i * layer.width + neuron ] = numbers[ next++ ];
+      }
+      layer.biases[ neuron ] = numbers[ next++ ];
+    }
+
+    for ( auto & activations : scratch_ ) {
+      activations.resize( max( activations.size(), layer.width ) );
+    }
+    layers_.push_back( move( layer ) );
+  }
+
+  if ( next != numbers.size() ) {
+    throw runtime_error( "MLP has more weights than its layers need" );
+  }
+}
+
+const float * MLP::evaluate( const float * const input )
+{
+  const float * layer_input = input;
+
+  for ( size_t l = 0; l < layers_.size(); l++ ) {
+    const Layer & layer = layers_[ l ];
+    float * const output = scratch_[ l % 2 ].data();
+
+    copy( layer.biases.begin(), layer.biases.end(), output );
+    for ( size_t i = 0; i < layer.inputs; i++ ) {
+      add_scaled( output, &layer.weights[ i * layer.width ], layer_input[ i ], layer.width );
+    }
+
+    if ( l + 1 < layers_.size() ) {
+      rectify( output, layer.width );
+    }
+
+    layer_input = output;
+  }
+
+  return layer_input;
+}
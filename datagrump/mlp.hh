@@ -0,0 +1,46 @@
+#ifndef MLP_HH
+#define MLP_HH
+
+#include <istream>
+#include <vector>
+
+/* a small fully-connected network (ReLU hidden layers, linear outputs),
+   evaluated with the vectorized loops in vector_math.hh
+
+   Text format: "mlp" and the layer widths from inputs to outputs, then
+   each layer's neurons in order, each as its weights (one per input to
+   the layer) followed by its bias; '#' starts a comment, e.g.
+
+     mlp 2 1
+     0.5 -0.25 1    # output = 0.5 x0 - 0.25 x1 + 1
+*/
+class MLP
+{
+private:
+  struct Layer
+  {
+    size_t inputs, outputs;
+    size_t width; /* outputs, padded to the vector width */
+
+    /* column-major, so a layer is one scaled add per input */
+    std::vector<float> weights; /* inputs x width */
+    std::vector<float> biases; /* width */
+  };
+
+  std::vector<Layer> layers_;
+
+  /* activations of alternate layers */
+  std::vector<float> scratch_[ 2 ];
+
+public:
+  /* throws runtime_error if the network is malformed */
+  MLP( std::istream & input );
+
+  size_t inputs() const { return layers_.front().inputs; }
+  size_t outputs() const { return layers_.back().outputs; }
+
+  /* run the network; the result is valid until the next call */
+  const float * evaluate( const float * const input );
+};
+
+#endif /* MLP_HH */
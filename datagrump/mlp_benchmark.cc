@@ -0,0 +1,167 @@
+/* check the vectorized MLP against a plain evaluation of the same
+   network, then measure inference and per-ack controller cost */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "mlp.hh"
+#include "learned_controller.hh"
+
+using namespace std;
+
+/* a random network with the given layer widths, in the text format */
+static string random_network( const vector<size_t> & widths, mt19937 & prng )
+{
+  uniform_real_distribution<float> weight( -1, 1 );
+  ostringstream text;
+
+  text << "mlp";
+  for ( const auto width : widths ) {
+    text << " " << width;
+  }
+  text << "\n";
+
+  text << setprecision( 9 );
+  for ( size_t l = 0; l + 1 < widths.size(); l++ ) {
+    for ( size_t neuron = 0; neuron < widths[ l + 1 ]; neuron++ ) {
+      for ( size_t i = 0; i <= widths[ l ]; i++ ) {
+	text << weight( prng ) << " ";
+      }
+      text << "\n";
+    }
+  }
+
+  return text.str();
+}
+
+/* evaluate the network in its text format one neuron at a time */
+static vector<float> reference( const string & network, const vector<float> & input )
+{
+  istringstream text( network );
+  string magic;
+  vector<size_t> widths;
+  string shape;
+  getline( text, shape );
+  istringstream fields( shape );
+  fields >> magic;
+  size_t width;
+  while ( fields >> width ) {
+    widths.push_back( width );
+  }
+
+  vector<float> activations = input;
+  for ( size_t l = 0; l + 1 < widths.size(); l++ ) {
+    vector<float> next( widths[ l + 1 ] );
+    for ( auto & neuron : next ) {
+      float weight;
+      neuron = 0;
+      for ( size_t i = 0; i < widths[ l ]; i++ ) {
+	text >> weight;
+	neuron += weight * activations[ i ];
+      }
+      text >> weight;
+      neuron += weight;
+      if ( l + 2 < widths.size() ) {
+	neuron = max( neuron, 0.0f );
+      }
+    }
+    activations = next;
+  }
+
+  return activations;
+}
+
+static void check( const vector<size_t> & widths, mt19937 & prng )
+{
+  const string network = random_network( widths, prng );
+  istringstream text( network );
+  MLP mlp( text );
+
+  uniform_real_distribution<float> feature( -4, 4 );
+  for ( unsigned int trial = 0; trial < 1000; trial++ ) {
+    vector<float> input( widths.front() );
+    for ( auto & x : input ) {
+      x = feature( prng );
+    }
+
+    const float * const output = mlp.evaluate( input.data() );
+    const vector<float> expected = reference( network, input );
+    for ( size_t i = 0; i < expected.size(); i++ ) {
+      if ( fabs( output[ i ] - expected[ i ] ) > 1e-3 * max( 1.0f, fabs( expected[ i ] ) ) ) {
+	throw runtime_error( "MLP output differs from the plain evaluation" );
+      }
+    }
+  }
+}
+
+template <typename Function>
+static double ns_per_call( const unsigned int rounds, Function && function )
+{
+  const auto start = chrono::steady_clock::now();
+  for ( unsigned int i = 0; i < rounds; i++ ) {
+    function( i );
+  }
+  const auto end = chrono::steady_clock::now();
+  return chrono::duration<double, nano>( end - start ).count() / rounds;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  const unsigned int rounds = argc > 1 ? atoi( argv[ 1 ] ) : 1000000;
+
+  mt19937 prng( 20161016 );
+
+  /* odd widths exercise the padding to the vector width */
+  for ( const auto & widths : vector<vector<size_t>>{ { 3, 2 }, { 3, 5, 2 }, { 3, 32, 32, 2 }, { 7, 13, 1 } } ) {
+    check( widths, prng );
+  }
+  cout << "matches plain evaluation: ok" << endl;
+
+#ifdef __SSE__
+  cout << "kernel: SSE" << endl;
+#else
+  cout << "kernel: scalar" << endl;
+#endif
+
+  float checksum = 0;
+  cout << fixed << setprecision( 1 );
+
+  for ( const auto & widths : vector<vector<size_t>>{ { 3, 16, 2 }, { 3, 32, 32, 2 }, { 3, 64, 64, 2 } } ) {
+    istringstream text( random_network( widths, prng ) );
+    MLP mlp( text );
+
+    float input[ 3 ] = { 1, 1, 1 };
+    cout << "inference " << widths[ 1 ] << "x" << widths.size() - 2 << ": "
+	 << ns_per_call( rounds, [&] ( const unsigned int i ) {
+	     input[ 0 ] = 1 + (i & 15) / 16.0f; /* keep the compiler from hoisting the call */
+	     checksum += mlp.evaluate( input )[ 0 ];
+	   } ) << " ns/ack" << endl;
+  }
+
+  /* a whole ack, features and all, with a typical policy */
+  istringstream text( random_network( { 3, 32, 32, 2 }, prng ) );
+  LearnedController controller( false, MLP( text ), Controller::Parameters() );
+  cout << "ack_received 32x2: " << ns_per_call( rounds, [&] ( const unsigned int i ) {
+      const uint64_t now = 1000000 + 1000 * uint64_t( i );
+      controller.datagram_was_sent( i + 20, now, false );
+      controller.ack_received( i, now - 20000 - (i & 7) * 1000, now - 10000, now );
+      checksum += controller.window_size();
+    } ) << " ns/ack" << endl;
+
+  /* print the checksum so that none of the work is optimized away */
+  cerr << "checksum " << checksum << endl;
+
+  return EXIT_SUCCESS;
+}
@@ -1,12 +1,234 @@
-/* simple UDP receiver that acknowledges every datagram */
+/* simple UDP receiver that acknowledges every datagram (optionally several
+   at a time, and with several workers, each pinned to a core with its own
+   socket on the port) */
 
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "config.h"
 #include "socket.hh"
 #include "contest_message.hh"
+#include "ack_aggregator.hh"
+#include "cpu_affinity.hh"
+#include "poller.hh"
+#include "util.hh"
+
+#ifdef HAVE_IO_URING
+#include "io_uring.hh"
+#endif
 
 using namespace std;
+using namespace PollerShortNames;
+
+/* most datagrams received (and acked) per wakeup */
+static const size_t BATCH_SIZE = 32;
+
+/* how the kernel picks a worker's socket for each incoming datagram:
+   by flow hash (so each sender sticks to one worker), preferring the
+   worker on the receiving CPU (SO_INCOMING_CPU), or strictly by the
+   receiving CPU (a reuseport BPF program) */
+enum class Steering { Hash, CPU, BPF };
+
+/* ack each sender's datagrams every ack_every, or within ack_delay_us of
+   the first one waiting, whichever comes first (1 acks each right away) */
+struct AckPolicy
+{
+  size_t ack_every;
+  uint64_t ack_delay_us;
+};
+
+/* assemble the acknowledgment of a received datagram in the next free ack slot */
+static void queue_ack( const DatagramPool::Datagram & recd, const uint64_t sequence_number,
+		       const uint64_t datagrams_received, DatagramPool & acks )
+{
+  ContestMessage::Header header( recd.data, recd.length );
+
+  /* assemble the acknowledgment (with the running count of the sender's
+     arrivals, so it can see its receive rate even if acks are lost) */
+  header.transform_into_ack( sequence_number, recd.timestamp,
+			     recd.length - header.wire_size, datagrams_received );
+
+  /* timestamp the ack just before sending */
+  header.set_send_timestamp();
+
+  DatagramPool::Datagram & ack = acks.push_back();
+  ack.address = recd.address;
+  /* acks carry no payload, so the compact header shrinks them by about half */
+  ack.length = header.serialize( ack.data, ContestMessage::Header::Format::Compact );
+}
+
+#ifndef HAVE_IO_URING
+/* Loop and acknowledge incoming datagrams back to their sources several
+   at a time, waking for incoming datagrams or when acks are due */
+static void acknowledge_batched_with_mmsg( UDPSocket & socket, const AckPolicy & policy )
+{
+  AckAggregator aggregator( policy.ack_every );
+
+  /* preallocated storage for incoming datagrams and outgoing acks */
+  DatagramPool datagrams( BATCH_SIZE, 65536 ), acks( BATCH_SIZE, AckAggregator::ACK_MTU );
+
+  /* let the kernel hand over bursts of datagrams as one buffer */
+  socket.set_gro();
+
+  const auto send_acks = [&] () {
+    if ( not acks.empty() ) {
+      socket.sendto_batch( acks );
+      acks.clear();
+    }
+  };
+
+  Poller poller;
+  bool timer_armed = false;
+
+  poller.add_action( Action( socket, Direction::In, [&] () {
+	socket.recv_into( datagrams );
+	for ( const auto & recd : datagrams ) {
+	  if ( acks.full() ) {
+	    send_acks();
+	  }
+	  aggregator.datagram_received( recd, acks );
+	}
+	send_acks();
+
+	/* datagrams left waiting are acked when the delay is up */
+	if ( aggregator.pending() and not timer_armed ) {
+	  timer_armed = true;
+	  poller.add_timer( policy.ack_delay_us, [&] () {
+	      timer_armed = false;
+	      while ( aggregator.flush( acks ) ) {
+		send_acks();
+	      }
+	      send_acks();
+	      return ResultType::Continue;
+	    } );
+	}
+	return ResultType::Continue;
+      } ) );
+
+  while ( true ) {
+    poller.poll( -1 );
+  }
+}
+
+/* Loop and acknowledge every incoming datagram back to its source,
+   one batch of datagrams (and one batch of acks) per wakeup */
+static void acknowledge_with_mmsg( UDPSocket & socket, const AckPolicy & policy )
+{
+  if ( policy.ack_every > 1 ) {
+    acknowledge_batched_with_mmsg( socket, policy );
+    return;
+  }
+
+  uint64_t sequence_number = 0;
+
+  /* (only used to count each sender's datagrams) */
+  AckAggregator aggregator( policy.ack_every );
+
+  /* preallocated storage for incoming datagrams and outgoing acks */
+  DatagramPool datagrams( BATCH_SIZE, 65536 ), acks( BATCH_SIZE, ContestMessage::Header::MAX_WIRE_SIZE );
+
+  /* let the kernel hand over bursts of datagrams as one buffer */
+  socket.set_gro();
+
+  while ( true ) {
+    socket.recv_into( datagrams );
+
+    /* (a coalesced buffer can hold more datagrams than there are ack slots) */
+    acks.clear();
+    for ( const auto & recd : datagrams ) {
+      if ( acks.full() ) {
+	socket.sendto_batch( acks );
+	acks.clear();
+      }
+      queue_ack( recd, sequence_number++, aggregator.count_arrival( recd ), acks );
+    }
+
+    /* send the acks */
+    socket.sendto_batch( acks );
+  }
+}
+
+#else
+/* Loop and acknowledge every incoming datagram back to its source,
+   with one io_uring_enter per wakeup both to receive (multishot)
+   and to send the previous wakeup's acks */
+static void acknowledge_with_io_uring( UDPSocket & socket, const AckPolicy & policy )
+{
+  uint64_t sequence_number = 0;
+
+  /* (only used to count each sender's datagrams, if acking every one) */
+  AckAggregator aggregator( policy.ack_every );
+  bool timer_armed = false;
+
+  IOUringLoop loop;
+
+  /* acks are sent asynchronously, so a pool is only reused once its sends complete */
+  vector< unique_ptr< DatagramPool > > spare_pools;
+  unique_ptr< DatagramPool > acks( new DatagramPool( BATCH_SIZE, AckAggregator::ACK_MTU ) );
+
+  const auto send_acks = [&] () {
+    if ( acks->empty() ) {
+      return;
+    }
+
+    DatagramPool * const sending = acks.release();
+    loop.send_batch( socket, *sending, true, [&spare_pools, sending] () {
+	sending->clear();
+	spare_pools.emplace_back( sending );
+      } );
+
+    if ( spare_pools.empty() ) {
+      acks.reset( new DatagramPool( BATCH_SIZE, AckAggregator::ACK_MTU ) );
+    } else {
+      acks = move( spare_pools.back() );
+      spare_pools.pop_back();
+    }
+  };
+
+  loop.recv_multishot( socket, [&] ( const DatagramPool::Datagram & recd ) {
+      if ( policy.ack_every == 1 ) {
+	queue_ack( recd, sequence_number++, aggregator.count_arrival( recd ), *acks );
+      } else {
+	aggregator.datagram_received( recd, *acks );
+
+	/* datagrams left waiting are acked when the delay is up */
+	if ( aggregator.pending() and not timer_armed ) {
+	  timer_armed = true;
+	  loop.add_timer( policy.ack_delay_us, [&] () {
+	      timer_armed = false;
+	      while ( aggregator.flush( *acks ) ) {
+		send_acks();
+	      }
+	      return ResultType::Continue;
+	    } );
+	}
+      }
+
+      if ( acks->full() ) {
+	send_acks();
+      }
+      return Poller::Action::Result();
+    } );
+
+  while ( true ) {
+    loop.loop_once( -1 );
+    send_acks();
+  }
+}
+#endif
+
+static void acknowledge( UDPSocket & socket, const AckPolicy & policy )
+{
+#ifdef HAVE_IO_URING
+  acknowledge_with_io_uring( socket, policy );
+#else
+  acknowledge_with_mmsg( socket, policy );
+#endif
+}
 
 int main( int argc, char *argv[] )
 {
@@ -15,37 +237,107 @@ int main( int argc, char *argv[] )
     abort();
   }
 
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
+  size_t workers = 1;
+  Steering steering = Steering::Hash;
+  AckPolicy policy = { 1, 10000 };
+  bool usage_error = argc < 2;
+
+  for ( int i = 2; i < argc; i++ ) {
+    const string option( argv[ i ] );
+    if ( option.compare( 0, 8, "workers=" ) == 0 ) {
+      workers = strtoul( option.c_str() + 8, nullptr, 10 );
+      usage_error = usage_error or workers == 0;
+    } else if ( option == "steer=hash" ) {
+      steering = Steering::Hash;
+    } else if ( option == "steer=cpu" ) {
+      steering = Steering::CPU;
+    } else if ( option == "steer=bpf" ) {
+      steering = Steering::BPF;
+    } else if ( option.compare( 0, 10, "ack_every=" ) == 0 ) {
+      policy.ack_every = strtoul( option.c_str() + 10, nullptr, 10 );
+      usage_error = usage_error or policy.ack_every == 0
+	or policy.ack_every > ContestMessage::AckBatch::MAX_ACKED + 1;
+    } else if ( option.compare( 0, 13, "ack_delay_us=" ) == 0 ) {
+      policy.ack_delay_us = strtoull( option.c_str() + 13, nullptr, 10 );
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " PORT [workers=N] [steer=hash|cpu|bpf]"
+	 << " [ack_every=N (at most " << ContestMessage::AckBatch::MAX_ACKED + 1 << ")]"
+	 << " [ack_delay_us=T]" << endl;
     return EXIT_FAILURE;
   }
 
-  /* create UDP socket for incoming datagrams */
-  UDPSocket socket;
+  try {
+    /* one worker acks on the main thread, as it always has */
+    if ( workers == 1 ) {
+      /* create UDP socket for incoming datagrams */
+      UDPSocket socket;
 
-  /* turn on timestamps on receipt */
-  socket.set_timestamps();
+      /* turn on timestamps on receipt */
+      socket.set_timestamps();
 
-  /* "bind" the socket to the user-specified local port number */
-  socket.bind( Address( "::0", argv[ 1 ] ) );
+      /* "bind" the socket to the user-specified local port number */
+      socket.bind( Address( "::0", argv[ 1 ] ) );
 
-  cerr << "Listening on " << socket.local_address().to_string() << endl;
+      cerr << "Listening on " << socket.local_address().to_string() << endl;
 
-  uint64_t sequence_number = 0;
+      acknowledge( socket, policy );
+      return EXIT_SUCCESS;
+    }
 
-  /* Loop and acknowledge every incoming datagram back to its source */
-  while ( true ) {
-    const UDPSocket::received_datagram recd = socket.recv();
-    ContestMessage message = recd.payload;
+    /* otherwise each worker gets its own socket on the port (with its own
+       ack counters) and a core, the ith worker the ith allowed CPU (wrapping
+       around if there are more workers than CPUs, in which case BPF steering
+       sends each CPU's traffic to the first worker on it) */
+    const vector<int> allowed = allowed_cpus();
+    vector<int> cpus( workers );
+    for ( size_t i = 0; i < workers; i++ ) {
+      cpus[ i ] = allowed[ i % allowed.size() ];
+    }
+
+    vector<UDPSocket> sockets( workers );
 
-    /* assemble the acknowledgment */
-    message.transform_into_ack( sequence_number++, recd.timestamp );
+    for ( size_t i = 0; i < workers; i++ ) {
+      sockets[ i ].set_timestamps();
+      sockets[ i ].set_reuseport();
+      if ( steering == Steering::CPU ) {
+	sockets[ i ].set_incoming_cpu( cpus[ i ] );
+      }
 
-    /* timestamp the ack just before sending */
-    message.set_send_timestamp();
+      /* the group's order of binding is the order the BPF program indexes */
+      sockets[ i ].bind( Address( "::0", argv[ 1 ] ) );
+    }
 
-    /* send the ack */
-    socket.sendto( recd.source_address, message.to_string() );
+    if ( steering == Steering::BPF ) {
+      sockets.front().set_reuseport_cpu_steering( cpus );
+    }
+
+    cerr << "Listening on " << sockets.front().local_address().to_string()
+	 << " with " << workers << " workers" << endl;
+
+    vector<thread> threads;
+    for ( size_t i = 0; i < workers; i++ ) {
+      threads.emplace_back( [&sockets, &cpus, &policy, i] () {
+	  try {
+	    pin_to_cpu( cpus[ i ] );
+	    acknowledge( sockets[ i ], policy );
+	  } catch ( const exception & e ) {
+	    print_exception( e );
+	    exit( EXIT_FAILURE );
+	  }
+	} );
+    }
+
+    for ( auto & thread : threads ) {
+      thread.join();
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
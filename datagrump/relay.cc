@@ -0,0 +1,450 @@
+/* user-space link emulator: relays datagrams between the contest's sender
+   and receiver (over loopback, say) through trace-driven bottlenecks and a
+   propagation delay, in real time, as mm-delay and mm-link would, without
+   root; optionally writes mm-link-style logs for scoring */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "poller.hh"
+#include "socket.hh"
+#include "timestamp.hh"
+#include "trace_link.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* most datagrams taken from (or handed to) the kernel per syscall */
+static const size_t BATCH_SIZE = 64;
+static const size_t MTU = 2048;
+
+/* IP and UDP headers, which mm-link counts as part of each packet */
+static const size_t IP_UDP_OVERHEAD = 28;
+
+/* how often idle opportunities are accounted for and logs flushed */
+static const uint64_t HOUSEKEEPING_INTERVAL_US = 100000;
+
+static const uint64_t NEVER = numeric_limits<uint64_t>::max();
+
+struct RelayPacket
+{
+  unique_ptr<char[]> payload; /* MTU bytes, from a BufferPool */
+  size_t length;
+  uint64_t arrival_us; /* when it joined the bottleneck's queue */
+  size_t size; /* on the wire */
+};
+
+/* payload buffers, handed back once their packets are sent so relaying a
+   datagram needn't allocate (those of lost or dropped packets are freed) */
+class BufferPool
+{
+private:
+  vector< unique_ptr<char[]> > free_;
+
+public:
+  BufferPool() : free_() {}
+
+  /* a packet holding a copy of a received datagram */
+  RelayPacket packet( const DatagramPool::Datagram & recd )
+  {
+    unique_ptr<char[]> buffer;
+    if ( free_.empty() ) {
+      buffer.reset( new char[ MTU ] );
+    } else {
+      buffer = move( free_.back() );
+      free_.pop_back();
+    }
+
+    memcpy( buffer.get(), recd.data, recd.length );
+    return { move( buffer ), recd.length, 0, recd.length + IP_UDP_OVERHEAD };
+  }
+
+  void give_back( RelayPacket && packet ) { free_.push_back( move( packet.payload ) ); }
+};
+
+/* one direction of the emulated path: random loss, then a bottleneck
+   followed by the propagation delay (uplink) or the propagation delay
+   followed by a bottleneck (downlink); everything runs in timestamp_us() */
+class Pipe
+{
+private:
+  TraceLink<RelayPacket> link_;
+  bool link_first_;
+  uint64_t delay_us_;
+
+  /* every packet is delayed by the same amount, so their release times
+     are in order and a FIFO is all the timer queue it takes */
+  deque< pair< uint64_t, RelayPacket > > delay_line_;
+
+  bernoulli_distribution loss_;
+  mt19937 prng_;
+
+  unique_ptr<ofstream> log_;
+  vector<RelayPacket> delivered_;
+
+  /* a packet reaches the bottleneck */
+  void enqueue( RelayPacket && packet, const uint64_t now_us );
+
+public:
+  Pipe( const DeliveryTrace & trace, const bool link_first, const uint64_t delay_ms,
+	const size_t queue_limit, const uint64_t codel_target_ms,
+	const double loss, const uint32_t seed, const string & log_filename );
+
+  /* a packet enters the pipe */
+  void push( RelayPacket && packet, const uint64_t now_us );
+
+  /* run the pipe up to now_us, passing the packets that leave it to output */
+  template <class Output>
+  void advance( const uint64_t now_us, Output && output );
+
+  /* when the pipe next has something to do (if it isn't idle) */
+  uint64_t next_deadline_us() const;
+
+  void flush_log() { if ( log_ ) { log_->flush(); } }
+};
+
+Pipe::Pipe( const DeliveryTrace & trace, const bool link_first, const uint64_t delay_ms,
+	    const size_t queue_limit, const uint64_t codel_target_ms,
+	    const double loss, const uint32_t seed, const string & log_filename )
+  : link_( trace, queue_limit, codel_target_ms * 1000 ),
+    link_first_( link_first ),
+    delay_us_( delay_ms * 1000 ),
+    delay_line_(),
+    loss_( loss ),
+    prng_( seed ),
+    log_(),
+    delivered_()
+{
+  if ( not log_filename.empty() ) {
+    log_.reset( new ofstream( log_filename ) );
+    if ( not log_->is_open() ) {
+      throw runtime_error( "cannot open log " + log_filename );
+    }
+
+    /* the header mm-throughput-graph looks for (times are ms since start) */
+    *log_ << "# datagrump relay (" << (link_first ? "uplink" : "downlink") << ")\n"
+	  << "# queue: " << (codel_target_ms ? "codel" : "droptail")
+	  << " [packets=" << queue_limit << "]\n"
+	  << "# init timestamp: " << chrono::duration_cast<chrono::milliseconds>(
+	       chrono::system_clock::now().time_since_epoch() ).count() << "\n"
+	  << "# base timestamp: 0\n";
+  }
+}
+
+void Pipe::enqueue( RelayPacket && packet, const uint64_t now_us )
+{
+  const size_t size = packet.size;
+  link_.enqueue( move( packet ), now_us );
+
+  if ( log_ ) {
+    *log_ << now_us / 1000 << " + " << size << "\n";
+  }
+}
+
+void Pipe::push( RelayPacket && packet, const uint64_t now_us )
+{
+  if ( loss_( prng_ ) ) {
+    return;
+  }
+
+  if ( link_first_ ) {
+    enqueue( move( packet ), now_us );
+  } else {
+    delay_line_.emplace_back( now_us + delay_us_, move( packet ) );
+  }
+}
+
+template <class Output>
+void Pipe::advance( const uint64_t now_us, Output && output )
+{
+  /* take the delay line's releases and the link's opportunities in time
+     order (a packet released at an opportunity's time can use it) */
+  while ( true ) {
+    const uint64_t release_us = delay_line_.empty() ? NEVER : delay_line_.front().first;
+    const uint64_t opportunity_us = link_.opportunity_ms() * 1000;
+
+    if ( release_us <= now_us and release_us <= opportunity_us ) {
+      RelayPacket packet = move( delay_line_.front().second );
+      delay_line_.pop_front();
+
+      if ( link_first_ ) {
+	output( move( packet ) );
+      } else {
+	enqueue( move( packet ), release_us );
+      }
+    } else if ( opportunity_us <= now_us ) {
+      if ( log_ ) {
+	*log_ << opportunity_us / 1000 << " # " << TraceLink<RelayPacket>::OPPORTUNITY_BYTES << "\n";
+      }
+
+      delivered_.clear();
+      link_.use_opportunity( delivered_ );
+
+      for ( auto & packet : delivered_ ) {
+	if ( log_ ) {
+	  *log_ << opportunity_us / 1000 << " - " << packet.size << " "
+		<< opportunity_us / 1000 - packet.arrival_us / 1000 << "\n";
+	}
+
+	if ( link_first_ ) {
+	  delay_line_.emplace_back( opportunity_us + delay_us_, move( packet ) );
+	} else {
+	  output( move( packet ) );
+	}
+      }
+    } else {
+      return;
+    }
+  }
+}
+
+uint64_t Pipe::next_deadline_us() const
+{
+  const uint64_t release_us = delay_line_.empty() ? NEVER : delay_line_.front().first;
+  const uint64_t opportunity_us = link_.empty() ? NEVER : link_.opportunity_ms() * 1000;
+  return min( release_us, opportunity_us );
+}
+
+/* sender <-> client_ socket, relay, server_ socket <-> receiver */
+class Relay
+{
+private:
+  UDPSocket client_, server_;
+  Address sender_address_;
+  bool have_sender_;
+
+  Pipe uplink_, downlink_;
+  BufferPool buffers_;
+
+  /* preallocated storage for batched receives and sends */
+  DatagramPool incoming_, to_receiver_, to_sender_;
+
+  Poller poller_;
+  Poller::TimerID wakeup_timer_;
+  uint64_t wakeup_us_; /* when wakeup_timer_ fires, or NEVER */
+
+  /* move everything due by now_us along, and send what came out */
+  void service( const uint64_t now_us );
+  void flush();
+
+  /* wake up for the earliest deadline */
+  void arm_wakeup();
+
+public:
+  Relay( const string & port, const Address & receiver,
+	 Pipe && uplink, Pipe && downlink );
+
+  int loop();
+};
+
+Relay::Relay( const string & port, const Address & receiver,
+	      Pipe && uplink, Pipe && downlink )
+  : client_(),
+    server_(),
+    sender_address_(),
+    have_sender_( false ),
+    uplink_( move( uplink ) ),
+    downlink_( move( downlink ) ),
+    buffers_(),
+    incoming_( BATCH_SIZE, MTU ),
+    to_receiver_( BATCH_SIZE, MTU ),
+    to_sender_( BATCH_SIZE, MTU ),
+    poller_(),
+    wakeup_timer_( 0 ),
+    wakeup_us_( NEVER )
+{
+  client_.bind( Address( "::0", port ) );
+  server_.connect( receiver );
+
+  cerr << "Relaying " << client_.local_address().to_string()
+       << " to " << server_.peer_address().to_string() << endl;
+}
+
+void Relay::flush()
+{
+  if ( not to_receiver_.empty() ) {
+    server_.send_batch( to_receiver_ );
+    to_receiver_.clear();
+  }
+
+  if ( not to_sender_.empty() ) {
+    client_.sendto_batch( to_sender_ );
+    to_sender_.clear();
+  }
+}
+
+void Relay::service( const uint64_t now_us )
+{
+  uplink_.advance( now_us, [&] ( RelayPacket && packet ) {
+      if ( to_receiver_.full() ) {
+	flush();
+      }
+      DatagramPool::Datagram & datagram = to_receiver_.push_back();
+      memcpy( datagram.data, packet.payload.get(), packet.length );
+      datagram.length = packet.length;
+      buffers_.give_back( move( packet ) );
+    } );
+
+  downlink_.advance( now_us, [&] ( RelayPacket && packet ) {
+      if ( not have_sender_ ) {
+	buffers_.give_back( move( packet ) );
+	return; /* nowhere to send it */
+      }
+      if ( to_sender_.full() ) {
+	flush();
+      }
+      DatagramPool::Datagram & datagram = to_sender_.push_back();
+      memcpy( datagram.data, packet.payload.get(), packet.length );
+      datagram.length = packet.length;
+      datagram.address = sender_address_;
+      buffers_.give_back( move( packet ) );
+    } );
+
+  flush();
+}
+
+void Relay::arm_wakeup()
+{
+  const uint64_t deadline = min( uplink_.next_deadline_us(), downlink_.next_deadline_us() );
+  if ( deadline == wakeup_us_ ) {
+    return;
+  }
+
+  /* (cancelling a timer that already fired does nothing) */
+  poller_.cancel_timer( wakeup_timer_ );
+  wakeup_us_ = deadline;
+  if ( deadline == NEVER ) {
+    return;
+  }
+
+  const uint64_t now = timestamp_us();
+  wakeup_timer_ = poller_.add_timer( deadline > now ? deadline - now : 0, [&] () {
+      wakeup_us_ = NEVER;
+      service( timestamp_us() );
+      arm_wakeup();
+      return ResultType::Continue;
+    } );
+}
+
+int Relay::loop()
+{
+  /* datagrams from the sender go up the uplink */
+  poller_.add_action( Action( client_, Direction::In, [&] () {
+	client_.recv_into( incoming_ );
+
+	/* (the link must have used its earlier opportunities first) */
+	const uint64_t now = timestamp_us();
+	service( now );
+	for ( const auto & recd : incoming_ ) {
+	  sender_address_ = recd.address;
+	  have_sender_ = true;
+	  uplink_.push( buffers_.packet( recd ), now );
+	}
+
+	arm_wakeup();
+	return ResultType::Continue;
+      } ) );
+
+  /* acks from the receiver go down the downlink */
+  poller_.add_action( Action( server_, Direction::In, [&] () {
+	server_.recv_into( incoming_ );
+
+	const uint64_t now = timestamp_us();
+	service( now );
+	for ( const auto & recd : incoming_ ) {
+	  downlink_.push( buffers_.packet( recd ), now );
+	}
+
+	arm_wakeup();
+	return ResultType::Continue;
+      } ) );
+
+  /* catch up on idle opportunities (for the logs) and flush the logs */
+  poller_.add_timer( HOUSEKEEPING_INTERVAL_US, [&] () {
+      service( timestamp_us() );
+      uplink_.flush_log();
+      downlink_.flush_log();
+      return ResultType::Continue;
+    }, HOUSEKEEPING_INTERVAL_US );
+
+  while ( true ) {
+    const auto ret = poller_.poll( -1 );
+    if ( ret.result == PollResult::Exit ) {
+      return ret.exit_status;
+    }
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc < 6 ) {
+    cerr << "Usage: " << argv[ 0 ] << " PORT RECEIVER_HOST RECEIVER_PORT UPLINK_TRACE DOWNLINK_TRACE"
+	 << " [delay=MS] [queue=PACKETS] [codel=TARGET_MS] [loss=FRACTION] [seed=N]"
+	 << " [uplink-log=FILE] [downlink-log=FILE]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    uint64_t delay_ms = 20, codel_target_ms = 0;
+    size_t queue_limit = 0;
+    double loss = 0;
+    uint32_t seed = 0;
+    string uplink_log, downlink_log;
+
+    for ( int i = 6; i < argc; i++ ) {
+      const string argument( argv[ i ] );
+      const size_t equals = argument.find( '=' );
+      const string name = argument.substr( 0, equals );
+      const string value = equals == string::npos ? "" : argument.substr( equals + 1 );
+
+      if ( name == "delay" ) {
+	delay_ms = stoull( value );
+      } else if ( name == "queue" ) {
+	queue_limit = stoull( value );
+      } else if ( name == "codel" ) {
+	codel_target_ms = stoull( value );
+      } else if ( name == "loss" ) {
+	loss = stod( value );
+      } else if ( name == "seed" ) {
+	seed = stoul( value );
+      } else if ( name == "uplink-log" ) {
+	uplink_log = value;
+      } else if ( name == "downlink-log" ) {
+	downlink_log = value;
+      } else {
+	throw runtime_error( "unknown option \"" + argument + "\"" );
+      }
+    }
+
+    const DeliveryTrace uplink_trace( argv[ 4 ] ), downlink_trace( argv[ 5 ] );
+
+    /* start the clock (trace time 0) */
+    timestamp_us();
+
+    Relay relay( argv[ 1 ], Address( argv[ 2 ], argv[ 3 ] ),
+		 Pipe( uplink_trace, true, delay_ms, queue_limit, codel_target_ms,
+		       loss, seed, uplink_log ),
+		 Pipe( downlink_trace, false, delay_ms, queue_limit, codel_target_ms,
+		       loss, seed + 1, downlink_log ) );
+    return relay.loop();
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+}
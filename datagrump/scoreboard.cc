@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "scoreboard.hh"
+
+using namespace std;
+
+/* RFC 6298's G: the smallest variance allowance, in microseconds */
+static const uint64_t CLOCK_GRANULARITY_US = 1000;
+
+/* the RTO before any RTT has been measured (RFC 6298, 2.1) */
+static const uint64_t INITIAL_RTO_US = 1000000;
+
+Scoreboard::Scoreboard( const uint64_t min_rto_us, const uint64_t max_rto_us,
+			const size_t history )
+  : entries_( history, Entry { 0, 0, 0, State::Unused, 0 } ),
+    first_outstanding_( 0 ),
+    next_sequence_number_( 0 ),
+    in_flight_( 0 ),
+    in_flight_bytes_( 0 ),
+    rack_end_( 0 ),
+    rack_rtt_( 0 ),
+    min_rtt_( -1 ),
+    srtt_( 0 ),
+    rttvar_( 0 ),
+    rto_( max( min_rto_us, min( INITIAL_RTO_US, max_rto_us ) ) ),
+    min_rto_( min_rto_us ),
+    max_rto_( max_rto_us ),
+    loss_deadline_( 0 ),
+    rto_deadline_( 0 )
+{
+  if ( history == 0 or (history & (history - 1)) ) {
+    throw runtime_error( "scoreboard history must be a power of two" );
+  }
+}
+
+void Scoreboard::datagram_was_sent( const uint64_t sequence_number, const uint32_t size,
+				    const uint64_t timestamp )
+{
+  if ( sequence_number != next_sequence_number_ or full() ) {
+    throw runtime_error( "scoreboard can't track datagram " + to_string( sequence_number ) );
+  }
+
+  entry( sequence_number ) = { sequence_number, timestamp, size, State::InFlight, 0 };
+  next_sequence_number_++;
+  in_flight_++;
+  in_flight_bytes_ += size;
+
+  /* start the retransmission timer if it isn't running (RFC 6298, 5.1) */
+  if ( rto_deadline_ == 0 ) {
+    rto_deadline_ = timestamp + rto_;
+  }
+}
+
+bool Scoreboard::ack_received( const uint64_t sequence_number, const uint64_t timestamp,
+			       vector<Lost> & losses )
+{
+  Entry & acked = entry( sequence_number );
+  if ( acked.sequence_number != sequence_number
+       or acked.state == State::Unused or acked.state == State::Acked ) {
+    return false;
+  }
+
+  /* a datagram declared lost may still turn up; it's acked, but no
+     longer counted in flight */
+  if ( acked.state == State::InFlight ) {
+    in_flight_--;
+    in_flight_bytes_ -= acked.size;
+  }
+  acked.state = State::Acked;
+  acked.acked_through = sequence_number + 1;
+
+  /* every datagram is sent once, so every ack gives an unambiguous RTT */
+  const uint64_t rtt = timestamp - acked.sent_time;
+  sample_rtt( rtt );
+  min_rtt_ = min( min_rtt_, rtt );
+
+  if ( sequence_number >= rack_end_ ) {
+    rack_end_ = sequence_number + 1;
+    rack_rtt_ = rtt;
+  }
+
+  /* restart the retransmission timer, or stop it if nothing
+     is left in flight (RFC 6298, 5.2 and 5.3) */
+  rto_deadline_ = in_flight_ ? timestamp + rto_ : 0;
+
+  detect_losses( timestamp, losses );
+  return true;
+}
+
+/* RACK: every datagram sent before the most recently sent one that was
+   acked is lost once it is older than that one's RTT plus a quarter of
+   the min RTT (to allow for reordering) */
+void Scoreboard::detect_losses( const uint64_t timestamp, vector<Lost> & losses )
+{
+  advance();
+
+  loss_deadline_ = 0;
+  const uint64_t reordering_window = min( min_rtt_ / 4, srtt_ );
+
+  for ( uint64_t s = first_outstanding_; s < rack_end_; s = next_unacked( s + 1 ) ) {
+    Entry & outstanding = entry( s );
+    if ( outstanding.state != State::InFlight ) {
+      continue;
+    }
+
+    /* datagrams are sent in sequence, so the rest are younger still */
+    const uint64_t deadline = outstanding.sent_time + rack_rtt_ + reordering_window;
+    if ( timestamp < deadline ) {
+      loss_deadline_ = deadline;
+      break;
+    }
+
+    mark_lost( outstanding, losses );
+  }
+
+  if ( in_flight_ == 0 ) {
+    rto_deadline_ = 0;
+  }
+
+  advance();
+}
+
+/* the first datagram from sequence_number on that isn't known to be acked */
+uint64_t Scoreboard::next_unacked( const uint64_t sequence_number )
+{
+  uint64_t end = sequence_number;
+  while ( end < next_sequence_number_ and acked( end ) ) {
+    end = entry( end ).acked_through;
+  }
+
+  /* let the run's datagrams skip straight to its end next time */
+  for ( uint64_t s = sequence_number; s < end and acked( s ); ) {
+    const uint64_t next = entry( s ).acked_through;
+    entry( s ).acked_through = end;
+    s = next;
+  }
+
+  return end;
+}
+
+void Scoreboard::mark_lost( Entry & lost, vector<Lost> & losses )
+{
+  lost.state = State::Lost;
+  in_flight_--;
+  in_flight_bytes_ -= lost.size;
+  losses.push_back( { lost.sequence_number, lost.sent_time, lost.size } );
+}
+
+/* move past the acked and lost datagrams at the front */
+void Scoreboard::advance()
+{
+  while ( first_outstanding_ < next_sequence_number_
+	  and entry( first_outstanding_ ).state != State::InFlight ) {
+    first_outstanding_++;
+  }
+}
+
+/* RFC 6298, 2.2 and 2.3 (a new sample also undoes any backoff) */
+void Scoreboard::sample_rtt( const uint64_t rtt )
+{
+  if ( srtt_ == 0 ) {
+    srtt_ = max<uint64_t>( rtt, 1 );
+    rttvar_ = rtt / 2;
+  } else {
+    const uint64_t deviation = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (3 * rttvar_ + deviation) / 4;
+    srtt_ = max<uint64_t>( (7 * srtt_ + rtt) / 8, 1 );
+  }
+
+  rto_ = max( min_rto_, min( srtt_ + max( CLOCK_GRANULARITY_US, 4 * rttvar_ ), max_rto_ ) );
+}
+
+uint64_t Scoreboard::deadline() const
+{
+  if ( loss_deadline_ == 0 or rto_deadline_ == 0 ) {
+    return max( loss_deadline_, rto_deadline_ );
+  }
+
+  return min( loss_deadline_, rto_deadline_ );
+}
+
+bool Scoreboard::timer_fired( const uint64_t timestamp, vector<Lost> & losses )
+{
+  if ( rto_deadline_ == 0 or timestamp < rto_deadline_ ) {
+    detect_losses( timestamp, losses );
+    return false;
+  }
+
+  /* RFC 6298, 5.4-5.6 (the sender retransmits; the timer restarts when it does) */
+  for ( uint64_t s = first_outstanding_; s < next_sequence_number_; s++ ) {
+    if ( entry( s ).state == State::InFlight ) {
+      mark_lost( entry( s ), losses );
+    }
+  }
+
+  rto_ = min( 2 * rto_, max_rto_ );
+  rto_deadline_ = 0;
+  loss_deadline_ = 0;
+  advance();
+
+  return true;
+}
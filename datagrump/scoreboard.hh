@@ -0,0 +1,108 @@
+#ifndef SCOREBOARD_HH
+#define SCOREBOARD_HH
+
+#include <cstdint>
+#include <vector>
+
+/* the sender's record of the datagrams it has in flight, with time-based
+   loss detection (RACK, RFC 8985) and a retransmission timer (RFC 6298):
+   a datagram is lost once one sent after it has been acked and it is
+   more than an RTT plus a reordering window old, or when the
+   retransmission timer expires (all times in microseconds) */
+class Scoreboard
+{
+public:
+  /* what loss detection reports */
+  struct Lost
+  {
+    uint64_t sequence_number;
+    uint64_t sent_time;
+    uint32_t size;
+  };
+
+private:
+  enum class State : uint32_t { Unused, InFlight, Acked, Lost };
+
+  struct Entry
+  {
+    uint64_t sequence_number;
+    uint64_t sent_time;
+    uint32_t size;
+    State state;
+    uint64_t acked_through; /* if acked: every datagram from this one up to here is too */
+  };
+
+  /* recent datagrams, indexed by sequence number (a power of two) */
+  std::vector<Entry> entries_;
+
+  /* every datagram before first_outstanding_ has been acked or lost */
+  uint64_t first_outstanding_, next_sequence_number_;
+  uint64_t in_flight_, in_flight_bytes_;
+
+  /* RACK: the most recently sent datagram that has been acked (datagrams
+     are sent in sequence, so the one before rack_end_), and its RTT */
+  uint64_t rack_end_, rack_rtt_;
+  uint64_t min_rtt_;
+
+  /* RFC 6298 estimator (srtt_ is 0 until the first sample) */
+  uint64_t srtt_, rttvar_, rto_;
+  uint64_t min_rto_, max_rto_;
+
+  uint64_t loss_deadline_; /* when the next datagram would pass RACK's threshold (or 0) */
+  uint64_t rto_deadline_; /* when the retransmission timer expires (or 0) */
+
+  Entry & entry( const uint64_t sequence_number )
+  {
+    return entries_[ sequence_number & (entries_.size() - 1) ];
+  }
+
+  bool acked( const uint64_t sequence_number )
+  {
+    const Entry & e = entry( sequence_number );
+    return e.sequence_number == sequence_number and e.state == State::Acked;
+  }
+
+  void mark_lost( Entry & lost, std::vector<Lost> & losses );
+  void detect_losses( const uint64_t timestamp, std::vector<Lost> & losses );
+  void advance();
+  void sample_rtt( const uint64_t rtt );
+
+public:
+  Scoreboard( const uint64_t min_rto_us = 200000, const uint64_t max_rto_us = 60000000,
+	      const size_t history = 65536 );
+
+  /* a datagram was sent (sequence numbers must increase by one each time) */
+  void datagram_was_sent( const uint64_t sequence_number, const uint32_t size,
+			  const uint64_t timestamp );
+
+  /* a datagram was acked; returns false if it is unknown or was already
+     acked. Datagrams this ack shows to be lost are added to losses. */
+  bool ack_received( const uint64_t sequence_number, const uint64_t timestamp,
+		     std::vector<Lost> & losses );
+
+  /* the first datagram from sequence_number on that isn't known to be
+     acked (skipping a run of acked datagrams in one step, mostly) */
+  uint64_t next_unacked( const uint64_t sequence_number );
+
+  /* when timer_fired() should next be called (0 if there's no need) */
+  uint64_t deadline() const;
+
+  /* the deadline passed; returns true if it was the retransmission
+     timer's, in which case every datagram in flight is lost (and the
+     timer backs off) */
+  bool timer_fired( const uint64_t timestamp, std::vector<Lost> & losses );
+
+  /* every datagram before this one has been acked or lost */
+  uint64_t first_outstanding() const { return first_outstanding_; }
+
+  uint64_t in_flight() const { return in_flight_; }
+  uint64_t in_flight_bytes() const { return in_flight_bytes_; }
+
+  /* too many datagrams are outstanding to track another */
+  bool full() const { return next_sequence_number_ - first_outstanding_ >= entries_.size(); }
+
+  uint64_t srtt_us() const { return srtt_; }
+  uint64_t rto_us() const { return rto_; }
+};
+
+#endif /* SCOREBOARD_HH */
@@ -1,37 +1,131 @@
 /* UDP sender for congestion-control contest */
 
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <vector>
 
+#include "config.h"
 #include "socket.hh"
 #include "contest_message.hh"
 #include "controller.hh"
+#include "live_stats.hh"
+#include "tracer.hh"
+#include "scoreboard.hh"
 #include "poller.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+#ifdef HAVE_IO_URING
+#include "io_uring.hh"
+#endif
 
 using namespace std;
 using namespace PollerShortNames;
 
+/* All messages use the same dummy payload */
+static const string dummy_payload( 1424, 'x' );
+
+/* most datagrams handed to (or taken from) the kernel per syscall */
+static const size_t BATCH_SIZE = 64;
+
+/* IP and UDP headers, counted in the datagram sizes reported for rate samples */
+static const size_t IP_UDP_OVERHEAD = 28;
+
+/* largest ack the sender is prepared to receive */
+static const size_t ACK_MTU = ContestMessage::Header::MAX_WIRE_SIZE
+  + ContestMessage::AckBatch::MAX_WIRE_SIZE;
+
+/* with user-space pacing, how far ahead of its departure time a datagram
+   may go (so one wakeup can send a few datagrams at high rates) */
+static const uint64_t PACING_QUANTUM_NS = 100000;
+
+/* recent kernel sends remembered for matching up transmit timestamps (a power of two) */
+static const size_t TX_HISTORY = 4096;
+
+/* how the controller's pacing rate is enforced: holding datagrams back
+   with a timer, stamping each with a departure time for the kernel
+   (SO_TXTIME), or capping the socket's rate (SO_MAX_PACING_RATE);
+   the kernel methods need the fq (or etf) qdisc on the outgoing interface */
+enum class Pacing { Timer, TxTime, FQ };
+
 /* simple sender class to handle the accounting */
 class DatagrumpSender
 {
 private:
   UDPSocket socket_;
-  Controller controller_; /* your class */
+  std::unique_ptr<Controller> controller_; /* your class */
+
+  /* per-datagram delivered/delivered-time accounting, for rate samples */
+  DeliveryRateEstimator rate_estimator_;
 
   uint64_t sequence_number_; /* next outgoing sequence number */
 
-  /* if network does not reorder or lose datagrams,
-     this is the sequence number that the sender
-     next expects will be acknowledged by the receiver */
-  uint64_t next_ack_expected_;
+  /* the datagrams in flight, and which have been lost */
+  Scoreboard scoreboard_;
+  std::vector<Scoreboard::Lost> losses_;
+
+  /* lost datagrams, oldest first, that the next datagrams sent will stand in for */
+  std::deque<uint64_t> retransmissions_;
+
+  /* the lost datagram each queued outgoing datagram stands in for (or -1) */
+  std::vector<uint64_t> retransmitting_;
 
+  /* preallocated storage for outgoing datagrams and incoming acks */
+  DatagramPool outgoing_, incoming_;
+
+  /* fires at the scoreboard's deadline (for loss detection or the
+     retransmission timeout), or after the controller's timeout if
+     nothing is in flight */
+  Poller::TimerID timeout_timer_;
+  uint64_t timeout_deadline_; /* the scoreboard's, when the timer was set */
+  bool timeout_timer_armed_;
+  std::function<void( const uint64_t delay_us )> reset_timeout_; /* on the event loop */
+
+  /* messages handed to the kernel so far (each a GSO burst of datagrams, with
+     one transmit timestamp), and the sequence numbers [first, end) of recent ones */
+  uint32_t messages_sent_;
+  std::vector< std::pair< uint64_t, uint64_t > > message_sequence_numbers_;
+
+  Pacing pacing_;
+  uint64_t next_departure_; /* earliest time (timestamp_ns) the next datagram may leave */
+  uint64_t max_pacing_rate_; /* as last told to the kernel (bits per second) */
+  bool pacing_timer_armed_;
+  std::function<void( const uint64_t delay_us )> schedule_send_; /* on the event loop */
+
+  /* live instrumentation for datagrump-stat (or null) */
+  std::unique_ptr<LiveStats> stats_;
+  uint64_t last_ack_timestamp_;
+
+  /* binary event trace, for datagrump-trace (or null) */
+  std::unique_ptr<Tracer> tracer_;
+
+  void queue_datagram();
+  void flush_datagrams( const bool after_timeout );
   void send_datagram( const bool after_timeout );
-  void got_ack( const uint64_t timestamp, const ContestMessage & msg );
+  void send_window();
+  void got_ack( const DatagramPool::Datagram & recd );
+  void acked( const uint64_t sequence_number, const uint64_t send_timestamp,
+	      const uint64_t recv_timestamp, const uint64_t timestamp );
+  void got_tx_timestamps();
+  void declare_lost( const uint64_t timestamp );
   bool window_is_open();
+  uint64_t pace( const size_t length );
+  bool ready_to_send();
+
+  /* timeout and controller ticks, on either event loop */
+  uint64_t timeout_delay_us();
+  void update_timeout();
+  template <class EventLoop> void arm_timeout( EventLoop & loop );
+  template <class EventLoop> void add_timers( EventLoop & loop );
 
 public:
   DatagrumpSender( const char * const host, const char * const port,
-		   const bool debug );
+		   const bool debug, const Pacing pacing, const string & controller,
+		   const string & stats, const string & trace_file );
   int loop();
 };
 
@@ -43,31 +137,96 @@ int main( int argc, char *argv[] )
   }
 
   bool debug = false;
-  if ( argc == 4 and string( argv[ 3 ] ) == "debug" ) {
-    debug = true;
-  } else if ( argc == 3 ) {
-    /* do nothing */
-  } else {
-    cerr << "Usage: " << argv[ 0 ] << " HOST PORT [debug]" << endl;
+  Pacing pacing = Pacing::Timer;
+  string controller = "aimd";
+  string stats, trace_file;
+  bool usage_error = argc < 3;
+
+  for ( int i = 3; i < argc; i++ ) {
+    const string option( argv[ i ] );
+    if ( option == "debug" ) {
+      debug = true;
+    } else if ( option == "pacing=timer" ) {
+      pacing = Pacing::Timer;
+    } else if ( option == "pacing=txtime" ) {
+      pacing = Pacing::TxTime;
+    } else if ( option == "pacing=fq" ) {
+      pacing = Pacing::FQ;
+    } else if ( option.compare( 0, 11, "controller=" ) == 0 ) {
+      controller = option.substr( 11 );
+    } else if ( option.compare( 0, 6, "stats=" ) == 0 ) {
+      stats = option.substr( 6 );
+    } else if ( option.compare( 0, 6, "trace=" ) == 0 ) {
+      trace_file = option.substr( 6 );
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " HOST PORT [debug] [pacing=timer|txtime|fq] [controller=aimd|bbr|sprout|learned:FILE] [stats=NAME] [trace=FILE]" << endl;
     return EXIT_FAILURE;
   }
 
   /* create sender object to handle the accounting */
   /* all the interesting work is done by the Controller */
-  DatagrumpSender sender( argv[ 1 ], argv[ 2 ], debug );
-  return sender.loop();
+  try {
+    DatagrumpSender sender( argv[ 1 ], argv[ 2 ], debug, pacing, controller, stats, trace_file );
+    return sender.loop();
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
 }
 
 DatagrumpSender::DatagrumpSender( const char * const host,
 				  const char * const port,
-				  const bool debug )
+				  const bool debug,
+				  const Pacing pacing,
+				  const string & controller,
+				  const string & stats,
+				  const string & trace_file )
   : socket_(),
-    controller_( debug ),
+    controller_( Controller::make( controller, debug ) ),
+    rate_estimator_(),
     sequence_number_( 0 ),
-    next_ack_expected_( 0 )
+    scoreboard_(),
+    losses_(),
+    retransmissions_(),
+    retransmitting_( BATCH_SIZE ),
+    outgoing_( BATCH_SIZE, ContestMessage::Header::WIRE_SIZE + dummy_payload.size() ),
+    incoming_( BATCH_SIZE, ACK_MTU ),
+    timeout_timer_( 0 ),
+    timeout_deadline_( 0 ),
+    timeout_timer_armed_( false ),
+    reset_timeout_(),
+    messages_sent_( 0 ),
+    message_sequence_numbers_( TX_HISTORY ),
+    pacing_( pacing ),
+    next_departure_( 0 ),
+    max_pacing_rate_( 0 ),
+    pacing_timer_armed_( false ),
+    schedule_send_(),
+    stats_( stats.empty() ? nullptr : LiveStats::create( stats ) ),
+    last_ack_timestamp_( 0 ),
+    tracer_( trace_file.empty() ? nullptr : Tracer::start( trace_file ) )
 {
-  /* turn on timestamps when socket receives a datagram */
-  socket_.set_timestamps();
+  /* the payload never changes, so write it into each outgoing slot once */
+  while ( not outgoing_.full() ) {
+    DatagramPool::Datagram & datagram = outgoing_.push_back();
+    memcpy( datagram.data + ContestMessage::Header::WIRE_SIZE,
+	    dummy_payload.data(), dummy_payload.size() );
+  }
+  outgoing_.clear();
+
+  /* turn on timestamps when socket receives a datagram, and when
+     each message leaves the host (before anything is sent, so the
+     kernel's count of messages matches messages_sent_) */
+  socket_.set_timestamping();
+
+  if ( pacing_ == Pacing::TxTime ) {
+    socket_.set_txtime();
+  }
 
   /* connect socket to the remote host */
   /* (note: this doesn't send anything; it just tags the socket
@@ -77,44 +236,419 @@ DatagrumpSender::DatagrumpSender( const char * const host,
   cerr << "Sending to " << socket_.peer_address().to_string() << endl;
 }
 
-void DatagrumpSender::got_ack( const uint64_t timestamp,
-			       const ContestMessage & ack )
+void DatagrumpSender::got_ack( const DatagramPool::Datagram & recd )
 {
+  const ContestMessage::Header ack( recd.data, recd.length );
   if ( not ack.is_ack() ) {
     throw runtime_error( "sender got something other than an ack from the receiver" );
   }
 
-  /* Update sender's counter */
-  next_ack_expected_ = max( next_ack_expected_,
-			    ack.header.ack_sequence_number + 1 );
+  const uint64_t timestamp = recd.timestamp;
+  losses_.clear();
+
+  if ( not ack.ack_batch ) {
+    acked( ack.ack_sequence_number, ack.ack_send_timestamp,
+	   ack.ack_recv_timestamp, timestamp );
+  } else {
+    const ContestMessage::AckBatch batch( ack, recd.data + ack.wire_size,
+					  recd.length - ack.wire_size );
+
+    /* each datagram's ack as if the receiver had sent it right away
+       (the ack's send timestamp is on the receiver's clock, like the
+       receive timestamps, so the difference is how long it was held) */
+    const auto unheld = [&] ( const uint64_t send_timestamp, const uint64_t recv_timestamp ) {
+      const uint64_t held = ack.send_timestamp > recv_timestamp ? ack.send_timestamp - recv_timestamp : 0;
+      return held < timestamp - send_timestamp ? timestamp - held : timestamp;
+    };
+
+    for ( size_t i = 0; i < batch.acked_count; i++ ) {
+      const auto & datagram = batch.acked[ i ];
+      acked( datagram.sequence_number, datagram.send_timestamp, datagram.recv_timestamp,
+	     unheld( datagram.send_timestamp, datagram.recv_timestamp ) );
+    }
+
+    acked( ack.ack_sequence_number, ack.ack_send_timestamp, ack.ack_recv_timestamp,
+	   unheld( ack.ack_send_timestamp, ack.ack_recv_timestamp ) );
+
+    /* datagrams whose own acks were lost only reach the scoreboard (and
+       the rate estimator), as there are no timestamps for the controller
+       (only those outstanding, whatever a stale or bogus ack claims) */
+    for ( size_t i = 0; i < batch.range_count; i++ ) {
+      const uint64_t end = min( batch.ranges[ i ].end, sequence_number_ );
+
+      /* the ranges repeat from ack to ack, so skip what's already acked */
+      for ( uint64_t s = scoreboard_.next_unacked( max( batch.ranges[ i ].first,
+							 scoreboard_.first_outstanding() ) );
+	    s < end; s = scoreboard_.next_unacked( s + 1 ) ) {
+	RateSample sample;
+	if ( scoreboard_.ack_received( s, timestamp, losses_ )
+	     and rate_estimator_.ack_received( s, timestamp, sample ) ) {
+	  controller_->delivery_rate_sampled( sample, timestamp );
+	  trace( TraceEvent::RateSample, timestamp, sample.delivery_rate_bps,
+		 sample.interval_us, sample.delivered );
+	}
+      }
+    }
+  }
+
+  if ( ack.ack_recv_count != uint64_t( -1 ) ) {
+    controller_->receive_count_reported( ack.ack_recv_count, timestamp );
+    trace( TraceEvent::ReceiveCount, timestamp, ack.ack_recv_count );
+  }
+
+  declare_lost( timestamp );
+
+  if ( stats_ or Tracer::enabled() ) {
+    const unsigned int window = controller_->window_size();
+    trace( TraceEvent::Window, timestamp, window, scoreboard_.in_flight(),
+	   controller_->pacing_rate_bps() );
+
+    if ( stats_ ) {
+      stats_->add( LiveStats::Counter::AcksReceived );
+      if ( last_ack_timestamp_ ) {
+	stats_->record( LiveStats::Histogram::InterAck, timestamp - last_ack_timestamp_ );
+      }
+      stats_->record( LiveStats::Histogram::Window, window );
+      stats_->record( LiveStats::Histogram::InFlight, scoreboard_.in_flight() );
+      stats_->set( LiveStats::Counter::RecvCalls, socket_.read_count() );
+    }
+  }
+  last_ack_timestamp_ = timestamp;
+}
+
+/* one datagram's ack (the scoreboard may find earlier datagrams lost) */
+void DatagrumpSender::acked( const uint64_t sequence_number, const uint64_t send_timestamp,
+			     const uint64_t recv_timestamp, const uint64_t timestamp )
+{
+  trace( TraceEvent::Ack, timestamp, sequence_number, send_timestamp, recv_timestamp );
+
+  /* Update sender's scoreboard */
+  scoreboard_.ack_received( sequence_number, timestamp, losses_ );
 
   /* Inform congestion controller */
-  controller_.ack_received( ack.header.ack_sequence_number,
-			    ack.header.ack_send_timestamp,
-			    ack.header.ack_recv_timestamp,
-			    timestamp );
+  controller_->ack_received( sequence_number, send_timestamp, recv_timestamp, timestamp );
+
+  RateSample sample;
+  if ( rate_estimator_.ack_received( sequence_number, timestamp, sample ) ) {
+    controller_->delivery_rate_sampled( sample, timestamp );
+    trace( TraceEvent::RateSample, timestamp, sample.delivery_rate_bps,
+	   sample.interval_us, sample.delivered );
+  }
+
+  if ( stats_ ) {
+    stats_->record( LiveStats::Histogram::RTT, timestamp - send_timestamp );
+
+    /* on the receiver's clock less the sender's, so only its changes mean
+       much (and it's negative if the receiver started after the sender) */
+    if ( recv_timestamp >= send_timestamp ) {
+      stats_->record( LiveStats::Histogram::OneWayDelay, recv_timestamp - send_timestamp );
+    }
+  }
 }
 
-void DatagrumpSender::send_datagram( const bool after_timeout )
+/* tell the controller about the scoreboard's latest losses, and
+   retransmit them as soon as the window allows */
+void DatagrumpSender::declare_lost( const uint64_t timestamp )
 {
-  /* All messages use the same dummy payload */
-  static const string dummy_payload( 1424, 'x' );
+  for ( const auto & lost : losses_ ) {
+    trace( TraceEvent::Lost, timestamp, lost.sequence_number, lost.sent_time );
+    controller_->datagram_was_lost( lost.sequence_number, lost.sent_time, timestamp );
+    retransmissions_.push_back( lost.sequence_number );
+  }
+
+  if ( stats_ ) {
+    stats_->add( LiveStats::Counter::DatagramsLost, losses_.size() );
+  }
+}
 
-  ContestMessage cm( sequence_number_++, dummy_payload );
-  cm.set_send_timestamp();
-  socket_.send( cm.to_string() );
+/* tell the controller when sent datagrams actually left the host */
+void DatagrumpSender::got_tx_timestamps()
+{
+  UDPSocket::tx_timestamp timestamps[ BATCH_SIZE ];
+  size_t count;
+
+  do {
+    count = socket_.recv_tx_timestamps( timestamps, BATCH_SIZE );
+
+    for ( size_t i = 0; i < count; i++ ) {
+      /* the id is the kernel's count of messages sent before this one */
+      if ( uint32_t( messages_sent_ - timestamps[ i ].id ) > TX_HISTORY ) {
+	continue; /* too old to match up */
+      }
+
+      const auto & sequence_numbers
+	= message_sequence_numbers_[ timestamps[ i ].id & (TX_HISTORY - 1) ];
+      for ( uint64_t s = sequence_numbers.first; s < sequence_numbers.second; s++ ) {
+	trace( TraceEvent::Transmitted, timestamps[ i ].timestamp, s );
+	controller_->datagram_was_transmitted( s, timestamps[ i ].timestamp );
+      }
+    }
+  } while ( count == BATCH_SIZE );
+}
+
+/* stamp the next datagram's header into a free outgoing slot */
+void DatagrumpSender::queue_datagram()
+{
+  ContestMessage::Header header( sequence_number_++ );
+  header.set_send_timestamp();
+
+  /* the payload is a dummy, so a retransmission is just the next datagram */
+  if ( retransmissions_.empty() ) {
+    retransmitting_[ outgoing_.size() ] = -1;
+  } else {
+    retransmitting_[ outgoing_.size() ] = retransmissions_.front();
+    retransmissions_.pop_front();
+  }
+
+  DatagramPool::Datagram & datagram = outgoing_.push_back();
+  header.serialize( datagram.data );
+  datagram.length = ContestMessage::Header::WIRE_SIZE + dummy_payload.size();
+  datagram.timestamp = header.send_timestamp;
+
+  const uint64_t departure = pace( datagram.length );
+  if ( pacing_ == Pacing::TxTime and departure ) {
+    datagram.departure = departure + timestamp_epoch_ns();
+  }
+}
+
+/* the datagram's paced departure time (timestamp_ns), or 0 if unpaced */
+uint64_t DatagrumpSender::pace( const size_t length )
+{
+  const uint64_t rate = controller_->pacing_rate_bps();
+  if ( rate == 0 or pacing_ == Pacing::FQ ) {
+    return 0;
+  }
+
+  /* an idle sender doesn't save up credit for a burst */
+  const uint64_t departure = max( next_departure_, timestamp_ns() );
+  next_departure_ = departure + length * 8 * 1000000000 / rate;
+  return departure;
+}
+
+/* may the next datagram go now? (if user-space pacing holds it
+   back, make sure a timer will send it) */
+bool DatagrumpSender::ready_to_send()
+{
+  if ( pacing_ != Pacing::Timer or controller_->pacing_rate_bps() == 0 ) {
+    return true;
+  }
+
+  const uint64_t now = timestamp_ns();
+  if ( next_departure_ <= now + PACING_QUANTUM_NS ) {
+    return true;
+  }
+
+  if ( not pacing_timer_armed_ ) {
+    pacing_timer_armed_ = true;
+    schedule_send_( (next_departure_ - now) / 1000 );
+  }
+
+  return false;
+}
+
+/* hand the queued datagrams to the kernel at once, as few
+   super-buffers for it to segment (UDP GSO) */
+void DatagrumpSender::flush_datagrams( const bool after_timeout )
+{
+  if ( outgoing_.empty() ) {
+    return;
+  }
+
+  /* segmenting would send each burst at line rate, so only when unpaced */
+  if ( controller_->pacing_rate_bps() == 0 ) {
+    socket_.send_batch_segmented( outgoing_ );
+  } else {
+    socket_.send_batch( outgoing_ );
+  }
 
   /* Inform congestion controller */
-  controller_.datagram_was_sent( cm.header.sequence_number,
-				 cm.header.send_timestamp,
-				 after_timeout );
+  const uint64_t first_sequence_number = sequence_number_ - outgoing_.size();
+  for ( size_t i = 0; i < outgoing_.size(); i++ ) {
+    const uint64_t sequence_number = first_sequence_number + i;
+    trace( TraceEvent::Sent, outgoing_[ i ].timestamp, sequence_number, after_timeout );
+    controller_->datagram_was_sent( sequence_number,
+				    outgoing_[ i ].timestamp,
+				    after_timeout );
+    if ( retransmitting_[ i ] != uint64_t( -1 ) ) {
+      trace( TraceEvent::Retransmitted, outgoing_[ i ].timestamp,
+	     sequence_number, retransmitting_[ i ] );
+      controller_->datagram_was_retransmitted( sequence_number, retransmitting_[ i ],
+					       outgoing_[ i ].timestamp );
+    }
+    rate_estimator_.datagram_was_sent( sequence_number,
+				       outgoing_[ i ].length + IP_UDP_OVERHEAD,
+				       outgoing_[ i ].timestamp,
+				       scoreboard_.in_flight() );
+    scoreboard_.datagram_was_sent( sequence_number,
+				   outgoing_[ i ].length + IP_UDP_OVERHEAD,
+				   outgoing_[ i ].timestamp );
+  }
+
+  /* remember which datagrams went in each message */
+  uint64_t sequence_number = first_sequence_number;
+  for ( size_t i = 0; i < outgoing_.message_count(); i++ ) {
+    const uint64_t end = sequence_number + outgoing_.message_length( i );
+    message_sequence_numbers_[ messages_sent_++ & (TX_HISTORY - 1) ] = { sequence_number, end };
+    sequence_number = end;
+  }
+
+  if ( stats_ ) {
+    stats_->add( LiveStats::Counter::DatagramsSent, outgoing_.size() );
+    stats_->set( LiveStats::Counter::SendCalls, socket_.write_count() );
+  }
+
+  outgoing_.clear();
+
+  /* the first datagram in flight starts the retransmission timer */
+  update_timeout();
+}
+
+void DatagrumpSender::send_datagram( const bool after_timeout )
+{
+  queue_datagram();
+  flush_datagrams( after_timeout );
+}
+
+/* fill the open window (as far as pacing allows), one sendmmsg call
+   per batch of datagrams */
+void DatagrumpSender::send_window()
+{
+  if ( pacing_ == Pacing::FQ and controller_->pacing_rate_bps() != max_pacing_rate_ ) {
+    max_pacing_rate_ = controller_->pacing_rate_bps();
+    socket_.set_max_pacing_rate( max_pacing_rate_ / 8 );
+  }
+
+  while ( window_is_open() and ready_to_send() ) {
+    queue_datagram();
+    if ( outgoing_.full() ) {
+      flush_datagrams( false );
+    }
+  }
+
+  flush_datagrams( false );
 }
 
 bool DatagrumpSender::window_is_open()
 {
-  return sequence_number_ - next_ack_expected_ < controller_.window_size();
+  return scoreboard_.in_flight() < controller_->window_size() and not scoreboard_.full();
+}
+
+/* how long until the timeout timer should fire */
+uint64_t DatagrumpSender::timeout_delay_us()
+{
+  if ( timeout_deadline_ == 0 ) {
+    return controller_->timeout_us();
+  }
+
+  const uint64_t now = timestamp_us();
+  return timeout_deadline_ > now ? timeout_deadline_ - now : 0;
 }
 
+/* move the timeout timer if the scoreboard's deadline has changed */
+void DatagrumpSender::update_timeout()
+{
+  if ( timeout_timer_armed_ and scoreboard_.deadline() != timeout_deadline_ ) {
+    timeout_deadline_ = scoreboard_.deadline();
+    reset_timeout_( timeout_delay_us() );
+  }
+}
+
+template <class EventLoop>
+void DatagrumpSender::arm_timeout( EventLoop & loop )
+{
+  timeout_deadline_ = scoreboard_.deadline();
+  timeout_timer_armed_ = true;
+  timeout_timer_ = loop.add_timer( timeout_delay_us(), [this, &loop] () {
+      timeout_timer_armed_ = false;
+
+      /* datagrams may have passed RACK's threshold, or the retransmission
+	 timer may have expired (losing everything in flight) */
+      const uint64_t now = timestamp_us();
+      losses_.clear();
+      const bool timed_out = timeout_deadline_ == 0 or scoreboard_.timer_fired( now, losses_ );
+      declare_lost( now );
+
+      if ( timed_out ) {
+	trace( TraceEvent::Timeout, now, timeout_deadline_ != 0 );
+
+	/* After a timeout, send one datagram to try to get things moving again */
+	send_datagram( true );
+      }
+
+      arm_timeout( loop );
+      return ResultType::Continue;
+    } );
+}
+
+template <class EventLoop>
+void DatagrumpSender::add_timers( EventLoop & loop )
+{
+  reset_timeout_ = [this, &loop] ( const uint64_t delay_us ) {
+    loop.reset_timer( timeout_timer_, delay_us );
+  };
+  arm_timeout( loop );
+
+  /* user-space pacing sends held-back datagrams from a timer */
+  schedule_send_ = [this, &loop] ( const uint64_t delay_us ) {
+    loop.add_timer( delay_us, [this] () {
+	pacing_timer_armed_ = false;
+	send_window();
+	return ResultType::Continue;
+      } );
+  };
+
+  const uint64_t tick_interval = controller_->tick_interval_us();
+  if ( tick_interval ) {
+    loop.add_timer( tick_interval, [&] () {
+	const uint64_t now = timestamp_us();
+	trace( TraceEvent::Tick, now );
+	controller_->tick( now );
+	return ResultType::Continue;
+      }, tick_interval );
+  }
+}
+
+#ifdef HAVE_IO_URING
+int DatagrumpSender::loop()
+{
+  /* receive acks with a multishot io_uring receive, so an idle
+     wakeup costs one io_uring_enter and no poll or recvmmsg */
+  IOUringLoop io_loop;
+  bool got_acks = false;
+
+  io_loop.recv_multishot( socket_, [&] ( const DatagramPool::Datagram & recd ) {
+      got_ack( recd );
+      got_acks = true;
+      return ResultType::Continue;
+    } );
+
+  /* transmit timestamps arrive on the socket's error queue */
+  io_loop.poll( socket_, POLLERR, [&] () {
+      got_tx_timestamps();
+      return ResultType::Continue;
+    } );
+
+  add_timers( io_loop );
+
+  while ( true ) {
+    /* if the window is open, close it by sending more datagrams */
+    if ( window_is_open() and ready_to_send() ) {
+      send_window();
+    }
+
+    const auto ret = io_loop.loop_once( -1 );
+    if ( ret.result == PollResult::Exit ) {
+      return ret.exit_status;
+    }
+
+    /* acks move the timeout (once per batch of completions) */
+    if ( got_acks ) {
+      update_timeout();
+      got_acks = false;
+    }
+  }
+}
+#else
 int DatagrumpSender::loop()
 {
   /* read and write from the receiver using an event-driven "poller" */
@@ -124,32 +658,42 @@ int DatagrumpSender::loop()
      sending more datagrams */
   poller.add_action( Action( socket_, Direction::Out, [&] () {
 	/* Close the window */
-	while ( window_is_open() ) {
-	  send_datagram( false );
-	}
+	send_window();
 	return ResultType::Continue;
       },
-      /* We're only interested in this rule when the window is open */
-      [&] () { return window_is_open(); } ) );
+      /* We're only interested in this rule when the window is open
+	 (and pacing lets the next datagram go) */
+      [&] () { return window_is_open() and ready_to_send(); } ) );
 
   /* second rule: if sender receives an ack,
      process it and inform the controller
      (by using the sender's got_ack method) */
   poller.add_action( Action( socket_, Direction::In, [&] () {
-	const UDPSocket::received_datagram recd = socket_.recv();
-	const ContestMessage ack  = recd.payload;
-	got_ack( recd.timestamp, ack );
+	socket_.recv_into( incoming_ );
+	for ( const auto & recd : incoming_ ) {
+	  got_ack( recd );
+	}
+	update_timeout();
 	return ResultType::Continue;
       } ) );
 
-  /* Run these two rules forever */
+  /* third rule: when datagrams leave the host, inform the controller
+     (the only place the error queue is read: its entries carry no
+     datagram, so it holds plenty between polls) */
+  poller.add_action( Action( socket_, Direction::Error, [&] () {
+	got_tx_timestamps();
+	return ResultType::Continue;
+      } ) );
+
+  /* fourth rule: timeouts and controller ticks run on the poller's timers */
+  add_timers( poller );
+
+  /* Run these rules forever */
   while ( true ) {
-    const auto ret = poller.poll( controller_.timeout_ms() );
+    const auto ret = poller.poll( -1 );
     if ( ret.result == PollResult::Exit ) {
       return ret.exit_status;
-    } else if ( ret.result == PollResult::Timeout ) {
-      /* After a timeout, send one datagram to try to get things moving again */
-      send_datagram( true );
     }
   }
 }
+#endif
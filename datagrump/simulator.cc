@@ -0,0 +1,528 @@
+/* deterministic discrete-event simulation of a contest run: the sender's
+   Controller, over links replaying mahimahi delivery traces behind a
+   propagation delay (as mm-delay and mm-link would emulate them), in
+   simulated time, with parameter sweeps spread across all cores */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "contest_message.hh"
+#include "controller.hh"
+#include "link_stats.hh"
+#include "scoreboard.hh"
+#include "trace_link.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* the sender's datagrams on the wire (1472 bytes of UDP payload
+   plus IP and UDP headers) */
+static const size_t DATAGRAM_SIZE = 1500;
+static const size_t IP_UDP_OVERHEAD = 28;
+static const uint64_t PAYLOAD_LENGTH = 1424;
+
+/* one point in a parameter sweep */
+struct Configuration
+{
+  uint64_t delay_ms; /* one-way propagation delay (each direction) */
+  size_t queue_limit; /* of each bottleneck, in packets (0 means unlimited) */
+  uint64_t codel_target_ms; /* 0 for plain droptail */
+  uint64_t duration_ms;
+  std::string controller;
+  Controller::Parameters controller_parameters;
+};
+
+/* what the simulated links carry */
+struct Packet
+{
+  uint64_t sequence_number;
+  uint64_t send_timestamp, recv_timestamp, recv_count; /* contest header fields */
+  uint64_t arrival_us; /* when it joined a bottleneck's queue */
+  size_t size; /* on the wire */
+};
+
+/* sender (as in sender.cc), receiver (as in receiver.cc) and the links
+   between them: datagrams queue at the uplink, then are delayed; acks
+   are delayed, then queue at the downlink */
+class Simulation
+{
+private:
+  enum class EventType { UplinkOpportunity, DownlinkOpportunity,
+			 DatagramArrival, AckAtDownlink,
+			 Timeout, Tick, PacingWake };
+
+  struct Event
+  {
+    uint64_t time_us;
+    uint64_t order; /* simultaneous events run in the order they were scheduled */
+    EventType type;
+    Packet packet; /* DatagramArrival and AckAtDownlink */
+    uint64_t generation; /* Timeout */
+
+    bool operator>( const Event & other ) const
+    {
+      return time_us != other.time_us ? time_us > other.time_us : order > other.order;
+    }
+  };
+
+  const Configuration & configuration_;
+  std::unique_ptr<Controller> controller_;
+  DeliveryRateEstimator rate_estimator_;
+  TraceLink<Packet> uplink_, downlink_;
+  LinkStats stats_;
+
+  std::priority_queue< Event, std::vector< Event >, std::greater< Event > > events_;
+  uint64_t next_order_;
+  uint64_t now_; /* simulated time, in microseconds */
+  std::vector< Packet > delivered_;
+
+  /* the sender's accounting */
+  uint64_t sequence_number_;
+  Scoreboard scoreboard_;
+  std::vector< Scoreboard::Lost > losses_;
+  std::deque< uint64_t > retransmissions_; /* lost datagrams, oldest first */
+  uint64_t timeout_generation_; /* only the latest Timeout counts */
+  uint64_t timeout_deadline_; /* the scoreboard's, when the Timeout was scheduled */
+  uint64_t next_departure_; /* earliest time the next datagram may go (if paced) */
+  bool pacing_wake_scheduled_;
+
+  /* the receiver's */
+  uint64_t ack_sequence_number_, datagrams_received_;
+
+  void schedule( const uint64_t time_us, const EventType type,
+		 const Packet & packet = Packet(),
+		 const uint64_t generation = 0 );
+
+  /* a packet joins a link's queue (waking the link if it was idle) */
+  void enqueue( TraceLink<Packet> & link, const EventType opportunity,
+		const Packet & packet );
+
+  /* a delivery opportunity; returns the packets it finished */
+  const std::vector< Packet > & serve( TraceLink<Packet> & link, const EventType opportunity );
+
+  void handle( const Event & event );
+
+  void arm_timeout();
+  void update_timeout();
+  void declare_lost();
+  void send_datagram( const bool after_timeout );
+  void send_window();
+  bool window_is_open();
+  bool ready_to_send();
+
+public:
+  Simulation( const DeliveryTrace & uplink, const DeliveryTrace & downlink,
+	      const Configuration & configuration );
+
+  LinkStats::Summary run();
+};
+
+Simulation::Simulation( const DeliveryTrace & uplink, const DeliveryTrace & downlink,
+			const Configuration & configuration )
+  : configuration_( configuration ),
+    controller_( Controller::make( configuration.controller, false,
+				  configuration.controller_parameters ) ),
+    rate_estimator_(),
+    uplink_( uplink, configuration.queue_limit, configuration.codel_target_ms * 1000 ),
+    downlink_( downlink, configuration.queue_limit, configuration.codel_target_ms * 1000 ),
+    stats_( 0 ),
+    events_(),
+    next_order_( 0 ),
+    now_( 0 ),
+    delivered_(),
+    sequence_number_( 0 ),
+    scoreboard_(),
+    losses_(),
+    retransmissions_(),
+    timeout_generation_( 0 ),
+    timeout_deadline_( 0 ),
+    next_departure_( 0 ),
+    pacing_wake_scheduled_( false ),
+    ack_sequence_number_( 0 ),
+    datagrams_received_( 0 )
+{
+  /* the uplink's capacity over the run (used or not) */
+  for ( uint64_t base_ms = 0; base_ms < configuration_.duration_ms; base_ms += uplink.period_ms() ) {
+    for ( size_t i = 0; i < uplink.size() and base_ms + uplink[ i ] < configuration_.duration_ms; i++ ) {
+      stats_.opportunity( base_ms + uplink[ i ], TraceLink<Packet>::OPPORTUNITY_BYTES );
+    }
+  }
+}
+
+void Simulation::schedule( const uint64_t time_us, const EventType type,
+			   const Packet & packet, const uint64_t generation )
+{
+  events_.push( { time_us, next_order_++, type, packet, generation } );
+}
+
+void Simulation::enqueue( TraceLink<Packet> & link, const EventType opportunity,
+			  const Packet & packet )
+{
+  const bool was_idle = link.empty();
+  if ( link.enqueue( packet, now_ ) and was_idle ) {
+    schedule( link.next_opportunity_ms( now_ ) * 1000, opportunity );
+  }
+}
+
+const vector< Packet > & Simulation::serve( TraceLink<Packet> & link, const EventType opportunity )
+{
+  delivered_.clear();
+  link.use_opportunity( delivered_ );
+
+  if ( not link.empty() ) {
+    schedule( link.next_opportunity_ms( now_ ) * 1000, opportunity );
+  }
+
+  return delivered_;
+}
+
+void Simulation::handle( const Event & event )
+{
+  switch ( event.type ) {
+  case EventType::UplinkOpportunity:
+    for ( const auto & datagram : serve( uplink_, event.type ) ) {
+      stats_.delivery( now_ / 1000, datagram.size, datagram.arrival_us / 1000 );
+      schedule( now_ + configuration_.delay_ms * 1000, EventType::DatagramArrival, datagram );
+    }
+    break;
+
+  case EventType::DatagramArrival: {
+    /* the receiver acks every datagram right away */
+    ContestMessage::Header header( event.packet.sequence_number );
+    header.send_timestamp = event.packet.send_timestamp;
+    header.transform_into_ack( ack_sequence_number_++, now_, PAYLOAD_LENGTH,
+			       ++datagrams_received_ );
+    header.send_timestamp = now_;
+
+    char wire[ ContestMessage::Header::MAX_WIRE_SIZE ];
+    const size_t ack_size = header.serialize( wire, ContestMessage::Header::Format::Compact )
+      + IP_UDP_OVERHEAD;
+
+    schedule( now_ + configuration_.delay_ms * 1000, EventType::AckAtDownlink,
+	      { header.ack_sequence_number, header.ack_send_timestamp,
+		  header.ack_recv_timestamp, header.ack_recv_count, 0, ack_size } );
+    break;
+  }
+
+  case EventType::AckAtDownlink:
+    enqueue( downlink_, EventType::DownlinkOpportunity, event.packet );
+    break;
+
+  case EventType::DownlinkOpportunity: {
+    const auto & acks = serve( downlink_, event.type );
+    for ( const auto & ack : acks ) {
+      losses_.clear();
+      scoreboard_.ack_received( ack.sequence_number, now_, losses_ );
+      controller_->ack_received( ack.sequence_number, ack.send_timestamp,
+				 ack.recv_timestamp, now_ );
+
+      RateSample sample;
+      if ( rate_estimator_.ack_received( ack.sequence_number, now_, sample ) ) {
+	controller_->delivery_rate_sampled( sample, now_ );
+      }
+      controller_->receive_count_reported( ack.recv_count, now_ );
+      declare_lost();
+    }
+
+    /* acks move the timeout */
+    update_timeout();
+    break;
+  }
+
+  case EventType::Timeout:
+    if ( event.generation == timeout_generation_ ) {
+      /* datagrams may have passed RACK's threshold, or the retransmission
+	 timer may have expired (losing everything in flight) */
+      losses_.clear();
+      const bool timed_out = timeout_deadline_ == 0 or scoreboard_.timer_fired( now_, losses_ );
+      declare_lost();
+
+      if ( timed_out ) {
+	/* After a timeout, send one datagram to try to get things moving again */
+	send_datagram( true );
+      }
+      arm_timeout();
+    }
+    break;
+
+  case EventType::Tick:
+    controller_->tick( now_ );
+    schedule( now_ + controller_->tick_interval_us(), EventType::Tick );
+    break;
+
+  case EventType::PacingWake:
+    pacing_wake_scheduled_ = false;
+    break;
+  }
+}
+
+/* at the scoreboard's deadline, or after the controller's timeout if nothing is in flight */
+void Simulation::arm_timeout()
+{
+  timeout_deadline_ = scoreboard_.deadline();
+  schedule( timeout_deadline_ ? max( timeout_deadline_, now_ ) : now_ + controller_->timeout_us(),
+	    EventType::Timeout, Packet(), ++timeout_generation_ );
+}
+
+void Simulation::update_timeout()
+{
+  if ( scoreboard_.deadline() != timeout_deadline_ ) {
+    arm_timeout();
+  }
+}
+
+/* as in sender.cc: tell the controller, and retransmit when the window allows */
+void Simulation::declare_lost()
+{
+  for ( const auto & lost : losses_ ) {
+    controller_->datagram_was_lost( lost.sequence_number, lost.sent_time, now_ );
+    retransmissions_.push_back( lost.sequence_number );
+  }
+}
+
+void Simulation::send_datagram( const bool after_timeout )
+{
+  const uint64_t rate = controller_->pacing_rate_bps();
+  if ( rate ) {
+    next_departure_ = max( next_departure_, now_ ) + DATAGRAM_SIZE * 8 * 1000000 / rate;
+  }
+
+  const uint64_t sequence_number = sequence_number_++;
+  controller_->datagram_was_sent( sequence_number, now_, after_timeout );
+  if ( not retransmissions_.empty() ) {
+    controller_->datagram_was_retransmitted( sequence_number, retransmissions_.front(), now_ );
+    retransmissions_.pop_front();
+  }
+  controller_->datagram_was_transmitted( sequence_number, now_ );
+  rate_estimator_.datagram_was_sent( sequence_number, DATAGRAM_SIZE, now_,
+				     scoreboard_.in_flight() );
+  scoreboard_.datagram_was_sent( sequence_number, DATAGRAM_SIZE, now_ );
+  update_timeout();
+
+  enqueue( uplink_, EventType::UplinkOpportunity,
+	   { sequence_number, now_, 0, 0, 0, DATAGRAM_SIZE } );
+}
+
+void Simulation::send_window()
+{
+  while ( window_is_open() and ready_to_send() ) {
+    send_datagram( false );
+  }
+}
+
+bool Simulation::window_is_open()
+{
+  return scoreboard_.in_flight() < controller_->window_size() and not scoreboard_.full();
+}
+
+/* may the next datagram go now? (if pacing holds it back, wake up when it may) */
+bool Simulation::ready_to_send()
+{
+  if ( controller_->pacing_rate_bps() == 0 or next_departure_ <= now_ ) {
+    return true;
+  }
+
+  if ( not pacing_wake_scheduled_ ) {
+    pacing_wake_scheduled_ = true;
+    schedule( next_departure_, EventType::PacingWake );
+  }
+
+  return false;
+}
+
+LinkStats::Summary Simulation::run()
+{
+  arm_timeout();
+  if ( controller_->tick_interval_us() ) {
+    schedule( controller_->tick_interval_us(), EventType::Tick );
+  }
+
+  const uint64_t end_us = configuration_.duration_ms * 1000;
+
+  while ( true ) {
+    /* like the sender's event loop, fill the window whenever it's open */
+    send_window();
+
+    if ( events_.empty() or events_.top().time_us >= end_us ) {
+      break;
+    }
+
+    const Event event = events_.top();
+    events_.pop();
+    now_ = event.time_us;
+    handle( event );
+  }
+
+  return stats_.summarize( configuration_.duration_ms );
+}
+
+/* split "a,b,c" */
+static vector<string> split( const string & list )
+{
+  vector<string> items;
+  size_t start = 0;
+  while ( true ) {
+    const size_t comma = list.find( ',', start );
+    items.push_back( list.substr( start, comma - start ) );
+    if ( comma == string::npos ) {
+      return items;
+    }
+    start = comma + 1;
+  }
+}
+
+/* every combination of the NAME=V1,V2,... arguments */
+static vector<Configuration> configurations( const vector< pair< string, vector<string> > > & sweep,
+					     const uint64_t default_duration_ms )
+{
+  vector<Configuration> result = { { 20, 0, 0, default_duration_ms, "aimd", {} } };
+
+  for ( const auto & dimension : sweep ) {
+    vector<Configuration> expanded;
+    for ( const auto & configuration : result ) {
+      for ( const auto & value : dimension.second ) {
+	Configuration next = configuration;
+	if ( dimension.first == "delay" ) {
+	  next.delay_ms = stoull( value );
+	} else if ( dimension.first == "queue" ) {
+	  next.queue_limit = stoull( value );
+	} else if ( dimension.first == "codel" ) {
+	  next.codel_target_ms = stoull( value );
+	} else if ( dimension.first == "duration" ) {
+	  next.duration_ms = stoull( value );
+	} else if ( dimension.first == "controller" ) {
+	  next.controller = value;
+	} else {
+	  next.controller_parameters[ dimension.first ] = stod( value );
+	}
+	expanded.push_back( next );
+      }
+    }
+    result = expanded;
+  }
+
+  return result;
+}
+
+/* run each configuration on its own thread, as many at a time as there are cores */
+static vector<LinkStats::Summary> run_all( const DeliveryTrace & uplink, const DeliveryTrace & downlink,
+					   const vector<Configuration> & configurations )
+{
+  vector<LinkStats::Summary> summaries( configurations.size() );
+  atomic<size_t> next( 0 );
+  exception_ptr failure;
+  mutex failure_mutex;
+
+  const size_t thread_count = min<size_t>( max( thread::hardware_concurrency(), 1u ),
+					   configurations.size() );
+  vector<thread> threads;
+  for ( size_t t = 0; t < thread_count; t++ ) {
+    threads.emplace_back( [&] () {
+	for ( size_t i = next++; i < configurations.size(); i = next++ ) {
+	  try {
+	    summaries[ i ] = Simulation( uplink, downlink, configurations[ i ] ).run();
+	  } catch ( ... ) {
+	    lock_guard<mutex> lock( failure_mutex );
+	    failure = current_exception();
+	  }
+	}
+      } );
+  }
+
+  for ( auto & thread : threads ) {
+    thread.join();
+  }
+
+  if ( failure ) {
+    rethrow_exception( failure );
+  }
+
+  return summaries;
+}
+
+int main( int argc, char *argv[] )
+{
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  if ( argc < 3 ) {
+    cerr << "Usage: " << argv[ 0 ] << " UPLINK_TRACE DOWNLINK_TRACE [NAME=VALUE[,VALUE...]]..." << endl
+	 << "  delay=MS (one-way, default 20), queue=PACKETS (default 0, unlimited)," << endl
+	 << "  codel=TARGET_MS (default 0, droptail only), controller=NAME (default aimd)," << endl
+	 << "  duration=MS (default: one pass of the uplink trace), or a controller parameter;" << endl
+	 << "  lists of values sweep over every combination" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const DeliveryTrace uplink( argv[ 1 ] ), downlink( argv[ 2 ] );
+
+    vector< pair< string, vector<string> > > sweep;
+    for ( int i = 3; i < argc; i++ ) {
+      const string argument( argv[ i ] );
+      const size_t equals = argument.find( '=' );
+      if ( equals == string::npos ) {
+	throw runtime_error( "expected NAME=VALUE, got \"" + argument + "\"" );
+      }
+      sweep.emplace_back( argument.substr( 0, equals ), split( argument.substr( equals + 1 ) ) );
+    }
+
+    const vector<Configuration> runs = configurations( sweep, uplink.period_ms() );
+
+    const auto start = chrono::steady_clock::now();
+    const vector<LinkStats::Summary> summaries = run_all( uplink, downlink, runs );
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    /* one row per configuration */
+    for ( const auto & dimension : sweep ) {
+      cout << setw( 12 ) << dimension.first;
+    }
+    cout << setw( 14 ) << "capacity" << setw( 14 ) << "throughput"
+	 << setw( 12 ) << "p95 delay" << setw( 12 ) << "p95 signal" << setw( 10 ) << "power" << endl;
+
+    for ( size_t i = 0; i < runs.size(); i++ ) {
+      for ( size_t d = 0; d < sweep.size(); d++ ) {
+	/* the value this run took along each dimension */
+	size_t stride = 1;
+	for ( size_t later = d + 1; later < sweep.size(); later++ ) {
+	  stride *= sweep[ later ].second.size();
+	}
+	cout << setw( 12 ) << sweep[ d ].second[ (i / stride) % sweep[ d ].second.size() ];
+      }
+
+      const LinkStats::Summary & summary = summaries[ i ];
+      cout << fixed << setprecision( 2 )
+	   << setw( 9 ) << summary.capacity_mbps << " Mb/s"
+	   << setw( 9 ) << summary.throughput_mbps << " Mb/s"
+	   << setw( 9 ) << summary.packet_delay_p95_ms << " ms"
+	   << setw( 9 ) << summary.signal_delay_p95_ms << " ms"
+	   << setw( 10 ) << summary.power << endl;
+    }
+
+    double simulated_s = 0;
+    for ( const auto & run : runs ) {
+      simulated_s += run.duration_ms / 1000.0;
+    }
+    cerr << "Simulated " << simulated_s << " s in " << elapsed.count() << " s of wall clock ("
+	 << runs.size() << " runs)" << endl;
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
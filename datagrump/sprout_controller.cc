@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+
+#include "sprout_controller.hh"
+#include "tracer.hh"
+#include "vector_math.hh"
+
+using namespace std;
+
+/* rates the distribution can take (a multiple of the vector width, as the
+   per-tick passes over it are vectorized) */
+static const size_t BINS = 256;
+
+/* the min RTT is the smallest seen over this long */
+static const uint64_t MIN_RTT_WINDOW_US = 10000000;
+
+SproutController::SproutController( const bool debug, const Parameters & parameters )
+  : Controller( debug ),
+    tick_us_( parameter( parameters, "tick_ms", 20 ) * 1000 ),
+    max_rate_( parameter( parameters, "max_rate_pps", 4000 ) ),
+    min_window_( parameter( parameters, "min_window", 2 ) ),
+    risk_( 1 - parameter( parameters, "confidence", 0.95 ) ),
+    probability_( BINS, 1.0 / BINS ),
+    kernel_(),
+    spread_( 0 ),
+    spread_input_(),
+    spread_output_(),
+    max_count_( 0 ),
+    exactly_(),
+    at_least_(),
+    max_forecast_( 0 ),
+    shortfall_(),
+    min_rtt_( MIN_RTT_WINDOW_US ),
+    tick_min_rtt_( -1 ),
+    last_ack_time_( 0 ),
+    datagrams_received_( 0 ),
+    tick_datagrams_received_( 0 ),
+    next_sequence_number_( 0 ),
+    next_ack_expected_( 0 ),
+    window_( 0 )
+{
+  check_parameters( parameters, { "tick_ms", "max_rate_pps", "min_window", "confidence",
+	"volatility", "target_delay_ms" } );
+
+  /* how fast the rate wanders, in datagrams per second per root second */
+  const double volatility = parameter( parameters, "volatility", 200 );
+  const double target_delay_s = parameter( parameters, "target_delay_ms", 100 ) / 1000;
+
+  if ( tick_us_ == 0 or max_rate_ <= 0 or volatility < 0 or target_delay_s <= 0
+       or risk_ <= 0 or risk_ >= 1 ) {
+    throw runtime_error( "sprout parameters out of range" );
+  }
+
+  const double tick_s = tick_us_ / 1e6;
+  const double bin_width = max_rate_ / (BINS - 1);
+  const auto rate = [&] ( const size_t bin ) { return bin * bin_width; };
+
+  /* a tick of Brownian motion moves the rate by a Gaussian step (cut off at three sigma) */
+  const double step_bins = max( volatility * sqrt( tick_s ) / bin_width, 1e-3 );
+  spread_ = max( 1.0, ceil( 3 * step_bins ) );
+  double kernel_sum = 0;
+  for ( int j = -int( spread_ ); j <= int( spread_ ); j++ ) {
+    kernel_.push_back( exp( -j * j / (2 * step_bins * step_bins) ) );
+    kernel_sum += kernel_.back();
+  }
+  for ( auto & weight : kernel_ ) {
+    weight /= kernel_sum;
+  }
+
+  /* output m is bin m - spread_, reading input m..m + 2 x spread_ */
+  spread_output_.resize( round_up_to_vector( BINS + 2 * spread_ ) );
+  spread_input_.resize( spread_output_.size() + 2 * spread_ );
+
+  /* Poisson likelihoods, in log space (so high rates don't underflow);
+     the "at least" tails are summed from well past the largest count */
+  max_count_ = ceil( 2 * max_rate_ * tick_s ) + 10;
+  exactly_.resize( (max_count_ + 1) * BINS );
+  at_least_.resize( (max_count_ + 1) * BINS );
+  vector<double> pmf( 2 * max_count_ + 1 );
+  for ( size_t i = 0; i < BINS; i++ ) {
+    const double mean = rate( i ) * tick_s;
+    for ( size_t k = 0; k < pmf.size(); k++ ) {
+      pmf[ k ] = mean > 0 ? exp( k * log( mean ) - mean - lgamma( k + 1 ) ) : (k == 0);
+    }
+
+    double tail = 0;
+    for ( size_t k = pmf.size(); k-- > 0; ) {
+      tail += pmf[ k ];
+      if ( k <= max_count_ ) {
+	exactly_[ k * BINS + i ] = pmf[ k ];
+	at_least_[ k * BINS + i ] = tail;
+      }
+    }
+  }
+
+  for ( auto table : { &exactly_, &at_least_ } ) {
+    for ( size_t k = 0; k <= max_count_; k++ ) {
+      float * const row = table->data() + k * BINS;
+      const float peak = *max_element( row, row + BINS );
+      if ( peak > 0 ) {
+	scale( row, 1 / peak, BINS );
+      }
+    }
+  }
+
+  /* deliveries within the target delay, starting from each rate: Poisson
+     arrivals at a wandering rate, whose integral over T has variance
+     volatility^2 T^3 / 3 (taken as normal, with a continuity correction) */
+  const double rate_variance = volatility * volatility * pow( target_delay_s, 3 ) / 3;
+  max_forecast_ = ceil( max_rate_ * target_delay_s
+			+ 4 * sqrt( max_rate_ * target_delay_s + rate_variance ) ) + 1;
+  shortfall_.resize( (max_forecast_ + 1) * BINS );
+  for ( size_t c = 1; c <= max_forecast_; c++ ) {
+    for ( size_t i = 0; i < BINS; i++ ) {
+      const double mean = rate( i ) * target_delay_s;
+      const double deviation = sqrt( mean + rate_variance );
+      shortfall_[ c * BINS + i ] = deviation > 0
+	? erfc( -(c - 0.5 - mean) / (deviation * sqrt( 2 )) ) / 2
+	: c > mean;
+    }
+  }
+
+  window_ = max( min_window_, forecast() );
+}
+
+unsigned int SproutController::window_size()
+{
+  return window_;
+}
+
+void SproutController::datagram_was_sent( const uint64_t sequence_number,
+					  const uint64_t,
+					  const bool )
+{
+  next_sequence_number_ = max( next_sequence_number_, sequence_number + 1 );
+}
+
+void SproutController::ack_received( const uint64_t sequence_number_acked,
+				     const uint64_t send_timestamp_acked,
+				     const uint64_t,
+				     const uint64_t timestamp_ack_received )
+{
+  next_ack_expected_ = max( next_ack_expected_, sequence_number_acked + 1 );
+
+  const uint64_t rtt = timestamp_ack_received - send_timestamp_acked;
+  min_rtt_.update( timestamp_ack_received, rtt );
+  tick_min_rtt_ = min( tick_min_rtt_, rtt );
+  last_ack_time_ = timestamp_ack_received;
+}
+
+void SproutController::receive_count_reported( const uint64_t datagrams_received,
+					       const uint64_t )
+{
+  datagrams_received_ = max( datagrams_received_, datagrams_received );
+}
+
+/* the rate may have wandered since the last tick */
+void SproutController::evolve()
+{
+  copy( probability_.begin(), probability_.end(), spread_input_.begin() + 2 * spread_ );
+  fill( spread_output_.begin(), spread_output_.end(), 0 );
+
+  for ( size_t j = 0; j < kernel_.size(); j++ ) {
+    add_scaled( spread_output_.data(), spread_input_.data() + j, kernel_[ j ],
+		spread_output_.size() );
+  }
+
+  /* rates can't go below zero or (as modeled) above the top bin */
+  const auto first = spread_output_.begin() + spread_;
+  probability_.front() = accumulate( spread_output_.begin(), first + 1, 0.0f );
+  copy( first + 1, first + BINS - 1, probability_.begin() + 1 );
+  probability_.back() = accumulate( first + BINS - 1, spread_output_.end(), 0.0f );
+}
+
+/* condition the distribution on the tick's arrivals; returns whether they
+   said anything (an idle link only shows the rate is at least what arrived) */
+bool SproutController::observe( const uint64_t timestamp, unsigned int & arrivals )
+{
+  arrivals = datagrams_received_ - tick_datagrams_received_;
+  tick_datagrams_received_ = datagrams_received_;
+
+  const uint64_t tick_min_rtt = tick_min_rtt_;
+  tick_min_rtt_ = -1;
+
+  if ( min_rtt_.empty() ) {
+    return false;
+  }
+
+  /* the link was busy for the whole tick if the datagrams that made it
+     through had queued for longer than a tick, or if it delivered
+     nothing at all for longer than that while datagrams were outstanding */
+  const uint64_t busy_delay = min_rtt_.best() + tick_us_;
+  const bool busy = tick_min_rtt == uint64_t( -1 )
+    ? in_flight() > 0 and timestamp - last_ack_time_ > busy_delay
+    : tick_min_rtt > busy_delay;
+
+  if ( not busy and arrivals == 0 ) {
+    return false;
+  }
+
+  const float * const likelihood = (busy ? exactly_ : at_least_).data()
+    + min( arrivals, max_count_ ) * BINS;
+
+  const float total = multiply( probability_.data(), likelihood, BINS );
+  if ( total > 1e-30 ) {
+    scale( probability_.data(), 1 / total, BINS );
+  } else {
+    /* the model all but ruled this out, so start again from the observation */
+    copy( likelihood, likelihood + BINS, probability_.begin() );
+    scale( probability_.data(), 1 / accumulate( likelihood, likelihood + BINS, 0.0f ), BINS );
+  }
+
+  return true;
+}
+
+/* the most datagrams that will be delivered within the target delay,
+   with the given confidence: the largest c with P(fewer than c) <= risk */
+unsigned int SproutController::forecast() const
+{
+  unsigned int low = 0, high = max_forecast_ + 1;
+  while ( high - low > 1 ) {
+    const unsigned int middle = (low + high) / 2;
+    if ( dot( probability_.data(), shortfall_.data() + middle * BINS, BINS ) <= risk_ ) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+uint64_t SproutController::tick_interval_us()
+{
+  return tick_us_;
+}
+
+void SproutController::tick( const uint64_t timestamp )
+{
+  evolve();
+
+  unsigned int arrivals;
+  const bool observed = observe( timestamp, arrivals );
+
+  window_ = max( min_window_, forecast() );
+
+  if ( debug_ or Tracer::enabled() ) {
+    double mean_rate = 0;
+    for ( size_t i = 0; i < BINS; i++ ) {
+      mean_rate += probability_[ i ] * i * max_rate_ / (BINS - 1);
+    }
+
+    trace( TraceEvent::Sprout, timestamp, observed ? int64_t( arrivals ) : -1,
+	   trace_double( mean_rate ), window_ );
+
+    if ( debug_ ) {
+      cerr << "At time " << timestamp << " Sprout saw " << arrivals << " arrivals"
+	   << (observed ? "" : " (no observation)")
+	   << ", mean rate " << mean_rate << " datagrams/s, window " << window_ << endl;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef SPROUT_CONTROLLER_HH
+#define SPROUT_CONTROLLER_HH
+
+#include <vector>
+
+#include "controller.hh"
+#include "windowed_filter.hh"
+
+/* stochastic forecasting in the style of Sprout (Winstein et al., NSDI
+   2013): the link's delivery rate is modeled as Brownian motion seen
+   through Poisson arrivals, and kept as a probability distribution over
+   discrete rates that each tick spreads out, then conditions on how many
+   datagrams the receiver reported in the tick; the window is what that
+   distribution says the link will deliver within the target delay, with
+   the given confidence */
+class SproutController : public Controller
+{
+private:
+  /* tunable constants */
+  uint64_t tick_us_;
+  double max_rate_; /* datagrams per second (the top bin) */
+  unsigned int min_window_;
+  double risk_; /* 1 - confidence */
+
+  /* P(the rate is bin i's), rates evenly spaced from 0 to max_rate_ */
+  std::vector<float> probability_;
+
+  /* one tick's spreading (a Gaussian kernel over bins, of half-width
+     spread_), and padded scratch space for the convolution */
+  std::vector<float> kernel_;
+  size_t spread_;
+  std::vector<float> spread_input_, spread_output_;
+
+  /* observation likelihoods, row k for each bin (rows scaled to a peak of
+     one): of k arrivals in a tick when the link was busy throughout, and
+     of at least k when it may have gone idle */
+  unsigned int max_count_;
+  std::vector<float> exactly_, at_least_;
+
+  /* row c for each bin: P(fewer than c datagrams delivered within the target delay) */
+  unsigned int max_forecast_;
+  std::vector<float> shortfall_;
+
+  /* what the acks in the current tick showed */
+  WindowedMinFilter<uint64_t> min_rtt_;
+  uint64_t tick_min_rtt_; /* -1 if there were none */
+  uint64_t last_ack_time_;
+  uint64_t datagrams_received_, tick_datagrams_received_;
+
+  /* datagrams outstanding: [next_ack_expected_, next_sequence_number_) */
+  uint64_t next_sequence_number_, next_ack_expected_;
+
+  unsigned int window_;
+
+  uint64_t in_flight() const { return next_sequence_number_ - next_ack_expected_; }
+
+  void evolve();
+  bool observe( const uint64_t timestamp, unsigned int & arrivals );
+  unsigned int forecast() const;
+
+public:
+  SproutController( const bool debug, const Parameters & parameters );
+
+  unsigned int window_size() override;
+
+  void datagram_was_sent( const uint64_t sequence_number,
+			  const uint64_t send_timestamp,
+			  const bool after_timeout ) override;
+
+  void ack_received( const uint64_t sequence_number_acked,
+		     const uint64_t send_timestamp_acked,
+		     const uint64_t recv_timestamp_acked,
+		     const uint64_t timestamp_ack_received ) override;
+
+  void receive_count_reported( const uint64_t datagrams_received,
+			       const uint64_t timestamp ) override;
+
+  uint64_t tick_interval_us() override;
+  void tick( const uint64_t timestamp ) override;
+};
+
+#endif /* SPROUT_CONTROLLER_HH */
@@ -0,0 +1,102 @@
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+#include "trace_link.hh"
+
+using namespace std;
+
+DeliveryTrace::DeliveryTrace( const string & filename )
+  : opportunities_ms_()
+{
+  ifstream file( filename );
+  if ( not file.is_open() ) {
+    throw runtime_error( "cannot open trace " + filename );
+  }
+
+  string line;
+  while ( getline( file, line ) ) {
+    if ( line.empty() ) {
+      continue;
+    }
+
+    size_t parsed = 0;
+    const uint64_t time_ms = stoull( line, &parsed );
+    if ( parsed != line.size()
+	 or (not opportunities_ms_.empty() and time_ms < opportunities_ms_.back()) ) {
+      throw runtime_error( filename + ": bad or out-of-order line \"" + line + "\"" );
+    }
+
+    opportunities_ms_.push_back( time_ms );
+  }
+
+  if ( opportunities_ms_.empty() or opportunities_ms_.back() == 0 ) {
+    throw runtime_error( filename + ": trace must end after time 0" );
+  }
+}
+
+CoDel::CoDel( const uint64_t target_us, const uint64_t interval_us )
+  : target_us_( target_us ),
+    interval_us_( interval_us ),
+    first_above_time_( 0 ),
+    drop_next_( 0 ),
+    count_( 0 ),
+    last_count_( 0 ),
+    dropping_( false )
+{}
+
+/* has the queueing delay stayed above target for at least an interval? */
+bool CoDel::ok_to_drop( const uint64_t sojourn_us, const uint64_t now_us, const size_t bytes_behind )
+{
+  /* (never empty the queue below one MTU's worth) */
+  if ( sojourn_us < target_us_ or bytes_behind <= 1500 ) {
+    first_above_time_ = 0;
+    return false;
+  }
+
+  if ( first_above_time_ == 0 ) {
+    first_above_time_ = now_us + interval_us_;
+    return false;
+  }
+
+  return now_us >= first_above_time_;
+}
+
+/* the next drop comes sooner the more drops it has taken to bring the delay down */
+static uint64_t control_law( const uint64_t time_us, const uint64_t interval_us, const uint32_t count )
+{
+  return time_us + interval_us / sqrt( count );
+}
+
+bool CoDel::drop( const uint64_t sojourn_us, const uint64_t now_us, const size_t bytes_behind )
+{
+  const bool ok = ok_to_drop( sojourn_us, now_us, bytes_behind );
+
+  if ( dropping_ ) {
+    if ( not ok ) {
+      /* delay is back under control */
+      dropping_ = false;
+      return false;
+    }
+
+    if ( now_us >= drop_next_ ) {
+      count_++;
+      drop_next_ = control_law( drop_next_, interval_us_, count_ );
+      return true;
+    }
+
+    return false;
+  }
+
+  if ( ok ) {
+    /* start dropping, more aggressively at first if we were dropping recently */
+    dropping_ = true;
+    const uint32_t delta = count_ - last_count_;
+    count_ = (delta > 1 and now_us - drop_next_ < 16 * interval_us_) ? delta : 1;
+    drop_next_ = control_law( now_us, interval_us_, count_ );
+    last_count_ = count_;
+    return true;
+  }
+
+  return false;
+}
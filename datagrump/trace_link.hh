@@ -0,0 +1,173 @@
+#ifndef TRACE_LINK_HH
+#define TRACE_LINK_HH
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* a mahimahi packet-delivery trace: each line is the time (in ms) of one
+   opportunity to deliver an MTU-sized packet, and the trace repeats
+   with a period of its last time */
+class DeliveryTrace
+{
+private:
+  std::vector<uint64_t> opportunities_ms_;
+
+public:
+  DeliveryTrace( const std::string & filename );
+
+  size_t size() const { return opportunities_ms_.size(); }
+  uint64_t operator[]( const size_t i ) const { return opportunities_ms_[ i ]; }
+  uint64_t period_ms() const { return opportunities_ms_.back(); }
+};
+
+/* CoDel active queue management (RFC 8289), deciding packet by packet
+   as each reaches the front of a queue */
+class CoDel
+{
+private:
+  uint64_t target_us_, interval_us_;
+
+  uint64_t first_above_time_; /* when the delay will have been above target for an interval */
+  uint64_t drop_next_;
+  uint32_t count_, last_count_;
+  bool dropping_;
+
+  bool ok_to_drop( const uint64_t sojourn_us, const uint64_t now_us, const size_t bytes_behind );
+
+public:
+  CoDel( const uint64_t target_us, const uint64_t interval_us );
+
+  /* should the packet at the front (queued for sojourn_us, with bytes_behind
+     more bytes queued after it) be dropped instead of delivered? */
+  bool drop( const uint64_t sojourn_us, const uint64_t now_us, const size_t bytes_behind );
+};
+
+/* a bottleneck that drains a queue at a trace's delivery opportunities
+   (as mm-link does): each opportunity carries up to OPPORTUNITY_BYTES
+   from the front of the queue, finishing some packets and perhaps
+   starting on the next, and an idle link wastes its opportunities;
+   the queue is droptail, optionally with CoDel at its front.
+   Packets need size (bytes on the wire) and arrival_us (set on enqueue). */
+template <class Packet>
+class TraceLink
+{
+public:
+  static const size_t OPPORTUNITY_BYTES = 1504;
+
+private:
+  const DeliveryTrace & trace_;
+  size_t queue_limit_; /* in packets (0 means unlimited) */
+  bool use_codel_;
+  CoDel codel_;
+
+  std::deque<Packet> queue_;
+  size_t queue_bytes_;
+  size_t head_bytes_left_; /* of the packet at the front of the queue */
+  uint64_t dropped_;
+
+  /* the next opportunity not yet used or wasted */
+  size_t next_index_;
+  uint64_t base_ms_; /* start of the current pass through the trace */
+
+  void advance()
+  {
+    if ( ++next_index_ == trace_.size() ) {
+      next_index_ = 0;
+      base_ms_ += trace_.period_ms();
+    }
+  }
+
+  void pop_front()
+  {
+    queue_bytes_ -= queue_.front().size;
+    queue_.pop_front();
+    head_bytes_left_ = queue_.empty() ? 0 : queue_.front().size;
+  }
+
+public:
+  /* a codel_target_us of zero means plain droptail */
+  TraceLink( const DeliveryTrace & trace, const size_t queue_limit,
+	     const uint64_t codel_target_us = 0, const uint64_t codel_interval_us = 100000 )
+    : trace_( trace ),
+      queue_limit_( queue_limit ),
+      use_codel_( codel_target_us != 0 ),
+      codel_( codel_target_us, codel_interval_us ),
+      queue_(),
+      queue_bytes_( 0 ),
+      head_bytes_left_( 0 ),
+      dropped_( 0 ),
+      next_index_( 0 ),
+      base_ms_( 0 )
+  {}
+
+  /* add a packet to the queue; returns false if the queue was full */
+  bool enqueue( Packet packet, const uint64_t now_us )
+  {
+    if ( queue_limit_ and queue_.size() >= queue_limit_ ) {
+      dropped_++;
+      return false;
+    }
+
+    packet.arrival_us = now_us;
+    queue_bytes_ += packet.size;
+    if ( queue_.empty() ) {
+      head_bytes_left_ = packet.size;
+    }
+
+    queue_.push_back( std::move( packet ) );
+    return true;
+  }
+
+  bool empty() const { return queue_.empty(); }
+  size_t queue_bytes() const { return queue_bytes_; }
+  uint64_t dropped() const { return dropped_; }
+
+  /* time (in ms) of the next opportunity not yet used or wasted */
+  uint64_t opportunity_ms() const { return base_ms_ + trace_[ next_index_ ]; }
+
+  /* time (in ms) of the first opportunity at or after time_us
+     (earlier ones are wasted) */
+  uint64_t next_opportunity_ms( const uint64_t time_us )
+  {
+    while ( opportunity_ms() * 1000 < time_us ) {
+      advance();
+    }
+
+    return opportunity_ms();
+  }
+
+  /* use the next opportunity, appending the packets it finishes to delivered */
+  void use_opportunity( std::vector<Packet> & delivered )
+  {
+    const uint64_t now_us = opportunity_ms() * 1000;
+    size_t bytes_left = OPPORTUNITY_BYTES;
+
+    while ( bytes_left and not queue_.empty() ) {
+      const Packet & head = queue_.front();
+
+      /* AQM decides as each packet starts to go */
+      if ( use_codel_ and head_bytes_left_ == head.size
+	   and codel_.drop( now_us - head.arrival_us, now_us, queue_bytes_ - head.size ) ) {
+	dropped_++;
+	pop_front();
+	continue;
+      }
+
+      if ( head_bytes_left_ > bytes_left ) {
+	head_bytes_left_ -= bytes_left;
+	break;
+      }
+
+      bytes_left -= head_bytes_left_;
+      delivered.push_back( std::move( queue_.front() ) );
+      pop_front();
+    }
+
+    advance();
+  }
+};
+
+#endif /* TRACE_LINK_HH */
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tracer.hh"
+#include "timestamp.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* how often the drain thread empties the rings */
+static const long DRAIN_INTERVAL_NS = 10000000;
+
+static const char TRACE_MAGIC[ 8 ] = { 'D', 'G', 'T', 'R', 'A', 'C', 'E', 0 };
+static const uint32_t TRACE_VERSION = 1;
+
+atomic<Tracer *> Tracer::active_( nullptr );
+atomic<uint64_t> Tracer::generations_( 0 );
+thread_local TraceRing * Tracer::ring_ = nullptr;
+thread_local uint64_t Tracer::ring_generation_ = 0;
+
+TraceRing::TraceRing( const size_t capacity, const uint32_t thread )
+  : records_( nullptr ),
+    mask_( capacity - 1 ),
+    thread_( thread ),
+    head_( 0 ),
+    tail_( 0 ),
+    dropped_( 0 ),
+    dropped_reported_( 0 )
+{
+  if ( capacity == 0 or (capacity & (capacity - 1)) ) {
+    throw runtime_error( "trace ring capacity must be a power of two" );
+  }
+
+  /* populated up front, so the traced thread never takes a page fault */
+  void * const mapping = mmap( nullptr, capacity * sizeof( TraceRecord ), PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+  if ( mapping == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+  records_ = static_cast<TraceRecord *>( mapping );
+}
+
+TraceRing::~TraceRing()
+{
+  munmap( records_, (mask_ + 1) * sizeof( TraceRecord ) );
+}
+
+void TraceRing::drain( string & output )
+{
+  const uint64_t head = head_.load( memory_order_acquire );
+  uint64_t tail = tail_.load( memory_order_relaxed );
+
+  /* at most two contiguous runs of the ring */
+  while ( tail < head ) {
+    const uint64_t run = min( head - tail, mask_ + 1 - (tail & mask_) );
+    output.append( reinterpret_cast<const char *>( records_ + (tail & mask_) ),
+		   run * sizeof( TraceRecord ) );
+    tail += run;
+  }
+  tail_.store( tail, memory_order_release );
+
+  const uint64_t dropped = dropped_.load( memory_order_relaxed );
+  if ( dropped != dropped_reported_ ) {
+    const TraceRecord record = { timestamp_us(), static_cast<uint32_t>( TraceEvent::Dropped ),
+				 thread_, { dropped - dropped_reported_, 0, 0 } };
+    output.append( reinterpret_cast<const char *>( &record ), sizeof( record ) );
+    dropped_reported_ = dropped;
+  }
+}
+
+TraceFileHeader TraceFileHeader::current()
+{
+  TraceFileHeader ret;
+  zero( ret );
+  memcpy( ret.magic, TRACE_MAGIC, sizeof( ret.magic ) );
+  ret.version = TRACE_VERSION;
+  ret.record_size = sizeof( TraceRecord );
+  ret.epoch_ns = timestamp_epoch_ns();
+  return ret;
+}
+
+bool TraceFileHeader::readable() const
+{
+  return not memcmp( magic, TRACE_MAGIC, sizeof( magic ) )
+    and version == TRACE_VERSION and record_size == sizeof( TraceRecord );
+}
+
+/* the signals the drain thread handles */
+static sigset_t exit_signals()
+{
+  sigset_t ret;
+  sigemptyset( &ret );
+  sigaddset( &ret, SIGINT );
+  sigaddset( &ret, SIGTERM );
+  return ret;
+}
+
+Tracer::Tracer( const string & filename, const size_t ring_capacity )
+  : file_( SystemCall( "open " + filename,
+		       open( filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) ),
+    ring_capacity_( ring_capacity ),
+    rings_mutex_(),
+    rings_(),
+    generation_( ++generations_ ),
+    saved_mask_(),
+    stopping_( false ),
+    drain_thread_()
+{
+  if ( ring_capacity == 0 or (ring_capacity & (ring_capacity - 1)) ) {
+    throw runtime_error( "trace ring capacity must be a power of two" );
+  }
+
+  const TraceFileHeader header = TraceFileHeader::current();
+  file_.write( string( reinterpret_cast<const char *>( &header ), sizeof( header ) ) );
+}
+
+unique_ptr<Tracer> Tracer::start( const string & filename, const size_t ring_capacity )
+{
+  if ( active_ ) {
+    throw runtime_error( "a tracer is already running" );
+  }
+
+  unique_ptr<Tracer> tracer( new Tracer( filename, ring_capacity ) );
+
+  /* only the drain thread takes SIGINT and SIGTERM (threads started
+     from here on inherit the mask) */
+  const sigset_t signals = exit_signals();
+  const int error = pthread_sigmask( SIG_BLOCK, &signals, &tracer->saved_mask_ );
+  if ( error ) {
+    throw unix_error( "pthread_sigmask", error );
+  }
+
+  Tracer * const started = tracer.get();
+  tracer->drain_thread_ = thread( [started] () { started->drain_loop(); } );
+
+  active_.store( started, memory_order_release );
+  return tracer;
+}
+
+Tracer::~Tracer()
+{
+  active_ = nullptr;
+
+  if ( drain_thread_.joinable() ) {
+    stopping_ = true;
+    drain_thread_.join();
+    pthread_sigmask( SIG_SETMASK, &saved_mask_, nullptr );
+  }
+}
+
+/* the calling thread's first event: give it a ring */
+TraceRing & Tracer::ring()
+{
+  lock_guard<mutex> lock( rings_mutex_ );
+  rings_.emplace_back( new TraceRing( ring_capacity_, rings_.size() ) );
+  ring_ = rings_.back().get();
+  ring_generation_ = generation_;
+  return *ring_;
+}
+
+void Tracer::drain()
+{
+  string output;
+  {
+    lock_guard<mutex> lock( rings_mutex_ );
+    for ( const auto & ring : rings_ ) {
+      ring->drain( output );
+    }
+  }
+
+  if ( not output.empty() ) {
+    file_.write( output );
+  }
+}
+
+void Tracer::drain_loop()
+{
+  const sigset_t signals = exit_signals();
+
+  while ( not stopping_ ) {
+    const timespec interval = { 0, DRAIN_INTERVAL_NS };
+    const int signal_number = sigtimedwait( &signals, nullptr, &interval );
+
+    drain();
+
+    if ( signal_number > 0 ) {
+      /* the trace is complete; now let the signal do what it would have */
+      signal( signal_number, SIG_DFL );
+      pthread_sigmask( SIG_UNBLOCK, &signals, nullptr );
+      raise( signal_number );
+    }
+  }
+
+  drain();
+}
+
+/* names for the decoder */
+static const TraceEventInfo::Format NONE = TraceEventInfo::Format::None;
+static const TraceEventInfo::Format UNSIGNED = TraceEventInfo::Format::Unsigned;
+static const TraceEventInfo::Format SIGNED = TraceEventInfo::Format::Signed;
+static const TraceEventInfo::Format DOUBLE = TraceEventInfo::Format::Double;
+
+static const TraceEventInfo EVENTS[] = {
+  { "sent", { "sequence_number", "after_timeout", "" }, { UNSIGNED, UNSIGNED, NONE } },
+  { "transmitted", { "sequence_number", "", "" }, { UNSIGNED, NONE, NONE } },
+  { "ack", { "sequence_number", "send_timestamp", "recv_timestamp" }, { UNSIGNED, UNSIGNED, UNSIGNED } },
+  { "rate_sample", { "delivery_rate_bps", "interval_us", "delivered" }, { UNSIGNED, UNSIGNED, UNSIGNED } },
+  { "receive_count", { "datagrams_received", "", "" }, { UNSIGNED, NONE, NONE } },
+  { "lost", { "sequence_number", "send_timestamp", "" }, { UNSIGNED, UNSIGNED, NONE } },
+  { "retransmitted", { "sequence_number", "lost_sequence_number", "" }, { UNSIGNED, UNSIGNED, NONE } },
+  { "window", { "window", "in_flight", "pacing_rate_bps" }, { UNSIGNED, UNSIGNED, UNSIGNED } },
+  { "timeout", { "retransmission_timeout", "", "" }, { UNSIGNED, NONE, NONE } },
+  { "tick", { "", "", "" }, { NONE, NONE, NONE } },
+  { "bbr", { "mode", "btlbw_bps", "rtprop_us" }, { UNSIGNED, UNSIGNED, UNSIGNED } },
+  { "sprout", { "arrivals", "mean_rate", "window" }, { SIGNED, DOUBLE, UNSIGNED } },
+  { "learned_features", { "rtt_ratio", "ack_send_ratio", "ack_interval_ms" }, { DOUBLE, DOUBLE, DOUBLE } },
+  { "learned_actions", { "window_action", "pacing_action", "window" }, { DOUBLE, DOUBLE, DOUBLE } },
+  { "dropped", { "records", "", "" }, { UNSIGNED, NONE, NONE } },
+};
+
+static_assert( sizeof( EVENTS ) / sizeof( EVENTS[ 0 ] ) == static_cast<size_t>( TraceEvent::Count ),
+	       "every TraceEvent needs a TraceEventInfo" );
+
+const TraceEventInfo & TraceEventInfo::of( const uint32_t event )
+{
+  if ( event >= static_cast<uint32_t>( TraceEvent::Count ) ) {
+    throw runtime_error( "unknown trace event " + to_string( event ) );
+  }
+  return EVENTS[ event ];
+}
@@ -0,0 +1,168 @@
+#ifndef TRACER_HH
+#define TRACER_HH
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_descriptor.hh"
+
+/* what happened (the decoder's names for each event and its arguments
+   are in tracer.cc) */
+enum class TraceEvent : uint32_t {
+  Sent, Transmitted, Ack, RateSample, ReceiveCount, Lost, Retransmitted,
+  Window, Timeout, Tick, BBR, Sprout, LearnedFeatures, LearnedActions,
+  Dropped, /* the tracer's own: records a full ring had no room for */
+  Count
+};
+
+/* one event, as written to the trace file (after a TraceFileHeader) */
+struct TraceRecord
+{
+  uint64_t timestamp; /* microseconds, as given by the caller */
+  uint32_t event;
+  uint32_t thread; /* the order in which threads first traced something */
+  uint64_t args[ 3 ];
+};
+
+struct TraceFileHeader
+{
+  char magic[ 8 ];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t epoch_ns; /* CLOCK_MONOTONIC when the tracing program started */
+
+  /* the header this build writes */
+  static TraceFileHeader current();
+
+  /* can this build read the records that follow? */
+  bool readable() const;
+};
+
+/* a thread's records on their way to the file: the thread writes at
+   head, the tracer's drain thread reads at tail, and when the ring is
+   full new records are dropped (and counted) rather than waited for */
+class TraceRing
+{
+private:
+  TraceRecord * records_;
+  size_t mask_;
+  uint32_t thread_;
+  std::atomic<uint64_t> head_, tail_, dropped_;
+  uint64_t dropped_reported_; /* by the drain thread */
+
+public:
+  TraceRing( const size_t capacity, const uint32_t thread );
+  ~TraceRing();
+
+  void push( const TraceEvent event, const uint64_t timestamp,
+	     const uint64_t a, const uint64_t b, const uint64_t c )
+  {
+    const uint64_t head = head_.load( std::memory_order_relaxed );
+    if ( head - tail_.load( std::memory_order_acquire ) > mask_ ) {
+      dropped_.store( dropped_.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+      return;
+    }
+
+    records_[ head & mask_ ] = { timestamp, static_cast<uint32_t>( event ), thread_, { a, b, c } };
+    head_.store( head + 1, std::memory_order_release );
+  }
+
+  /* append the records not yet drained (and a Dropped record, if any
+     were) to output, and let the writer reuse their slots */
+  void drain( std::string & output );
+
+  TraceRing( const TraceRing & other ) = delete;
+  const TraceRing & operator=( const TraceRing & other ) = delete;
+};
+
+/* the process's tracer: each thread that traces gets a ring, which a
+   background thread drains into the trace file every few milliseconds.
+   SIGINT and SIGTERM are taken by the drain thread, which writes out
+   what is left before letting the signal end the process. */
+class Tracer
+{
+private:
+  FileDescriptor file_;
+  size_t ring_capacity_;
+
+  std::mutex rings_mutex_;
+  std::vector< std::unique_ptr<TraceRing> > rings_;
+
+  uint64_t generation_; /* tells this Tracer's rings from an earlier one's */
+  sigset_t saved_mask_;
+
+  std::atomic<bool> stopping_;
+  std::thread drain_thread_;
+
+  static std::atomic<Tracer *> active_;
+  static std::atomic<uint64_t> generations_;
+  static thread_local TraceRing * ring_;
+  static thread_local uint64_t ring_generation_;
+
+  Tracer( const std::string & filename, const size_t ring_capacity );
+
+  TraceRing & ring();
+  void drain();
+  void drain_loop();
+
+public:
+  /* start tracing to filename (ring_capacity records per thread, a
+     power of two); tracing stops when the Tracer is destroyed, which
+     must be after the threads being traced are done */
+  static std::unique_ptr<Tracer> start( const std::string & filename,
+					const size_t ring_capacity = 65536 );
+  ~Tracer();
+
+  /* is anything being traced? */
+  static bool enabled() { return active_.load( std::memory_order_relaxed ) != nullptr; }
+
+  static void record( const TraceEvent event, const uint64_t timestamp,
+		      const uint64_t a, const uint64_t b, const uint64_t c )
+  {
+    Tracer * const tracer = active_.load( std::memory_order_acquire );
+    if ( tracer ) {
+      TraceRing & ring = ring_generation_ == tracer->generation_ ? *ring_ : tracer->ring();
+      ring.push( event, timestamp, a, b, c );
+    }
+  }
+
+  Tracer( const Tracer & other ) = delete;
+  const Tracer & operator=( const Tracer & other ) = delete;
+};
+
+/* a floating-point trace argument */
+inline uint64_t trace_double( const double value )
+{
+  uint64_t ret;
+  memcpy( &ret, &value, sizeof( ret ) );
+  return ret;
+}
+
+/* trace an event (a load and a branch when tracing is off) */
+inline void trace( const TraceEvent event, const uint64_t timestamp,
+		   const uint64_t a = 0, const uint64_t b = 0, const uint64_t c = 0 )
+{
+  Tracer::record( event, timestamp, a, b, c );
+}
+
+/* the decoder's view of an event */
+struct TraceEventInfo
+{
+  enum class Format { None, Unsigned, Signed, Double };
+
+  const char * name;
+  const char * arg_names[ 3 ];
+  Format formats[ 3 ];
+
+  /* throws runtime_error for an unknown event */
+  static const TraceEventInfo & of( const uint32_t event );
+};
+
+#endif /* TRACER_HH */
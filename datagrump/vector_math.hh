@@ -0,0 +1,111 @@
+#ifndef VECTOR_MATH_HH
+#define VECTOR_MATH_HH
+
+#include <cstddef>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/* The few float loops the controllers run per tick or per ack, written
+   four lanes at a time with SSE, with plain loops for other targets;
+   lengths must be multiples of four (see round_up_to_vector) */
+
+inline size_t round_up_to_vector( const size_t n )
+{
+  return (n + 3) & ~size_t( 3 );
+}
+
+#ifdef __SSE__
+inline float horizontal_sum( const __m128 v )
+{
+  const __m128 pairs = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+  return _mm_cvtss_f32( _mm_add_ss( pairs, _mm_shuffle_ps( pairs, pairs, 1 ) ) );
+}
+#endif
+
+/* dest += weight x src */
+inline void add_scaled( float * const dest, const float * const src,
+			const float weight, const size_t n )
+{
+#ifdef __SSE__
+  const __m128 w = _mm_set1_ps( weight );
+  for ( size_t i = 0; i < n; i += 4 ) {
+    _mm_storeu_ps( dest + i, _mm_add_ps( _mm_loadu_ps( dest + i ),
+					 _mm_mul_ps( w, _mm_loadu_ps( src + i ) ) ) );
+  }
+#else
+  for ( size_t i = 0; i < n; i++ ) {
+    dest[ i ] += weight * src[ i ];
+  }
+#endif
+}
+
+/* dest *= src (elementwise); returns the sum of the products */
+inline float multiply( float * const dest, const float * const src, const size_t n )
+{
+#ifdef __SSE__
+  __m128 sum = _mm_setzero_ps();
+  for ( size_t i = 0; i < n; i += 4 ) {
+    const __m128 product = _mm_mul_ps( _mm_loadu_ps( dest + i ), _mm_loadu_ps( src + i ) );
+    _mm_storeu_ps( dest + i, product );
+    sum = _mm_add_ps( sum, product );
+  }
+  return horizontal_sum( sum );
+#else
+  float sum = 0;
+  for ( size_t i = 0; i < n; i++ ) {
+    dest[ i ] *= src[ i ];
+    sum += dest[ i ];
+  }
+  return sum;
+#endif
+}
+
+inline float dot( const float * const a, const float * const b, const size_t n )
+{
+#ifdef __SSE__
+  __m128 sum = _mm_setzero_ps();
+  for ( size_t i = 0; i < n; i += 4 ) {
+    sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps( a + i ), _mm_loadu_ps( b + i ) ) );
+  }
+  return horizontal_sum( sum );
+#else
+  float sum = 0;
+  for ( size_t i = 0; i < n; i++ ) {
+    sum += a[ i ] * b[ i ];
+  }
+  return sum;
+#endif
+}
+
+inline void scale( float * const dest, const float factor, const size_t n )
+{
+#ifdef __SSE__
+  const __m128 f = _mm_set1_ps( factor );
+  for ( size_t i = 0; i < n; i += 4 ) {
+    _mm_storeu_ps( dest + i, _mm_mul_ps( f, _mm_loadu_ps( dest + i ) ) );
+  }
+#else
+  for ( size_t i = 0; i < n; i++ ) {
+    dest[ i ] *= factor;
+  }
+#endif
+}
+
+/* dest = max( dest, 0 ) */
+inline void rectify( float * const dest, const size_t n )
+{
+#ifdef __SSE__
+  const __m128 zero = _mm_setzero_ps();
+  for ( size_t i = 0; i < n; i += 4 ) {
+    _mm_storeu_ps( dest + i, _mm_max_ps( zero, _mm_loadu_ps( dest + i ) ) );
+  }
+#else
+  for ( size_t i = 0; i < n; i++ ) {
+    dest[ i ] = dest[ i ] > 0 ? dest[ i ] : 0;
+  }
+#endif
+}
+
+#endif /* VECTOR_MATH_HH */
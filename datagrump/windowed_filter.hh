@@ -0,0 +1,84 @@
+#ifndef WINDOWED_FILTER_HH
+#define WINDOWED_FILTER_HH
+
+#include <cstdint>
+#include <functional>
+
+/* the best (e.g. max or min) of the values seen over a sliding window of
+   time (or of any increasing count, such as round trips), kept as three
+   samples -- the best, and the best since a quarter and half window later
+   -- so it needs constant space (Kathleen Nichols' algorithm, as in
+   Linux's lib/minmax.c); Compare( a, b ) is whether a is at least as good */
+template <typename T, class Compare>
+class WindowedFilter
+{
+private:
+  struct Sample
+  {
+    uint64_t time;
+    T value;
+  };
+
+  uint64_t window_;
+  Sample samples_[ 3 ];
+  bool empty_;
+
+  void reset( const Sample & sample )
+  {
+    samples_[ 0 ] = samples_[ 1 ] = samples_[ 2 ] = sample;
+    empty_ = false;
+  }
+
+public:
+  WindowedFilter( const uint64_t window )
+    : window_( window ), samples_(), empty_( true )
+  {}
+
+  bool empty() const { return empty_; }
+  T best() const { return samples_[ 0 ].value; }
+
+  void update( const uint64_t time, const T value )
+  {
+    const Sample sample = { time, value };
+    const Compare at_least_as_good;
+
+    /* a new best, or nothing left in the window */
+    if ( empty_ or at_least_as_good( value, samples_[ 0 ].value )
+	 or time - samples_[ 2 ].time > window_ ) {
+      reset( sample );
+      return;
+    }
+
+    if ( at_least_as_good( value, samples_[ 1 ].value ) ) {
+      samples_[ 2 ] = samples_[ 1 ] = sample;
+    } else if ( at_least_as_good( value, samples_[ 2 ].value ) ) {
+      samples_[ 2 ] = sample;
+    }
+
+    /* age out the best sample, promoting the later ones */
+    const uint64_t age = time - samples_[ 0 ].time;
+    if ( age > window_ ) {
+      samples_[ 0 ] = samples_[ 1 ];
+      samples_[ 1 ] = samples_[ 2 ];
+      samples_[ 2 ] = sample;
+      if ( time - samples_[ 0 ].time > window_ ) {
+	samples_[ 0 ] = samples_[ 1 ];
+	samples_[ 1 ] = samples_[ 2 ];
+	samples_[ 2 ] = sample;
+      }
+    } else if ( samples_[ 1 ].time == samples_[ 0 ].time and age > window_ / 4 ) {
+      /* a quarter of the way through the window with no second choice yet */
+      samples_[ 2 ] = samples_[ 1 ] = sample;
+    } else if ( samples_[ 2 ].time == samples_[ 1 ].time and age > window_ / 2 ) {
+      samples_[ 2 ] = sample;
+    }
+  }
+};
+
+template <typename T>
+using WindowedMaxFilter = WindowedFilter< T, std::greater_equal<T> >;
+
+template <typename T>
+using WindowedMinFilter = WindowedFilter< T, std::less_equal<T> >;
+
+#endif /* WINDOWED_FILTER_HH */
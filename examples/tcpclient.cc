@@ -35,6 +35,10 @@ int main( int argc, char *argv[] )
   socket.connect( server );
   cerr << "done." << endl;
 
+  /* never wait for a slow server: what it isn't ready for is kept
+     (stopping the keyboard after 1 MiB, until it is down to 256 KiB) */
+  socket.set_buffered_output( 256 * 1024, 1024 * 1024 );
+
   /* now read and write from the server using an event-driven "poller" */
   Poller poller;
 
@@ -53,11 +57,30 @@ int main( int argc, char *argv[] )
 			     } ) );
 
   /* second rule: if the keyboard has data ready (also in the "In" direction),
-     write it to the server, plus a carriage return and newline */
+     write it to the server, plus a carriage return and newline
+     (as long as the server is keeping up) */
   FileDescriptor keyboard( 0 );
+  const string CRLF = "\r\n";
   poller.add_action( Action( keyboard, Direction::In,
 			     [&] () {
-			       socket.write( keyboard.read() + "\r\n" );
+			       const string line = keyboard.read();
+
+			       /* exit at the end of the input */
+			       if ( keyboard.eof() ) {
+				 return ResultType::Exit;
+			       }
+
+			       socket.writev( { line, CRLF } ); /* without joining them */
+			       return ResultType::Continue;
+			     },
+			     [&] () { return socket.accepting_output(); } ) );
+
+  /* third rule: if the server can take more (in the "Out" direction)
+     of what it wasn't ready for, write it (the poller only asks while
+     something is waiting) */
+  poller.add_action( Action( socket, Direction::Out,
+			     [&] () {
+			       socket.flush();
 			       return ResultType::Continue;
 			     } ) );
 
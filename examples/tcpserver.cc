@@ -5,22 +5,15 @@
 #include <iostream>
 
 #include "socket.hh"
+#include "reactor_server.hh"
+#include "cpu_affinity.hh"
 #include "util.hh"
 
 using namespace std;
 
-int main( int argc, char *argv[] )
+/* one thread per client (the original model) */
+static void serve_with_threads( const string & port )
 {
-  /* check the command-line arguments */
-  if ( argc < 1 ) { /* for sticklers */
-    abort();
-  }
-
-  if ( argc != 2 ) {
-    cerr << "Usage: " << argv[ 0 ] << " PORT" << endl;
-    return EXIT_FAILURE;
-  }
-
   /* create a TCP socket */
   TCPSocket listening_socket;
 
@@ -29,7 +22,7 @@ int main( int argc, char *argv[] )
   listening_socket.set_reuseaddr();
 
   /* "bind" the socket to the user-specified local port number */
-  listening_socket.bind( Address( "::0", argv[ 1 ] ) );
+  listening_socket.bind( Address( "::0", port ) );
 
   /* mark the socket as listening for incoming connections */
   listening_socket.listen();
@@ -55,7 +48,7 @@ int main( int argc, char *argv[] )
 	  client.write( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
 	}
 
-	cerr << client.peer_address().to_string() << " closed the connection." << endl; 
+	cerr << client.peer_address().to_string() << " closed the connection." << endl;
       }, listening_socket.accept() );
 
     /* Let the client handler continue to run without having
@@ -64,6 +57,75 @@ int main( int argc, char *argv[] )
 
     client_handler.detach();
   }
+}
+
+/* a few event loops, one per core, share every client between them */
+static void serve_with_reactors( const string & port, const unsigned int reactors )
+{
+  ReactorServer::Handlers handlers;
+
+  handlers.on_open = [] ( ReactorServer::Connection & client ) {
+    cerr << "New connection from " << client.peer_address().to_string() << endl;
+  };
+
+  /* Print every line that the client sends */
+  handlers.on_data = [] ( ReactorServer::Connection & client, const string & chunk ) {
+    cerr << "Got " << chunk.size() << " bytes from "
+	 << client.peer_address().to_string() << ": " << chunk;
+    client.send( "Received " + to_string( chunk.size() ) + " bytes from you.\n" );
+  };
+
+  handlers.on_close = [] ( ReactorServer::Connection & client ) {
+    cerr << client.peer_address().to_string() << " closed the connection." << endl;
+  };
+
+  const vector<int> cpus = allowed_cpus();
+  ReactorServer server( Address( "::0", port ), handlers,
+			reactors ? reactors : cpus.size(), cpus );
+  cerr << "Listening on local address: " << server.local_address().to_string()
+       << " with " << server.reactor_count() << " reactor(s)" << endl;
+
+  server.wait();
+}
+
+int main( int argc, char *argv[] )
+{
+  /* check the command-line arguments */
+  if ( argc < 1 ) { /* for sticklers */
+    abort();
+  }
+
+  bool threads = false;
+  unsigned int reactors = 0; /* one per core */
+  bool usage_error = argc < 2;
+
+  for ( int i = 2; i < argc; i++ ) {
+    const string option( argv[ i ] );
+    if ( option == "threads" ) {
+      threads = true;
+    } else if ( option.compare( 0, 9, "reactors=" ) == 0 ) {
+      reactors = stoul( option.substr( 9 ) );
+      usage_error |= reactors == 0;
+    } else {
+      usage_error = true;
+    }
+  }
+
+  if ( usage_error ) {
+    cerr << "Usage: " << argv[ 0 ] << " PORT [reactors=N | threads]" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    if ( threads ) {
+      serve_with_threads( argv[ 1 ] );
+    } else {
+      serve_with_reactors( argv[ 1 ], reactors );
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
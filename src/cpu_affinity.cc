@@ -0,0 +1,36 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "cpu_affinity.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* the CPUs this process may run on, in order */
+vector<int> allowed_cpus()
+{
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  SystemCall( "sched_getaffinity", sched_getaffinity( 0, sizeof( set ), &set ) );
+
+  vector<int> cpus;
+  for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+    if ( CPU_ISSET( cpu, &set ) ) {
+      cpus.push_back( cpu );
+    }
+  }
+  return cpus;
+}
+
+/* run the calling thread only on cpu */
+void pin_to_cpu( const int cpu )
+{
+  cpu_set_t set;
+  CPU_ZERO( &set );
+  CPU_SET( cpu, &set );
+
+  const int error = pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+  if ( error ) {
+    throw unix_error( "pthread_setaffinity_np", error );
+  }
+}
@@ -0,0 +1,12 @@
+#ifndef CPU_AFFINITY_HH
+#define CPU_AFFINITY_HH
+
+#include <vector>
+
+/* the CPUs this process may run on, in order */
+std::vector<int> allowed_cpus();
+
+/* run the calling thread only on cpu */
+void pin_to_cpu( const int cpu );
+
+#endif /* CPU_AFFINITY_HH */
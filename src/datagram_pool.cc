@@ -0,0 +1,176 @@
+#include <stdexcept>
+#include <cstring>
+
+#include <netinet/udp.h>
+
+#include "datagram_pool.hh"
+#include "util.hh"
+
+/* most datagrams, and bytes of UDP payload, the kernel will segment from one message */
+static const size_t MAX_SEGMENTS = 64;
+static const size_t MAX_SEGMENTED_BYTES = 65507;
+
+using namespace std;
+
+DatagramPool::Datagram::Datagram( char * const s_data )
+  : address(),
+    timestamp( -1 ),
+    data( s_data ),
+    length( 0 ),
+    departure( 0 )
+{}
+
+DatagramPool::DatagramPool( const size_t capacity, const size_t mtu )
+  : mtu_( mtu ),
+    payloads_( capacity * mtu ),
+    controls_( capacity * CONTROL_SIZE ),
+    addresses_( capacity ),
+    iovecs_( capacity ),
+    headers_( capacity ),
+    datagrams_(),
+    size_( 0 ),
+    message_count_( 0 )
+{
+  if ( capacity == 0 or mtu == 0 ) {
+    throw runtime_error( "DatagramPool: capacity and mtu must be positive" );
+  }
+
+  datagrams_.reserve( capacity );
+  for ( size_t i = 0; i < capacity; i++ ) {
+    datagrams_.emplace_back( slot( i ) );
+  }
+}
+
+/* claim the next free slot for an outgoing datagram */
+DatagramPool::Datagram & DatagramPool::push_back()
+{
+  if ( full() ) {
+    throw runtime_error( "DatagramPool: no free slots" );
+  }
+
+  Datagram & ret = datagrams_[ size_ ];
+  ret.data = slot( size_ ); /* a GRO receive may have pointed it elsewhere */
+  ret.length = 0;
+  ret.departure = 0;
+  size_++;
+  return ret;
+}
+
+/* point every slot's syscall structures at the slab, ready to receive */
+void DatagramPool::prepare_to_receive()
+{
+  size_ = 0;
+
+  for ( size_t i = 0; i < capacity(); i++ ) {
+    zero( headers_[ i ] );
+    msghdr & header = headers_[ i ].msg_hdr;
+
+    /* prepare to get the source address */
+    header.msg_name = &addresses_[ i ];
+    header.msg_namelen = sizeof( addresses_[ i ] );
+
+    /* prepare to get the payload */
+    iovecs_[ i ].iov_base = slot( i );
+    iovecs_[ i ].iov_len = mtu_;
+    header.msg_iov = &iovecs_[ i ];
+    header.msg_iovlen = 1;
+
+    /* prepare to get the timestamp */
+    header.msg_control = &controls_[ i * CONTROL_SIZE ];
+    header.msg_controllen = CONTROL_SIZE;
+  }
+}
+
+/* point the occupied slots' syscall structures at the slab, ready to send */
+void DatagramPool::prepare_to_send( const bool with_addresses )
+{
+  for ( size_t i = 0; i < size_; i++ ) {
+    const Datagram & datagram = datagrams_[ i ];
+
+    if ( datagram.length > mtu_ ) {
+      throw runtime_error( "DatagramPool: datagram overflows its slot" );
+    }
+
+    zero( headers_[ i ] );
+    msghdr & header = headers_[ i ].msg_hdr;
+
+    if ( with_addresses ) {
+      header.msg_name = const_cast<sockaddr *>( &datagram.address.to_sockaddr() );
+      header.msg_namelen = datagram.address.size();
+    }
+
+    iovecs_[ i ].iov_base = datagram.data;
+    iovecs_[ i ].iov_len = datagram.length;
+    header.msg_iov = &iovecs_[ i ];
+    header.msg_iovlen = 1;
+
+    if ( datagram.departure ) {
+      header.msg_control = &controls_[ i * CONTROL_SIZE ];
+      header.msg_controllen = CMSG_SPACE( sizeof( datagram.departure ) );
+
+      cmsghdr * const cmsg = CMSG_FIRSTHDR( &header );
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN( sizeof( datagram.departure ) );
+      memcpy( CMSG_DATA( cmsg ), &datagram.departure, sizeof( datagram.departure ) );
+    }
+  }
+
+  message_count_ = size_;
+}
+
+/* group runs of equal-size datagrams into one message each */
+void DatagramPool::prepare_to_send_segmented()
+{
+  message_count_ = 0;
+
+  size_t i = 0;
+  while ( i < size_ ) {
+    /* every datagram of a run but the last must be segment_size long */
+    const size_t segment_size = datagrams_[ i ].length;
+    const size_t first = i;
+    size_t bytes = 0;
+
+    while ( i < size_ and i - first < MAX_SEGMENTS ) {
+      const Datagram & datagram = datagrams_[ i ];
+      if ( i > first and (datagram.length > segment_size
+			  or bytes + datagram.length > MAX_SEGMENTED_BYTES) ) {
+	break;
+      }
+
+      if ( datagram.length > mtu_ ) {
+	throw runtime_error( "DatagramPool: datagram overflows its slot" );
+      }
+
+      iovecs_[ i ].iov_base = datagram.data;
+      iovecs_[ i ].iov_len = datagram.length;
+      bytes += datagram.length;
+      i++;
+
+      /* a shorter datagram ends the run (and an empty one is never segmented) */
+      if ( datagram.length != segment_size or segment_size == 0 ) {
+	break;
+      }
+    }
+
+    /* messages are only ever behind slots they've finished with */
+    zero( headers_[ message_count_ ] );
+    msghdr & header = headers_[ message_count_ ].msg_hdr;
+    header.msg_iov = &iovecs_[ first ];
+    header.msg_iovlen = i - first;
+
+    if ( i - first > 1 ) {
+      header.msg_control = &controls_[ message_count_ * CONTROL_SIZE ];
+      header.msg_controllen = CMSG_SPACE( sizeof( uint16_t ) );
+
+      cmsghdr * const cmsg = CMSG_FIRSTHDR( &header );
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+      const uint16_t gso_size = segment_size;
+      memcpy( CMSG_DATA( cmsg ), &gso_size, sizeof( gso_size ) );
+    }
+
+    message_count_++;
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef DATAGRAM_POOL_HH
+#define DATAGRAM_POOL_HH
+
+#include <vector>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+#include "address.hh"
+
+/* preallocated slab of datagram buffers, reused for batched sends
+   and receives so the datagram hot path makes no heap allocations */
+class DatagramPool
+{
+public:
+  /* room for ancillary data (e.g. kernel timestamps) per datagram */
+  const static size_t CONTROL_SIZE = 256;
+
+  /* view of one slot of the slab */
+  struct Datagram
+  {
+    Address address;    /* source (if received) or destination (if sent with sendto) */
+    uint64_t timestamp; /* kernel receive time in microseconds (if received), or caller's choice */
+    char * data;        /* start of this slot's storage (mtu bytes), or for a
+			   received GRO buffer, of this datagram within it */
+    size_t length;      /* bytes of the slot in use */
+    uint64_t departure; /* when to send it (absolute CLOCK_MONOTONIC ns, with
+			   SO_TXTIME), or 0 for now; not used by segmented sends */
+
+    Datagram( char * const s_data );
+    Datagram( const Datagram & other ) = default;
+    Datagram & operator=( const Datagram & other ) = default;
+  };
+
+private:
+  size_t mtu_;
+  std::vector<char> payloads_;
+  std::vector<char> controls_;
+  std::vector<Address::raw> addresses_;
+  std::vector<iovec> iovecs_;
+  std::vector<mmsghdr> headers_;
+  std::vector<Datagram> datagrams_;
+  size_t size_;
+  size_t message_count_;
+
+  /* start of a slot's storage */
+  char * slot( const size_t i ) { return &payloads_[ i * mtu_ ]; }
+
+  /* UDPSocket (and the io_uring engine) fill in and read out the syscall structures */
+  friend class UDPSocket;
+  friend class IOUringLoop;
+
+  /* point every slot's syscall structures at the slab, ready to receive */
+  void prepare_to_receive();
+
+  /* point the occupied slots' syscall structures at the slab, ready to send */
+  void prepare_to_send( const bool with_addresses );
+
+  /* same, but with runs of equal-size datagrams (to the connected address) grouped
+     into one message each, to be split by the kernel (UDP_SEGMENT) */
+  void prepare_to_send_segmented();
+
+public:
+  DatagramPool( const size_t capacity, const size_t mtu );
+
+  /* accessors */
+  size_t capacity() const { return payloads_.size() / mtu_; }
+  size_t mtu() const { return mtu_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ == capacity(); }
+
+  /* release every slot */
+  void clear() { size_ = 0; }
+
+  /* how the last send grouped datagrams into messages (one kernel send,
+     and so one transmit timestamp, each): how many, and datagrams in each */
+  size_t message_count() const { return message_count_; }
+  size_t message_length( const size_t i ) const { return headers_[ i ].msg_hdr.msg_iovlen; }
+
+  /* claim the next free slot for an outgoing datagram */
+  Datagram & push_back();
+
+  /* occupied slots */
+  Datagram & operator[]( const size_t i ) { return datagrams_[ i ]; }
+  const Datagram & operator[]( const size_t i ) const { return datagrams_[ i ]; }
+
+  std::vector<Datagram>::iterator begin() { return datagrams_.begin(); }
+  std::vector<Datagram>::iterator end() { return datagrams_.begin() + size_; }
+  std::vector<Datagram>::const_iterator begin() const { return datagrams_.begin(); }
+  std::vector<Datagram>::const_iterator end() const { return datagrams_.begin() + size_; }
+
+  /* forbid copying DatagramPool objects (the syscall structures point into the slab) */
+  DatagramPool( const DatagramPool & other ) = delete;
+  const DatagramPool & operator=( const DatagramPool & other ) = delete;
+};
+
+#endif /* DATAGRAM_POOL_HH */
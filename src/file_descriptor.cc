@@ -1,24 +1,41 @@
 #include "file_descriptor.hh"
 #include "util.hh"
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std;
 
+/* an output buffer that grew past this is given back once drained */
+static const size_t RETAINED_OUTPUT_CAPACITY = 65536;
+
 /* construct from fd number */
 FileDescriptor::FileDescriptor( const int fd )
   : fd_( fd ),
     eof_( false ),
+    blocking_( true ),
     read_count_( 0 ),
-    write_count_( 0 )
+    write_count_( 0 ),
+    output_(),
+    low_watermark_( 0 ),
+    high_watermark_( 0 ),
+    accepting_output_( true ),
+    output_watcher_()
 {}
 
 /* move constructor */
 FileDescriptor::FileDescriptor( FileDescriptor && other )
   : fd_( other.fd_ ),
     eof_( other.eof_ ),
+    blocking_( other.blocking_ ),
     read_count_( other.read_count_ ),
-    write_count_( other.write_count_ )
+    write_count_( other.write_count_ ),
+    output_( move( other.output_ ) ),
+    low_watermark_( other.low_watermark_ ),
+    high_watermark_( other.high_watermark_ ),
+    accepting_output_( other.accepting_output_ ),
+    output_watcher_( move( other.output_watcher_ ) )
 {
   /* mark other file descriptor as inactive */
   other.fd_ = -1;
@@ -46,39 +63,286 @@ string::const_iterator FileDescriptor::write( const string::const_iterator & beg
     throw runtime_error( "nothing to write" );
   }
 
-  ssize_t bytes_written = SystemCall( "write", ::write( fd_, &*begin, end - begin ) );
+  const ssize_t bytes_written = ::write( fd_, &*begin, end - begin );
+  register_write();
+
+  if ( bytes_written < 0 and not blocking_ and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return begin; /* the kernel's buffer is full */
+  }
+
+  SystemCall( "write", bytes_written );
   if ( bytes_written == 0 ) {
     throw runtime_error( "write returned 0" );
   }
 
-  register_write();
-
   return begin + bytes_written;
 }
 
 /* read method */
 string FileDescriptor::read( const size_t limit )
 {
-  char buffer[ BUFFER_SIZE ];
+  /* room for the biggest read: allocated once per thread, rather than
+     taking a megabyte of stack on every call */
+  static thread_local unique_ptr<char[]> buffer;
+  if ( not buffer ) {
+    buffer.reset( new char[ BUFFER_SIZE ] );
+  }
+
+  const ssize_t bytes_read = ::read( fd_, buffer.get(), min( BUFFER_SIZE, limit ) );
+  register_read();
 
-  ssize_t bytes_read = SystemCall( "read", ::read( fd_, buffer, min( BUFFER_SIZE, limit ) ) );
+  if ( bytes_read < 0 and not blocking_ and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return string(); /* nothing to read yet */
+  }
+
+  SystemCall( "read", bytes_read );
   if ( bytes_read == 0 ) {
     set_eof();
   }
 
+  return string( buffer.get(), bytes_read );
+}
+
+/* read straight into a ring buffer's free space */
+size_t FileDescriptor::read_into( RingBuffer & buffer, const size_t limit )
+{
+  /* a read of nothing would return 0, which looks like EOF */
+  if ( limit == 0 ) {
+    return 0;
+  }
+
+  buffer.reserve( limit );
+
+  iovec runs[ 2 ];
+  size_t run_count = buffer.writable( runs );
+  if ( run_count == 0 ) {
+    return 0;
+  }
+
+  /* no more than limit */
+  if ( runs[ 0 ].iov_len >= limit ) {
+    runs[ 0 ].iov_len = limit;
+    run_count = 1;
+  } else if ( run_count == 2 ) {
+    runs[ 1 ].iov_len = min( runs[ 1 ].iov_len, limit - runs[ 0 ].iov_len );
+  }
+
+  const ssize_t bytes_read = ::readv( fd_, runs, run_count );
   register_read();
 
-  return string( buffer, bytes_read );
+  if ( bytes_read < 0 and not blocking_ and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return 0; /* nothing to read yet */
+  }
+
+  SystemCall( "readv", bytes_read );
+  if ( bytes_read == 0 ) {
+    set_eof();
+  }
+
+  buffer.commit( bytes_read );
+  return bytes_read;
+}
+
+/* one writev (or 0 if a non-blocking fd's kernel buffer is full) */
+size_t FileDescriptor::write_some( const iovec * const runs, const size_t run_count )
+{
+  const ssize_t bytes_written = ::writev( fd_, runs, run_count );
+  register_write();
+
+  if ( bytes_written < 0 and not blocking_ and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return 0;
+  }
+
+  SystemCall( "writev", bytes_written );
+  return bytes_written;
+}
+
+/* skip past the first length bytes of runs; returns the runs left */
+static size_t advance( iovec * & runs, size_t run_count, size_t length )
+{
+  while ( run_count and length >= runs[ 0 ].iov_len ) {
+    length -= runs[ 0 ].iov_len;
+    runs++;
+    run_count--;
+  }
+
+  if ( run_count ) {
+    runs[ 0 ].iov_base = static_cast<char *>( runs[ 0 ].iov_base ) + length;
+    runs[ 0 ].iov_len -= length;
+  }
+
+  return run_count;
+}
+
+/* write runs in order, through the output buffer if there is one */
+size_t FileDescriptor::write_runs( iovec * const runs, const size_t run_count, const bool write_all )
+{
+  size_t total = 0;
+  for ( size_t i = 0; i < run_count; i++ ) {
+    total += runs[ i ].iov_len;
+  }
+
+  if ( total == 0 ) {
+    return 0;
+  }
+
+  iovec * remaining = runs;
+  size_t remaining_count = run_count;
+
+  if ( output_ ) {
+    /* with nothing waiting, the kernel gets the caller's bytes without a copy */
+    const bool was_empty = output_->empty();
+    if ( was_empty ) {
+      remaining_count = advance( remaining, remaining_count, write_some( remaining, remaining_count ) );
+    }
+
+    for ( size_t i = 0; i < remaining_count; i++ ) {
+      output_->push( static_cast<const char *>( remaining[ i ].iov_base ), remaining[ i ].iov_len );
+    }
+    output_changed( was_empty );
+
+    return total;
+  }
+
+  size_t written = 0;
+  do {
+    const size_t bytes_written = write_some( remaining, remaining_count );
+    if ( bytes_written == 0 and write_all ) {
+      throw runtime_error( "write would block" );
+    }
+    written += bytes_written;
+    remaining_count = advance( remaining, remaining_count, bytes_written );
+  } while ( write_all and remaining_count );
+
+  return written;
+}
+
+/* write what a ring buffer holds, and take that from its front */
+size_t FileDescriptor::write_from( RingBuffer & buffer )
+{
+  iovec runs[ 2 ];
+  const size_t written = write_runs( runs, buffer.readable( runs ), false );
+  buffer.pop( written );
+  return written;
+}
+
+/* write several strings as if joined */
+void FileDescriptor::writev( const initializer_list< reference_wrapper< const string > > & pieces )
+{
+  if ( pieces.size() > MAX_PIECES ) {
+    throw runtime_error( "writev: too many pieces" );
+  }
+
+  iovec runs[ MAX_PIECES ];
+  size_t run_count = 0;
+  for ( const string & piece : pieces ) {
+    if ( not piece.empty() ) {
+      runs[ run_count++ ] = { const_cast<char *>( piece.data() ), piece.size() };
+    }
+  }
+
+  write_runs( runs, run_count, true );
 }
 
 /* write method */
 string::const_iterator FileDescriptor::write( const std::string & buffer, const bool write_all )
 {
+  if ( output_ ) {
+    buffered_write( buffer );
+    return buffer.end();
+  }
+
   auto it = buffer.begin();
 
   do {
-    it = write( it, buffer.end() );
+    const auto written_to = write( it, buffer.end() );
+    if ( written_to == it and write_all ) {
+      throw runtime_error( "write would block" );
+    }
+    it = written_to;
   } while ( write_all and (it != buffer.end()) );
 
   return it;
 }
+
+/* set or clear O_NONBLOCK */
+void FileDescriptor::set_blocking( const bool blocking )
+{
+  const int flags = SystemCall( "fcntl", fcntl( fd_, F_GETFL ) );
+  SystemCall( "fcntl", fcntl( fd_, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK) ) );
+  blocking_ = blocking;
+}
+
+/* make writes never wait, buffering what the kernel won't take yet */
+void FileDescriptor::set_buffered_output( const size_t low_watermark, const size_t high_watermark )
+{
+  if ( low_watermark > high_watermark ) {
+    throw runtime_error( "output low watermark is above the high watermark" );
+  }
+
+  if ( blocking_ ) {
+    set_blocking( false );
+  }
+
+  if ( not output_ ) {
+    output_.reset( new RingBuffer );
+  }
+  low_watermark_ = low_watermark;
+  high_watermark_ = high_watermark;
+  accepting_output_ = output_->size() < high_watermark_;
+}
+
+/* write now what the kernel takes, after any output already waiting, and buffer the rest */
+void FileDescriptor::buffered_write( const string & buffer )
+{
+  if ( not output_ ) {
+    throw runtime_error( "buffered_write without buffered output" );
+  }
+
+  iovec run = { const_cast<char *>( buffer.data() ), buffer.size() };
+  write_runs( &run, 1, true );
+}
+
+/* write out as much buffered output as the kernel will take */
+bool FileDescriptor::flush()
+{
+  if ( not output_ or output_->empty() ) {
+    return true;
+  }
+
+  iovec runs[ 2 ];
+  const size_t run_count = output_->readable( runs );
+
+  const ssize_t bytes_written = ::writev( fd_, runs, run_count );
+  register_write();
+
+  if ( bytes_written < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+    return false; /* the kernel's buffer is still full */
+  }
+
+  SystemCall( "writev", bytes_written );
+  output_->pop( bytes_written );
+  output_changed( false );
+
+  return output_->empty();
+}
+
+/* track the watermarks, and tell the watcher if output started or stopped waiting */
+void FileDescriptor::output_changed( const bool was_empty )
+{
+  const size_t waiting = output_->size();
+
+  if ( waiting >= high_watermark_ and waiting > 0 ) {
+    accepting_output_ = false;
+  } else if ( waiting <= low_watermark_ ) {
+    accepting_output_ = true;
+  }
+
+  if ( waiting == 0 ) {
+    output_->release( RETAINED_OUTPUT_CAPACITY );
+  }
+
+  if ( was_empty != (waiting == 0) and output_watcher_ ) {
+    output_watcher_();
+  }
+}
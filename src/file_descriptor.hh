@@ -1,29 +1,65 @@
 #ifndef FILE_DESCRIPTOR_HH
 #define FILE_DESCRIPTOR_HH
 
+#include <functional>
+#include <initializer_list>
+#include <memory>
 #include <string>
 
+#include "ring_buffer.hh"
+
 /* Unix file descriptors (sockets, files, etc.) */
 class FileDescriptor
 {
 private:
   int fd_;
   bool eof_;
+  bool blocking_;
 
   unsigned int read_count_, write_count_;
 
+  /* buffered output (if set_buffered_output() was called) */
+  std::unique_ptr<RingBuffer> output_;
+  size_t low_watermark_, high_watermark_;
+  bool accepting_output_;
+  std::function<void(void)> output_watcher_;
+
+  /* after the output buffer changed: track the watermarks, and tell
+     the watcher if output has started or stopped waiting */
+  void output_changed( const bool was_empty );
+
   /* attempt to write a portion of a string */
   std::string::const_iterator write( const std::string::const_iterator & begin,
 				     const std::string::const_iterator & end );
 
+  /* one writev (or 0 if a non-blocking fd's kernel buffer is full) */
+  size_t write_some( const iovec * const runs, const size_t run_count );
+
+  /* write runs in order, through the output buffer if there is one, else
+     all of them (write_all) or as much as one writev takes; returns how
+     many bytes were written or buffered */
+  size_t write_runs( iovec * const runs, const size_t run_count, const bool write_all );
+
   /* maximum size of a read */
   const static size_t BUFFER_SIZE = 1024 * 1024;
 
+  /* most strings one writev() can gather */
+  const static size_t MAX_PIECES = 16;
+
+  /* the io_uring engine reads and writes on the fd's behalf */
+  friend class IOUringLoop;
+
+  /* and so does splice() */
+  friend class SplicePipe;
+
 protected:
   void register_read() { read_count_++; }
   void register_write() { write_count_++; }
   void set_eof() { eof_ = true; }
 
+  /* record that the fd came from the kernel already non-blocking */
+  void register_nonblocking() { blocking_ = false; }
+
 public:
   /* construct from fd number */
   FileDescriptor( const int fd );
@@ -37,13 +73,57 @@ public:
   /* accessors */
   const int & fd_num() const { return fd_; }
   const bool & eof() const { return eof_; }
+  bool blocking() const { return blocking_; }
   unsigned int read_count() const { return read_count_; }
   unsigned int write_count() const { return write_count_; }
 
-  /* read and write methods */
+  /* make reads and writes return at once rather than wait (O_NONBLOCK):
+     with nothing to read, read() returns an empty string (and eof()
+     stays false), and a write stops where the kernel's buffer is full */
+  void set_blocking( const bool blocking );
+
+  /* read and write methods (on a non-blocking fd, a write_all that
+     would block throws, unless the fd has buffered output) */
   std::string read( const size_t limit = BUFFER_SIZE );
   std::string::const_iterator write( const std::string & buffer, const bool write_all = true );
 
+  /* read up to limit bytes straight into buffer's free space (making
+     room for them first); returns how many (0 at EOF, on a non-blocking
+     fd with nothing to read, or without reading if limit is 0) */
+  size_t read_into( RingBuffer & buffer, const size_t limit = 65536 );
+
+  /* write what buffer holds, as much as one writev takes (or all of
+     it, on an fd with buffered output), and take that from its front;
+     returns how many bytes */
+  size_t write_from( RingBuffer & buffer );
+
+  /* write several strings as if joined, without joining them
+     (as write() does with write_all) */
+  void writev( const std::initializer_list< std::reference_wrapper< const std::string > > & pieces );
+
+  /* make the fd non-blocking, with writes that never wait: what the
+     kernel won't take yet is kept in an output buffer, in order, and
+     written out by flush() (as a Poller Out action on the fd does, which
+     is polled only while output is waiting). Writers should hold off
+     while accepting_output() is false: from when the buffer reaches
+     high_watermark bytes until it drains to low_watermark. */
+  void set_buffered_output( const size_t low_watermark, const size_t high_watermark );
+
+  bool buffering() const { return output_ != nullptr; }
+  size_t buffered() const { return output_ ? output_->size() : 0; }
+  bool accepting_output() const { return accepting_output_; }
+
+  /* write what the kernel will take now, after any output already
+     waiting, and buffer the rest */
+  void buffered_write( const std::string & buffer );
+
+  /* write out as much buffered output as the kernel will take (without
+     throwing if it takes none); returns true once none is waiting */
+  bool flush();
+
+  /* for the Poller: called when buffered output starts or stops waiting */
+  void set_output_watcher( const std::function<void(void)> & watcher ) { output_watcher_ = watcher; }
+
   /* forbid copying FileDescriptor objects or assigning them */
   FileDescriptor( const FileDescriptor & other ) = delete;
   const FileDescriptor & operator=( const FileDescriptor & other ) = delete;
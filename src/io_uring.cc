@@ -0,0 +1,856 @@
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_uring.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* raw system calls (glibc has no wrappers) */
+static int io_uring_setup( const unsigned entries, io_uring_params * const params )
+{
+  return syscall( __NR_io_uring_setup, entries, params );
+}
+
+static int io_uring_enter( const int fd, const unsigned to_submit, const unsigned min_complete,
+			   const unsigned flags, const void * const arg, const size_t argsz )
+{
+  return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz );
+}
+
+/* map memory shared with the kernel */
+static void * map_shared( const int fd, const size_t length, const off_t offset )
+{
+  void * const ret = mmap( nullptr, length, PROT_READ | PROT_WRITE,
+			   fd < 0 ? (MAP_PRIVATE | MAP_ANONYMOUS) : (MAP_SHARED | MAP_POPULATE),
+			   fd, offset );
+  if ( ret == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+  return ret;
+}
+
+/* pointer to a field of a mapped ring, given its offset */
+template <typename T> static T * ring_field( void * const ring, const uint32_t offset )
+{
+  return reinterpret_cast<T *>( static_cast<char *>( ring ) + offset );
+}
+
+static io_uring_params zeroed_params()
+{
+  io_uring_params ret;
+  zero( ret );
+  return ret;
+}
+
+IOUring::IOUring( const unsigned entries )
+  : params_( zeroed_params() ),
+    fd_( SystemCall( "io_uring_setup", io_uring_setup( entries, &params_ ) ) ),
+    sq_ring_( nullptr ), sq_ring_size_( 0 ),
+    cq_ring_( nullptr ), cq_ring_size_( 0 ),
+    sqes_( nullptr ), sqes_size_( 0 ),
+    sq_head_( nullptr ), sq_tail_( nullptr ), sq_mask_( 0 ), sq_entries_( 0 ),
+    cq_head_( nullptr ), cq_tail_( nullptr ), cq_mask_( 0 ), cqes_( nullptr ),
+    sqe_tail_( 0 ), submitted_tail_( 0 )
+{
+  if ( not (params_.features & IORING_FEAT_EXT_ARG) ) {
+    throw runtime_error( "io_uring: kernel lacks IORING_FEAT_EXT_ARG (needs Linux 5.11 or later)" );
+  }
+
+  sq_ring_size_ = params_.sq_off.array + params_.sq_entries * sizeof( unsigned );
+  cq_ring_size_ = params_.cq_off.cqes + params_.cq_entries * sizeof( io_uring_cqe );
+
+  if ( params_.features & IORING_FEAT_SINGLE_MMAP ) {
+    sq_ring_size_ = cq_ring_size_ = max( sq_ring_size_, cq_ring_size_ );
+    sq_ring_ = cq_ring_ = map_shared( fd_.fd_num(), sq_ring_size_, IORING_OFF_SQ_RING );
+  } else {
+    sq_ring_ = map_shared( fd_.fd_num(), sq_ring_size_, IORING_OFF_SQ_RING );
+    cq_ring_ = map_shared( fd_.fd_num(), cq_ring_size_, IORING_OFF_CQ_RING );
+  }
+
+  sqes_size_ = params_.sq_entries * sizeof( io_uring_sqe );
+  sqes_ = static_cast<io_uring_sqe *>( map_shared( fd_.fd_num(), sqes_size_, IORING_OFF_SQES ) );
+
+  sq_head_ = ring_field<unsigned>( sq_ring_, params_.sq_off.head );
+  sq_tail_ = ring_field<unsigned>( sq_ring_, params_.sq_off.tail );
+  sq_mask_ = *ring_field<unsigned>( sq_ring_, params_.sq_off.ring_mask );
+  sq_entries_ = *ring_field<unsigned>( sq_ring_, params_.sq_off.ring_entries );
+
+  cq_head_ = ring_field<unsigned>( cq_ring_, params_.cq_off.head );
+  cq_tail_ = ring_field<unsigned>( cq_ring_, params_.cq_off.tail );
+  cq_mask_ = *ring_field<unsigned>( cq_ring_, params_.cq_off.ring_mask );
+  cqes_ = ring_field<io_uring_cqe>( cq_ring_, params_.cq_off.cqes );
+
+  /* submission queue slot i always holds sqe i */
+  unsigned * const sq_array = ring_field<unsigned>( sq_ring_, params_.sq_off.array );
+  for ( unsigned i = 0; i < sq_entries_; i++ ) {
+    sq_array[ i ] = i;
+  }
+
+  sqe_tail_ = submitted_tail_ = *sq_tail_;
+}
+
+IOUring::~IOUring()
+{
+  munmap( sqes_, sqes_size_ );
+  if ( cq_ring_ != sq_ring_ ) {
+    munmap( cq_ring_, cq_ring_size_ );
+  }
+  munmap( sq_ring_, sq_ring_size_ );
+}
+
+/* claim a zeroed submission entry (submitting first if the queue is full) */
+io_uring_sqe & IOUring::get_sqe()
+{
+  if ( sqe_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) >= sq_entries_ ) {
+    submit_and_wait( 0, -1 );
+    if ( sqe_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) >= sq_entries_ ) {
+      throw runtime_error( "io_uring: submission queue full" );
+    }
+  }
+
+  io_uring_sqe & sqe = sqes_[ sqe_tail_ & sq_mask_ ];
+  sqe_tail_++;
+  zero( sqe );
+  return sqe;
+}
+
+/* hand pending submissions to the kernel and wait for completions */
+bool IOUring::submit_and_wait( const unsigned min_complete, const int timeout_ms )
+{
+  const unsigned to_submit = sqe_tail_ - submitted_tail_;
+  __atomic_store_n( sq_tail_, sqe_tail_, __ATOMIC_RELEASE );
+  submitted_tail_ = sqe_tail_;
+
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+  __kernel_timespec timeout;
+  io_uring_getevents_arg arg;
+  zero( timeout );
+  zero( arg );
+
+  const void * arg_ptr = nullptr;
+  size_t arg_size = 0;
+
+  if ( min_complete and timeout_ms >= 0 ) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = reinterpret_cast<uint64_t>( &timeout );
+    arg.sigmask_sz = _NSIG / 8;
+    arg_ptr = &arg;
+    arg_size = sizeof( arg );
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+
+  if ( io_uring_enter( fd_.fd_num(), to_submit, min_complete, flags, arg_ptr, arg_size ) < 0 ) {
+    if ( errno == ETIME ) {
+      return false;
+    }
+    throw unix_error( "io_uring_enter" );
+  }
+
+  return true;
+}
+
+/* take the next completion, if there is one */
+bool IOUring::pop_cqe( io_uring_cqe & cqe )
+{
+  const unsigned head = *cq_head_;
+  if ( head == __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE ) ) {
+    return false;
+  }
+
+  cqe = cqes_[ head & cq_mask_ ];
+  __atomic_store_n( cq_head_, head + 1, __ATOMIC_RELEASE );
+  return true;
+}
+
+/* io_uring_register(2) */
+void IOUring::register_resource( const unsigned opcode, const void * const arg, const unsigned nr_args )
+{
+  SystemCall( "io_uring_register",
+	      syscall( __NR_io_uring_register, fd_.fd_num(), opcode, arg, nr_args ) );
+}
+
+IOUringLoop::ProvidedBuffers::ProvidedBuffers( IOUring & s_io_uring,
+					       const uint16_t s_group_id,
+					       const unsigned s_entries,
+					       const size_t s_buffer_size )
+  : io_uring( s_io_uring ),
+    group_id( s_group_id ),
+    entries( s_entries ),
+    buffer_size( s_buffer_size ),
+    ring( nullptr ),
+    ring_size( s_entries * sizeof( io_uring_buf ) ),
+    storage( s_entries * s_buffer_size ),
+    tail_( 0 )
+{
+  if ( entries == 0 or entries > 32768 or (entries & (entries - 1)) ) {
+    throw runtime_error( "io_uring: provided buffer count must be a power of two up to 32768" );
+  }
+
+  /* the ring itself must be page-aligned */
+  ring = map_shared( -1, ring_size, 0 );
+
+  io_uring_buf_reg registration;
+  zero( registration );
+  registration.ring_addr = reinterpret_cast<uint64_t>( ring );
+  registration.ring_entries = entries;
+  registration.bgid = group_id;
+  io_uring.register_resource( IORING_REGISTER_PBUF_RING, &registration, 1 );
+
+  for ( unsigned i = 0; i < entries; i++ ) {
+    recycle( i );
+  }
+}
+
+IOUringLoop::ProvidedBuffers::~ProvidedBuffers()
+{
+  try {
+    io_uring_buf_reg registration;
+    zero( registration );
+    registration.bgid = group_id;
+    io_uring.register_resource( IORING_UNREGISTER_PBUF_RING, &registration, 1 );
+  } catch ( const exception & e ) { /* don't throw from destructor */
+    print_exception( e );
+  }
+
+  munmap( ring, ring_size );
+}
+
+/* give a buffer (back) to the kernel */
+void IOUringLoop::ProvidedBuffers::recycle( const uint16_t buffer_id )
+{
+  /* index the ring as plain io_uring_bufs (in C++, io_uring_buf_ring's
+     flexible array member isn't guaranteed to sit at offset 0) */
+  io_uring_buf * const bufs = static_cast<io_uring_buf *>( ring );
+  io_uring_buf & buf = bufs[ tail_ & (entries - 1) ];
+  buf.addr = reinterpret_cast<uint64_t>( buffer( buffer_id ) );
+  buf.len = buffer_size;
+  buf.bid = buffer_id;
+  tail_++;
+
+  /* the ring's tail overlays the first entry's resv field */
+  __atomic_store_n( &bufs[ 0 ].resv, tail_, __ATOMIC_RELEASE );
+}
+
+IOUringLoop::Operation::Operation( const Type s_type, FileDescriptor & s_fd )
+  : type( s_type ),
+    fd( s_fd ),
+    datagram_callback(),
+    read_callback(),
+    completion_callback(),
+    callback(),
+    provided_buffers(),
+    msg_template(),
+    buffer_index( -1 ),
+    offset( 0 ),
+    length( 0 ),
+    data(),
+    cancelled( false ),
+    sends_outstanding( 0 ),
+    timeout(),
+    period(),
+    periodic( false ),
+    timer_serial( 0 ),
+    poll_events( 0 )
+{
+  zero( msg_template );
+  zero( timeout );
+  zero( period );
+}
+
+IOUringLoop::IOUringLoop( const unsigned entries,
+			  const size_t registered_buffer_count,
+			  const size_t registered_buffer_size )
+  : ring_( entries ),
+    operations_(),
+    free_operations_(),
+    registered_buffer_size_( registered_buffer_size ),
+    registered_storage_( registered_buffer_count * registered_buffer_size ),
+    free_registered_buffers_(),
+    next_buffer_group_( 0 ),
+    next_timer_serial_( 0 )
+{
+  if ( registered_buffer_count ) {
+    vector<iovec> buffers( registered_buffer_count );
+    for ( size_t i = 0; i < registered_buffer_count; i++ ) {
+      buffers[ i ].iov_base = &registered_storage_[ i * registered_buffer_size_ ];
+      buffers[ i ].iov_len = registered_buffer_size_;
+      free_registered_buffers_.push_back( registered_buffer_count - 1 - i );
+    }
+    ring_.register_resource( IORING_REGISTER_BUFFERS, buffers.data(), buffers.size() );
+  }
+}
+
+size_t IOUringLoop::add_operation( unique_ptr< Operation > && operation )
+{
+  if ( free_operations_.empty() ) {
+    operations_.push_back( move( operation ) );
+    return operations_.size() - 1;
+  }
+
+  const size_t id = free_operations_.back();
+  free_operations_.pop_back();
+  operations_.at( id ) = move( operation );
+  return id;
+}
+
+void IOUringLoop::finish_operation( const size_t id )
+{
+  Operation & operation = *operations_.at( id );
+  if ( operation.buffer_index != size_t( -1 ) ) {
+    free_registered_buffers_.push_back( operation.buffer_index );
+  }
+
+  operations_.at( id ).reset();
+  free_operations_.push_back( id );
+}
+
+/* receive datagrams continuously into kernel-selected buffers */
+void IOUringLoop::recv_multishot( UDPSocket & socket, const DatagramCallback & callback,
+				  const size_t mtu, const unsigned buffer_count )
+{
+  unique_ptr< Operation > operation( new Operation( Operation::Type::RecvMultishot, socket ) );
+  operation->datagram_callback = callback;
+
+  /* each buffer holds io_uring_recvmsg_out, source address, control data, then payload */
+  operation->msg_template.msg_namelen = sizeof( Address::raw );
+  operation->msg_template.msg_controllen = DatagramPool::CONTROL_SIZE;
+
+  const size_t buffer_size = sizeof( io_uring_recvmsg_out ) + sizeof( Address::raw )
+    + DatagramPool::CONTROL_SIZE + mtu;
+  const size_t aligned_buffer_size = (buffer_size + 63) & ~size_t( 63 );
+
+  operation->provided_buffers.reset( new ProvidedBuffers( ring_, next_buffer_group_++,
+							  buffer_count, aligned_buffer_size ) );
+
+  submit_recv( add_operation( move( operation ) ) );
+}
+
+void IOUringLoop::submit_recv( const size_t id )
+{
+  Operation & operation = *operations_.at( id );
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_RECVMSG;
+  sqe.fd = operation.fd.fd_num();
+  sqe.addr = reinterpret_cast<uint64_t>( &operation.msg_template );
+  sqe.ioprio = IORING_RECV_MULTISHOT;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = operation.provided_buffers->group_id;
+  sqe.user_data = id;
+}
+
+/* send the pool's occupied slots */
+void IOUringLoop::send_batch( UDPSocket & socket, DatagramPool & pool, const bool with_addresses,
+			      const CompletionCallback & callback )
+{
+  if ( pool.empty() ) {
+    if ( callback ) {
+      callback();
+    }
+    return;
+  }
+
+  unique_ptr< Operation > operation( new Operation( Operation::Type::SendBatch, socket ) );
+  operation->completion_callback = callback;
+  operation->sends_outstanding = pool.size();
+
+  const size_t id = add_operation( move( operation ) );
+
+  pool.prepare_to_send( with_addresses );
+  for ( size_t i = 0; i < pool.size(); i++ ) {
+    io_uring_sqe & sqe = ring_.get_sqe();
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = socket.fd_num();
+    sqe.addr = reinterpret_cast<uint64_t>( &pool.headers_[ i ].msg_hdr );
+    sqe.user_data = id;
+  }
+}
+
+/* read continuously into a registered buffer */
+void IOUringLoop::read( FileDescriptor & fd, const ReadCallback & callback )
+{
+  if ( free_registered_buffers_.empty() ) {
+    throw runtime_error( "IOUringLoop: no free registered buffers" );
+  }
+
+  unique_ptr< Operation > operation( new Operation( Operation::Type::Read, fd ) );
+  operation->read_callback = callback;
+  operation->buffer_index = free_registered_buffers_.back();
+  free_registered_buffers_.pop_back();
+
+  submit_read( add_operation( move( operation ) ) );
+}
+
+void IOUringLoop::submit_read( const size_t id )
+{
+  Operation & operation = *operations_.at( id );
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_READ_FIXED;
+  sqe.fd = operation.fd.fd_num();
+  sqe.off = -1; /* current position (or none, for pipes and sockets) */
+  sqe.addr = reinterpret_cast<uint64_t>( &registered_storage_[ operation.buffer_index
+							       * registered_buffer_size_ ] );
+  sqe.len = registered_buffer_size_;
+  sqe.buf_index = operation.buffer_index;
+  sqe.user_data = id;
+}
+
+/* write all of data from a registered buffer */
+void IOUringLoop::write( FileDescriptor & fd, const string & data, const CompletionCallback & callback )
+{
+  for ( const auto & other : operations_ ) {
+    if ( other and other->type == Operation::Type::Write and &other->fd == &fd ) {
+      throw runtime_error( "IOUringLoop: write already in progress on this fd" );
+    }
+  }
+
+  if ( free_registered_buffers_.empty() ) {
+    throw runtime_error( "IOUringLoop: no free registered buffers" );
+  }
+
+  unique_ptr< Operation > operation( new Operation( Operation::Type::Write, fd ) );
+  operation->completion_callback = callback;
+  operation->data = data;
+  operation->buffer_index = free_registered_buffers_.back();
+  free_registered_buffers_.pop_back();
+
+  submit_write( add_operation( move( operation ) ) );
+}
+
+void IOUringLoop::submit_write( const size_t id )
+{
+  Operation & operation = *operations_.at( id );
+
+  /* stage the next chunk in the registered buffer */
+  char * const buffer = &registered_storage_[ operation.buffer_index * registered_buffer_size_ ];
+  operation.length = min( operation.data.size() - operation.offset, registered_buffer_size_ );
+  memcpy( buffer, operation.data.data() + operation.offset, operation.length );
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_WRITE_FIXED;
+  sqe.fd = operation.fd.fd_num();
+  sqe.off = -1;
+  sqe.addr = reinterpret_cast<uint64_t>( buffer );
+  sqe.len = operation.length;
+  sqe.buf_index = operation.buffer_index;
+  sqe.user_data = id;
+}
+
+static __kernel_timespec to_kernel_timespec( const uint64_t us )
+{
+  __kernel_timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  return ts;
+}
+
+/* run callback once after delay_us, then every period_us (if nonzero) */
+Poller::TimerID IOUringLoop::add_timer( const uint64_t delay_us,
+					const Poller::Action::CallbackType & callback,
+					const uint64_t period_us )
+{
+  unique_ptr< Operation > operation( new Operation( Operation::Type::Timer, ring_.fd() ) );
+  operation->callback = callback;
+  operation->timeout = to_kernel_timespec( delay_us );
+  operation->period = to_kernel_timespec( period_us );
+  operation->periodic = period_us;
+  operation->timer_serial = next_timer_serial_++;
+
+  const uint32_t serial = operation->timer_serial;
+  const size_t id = add_operation( move( operation ) );
+  submit_timer( id );
+
+  return (Poller::TimerID( serial ) << 32) | id;
+}
+
+void IOUringLoop::submit_timer( const size_t id )
+{
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_TIMEOUT;
+  sqe.addr = reinterpret_cast<uint64_t>( &operations_.at( id )->timeout );
+  sqe.len = 1;
+  sqe.user_data = id;
+}
+
+/* the in-flight timer a TimerID refers to */
+size_t IOUringLoop::find_timer( const Poller::TimerID timer_id ) const
+{
+  const size_t id = timer_id & 0xffffffff;
+  if ( id >= operations_.size() or not operations_[ id ] ) {
+    return -1;
+  }
+
+  const Operation & operation = *operations_[ id ];
+  if ( operation.type != Operation::Type::Timer or operation.cancelled
+       or operation.timer_serial != (timer_id >> 32) ) {
+    return -1;
+  }
+
+  return id;
+}
+
+/* cancel a timer (no effect if it has already fired or been cancelled) */
+void IOUringLoop::cancel_timer( const Poller::TimerID timer_id )
+{
+  const size_t id = find_timer( timer_id );
+  if ( id == size_t( -1 ) ) {
+    return;
+  }
+
+  operations_[ id ]->cancelled = true;
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe.addr = id;
+  sqe.user_data = IGNORED_COMPLETION;
+}
+
+/* restart a pending timer's countdown */
+void IOUringLoop::reset_timer( const Poller::TimerID timer_id, const uint64_t delay_us )
+{
+  const size_t id = find_timer( timer_id );
+  if ( id == size_t( -1 ) ) {
+    throw runtime_error( "IOUringLoop: reset_timer on a timer that is not pending" );
+  }
+
+  Operation & operation = *operations_[ id ];
+  operation.timeout = to_kernel_timespec( delay_us );
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_TIMEOUT_REMOVE;
+  sqe.addr = id;
+  sqe.addr2 = reinterpret_cast<uint64_t>( &operation.timeout );
+  sqe.timeout_flags = IORING_TIMEOUT_UPDATE;
+  sqe.user_data = IGNORED_COMPLETION;
+}
+
+/* submit queued operations and dispatch completions */
+Poller::Result IOUringLoop::loop_once( const int timeout_ms )
+{
+  /* Quit if nothing is in flight */
+  if ( idle() ) {
+    return Poller::Result::Type::Exit;
+  }
+
+  try {
+    ring_.submit_and_wait( 1, timeout_ms );
+  } catch ( unix_error const& e ) {
+    if ( e.code().value() == EINTR ) {
+      return Poller::Result::Type::Exit;
+    }
+    throw;
+  }
+
+  Poller::Result result = Poller::Result::Type::Timeout;
+
+  io_uring_cqe cqe;
+  while ( ring_.pop_cqe( cqe ) ) {
+    result = Poller::Result::Type::Success;
+    if ( complete( cqe, result ) ) {
+      return result;
+    }
+  }
+
+  return result;
+}
+
+/* dispatch one completion; returns true if the loop should exit */
+bool IOUringLoop::complete( const io_uring_cqe & cqe, Poller::Result & result )
+{
+  if ( cqe.user_data == IGNORED_COMPLETION ) {
+    return false;
+  }
+
+  const size_t id = cqe.user_data;
+  if ( id >= operations_.size() or not operations_[ id ] ) {
+    throw runtime_error( "IOUringLoop: completion for unknown operation" );
+  }
+
+  switch ( operations_[ id ]->type ) {
+  case Operation::Type::RecvMultishot:
+    return complete_recv( id, cqe, result );
+  case Operation::Type::Read:
+    return complete_read( id, cqe, result );
+  case Operation::Type::Write:
+    complete_write( id, cqe );
+    return false;
+  case Operation::Type::SendBatch:
+    complete_send( id, cqe );
+    return false;
+  case Operation::Type::Timer:
+    return complete_timer( id, cqe, result );
+  case Operation::Type::Poll:
+    return complete_poll( id, cqe, result );
+  }
+
+  return false;
+}
+
+bool IOUringLoop::complete_recv( const size_t id, const io_uring_cqe & cqe, Poller::Result & result )
+{
+  Operation & operation = *operations_[ id ];
+  ProvidedBuffers & buffers = *operation.provided_buffers;
+  bool exit = false;
+
+  if ( cqe.res < 0 ) {
+    /* ENOBUFS: every buffer was in use; they've been recycled since, so just re-arm */
+    if ( not (-cqe.res == ENOBUFS or (-cqe.res == ECANCELED and operation.cancelled)) ) {
+      throw unix_error( "io_uring recvmsg", -cqe.res );
+    }
+  } else {
+    if ( not (cqe.flags & IORING_CQE_F_BUFFER) ) {
+      throw runtime_error( "io_uring recvmsg: completion without a buffer" );
+    }
+
+    const uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    char * const buffer = buffers.buffer( buffer_id );
+
+    io_uring_recvmsg_out out;
+    memcpy( &out, buffer, sizeof( out ) );
+
+    if ( out.flags & MSG_TRUNC ) {
+      throw runtime_error( "recvfrom (oversized datagram)" );
+    }
+
+    char * const name = buffer + sizeof( out );
+    char * const control = name + operation.msg_template.msg_namelen;
+    char * const payload = control + operation.msg_template.msg_controllen;
+
+    /* view of the datagram in place */
+    msghdr header;
+    zero( header );
+    header.msg_control = control;
+    header.msg_controllen = out.controllen;
+
+    DatagramPool::Datagram datagram( payload );
+    datagram.address = Address( *reinterpret_cast<const sockaddr *>( name ), out.namelen );
+    datagram.timestamp = UDPSocket::received_timestamp( header );
+    datagram.length = out.payloadlen;
+
+    operation.fd.register_read();
+
+    const auto callback_result = operation.cancelled
+      ? CallbackResult( ResultType::Cancel ) : operation.datagram_callback( datagram );
+
+    buffers.recycle( buffer_id );
+
+    switch ( callback_result.result ) {
+    case ResultType::Exit:
+      result = Poller::Result( Poller::Result::Type::Exit, callback_result.exit_status );
+      exit = true;
+      break;
+    case ResultType::Cancel:
+      if ( not operation.cancelled ) {
+	operation.cancelled = true;
+	io_uring_sqe & sqe = ring_.get_sqe();
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.addr = id;
+	sqe.user_data = IGNORED_COMPLETION;
+      }
+      break;
+    case ResultType::Continue:
+      break;
+    }
+  }
+
+  /* the kernel has stopped this receive */
+  if ( not (cqe.flags & IORING_CQE_F_MORE) ) {
+    if ( operation.cancelled ) {
+      finish_operation( id );
+    } else {
+      submit_recv( id );
+    }
+  }
+
+  return exit;
+}
+
+bool IOUringLoop::complete_read( const size_t id, const io_uring_cqe & cqe, Poller::Result & result )
+{
+  Operation & operation = *operations_[ id ];
+
+  if ( cqe.res < 0 ) {
+    throw unix_error( "io_uring read", -cqe.res );
+  }
+
+  if ( cqe.res == 0 ) {
+    operation.fd.set_eof();
+  }
+
+  operation.fd.register_read();
+
+  const auto callback_result
+    = operation.read_callback( &registered_storage_[ operation.buffer_index * registered_buffer_size_ ],
+			       cqe.res );
+
+  if ( operation.fd.eof() or callback_result.result == ResultType::Cancel ) {
+    finish_operation( id );
+  } else {
+    submit_read( id );
+  }
+
+  if ( callback_result.result == ResultType::Exit ) {
+    result = Poller::Result( Poller::Result::Type::Exit, callback_result.exit_status );
+    return true;
+  }
+
+  return false;
+}
+
+void IOUringLoop::complete_write( const size_t id, const io_uring_cqe & cqe )
+{
+  Operation & operation = *operations_[ id ];
+
+  if ( cqe.res < 0 ) {
+    throw unix_error( "io_uring write", -cqe.res );
+  } else if ( cqe.res == 0 ) {
+    throw runtime_error( "write returned 0" );
+  }
+
+  operation.fd.register_write();
+  operation.offset += cqe.res;
+
+  if ( operation.offset < operation.data.size() ) {
+    submit_write( id );
+    return;
+  }
+
+  const CompletionCallback callback = operation.completion_callback;
+  finish_operation( id );
+  if ( callback ) {
+    callback();
+  }
+}
+
+void IOUringLoop::complete_send( const size_t id, const io_uring_cqe & cqe )
+{
+  Operation & operation = *operations_[ id ];
+
+  if ( cqe.res < 0 ) {
+    throw unix_error( "io_uring sendmsg", -cqe.res );
+  }
+
+  if ( --operation.sends_outstanding ) {
+    return;
+  }
+
+  operation.fd.register_write();
+
+  const CompletionCallback callback = operation.completion_callback;
+  finish_operation( id );
+  if ( callback ) {
+    callback();
+  }
+}
+
+bool IOUringLoop::complete_timer( const size_t id, const io_uring_cqe & cqe, Poller::Result & result )
+{
+  Operation & operation = *operations_[ id ];
+
+  /* a timer "fails" with ETIME when it expires */
+  if ( cqe.res < 0 and -cqe.res != ETIME and -cqe.res != ECANCELED ) {
+    throw unix_error( "io_uring timeout", -cqe.res );
+  }
+
+  if ( -cqe.res != ETIME or operation.cancelled ) {
+    finish_operation( id );
+    return false;
+  }
+
+  CallbackResult callback_result = ResultType::Continue;
+
+  if ( operation.periodic ) {
+    /* re-armed (for one period, unless the callback resets it) once the callback returns;
+       until then the operation stays put, even if the callback cancels it */
+    operation.timeout = operation.period;
+    callback_result = operation.callback();
+
+    if ( operation.cancelled or callback_result.result == ResultType::Cancel ) {
+      finish_operation( id );
+    } else {
+      submit_timer( id );
+    }
+  } else {
+    /* the callback may reuse the one-shot's id */
+    const Poller::Action::CallbackType callback = move( operation.callback );
+    finish_operation( id );
+    callback_result = callback();
+  }
+
+  if ( callback_result.result == ResultType::Exit ) {
+    result = Poller::Result( Poller::Result::Type::Exit, callback_result.exit_status );
+    return true;
+  }
+
+  return false;
+}
+
+/* call back whenever fd has any of events */
+void IOUringLoop::poll( FileDescriptor & fd, const short events, const Poller::Action::CallbackType & callback )
+{
+  unique_ptr< Operation > operation( new Operation( Operation::Type::Poll, fd ) );
+  operation->callback = callback;
+  operation->poll_events = events;
+
+  submit_poll( add_operation( move( operation ) ) );
+}
+
+void IOUringLoop::submit_poll( const size_t id )
+{
+  Operation & operation = *operations_.at( id );
+
+  io_uring_sqe & sqe = ring_.get_sqe();
+  sqe.opcode = IORING_OP_POLL_ADD;
+  sqe.fd = operation.fd.fd_num();
+  sqe.poll32_events = operation.poll_events;
+  sqe.len = IORING_POLL_ADD_MULTI;
+  sqe.user_data = id;
+}
+
+bool IOUringLoop::complete_poll( const size_t id, const io_uring_cqe & cqe, Poller::Result & result )
+{
+  Operation & operation = *operations_[ id ];
+
+  if ( cqe.res < 0 and not (-cqe.res == ECANCELED and operation.cancelled) ) {
+    throw unix_error( "io_uring poll", -cqe.res );
+  }
+
+  CallbackResult callback_result = ResultType::Continue;
+  if ( cqe.res >= 0 and not operation.cancelled ) {
+    callback_result = operation.callback();
+  }
+
+  if ( callback_result.result == ResultType::Cancel ) {
+    operation.cancelled = true;
+    io_uring_sqe & sqe = ring_.get_sqe();
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.addr = id;
+    sqe.user_data = IGNORED_COMPLETION;
+  }
+
+  /* the kernel has stopped this poll */
+  if ( not (cqe.flags & IORING_CQE_F_MORE) ) {
+    if ( operation.cancelled ) {
+      finish_operation( id );
+    } else {
+      submit_poll( id );
+    }
+  }
+
+  if ( callback_result.result == ResultType::Exit ) {
+    result = Poller::Result( Poller::Result::Type::Exit, callback_result.exit_status );
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,223 @@
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "file_descriptor.hh"
+#include "datagram_pool.hh"
+#include "poller.hh"
+#include "socket.hh"
+
+/* submission and completion queues shared with the kernel (raw io_uring) */
+class IOUring
+{
+private:
+  io_uring_params params_;
+  FileDescriptor fd_;
+
+  /* memory mapped from the kernel */
+  void * sq_ring_;
+  size_t sq_ring_size_;
+  void * cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe * sqes_;
+  size_t sqes_size_;
+
+  /* pointers into the mapped rings */
+  unsigned * sq_head_, * sq_tail_;
+  unsigned sq_mask_, sq_entries_;
+  unsigned * cq_head_, * cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe * cqes_;
+
+  /* submission entries filled in but not yet handed to the kernel */
+  unsigned sqe_tail_, submitted_tail_;
+
+public:
+  IOUring( const unsigned entries );
+  ~IOUring();
+
+  /* accessors */
+  const FileDescriptor & fd() const { return fd_; }
+  FileDescriptor & fd() { return fd_; }
+  uint32_t features() const { return params_.features; }
+
+  /* claim a zeroed submission entry (submitting first if the queue is full) */
+  io_uring_sqe & get_sqe();
+
+  /* hand pending submissions to the kernel and wait for min_complete completions
+     (up to timeout_ms, or forever if negative); returns false on timeout */
+  bool submit_and_wait( const unsigned min_complete, const int timeout_ms );
+
+  /* take the next completion, if there is one */
+  bool pop_cqe( io_uring_cqe & cqe );
+
+  /* io_uring_register(2) */
+  void register_resource( const unsigned opcode, const void * const arg, const unsigned nr_args );
+
+  /* forbid copying IOUring objects or assigning them */
+  IOUring( const IOUring & other ) = delete;
+  const IOUring & operator=( const IOUring & other ) = delete;
+};
+
+/* completion-driven event loop built on io_uring that can stand in for Poller:
+   operations are queued, then one io_uring_enter per call to loop_once()
+   submits them all and reaps every completion */
+class IOUringLoop
+{
+public:
+  typedef Poller::Action::Result CallbackResult;
+  typedef std::function<CallbackResult( const DatagramPool::Datagram & )> DatagramCallback;
+  typedef std::function<CallbackResult( const char * const data, const size_t length )> ReadCallback;
+  typedef std::function<void(void)> CompletionCallback;
+
+private:
+  /* kernel-owned receive buffers for one multishot receive */
+  struct ProvidedBuffers
+  {
+    IOUring & io_uring;
+    uint16_t group_id;
+    unsigned entries;
+    size_t buffer_size;
+    void * ring;
+    size_t ring_size;
+    std::vector<char> storage;
+
+    ProvidedBuffers( IOUring & s_io_uring, const uint16_t s_group_id,
+		     const unsigned s_entries, const size_t s_buffer_size );
+    ~ProvidedBuffers();
+
+    /* give a buffer (back) to the kernel */
+    void recycle( const uint16_t buffer_id );
+    char * buffer( const uint16_t buffer_id ) { return &storage[ buffer_id * buffer_size ]; }
+
+    ProvidedBuffers( const ProvidedBuffers & other ) = delete;
+    const ProvidedBuffers & operator=( const ProvidedBuffers & other ) = delete;
+
+  private:
+    uint16_t tail_;
+  };
+
+  struct Operation
+  {
+    enum class Type { RecvMultishot, Read, Write, SendBatch, Timer, Poll } type;
+    FileDescriptor & fd;
+
+    DatagramCallback datagram_callback;
+    ReadCallback read_callback;
+    CompletionCallback completion_callback;
+    Poller::Action::CallbackType callback; /* Timer and Poll */
+
+    /* RecvMultishot */
+    std::unique_ptr<ProvidedBuffers> provided_buffers;
+    msghdr msg_template;
+
+    /* Read and Write (registered buffer and progress through it) */
+    size_t buffer_index;
+    size_t offset, length;
+    std::string data;
+
+    /* RecvMultishot, Timer or Poll after being cancelled */
+    bool cancelled;
+
+    /* SendBatch */
+    size_t sends_outstanding;
+
+    /* Timer (the serial number distinguishes reuses of the same operation id) */
+    __kernel_timespec timeout, period;
+    bool periodic;
+    uint32_t timer_serial;
+
+    /* Poll */
+    short poll_events;
+
+    Operation( const Type s_type, FileDescriptor & s_fd );
+  };
+
+  /* user_data for submissions whose completions need no handling */
+  const static uint64_t IGNORED_COMPLETION = -1;
+
+  IOUring ring_;
+
+  /* operations in flight, indexed by the sqe's user_data */
+  std::vector< std::unique_ptr< Operation > > operations_;
+  std::vector< size_t > free_operations_;
+
+  /* registered (fixed) buffers for read and write */
+  size_t registered_buffer_size_;
+  std::vector< char > registered_storage_;
+  std::vector< size_t > free_registered_buffers_;
+
+  uint16_t next_buffer_group_;
+  uint32_t next_timer_serial_;
+
+  size_t add_operation( std::unique_ptr< Operation > && operation );
+  void finish_operation( const size_t id );
+
+  void submit_recv( const size_t id );
+  void submit_read( const size_t id );
+  void submit_write( const size_t id );
+
+  /* returns true if the loop should exit */
+  bool complete( const io_uring_cqe & cqe, Poller::Result & result );
+  bool complete_recv( const size_t id, const io_uring_cqe & cqe, Poller::Result & result );
+  bool complete_read( const size_t id, const io_uring_cqe & cqe, Poller::Result & result );
+  void complete_write( const size_t id, const io_uring_cqe & cqe );
+  void complete_send( const size_t id, const io_uring_cqe & cqe );
+  void submit_timer( const size_t id );
+  bool complete_timer( const size_t id, const io_uring_cqe & cqe, Poller::Result & result );
+  void submit_poll( const size_t id );
+  bool complete_poll( const size_t id, const io_uring_cqe & cqe, Poller::Result & result );
+
+  /* the in-flight timer a TimerID refers to, or size_t( -1 ) */
+  size_t find_timer( const Poller::TimerID id ) const;
+
+public:
+  IOUringLoop( const unsigned entries = 1024,
+	       const size_t registered_buffer_count = 16,
+	       const size_t registered_buffer_size = 65536 );
+
+  /* receive datagrams continuously (multishot recvmsg into kernel-selected buffers)
+     until the callback returns Exit or Cancel */
+  void recv_multishot( UDPSocket & socket, const DatagramCallback & callback,
+		       const size_t mtu = 2048, const unsigned buffer_count = 256 );
+
+  /* send the pool's occupied slots (to their addresses, or to the connected address);
+     the pool must not be touched until the completion callback runs */
+  void send_batch( UDPSocket & socket, DatagramPool & pool, const bool with_addresses,
+		   const CompletionCallback & callback = nullptr );
+
+  /* read continuously into a registered buffer until the callback returns Exit or Cancel
+     (or EOF, which is delivered as a zero-length read) */
+  void read( FileDescriptor & fd, const ReadCallback & callback );
+
+  /* write all of data from a registered buffer (one write per fd at a time) */
+  void write( FileDescriptor & fd, const std::string & data,
+	      const CompletionCallback & callback = nullptr );
+
+  /* call back whenever fd has any of events (a multishot poll, e.g. for POLLERR
+     alongside operations that don't report readiness) until the callback
+     returns Exit or Cancel */
+  void poll( FileDescriptor & fd, const short events, const Poller::Action::CallbackType & callback );
+
+  /* run callback once after delay_us, then every period_us (if nonzero)
+     until it returns Cancel or the timer is cancelled (same contract as Poller) */
+  Poller::TimerID add_timer( const uint64_t delay_us,
+			     const Poller::Action::CallbackType & callback,
+			     const uint64_t period_us = 0 );
+  void cancel_timer( const Poller::TimerID id );
+  void reset_timer( const Poller::TimerID id, const uint64_t delay_us );
+
+  /* submit queued operations and dispatch completions (waiting up to timeout_ms for one) */
+  Poller::Result loop_once( const int timeout_ms );
+
+  /* is anything still in flight? */
+  bool idle() const { return free_operations_.size() == operations_.size(); }
+};
+
+#endif /* IO_URING_HH */
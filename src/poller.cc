@@ -1,6 +1,11 @@
 #include <algorithm>
 #include <cassert>
-#include <numeric>
+
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "poller.hh"
 #include "util.hh"
@@ -8,40 +13,240 @@
 using namespace std;
 using namespace PollerShortNames;
 
-void Poller::add_action( Poller::Action action )
+/* nanoseconds per microsecond and per second */
+static const uint64_t THOUSAND = 1000;
+static const uint64_t BILLION = 1000 * 1000 * 1000;
+
+/* stand-in action for the timerfd in the Poll backend's pollfds */
+static const Poller::ActionID TIMER_ACTION = -1;
+
+/* timers run on CLOCK_MONOTONIC (absolute nanoseconds) */
+static uint64_t monotonic_ns()
+{
+  timespec now;
+  SystemCall( "clock_gettime", clock_gettime( CLOCK_MONOTONIC, &now ) );
+  return now.tv_sec * BILLION + now.tv_nsec;
+}
+
+Poller::Poller( const Backend backend )
+  : backend_( backend ),
+    actions_(),
+    free_ids_(),
+    retired_actions_(),
+    pollfds_(),
+    pollfd_actions_(),
+    error_fds_(),
+    in_fds_(),
+    out_fds_(),
+    epoll_fd_( backend == Backend::Epoll
+	       ? SystemCall( "epoll_create1", epoll_create1( EPOLL_CLOEXEC ) )
+	       : -1 ),
+    registrations_(),
+    self_( new Poller * ( this ) ),
+    dynamic_actions_(),
+    dirty_fds_(),
+    armed_fds_( 0 ),
+    timer_fd_( SystemCall( "timerfd_create",
+			   timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) ),
+    timers_(),
+    free_timers_(),
+    timer_heap_(),
+    pending_timers_( 0 ),
+    armed_deadline_ns_( 0 )
+{
+  if ( backend_ == Backend::Epoll ) {
+    epoll_event event;
+    zero( event );
+    event.events = EPOLLIN;
+    event.data.fd = timer_fd_.fd_num();
+    SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, timer_fd_.fd_num(), &event ) );
+  }
+}
+
+Poller::ActionID Poller::add_action( Poller::Action action )
 {
-  actions_.push_back( action );
-  pollfds_.push_back( { action.fd.fd_num(), 0, 0 } );
+  ActionID id;
+  if ( free_ids_.empty() ) {
+    id = actions_.size();
+    actions_.emplace_back( new Action( action ) );
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+    actions_.at( id ).reset( new Action( action ) );
+  }
+
+  if ( backend_ == Backend::Epoll ) {
+    const int fd = action.fd.fd_num();
+    if ( registrations_.size() <= size_t( fd ) ) {
+      registrations_.resize( fd + 1 );
+    }
+
+    ActionID & slot = registrations_[ fd ].action( action.direction );
+    if ( slot != Registration::NONE ) {
+      throw runtime_error( "Poller: fd already has an action in that direction" );
+    }
+    slot = id;
+
+    if ( action.when_interested ) {
+      dynamic_actions_.push_back( id );
+    }
+
+    /* buffered output can start waiting outside the action's callback */
+    if ( action.direction == Direction::Out ) {
+      const weak_ptr< Poller * > poller = self_;
+      action.fd.set_output_watcher( [poller, fd] () {
+	  const shared_ptr< Poller * > live = poller.lock();
+	  if ( live ) {
+	    (*live)->mark_dirty( fd );
+	  }
+	} );
+    }
+
+    mark_dirty( fd );
+  }
+
+  return id;
+}
+
+/* remove an action (must be called before the action's fd is destroyed) */
+void Poller::remove_action( const ActionID id )
+{
+  if ( id >= actions_.size() or not actions_[ id ] ) {
+    throw runtime_error( "Poller: no such action" );
+  }
+
+  if ( backend_ == Backend::Epoll ) {
+    const int fd = actions_[ id ]->fd.fd_num();
+    Registration & registration = registrations_.at( fd );
+    registration.action( actions_[ id ]->direction ) = Registration::NONE;
+
+    dynamic_actions_.erase( remove( dynamic_actions_.begin(), dynamic_actions_.end(), id ),
+			    dynamic_actions_.end() );
+
+    if ( actions_[ id ]->direction == Direction::Out ) {
+      actions_[ id ]->fd.set_output_watcher( nullptr );
+    }
+
+    /* with no actions left, unregister now: once the fd is closed, its
+       number can come back from accept() before the next poll */
+    if ( registration.in == Registration::NONE and registration.out == Registration::NONE
+	 and registration.error == Registration::NONE and registration.registered ) {
+      if ( epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd, nullptr ) < 0
+	   and errno != EBADF and errno != ENOENT ) {
+	throw unix_error( "epoll_ctl" );
+      }
+      registration.registered = false;
+    }
+
+    mark_dirty( fd );
+  }
+
+  /* the action may be the one whose callback is running, so keep it alive until the next poll */
+  retired_actions_.push_back( move( actions_[ id ] ) );
+  free_ids_.push_back( id );
 }
 
 unsigned int Poller::Action::service_count() const
 {
-  return direction == Direction::In ? fd.read_count() : fd.write_count();
+  return direction == Direction::Out ? fd.write_count() : fd.read_count();
+}
+
+/* should the fd be polled for this action right now? */
+bool Poller::Action::interested() const
+{
+  if ( not active ) {
+    return false;
+  }
+
+  /* don't poll in on fds that have had EOF */
+  if ( direction == Direction::In and fd.eof() ) {
+    return false;
+  }
+
+  /* don't poll out on fds with buffered output while none is waiting */
+  if ( direction == Direction::Out and fd.buffering() and fd.buffered() == 0 ) {
+    return false;
+  }
+
+  return when_interested ? when_interested() : true;
+}
+
+/* run an action's callback; returns true if the poller should exit */
+bool Poller::dispatch( const ActionID id, Result & result )
+{
+  Action * const action = actions_.at( id ).get();
+  assert( action );
+
+  const auto count_before = action->service_count();
+  const auto callback_result = action->callback();
+
+  const bool removed = actions_.at( id ).get() != action;
+
+  if ( not removed and count_before == action->service_count() ) {
+    throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+  }
+
+  switch ( callback_result.result ) {
+  case ResultType::Exit:
+    result = Result( Result::Type::Exit, callback_result.exit_status );
+    return true;
+  case ResultType::Cancel:
+    action->active = false;
+  case ResultType::Continue:
+    break;
+  }
+
+  if ( backend_ == Backend::Epoll and not removed ) {
+    mark_dirty( action->fd.fd_num() );
+  }
+
+  return false;
 }
 
 Poller::Result Poller::poll( const int & timeout_ms )
 {
-  assert( pollfds_.size() == actions_.size() );
+  retired_actions_.clear();
 
+  return backend_ == Backend::Epoll
+    ? poll_with_epoll( timeout_ms ) : poll_with_poll( timeout_ms );
+}
+
+Poller::Result Poller::poll_with_poll( const int & timeout_ms )
+{
   /* tell poll whether we care about each fd */
-  for ( unsigned int i = 0; i < actions_.size(); i++ ) {
-    assert( pollfds_.at( i ).fd == actions_.at( i ).fd.fd_num() );
-    pollfds_.at( i ).events = (actions_.at( i ).active and actions_.at( i ).when_interested())
-      ? actions_.at( i ).direction : 0;
+  pollfds_.clear();
+  pollfd_actions_.clear();
+  error_fds_.clear();
+  in_fds_.clear();
+  out_fds_.clear();
 
-    /* don't poll in on fds that have had EOF */
-    if ( actions_.at( i ).direction == Direction::In
-	 and actions_.at( i ).fd.eof() ) {
-      pollfds_.at( i ).events = 0;
+  /* an fd is polled only for the actions interested in it (even with no
+     events, poll reports a hang-up, which nothing would then handle) */
+  for ( ActionID id = 0; id < actions_.size(); id++ ) {
+    if ( not actions_[ id ] or not actions_[ id ]->interested() ) {
+      continue;
     }
+
+    const Action & action = *actions_[ id ];
+    const int fd = action.fd.fd_num();
+    ( action.direction == Direction::In ? in_fds_
+      : action.direction == Direction::Out ? out_fds_ : error_fds_ ).push_back( fd );
+
+    pollfds_.push_back( { fd, action.direction, 0 } );
+    pollfd_actions_.push_back( id );
   }
 
-  /* Quit if no member in pollfds_ has a non-zero direction */
-  if ( not accumulate( pollfds_.begin(), pollfds_.end(), false,
-		       [] ( bool acc, pollfd x ) { return acc or x.events; } ) ) {
+  /* Quit if no action is interested and no timer is pending */
+  if ( pollfds_.empty() and pending_timers_ == 0 ) {
     return Result::Type::Exit;
   }
 
+  if ( pending_timers_ ) {
+    arm_timer_fd();
+    pollfds_.push_back( { timer_fd_.fd_num(), POLLIN, 0 } );
+    pollfd_actions_.push_back( TIMER_ACTION );
+  }
+
   try {
     if ( 0 == SystemCall( "poll", ::poll( &pollfds_[ 0 ], pollfds_.size(), timeout_ms ) ) ) {
       return Result::Type::Timeout;
@@ -50,33 +255,384 @@ Poller::Result Poller::poll( const int & timeout_ms )
     if ( e.code().value() == EINTR ) {
       return Result::Type::Exit;
     }
+    throw;
   }
 
   for ( unsigned int i = 0; i < pollfds_.size(); i++ ) {
-    if ( pollfds_[ i ].revents & (POLLERR | POLLHUP | POLLNVAL) ) {
+    if ( pollfds_[ i ].revents & POLLNVAL ) {
       return Result::Type::Exit;
     }
 
-    if ( pollfds_[ i ].revents & pollfds_[ i ].events ) {
-      /* we only want to call callback if revents includes
-	 the event we asked for */
-      const auto count_before = actions_.at( i ).service_count();
-      auto result = actions_.at( i ).callback();
+    /* a hang-up, or an error on an fd without an Error action, is for
+       one of the fd's actions to see when it reads or writes */
+    const int fd = pollfds_[ i ].fd;
+    const auto polled_for = [fd] ( const vector< int > & fds ) {
+      return find( fds.begin(), fds.end(), fd ) != fds.end();
+    };
+    if ( (pollfds_[ i ].revents & POLLHUP)
+	 or ((pollfds_[ i ].revents & POLLERR) and not polled_for( error_fds_ )) ) {
+      const short handler = polled_for( in_fds_ ) ? POLLIN : polled_for( out_fds_ ) ? POLLOUT : POLLERR;
+      if ( pollfds_[ i ].events == handler ) {
+	pollfds_[ i ].revents |= handler;
+      }
+    }
 
-      if ( count_before == actions_.at( i ).service_count() ) {
-	throw runtime_error( "Poller: busy wait detected: callback did not read/write fd" );
+    if ( pollfd_actions_[ i ] == TIMER_ACTION ) {
+      Result result = Result::Type::Success;
+      if ( (pollfds_[ i ].revents & POLLIN) and run_timers( result ) ) {
+	return result;
       }
+      continue;
+    }
 
-      switch ( result.result ) {
-      case ResultType::Exit:
-	return Result( Result::Type::Exit, result.exit_status );
-      case ResultType::Cancel:
-	actions_.at( i ).active = false;
-      case ResultType::Continue:
-	break;
+    /* we only want to call callback if revents includes the event we
+       asked for (and the action is still there, and an earlier callback
+       hasn't drained its buffered output) */
+    if ( (pollfds_[ i ].revents & pollfds_[ i ].events)
+	 and actions_.at( pollfd_actions_[ i ] )
+	 and not (pollfds_[ i ].events == POLLOUT and actions_[ pollfd_actions_[ i ] ]->fd.buffering()
+		  and actions_[ pollfd_actions_[ i ] ]->fd.buffered() == 0) ) {
+      Result result = Result::Type::Success;
+      if ( dispatch( pollfd_actions_[ i ], result ) ) {
+	return result;
       }
     }
   }
 
   return Result::Type::Success;
 }
+
+/* Epoll backend: note that an fd's interest may have changed */
+void Poller::mark_dirty( const int fd )
+{
+  Registration & registration = registrations_.at( fd );
+  if ( not registration.dirty ) {
+    registration.dirty = true;
+    dirty_fds_.push_back( fd );
+  }
+}
+
+/* Epoll backend: tell the kernel about fds whose interest has changed */
+void Poller::update_registrations()
+{
+  for ( const int fd : dirty_fds_ ) {
+    Registration & registration = registrations_[ fd ];
+    registration.dirty = false;
+
+    uint32_t events = 0;
+    if ( registration.in != Registration::NONE and actions_[ registration.in ]->interested() ) {
+      events |= EPOLLIN;
+    }
+    if ( registration.out != Registration::NONE and actions_[ registration.out ]->interested() ) {
+      events |= EPOLLOUT;
+    }
+    /* the kernel always reports errors; this just records that they're wanted */
+    if ( registration.error != Registration::NONE and actions_[ registration.error ]->interested() ) {
+      events |= EPOLLERR;
+    }
+
+    epoll_event event;
+    zero( event );
+    event.events = events;
+    event.data.fd = fd;
+
+    if ( registration.in == Registration::NONE and registration.out == Registration::NONE
+	 and registration.error == Registration::NONE ) {
+      /* no actions left on this fd */
+      if ( registration.registered ) {
+	/* the fd may already have been closed (which unregisters it) */
+	if ( epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd, nullptr ) < 0
+	     and errno != EBADF and errno != ENOENT ) {
+	  throw unix_error( "epoll_ctl" );
+	}
+	registration.registered = false;
+      }
+      events = 0;
+    } else if ( events == 0 ) {
+      /* nothing wants the fd now: leave it out of the set (even with no
+	 events, epoll reports a hang-up, which nothing would then handle) */
+      if ( registration.registered ) {
+	SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_DEL, fd, nullptr ) );
+	registration.registered = false;
+      }
+    } else if ( not registration.registered ) {
+      SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_ADD, fd, &event ) );
+      registration.registered = true;
+    } else if ( events != registration.events ) {
+      SystemCall( "epoll_ctl", epoll_ctl( epoll_fd_.fd_num(), EPOLL_CTL_MOD, fd, &event ) );
+    }
+
+    if ( bool( events ) != bool( registration.events ) ) {
+      events ? armed_fds_++ : armed_fds_--;
+    }
+    registration.events = events;
+  }
+
+  dirty_fds_.clear();
+}
+
+Poller::Result Poller::poll_with_epoll( const int & timeout_ms )
+{
+  /* only actions with a when_interested predicate need to be asked again */
+  for ( const ActionID id : dynamic_actions_ ) {
+    mark_dirty( actions_[ id ]->fd.fd_num() );
+  }
+
+  update_registrations();
+
+  /* Quit if no fd is armed for any direction and no timer is pending */
+  if ( armed_fds_ == 0 and pending_timers_ == 0 ) {
+    return Result::Type::Exit;
+  }
+
+  arm_timer_fd();
+
+  const static int MAX_EVENTS = 256;
+  epoll_event events[ MAX_EVENTS ];
+
+  int event_count;
+  try {
+    event_count = SystemCall( "epoll_wait",
+			      epoll_wait( epoll_fd_.fd_num(), events, MAX_EVENTS, timeout_ms ) );
+  } catch ( unix_error const& e ) {
+    if ( e.code().value() == EINTR ) {
+      return Result::Type::Exit;
+    }
+    throw;
+  }
+
+  if ( event_count == 0 ) {
+    return Result::Type::Timeout;
+  }
+
+  for ( int i = 0; i < event_count; i++ ) {
+    const int fd = events[ i ].data.fd;
+
+    if ( fd == timer_fd_.fd_num() ) {
+      Result result = Result::Type::Success;
+      if ( run_timers( result ) ) {
+	return result;
+      }
+      continue;
+    }
+
+    /* a hang-up, or an error on an fd without an Error action, is for
+       one of the fd's actions to see when it reads or writes */
+    const uint32_t wanted = registrations_.at( fd ).events;
+    if ( (events[ i ].events & EPOLLHUP)
+	 or ((events[ i ].events & EPOLLERR) and not (wanted & EPOLLERR)) ) {
+      events[ i ].events |= (wanted & EPOLLIN) ? EPOLLIN : (wanted & EPOLLOUT) ? EPOLLOUT : EPOLLERR;
+    }
+
+    /* re-read the registration before each callback, since callbacks can
+       add and remove actions */
+    for ( const uint32_t direction : { uint32_t( EPOLLERR ), uint32_t( EPOLLIN ), uint32_t( EPOLLOUT ) } ) {
+      Registration & registration = registrations_.at( fd );
+      const ActionID id = registration.action( Direction( direction ) ); /* same bits as poll's */
+
+      /* an earlier callback may have changed this action's interest
+	 since the kernel was told */
+      if ( (events[ i ].events & direction)
+	   and (registration.events & direction)
+	   and id != Registration::NONE
+	   and (not registration.dirty or actions_[ id ]->interested()) ) {
+	Result result = Result::Type::Success;
+	if ( dispatch( id, result ) ) {
+	  return result;
+	}
+      }
+    }
+  }
+
+  return Result::Type::Success;
+}
+
+/* run callback once after delay_us, then every period_us (if nonzero) */
+Poller::TimerID Poller::add_timer( const uint64_t delay_us,
+				   const Action::CallbackType & callback,
+				   const uint64_t period_us )
+{
+  size_t slot;
+  if ( free_timers_.empty() ) {
+    slot = timers_.size();
+    timers_.emplace_back();
+  } else {
+    slot = free_timers_.back();
+    free_timers_.pop_back();
+  }
+
+  Timer & timer = timers_[ slot ];
+  timer.deadline_ns = monotonic_ns() + delay_us * THOUSAND;
+  timer.period_ns = period_us * THOUSAND;
+  timer.callback = callback;
+  timer.pending = true;
+  pending_timers_++;
+
+  push_deadline( slot );
+
+  return (TimerID( timer.generation ) << 32) | slot;
+}
+
+/* the timer a TimerID refers to, or nullptr if it has fired or been cancelled */
+Poller::Timer * Poller::find_timer( const TimerID id )
+{
+  const size_t slot = id & 0xffffffff;
+  if ( slot >= timers_.size() ) {
+    return nullptr;
+  }
+
+  Timer & timer = timers_[ slot ];
+  if ( not timer.pending or timer.generation != (id >> 32) ) {
+    return nullptr;
+  }
+
+  return &timer;
+}
+
+void Poller::release_timer( const size_t slot )
+{
+  Timer & timer = timers_[ slot ];
+  timer.pending = false;
+  timer.generation++;
+  timer.callback = nullptr;
+  free_timers_.push_back( slot );
+  pending_timers_--;
+}
+
+/* give the slot a new heap entry (which makes any older one stale) */
+void Poller::push_deadline( const size_t slot )
+{
+  Timer & timer = timers_[ slot ];
+  timer_heap_.push_back( { timer.deadline_ns, slot, ++timer.sequence } );
+  push_heap( timer_heap_.begin(), timer_heap_.end(), greater<TimerDeadline>() );
+}
+
+/* cancel a timer (no effect if it has already fired or been cancelled) */
+void Poller::cancel_timer( const TimerID id )
+{
+  if ( find_timer( id ) ) {
+    /* its heap entry goes stale and is discarded when it reaches the top */
+    release_timer( id & 0xffffffff );
+  }
+}
+
+/* restart a pending timer's countdown */
+void Poller::reset_timer( const TimerID id, const uint64_t delay_us )
+{
+  Timer * const timer = find_timer( id );
+  if ( not timer ) {
+    throw runtime_error( "Poller: reset_timer on a timer that is not pending" );
+  }
+
+  const uint64_t old_deadline = timer->deadline_ns;
+  timer->deadline_ns = monotonic_ns() + delay_us * THOUSAND;
+
+  /* a later deadline is picked up when the old heap entry reaches the top
+     (an earlier one replaces it) */
+  if ( timer->deadline_ns < old_deadline ) {
+    push_deadline( id & 0xffffffff );
+  }
+}
+
+/* point the timerfd at the earliest pending deadline */
+void Poller::arm_timer_fd()
+{
+  /* discard heap entries for timers that were cancelled or moved earlier,
+     and requeue those for timers moved later */
+  while ( not timer_heap_.empty() ) {
+    const TimerDeadline & top = timer_heap_.front();
+    const Timer & timer = timers_[ top.slot ];
+
+    const bool live = timer.pending and timer.sequence == top.sequence;
+    if ( live and timer.deadline_ns == top.deadline_ns ) {
+      break;
+    }
+
+    const size_t slot = top.slot;
+    pop_heap( timer_heap_.begin(), timer_heap_.end(), greater<TimerDeadline>() );
+    timer_heap_.pop_back();
+
+    if ( live ) { /* moved later */
+      push_deadline( slot );
+    }
+  }
+
+  const uint64_t deadline_ns = timer_heap_.empty() ? 0 : timer_heap_.front().deadline_ns;
+  if ( deadline_ns == armed_deadline_ns_ ) {
+    return;
+  }
+
+  /* a zero it_value disarms the timerfd */
+  itimerspec setting;
+  zero( setting );
+  setting.it_value.tv_sec = deadline_ns / BILLION;
+  setting.it_value.tv_nsec = deadline_ns % BILLION;
+  SystemCall( "timerfd_settime",
+	      timerfd_settime( timer_fd_.fd_num(), TFD_TIMER_ABSTIME, &setting, nullptr ) );
+  armed_deadline_ns_ = deadline_ns;
+}
+
+/* run every timer that is due; returns true if the poller should exit */
+bool Poller::run_timers( Result & result )
+{
+  /* clear the expiration count (a re-arm since the poll may already have) */
+  uint64_t expirations;
+  if ( ::read( timer_fd_.fd_num(), &expirations, sizeof( expirations ) ) < 0
+       and errno != EAGAIN ) {
+    throw unix_error( "read" );
+  }
+  armed_deadline_ns_ = 0;
+
+  const uint64_t now = monotonic_ns();
+
+  while ( not timer_heap_.empty() and timer_heap_.front().deadline_ns <= now ) {
+    const TimerDeadline due = timer_heap_.front();
+    pop_heap( timer_heap_.begin(), timer_heap_.end(), greater<TimerDeadline>() );
+    timer_heap_.pop_back();
+
+    Timer & timer = timers_[ due.slot ];
+    if ( not timer.pending or timer.sequence != due.sequence ) {
+      continue; /* cancelled, or replaced by an earlier deadline */
+    }
+
+    if ( timer.deadline_ns != due.deadline_ns ) {
+      push_deadline( due.slot ); /* reset to a later deadline */
+      continue;
+    }
+
+    /* take the callback out of the slot, which the callback itself may reuse */
+    Action::CallbackType callback = move( timer.callback );
+    const bool periodic = timer.period_ns;
+    const TimerID id = (TimerID( timer.generation ) << 32) | due.slot;
+
+    if ( periodic ) {
+      /* skip any periods that were missed entirely */
+      timer.deadline_ns += timer.period_ns;
+      if ( timer.deadline_ns <= now ) {
+	timer.deadline_ns = now + timer.period_ns;
+      }
+      push_deadline( due.slot );
+    } else {
+      release_timer( due.slot );
+    }
+
+    const auto callback_result = callback();
+
+    if ( periodic ) {
+      if ( find_timer( id ) ) {
+	if ( callback_result.result == ResultType::Cancel ) {
+	  release_timer( due.slot );
+	} else {
+	  timers_[ due.slot ].callback = move( callback );
+	}
+      }
+    }
+
+    if ( callback_result.result == ResultType::Exit ) {
+      result = Result( Result::Type::Exit, callback_result.exit_status );
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -2,6 +2,7 @@
 #define POLLER_HH
 
 #include <functional>
+#include <memory>
 #include <vector>
 
 #include <poll.h>
@@ -24,26 +25,38 @@ public:
     typedef std::function<Result(void)> CallbackType;
 
     FileDescriptor & fd;
-    enum PollDirection : short { In = POLLIN, Out = POLLOUT } direction;
+    /* Error: the fd has a pending error or error-queue entry (e.g. a transmit
+       timestamp or a zerocopy completion). A hang-up, or an error on an fd
+       with no Error action, goes to the fd's In action (whose read sees the
+       EOF or error), or if it isn't polling in, to its Out action (whose
+       write fails), or else to its Error action. It never ends the poll. */
+    enum PollDirection : short { In = POLLIN, Out = POLLOUT, Error = POLLERR } direction;
     CallbackType callback;
-    std::function<bool(void)> when_interested;
+    std::function<bool(void)> when_interested; /* empty means "always" */
     bool active;
 
     Action( FileDescriptor & s_fd,
 	    const PollDirection & s_direction,
 	    const CallbackType & s_callback,
-	    const std::function<bool(void)> & s_when_interested = [] () { return true; } )
+	    const std::function<bool(void)> & s_when_interested = nullptr )
       : fd( s_fd ), direction( s_direction ), callback( s_callback ),
 	when_interested( s_when_interested ), active( true ) {}
 
     unsigned int service_count() const;
+
+    /* should the fd be polled for this action right now? */
+    bool interested() const;
   };
 
-private:
-  std::vector< Action > actions_;
-  std::vector< pollfd > pollfds_;
+  /* kernel interface used to wait for events */
+  enum class Backend { Poll, Epoll };
+
+  /* handle for removing an action */
+  typedef size_t ActionID;
+
+  /* handle for cancelling or resetting a timer */
+  typedef uint64_t TimerID;
 
-public:
   struct Result
   {
     enum class Type { Success, Timeout, Exit } result;
@@ -52,9 +65,123 @@ public:
       : result( s_result ), exit_status( s_status ) {}
   };
 
-  Poller() : actions_(), pollfds_() {}
-  void add_action( Action action );
+private:
+  Backend backend_;
+
+  /* action slots (empty when removed) and slots free for reuse */
+  std::vector< std::unique_ptr< Action > > actions_;
+  std::vector< ActionID > free_ids_;
+  std::vector< std::unique_ptr< Action > > retired_actions_;
+
+  /* Poll backend: rebuilt on every call */
+  std::vector< pollfd > pollfds_;
+  std::vector< ActionID > pollfd_actions_;
+  std::vector< int > error_fds_; /* fds with an interested Error action */
+  std::vector< int > in_fds_; /* fds with an interested In action */
+  std::vector< int > out_fds_; /* fds with an interested Out action */
+
+  /* Epoll backend: per-fd registration state, indexed by fd number */
+  struct Registration
+  {
+    static const ActionID NONE = -1;
+    ActionID in, out, error;
+    uint32_t events; /* as last told to the kernel (EPOLLERR: has an interested Error action) */
+    bool registered, dirty;
+    Registration() : in( NONE ), out( NONE ), error( NONE ), events( 0 ),
+		     registered( false ), dirty( false ) {}
+
+    ActionID & action( const Action::PollDirection direction )
+    {
+      return direction == Action::In ? in : direction == Action::Out ? out : error;
+    }
+  };
+
+  FileDescriptor epoll_fd_;
+  std::vector< Registration > registrations_;
+  std::shared_ptr< Poller * > self_; /* lets fds with buffered output find a live Poller */
+  std::vector< ActionID > dynamic_actions_; /* actions with a when_interested predicate */
+  std::vector< int > dirty_fds_;
+  size_t armed_fds_;
+
+  /* Timers: slots (reused, with a generation count so stale TimerIDs are harmless),
+     a min-heap of deadlines, and one timerfd armed for the earliest deadline;
+     each heap entry carries its slot's sequence number when it was pushed,
+     and only the latest entry for a slot (matching the sequence) is live */
+  struct Timer
+  {
+    uint64_t deadline_ns, period_ns;
+    Action::CallbackType callback;
+    uint32_t generation;
+    uint64_t sequence;
+    bool pending;
+    Timer() : deadline_ns( 0 ), period_ns( 0 ), callback(), generation( 0 ), sequence( 0 ),
+	      pending( false ) {}
+  };
+
+  struct TimerDeadline
+  {
+    uint64_t deadline_ns;
+    size_t slot;
+    uint64_t sequence;
+    bool operator>( const TimerDeadline & other ) const { return deadline_ns > other.deadline_ns; }
+  };
+
+  FileDescriptor timer_fd_;
+  std::vector< Timer > timers_;
+  std::vector< size_t > free_timers_;
+  std::vector< TimerDeadline > timer_heap_;
+  size_t pending_timers_;
+  uint64_t armed_deadline_ns_;
+
+  /* the timer a TimerID refers to, or nullptr if it has fired or been cancelled */
+  Timer * find_timer( const TimerID id );
+  void release_timer( const size_t slot );
+  void push_deadline( const size_t slot );
+
+  /* point the timerfd at the earliest pending deadline */
+  void arm_timer_fd();
+
+  /* run every timer that is due; returns true if the poller should exit */
+  bool run_timers( Result & result );
+
+  Result poll_with_poll( const int & timeout_ms );
+  Result poll_with_epoll( const int & timeout_ms );
+
+  /* run an action's callback; returns true if the poller should exit */
+  bool dispatch( const ActionID id, Result & result );
+
+  /* Epoll backend: note that an fd's interest may have changed, then tell the kernel */
+  void mark_dirty( const int fd );
+  void update_registrations();
+
+public:
+  Poller( const Backend backend = Backend::Poll );
+  ActionID add_action( Action action );
+
+  /* remove an action (must be called before the action's fd is destroyed,
+     whose number may then be reused at once)
+
+     An Out action on an fd with buffered output is polled only while
+     output is waiting; its callback should flush() the fd. */
+  void remove_action( const ActionID id );
+
+  /* run callback once after delay_us, then every period_us (if nonzero)
+     until it returns Cancel or the timer is cancelled */
+  TimerID add_timer( const uint64_t delay_us,
+		     const Action::CallbackType & callback,
+		     const uint64_t period_us = 0 );
+
+  /* cancel a timer (no effect if it has already fired or been cancelled) */
+  void cancel_timer( const TimerID id );
+
+  /* restart a pending timer's countdown so it next fires after delay_us */
+  void reset_timer( const TimerID id, const uint64_t delay_us );
+
   Result poll( const int & timeout_ms );
+
+  /* forbid copying Poller objects or assigning them */
+  Poller( const Poller & other ) = delete;
+  const Poller & operator=( const Poller & other ) = delete;
 };
 
 namespace PollerShortNames {
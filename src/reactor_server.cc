@@ -0,0 +1,370 @@
+#include <csignal>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reactor_server.hh"
+#include "cpu_affinity.hh"
+#include "util.hh"
+
+using namespace std;
+using namespace PollerShortNames;
+
+/* most connections a reactor accepts per wakeup, so the ones it
+   already has keep being served during a burst of new ones */
+static const unsigned int ACCEPTS_PER_WAKEUP = 64;
+
+/* how long a reactor out of file descriptors leaves new connections waiting */
+static const uint64_t ACCEPT_BACKOFF_US = 100000;
+
+/* output buffered for a client before it stops being read from, and
+   how far the client must catch up before it is read from again */
+static const size_t OUTPUT_HIGH_WATERMARK = 1024 * 1024;
+static const size_t OUTPUT_LOW_WATERMARK = 256 * 1024;
+
+/* one event loop: a Poller, a listening socket, and the connections it accepted */
+class ReactorServer::Reactor
+{
+private:
+  Handlers handlers_;
+  int cpu_;
+
+  Poller poller_;
+  TCPSocket listener_;
+  Poller::ActionID accept_action_;
+  FileDescriptor stop_fd_;
+
+  /* indexed by fd number */
+  vector< unique_ptr<Connection> > connections_;
+
+  /* connections that are over, to destroy once the poll returns */
+  vector<int> finished_;
+
+  friend class Connection;
+
+  Poller::ActionID add_accept_action();
+  void accept_connections();
+  void receive( Connection & connection );
+
+public:
+  Reactor( const Address & address, const Handlers & handlers, const int cpu );
+
+  Address local_address() const { return listener_.local_address(); }
+
+  /* serve connections until stop() (on the reactor's own thread) */
+  void run();
+
+  /* make run() return (from any thread) */
+  void stop();
+
+  Reactor( const Reactor & other ) = delete;
+  const Reactor & operator=( const Reactor & other ) = delete;
+};
+
+ReactorServer::Reactor::Reactor( const Address & address, const Handlers & handlers, const int cpu )
+  : handlers_( handlers ),
+    cpu_( cpu ),
+    poller_( Poller::Backend::Epoll ),
+    listener_(),
+    accept_action_(),
+    stop_fd_( SystemCall( "eventfd", eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) ),
+    connections_(),
+    finished_()
+{
+  listener_.set_reuseaddr();
+  listener_.set_reuseport();
+  listener_.bind( address );
+  listener_.listen( SOMAXCONN );
+  listener_.set_blocking( false );
+
+  accept_action_ = add_accept_action();
+
+  poller_.add_action( Action( stop_fd_, Direction::In,
+			      [&] () {
+				stop_fd_.read();
+				return ResultType::Exit;
+			      } ) );
+}
+
+Poller::ActionID ReactorServer::Reactor::add_accept_action()
+{
+  return poller_.add_action( Action( listener_, Direction::In,
+				     [&] () {
+				       accept_connections();
+				       return ResultType::Continue;
+				     } ) );
+}
+
+void ReactorServer::Reactor::accept_connections()
+{
+  for ( unsigned int i = 0; i < ACCEPTS_PER_WAKEUP; i++ ) {
+    unique_ptr<TCPSocket> socket;
+    try {
+      socket = listener_.try_accept();
+    } catch ( const unix_error & e ) {
+      if ( e.code().value() != EMFILE and e.code().value() != ENFILE ) {
+	throw;
+      }
+
+      /* out of file descriptors: stop listening for a while rather
+	 than spin on a connection that can't be accepted */
+      print_exception( e );
+      poller_.remove_action( accept_action_ );
+      poller_.add_timer( ACCEPT_BACKOFF_US, [&] () {
+	  accept_action_ = add_accept_action();
+	  return ResultType::Continue;
+	} );
+      return;
+    }
+
+    if ( not socket ) {
+      return;
+    }
+
+    const int fd = socket->fd_num();
+    unique_ptr<Connection> connection;
+    try {
+      connection.reset( new Connection( *this, move( *socket ) ) );
+    } catch ( const unix_error & ) {
+      continue; /* reset before it could be asked where it's from */
+    }
+
+    Connection * const client = connection.get();
+    client->set_reading( true );
+    client->write_action_ = poller_.add_action( Action( client->socket_, Direction::Out,
+							[client] () {
+							  client->flush();
+							  return ResultType::Continue;
+							} ) );
+
+    if ( connections_.size() <= size_t( fd ) ) {
+      connections_.resize( fd + 1 );
+    }
+    connections_[ fd ] = move( connection );
+
+    if ( handlers_.on_open ) {
+      handlers_.on_open( *client );
+    }
+  }
+}
+
+void ReactorServer::Reactor::receive( Connection & connection )
+{
+  string chunk;
+  try {
+    chunk = connection.socket_.read();
+  } catch ( const unix_error & ) {
+    connection.finish(); /* e.g., reset by the client */
+    return;
+  }
+
+  if ( connection.socket_.eof() ) {
+    connection.close(); /* the client is done sending, but may still be reading */
+  } else if ( not chunk.empty() ) {
+    handlers_.on_data( connection, chunk );
+  }
+}
+
+void ReactorServer::Reactor::run()
+{
+  try {
+    if ( cpu_ >= 0 ) {
+      pin_to_cpu( cpu_ );
+    }
+
+    while ( true ) {
+      const auto result = poller_.poll( -1 );
+
+      for ( const int fd : finished_ ) {
+	connections_[ fd ].reset();
+      }
+      finished_.clear();
+
+      if ( result.result == PollResult::Exit ) {
+	break;
+      }
+    }
+  } catch ( const exception & e ) {
+    print_exception( e );
+  }
+
+  /* close whatever is left */
+  for ( auto & connection : connections_ ) {
+    if ( connection ) {
+      connection->finish();
+    }
+  }
+  connections_.clear();
+}
+
+void ReactorServer::Reactor::stop()
+{
+  const uint64_t one = 1;
+  SystemCall( "write", ::write( stop_fd_.fd_num(), &one, sizeof( one ) ) );
+}
+
+ReactorServer::Connection::Connection( Reactor & reactor, TCPSocket && socket )
+  : reactor_( reactor ),
+    socket_( move( socket ) ),
+    peer_( socket_.peer_address() ),
+    read_action_(),
+    write_action_(),
+    reading_( false ),
+    closing_( false ),
+    closed_( false )
+{
+  socket_.set_buffered_output( OUTPUT_LOW_WATERMARK, OUTPUT_HIGH_WATERMARK );
+}
+
+/* poll for (or stop polling for) what the client sends (while reading
+   is paused, output is waiting, so a hang-up or error on the socket goes
+   to the write action, whose flush() fails and finishes the connection) */
+void ReactorServer::Connection::set_reading( const bool reading )
+{
+  if ( reading == reading_ ) {
+    return;
+  }
+
+  if ( reading ) {
+    read_action_ = reactor_.poller_.add_action( Action( socket_, Direction::In,
+							[this] () {
+							  reactor_.receive( *this );
+							  return ResultType::Continue;
+							} ) );
+  } else {
+    reactor_.poller_.remove_action( read_action_ );
+  }
+  reading_ = reading;
+}
+
+/* write now what the kernel will take, and buffer the rest */
+void ReactorServer::Connection::send( const string & data )
+{
+  if ( closing_ or closed_ ) {
+    return;
+  }
+
+  try {
+    socket_.buffered_write( data );
+  } catch ( const unix_error & ) {
+    finish(); /* the client went away */
+    return;
+  }
+
+  if ( not socket_.accepting_output() ) {
+    set_reading( false );
+  }
+}
+
+/* write out as much buffered output as the kernel will take */
+void ReactorServer::Connection::flush()
+{
+  try {
+    socket_.flush();
+  } catch ( const unix_error & ) {
+    finish(); /* e.g., reset by the client (perhaps while it wasn't being read) */
+    return;
+  }
+
+  if ( closing_ ) {
+    if ( socket_.buffered() == 0 ) {
+      finish();
+    }
+  } else if ( socket_.accepting_output() ) {
+    set_reading( true );
+  }
+}
+
+/* stop reading, and close once everything sent has been written */
+void ReactorServer::Connection::close()
+{
+  if ( closing_ or closed_ ) {
+    return;
+  }
+
+  closing_ = true;
+  set_reading( false );
+
+  if ( socket_.buffered() == 0 ) {
+    finish();
+  }
+}
+
+/* stop serving the connection (it is destroyed after this poll) */
+void ReactorServer::Connection::finish()
+{
+  if ( closed_ ) {
+    return;
+  }
+
+  closed_ = true;
+  set_reading( false );
+  reactor_.poller_.remove_action( write_action_ );
+
+  reactor_.finished_.push_back( socket_.fd_num() );
+
+  if ( reactor_.handlers_.on_close ) {
+    reactor_.handlers_.on_close( *this );
+  }
+}
+
+ReactorServer::ReactorServer( const Address & address, const Handlers & handlers,
+			      const unsigned int reactors, const vector<int> & cpus )
+  : reactors_(),
+    threads_()
+{
+  if ( reactors == 0 ) {
+    throw runtime_error( "ReactorServer needs at least one reactor" );
+  }
+
+  if ( not handlers.on_data ) {
+    throw runtime_error( "ReactorServer needs an on_data handler" );
+  }
+
+  signal( SIGPIPE, SIG_IGN );
+
+  /* the first listener settles the port (if it was 0) for the others */
+  for ( unsigned int i = 0; i < reactors; i++ ) {
+    reactors_.emplace_back( new Reactor( i == 0 ? address : reactors_.front()->local_address(),
+					 handlers, cpus.empty() ? -1 : cpus.at( i % cpus.size() ) ) );
+  }
+
+  for ( auto & reactor : reactors_ ) {
+    Reactor * const started = reactor.get();
+    threads_.emplace_back( [started] () { started->run(); } );
+  }
+}
+
+ReactorServer::~ReactorServer()
+{
+  try {
+    stop();
+  } catch ( const exception & e ) {
+    print_exception( e );
+  }
+  wait();
+}
+
+Address ReactorServer::local_address() const
+{
+  return reactors_.front()->local_address();
+}
+
+/* tell the reactors to close their connections and return */
+void ReactorServer::stop()
+{
+  for ( auto & reactor : reactors_ ) {
+    reactor->stop();
+  }
+}
+
+/* wait for the reactors to return */
+void ReactorServer::wait()
+{
+  for ( auto & thread : threads_ ) {
+    if ( thread.joinable() ) {
+      thread.join();
+    }
+  }
+}
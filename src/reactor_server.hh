@@ -0,0 +1,110 @@
+#ifndef REACTOR_SERVER_HH
+#define REACTOR_SERVER_HH
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "address.hh"
+#include "poller.hh"
+#include "socket.hh"
+
+/* a TCP server whose connections are served by a few event-loop threads
+   ("reactors", one per core) instead of a thread each: every reactor has
+   its own Poller and its own listening socket on the server's address
+   (SO_REUSEPORT), so the kernel spreads new connections across reactors
+   and a connection stays with the reactor that accepted it. (Constructing
+   one ignores SIGPIPE, so a client that goes away is just an error.) */
+class ReactorServer
+{
+public:
+  class Reactor;
+
+  /* one client, as seen by the handlers (which may only use it until
+     their callback returns) */
+  class Connection
+  {
+  private:
+    Reactor & reactor_;
+    TCPSocket socket_;
+    Address peer_;
+
+    Poller::ActionID read_action_, write_action_;
+    bool reading_, closing_, closed_;
+
+    friend class Reactor;
+
+    /* poll for (or stop polling for) what the client sends */
+    void set_reading( const bool reading );
+
+    /* write out as much buffered output as the kernel will take, and
+       read again once the client has caught up */
+    void flush();
+
+    /* stop serving the connection (it is destroyed after this poll) */
+    void finish();
+
+  public:
+    Connection( Reactor & reactor, TCPSocket && socket );
+
+    const Address & peer_address() const { return peer_; }
+
+    /* write now what the kernel will take, and buffer the rest to be
+       written as the client makes room for it (a client that falls
+       behind by the high watermark isn't read from until it catches up) */
+    void send( const std::string & data );
+
+    /* bytes waiting for the client to make room */
+    size_t queued() const { return socket_.buffered(); }
+
+    /* stop reading, and close once everything sent has been written */
+    void close();
+
+    Connection( const Connection & other ) = delete;
+    const Connection & operator=( const Connection & other ) = delete;
+  };
+
+  struct Handlers
+  {
+    /* bytes arrived from the client */
+    std::function<void(Connection &, const std::string &)> on_data;
+
+    /* optional: a client connected / the connection is over (either
+       side closed it, or it failed) */
+    std::function<void(Connection &)> on_open, on_close;
+
+    Handlers() : on_data(), on_open(), on_close() {}
+  };
+
+private:
+  std::vector< std::unique_ptr<Reactor> > reactors_;
+  std::vector< std::thread > threads_;
+
+public:
+  /* listen on address (port 0 picks one) with the given number of
+     reactors, each pinned to the next of cpus if there are any; the
+     handlers are called from every reactor's thread */
+  ReactorServer( const Address & address, const Handlers & handlers,
+		 const unsigned int reactors, const std::vector<int> & cpus = {} );
+
+  /* stops and waits for the reactors */
+  ~ReactorServer();
+
+  /* where clients should connect */
+  Address local_address() const;
+
+  unsigned int reactor_count() const { return reactors_.size(); }
+
+  /* tell the reactors to close their connections and return */
+  void stop();
+
+  /* wait for the reactors to return */
+  void wait();
+
+  ReactorServer( const ReactorServer & other ) = delete;
+  const ReactorServer & operator=( const ReactorServer & other ) = delete;
+};
+
+#endif /* REACTOR_SERVER_HH */
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "ring_buffer.hh"
+
+using namespace std;
+
+/* the smallest storage worth allocating */
+static const size_t MINIMUM_CAPACITY = 4096;
+
+RingBuffer::RingBuffer()
+  : storage_(),
+    head_( 0 ),
+    tail_( 0 )
+{}
+
+/* make room for at least needed more bytes */
+void RingBuffer::reserve( const size_t needed )
+{
+  if ( capacity() - size() >= needed ) {
+    return;
+  }
+
+  size_t new_capacity = max( capacity(), MINIMUM_CAPACITY );
+  while ( new_capacity - size() < needed ) {
+    new_capacity *= 2;
+  }
+
+  /* unwrap what is queued to the start of the new storage */
+  vector<char> new_storage( new_capacity );
+  iovec runs[ 2 ];
+  const size_t run_count = readable( runs );
+  size_t offset = 0;
+  for ( size_t i = 0; i < run_count; i++ ) {
+    memcpy( &new_storage[ offset ], runs[ i ].iov_base, runs[ i ].iov_len );
+    offset += runs[ i ].iov_len;
+  }
+
+  storage_.swap( new_storage );
+  head_ = 0;
+  tail_ = offset;
+}
+
+/* queue bytes at the back */
+void RingBuffer::push( const char * const data, const size_t length )
+{
+  if ( length == 0 ) {
+    return;
+  }
+
+  reserve( length );
+
+  const size_t start = tail_ & mask();
+  const size_t first = min( length, capacity() - start );
+  memcpy( &storage_[ start ], data, first );
+  memcpy( &storage_[ 0 ], data + first, length - first );
+  tail_ += length;
+}
+
+/* point runs at the queued bytes, in order */
+size_t RingBuffer::readable( iovec ( & runs )[ 2 ] ) const
+{
+  if ( empty() ) {
+    return 0;
+  }
+
+  const size_t start = head_ & mask();
+  const size_t first = min( size(), capacity() - start );
+  runs[ 0 ] = { const_cast<char *>( &storage_[ start ] ), first };
+  if ( first == size() ) {
+    return 1;
+  }
+
+  runs[ 1 ] = { const_cast<char *>( &storage_[ 0 ] ), size() - first };
+  return 2;
+}
+
+/* point runs at the free space after the queued bytes */
+size_t RingBuffer::writable( iovec ( & runs )[ 2 ] )
+{
+  const size_t free_space = capacity() - size();
+  if ( free_space == 0 ) {
+    return 0;
+  }
+
+  const size_t start = tail_ & mask();
+  const size_t first = min( free_space, capacity() - start );
+  runs[ 0 ] = { &storage_[ start ], first };
+  if ( first == free_space ) {
+    return 1;
+  }
+
+  runs[ 1 ] = { &storage_[ 0 ], free_space - first };
+  return 2;
+}
+
+/* queue length bytes written into the free space */
+void RingBuffer::commit( const size_t length )
+{
+  if ( length > capacity() - size() ) {
+    throw runtime_error( "RingBuffer: commit past the free space" );
+  }
+
+  tail_ += length;
+}
+
+/* the first length queued bytes, in one piece */
+const char * RingBuffer::contiguous( const size_t length )
+{
+  if ( length > size() ) {
+    throw runtime_error( "RingBuffer: contiguous past the end" );
+  }
+
+  if ( empty() ) {
+    return nullptr;
+  }
+
+  /* if they wrap around the end, turn the storage so the front is at the start */
+  const size_t start = head_ & mask();
+  if ( start + length > capacity() ) {
+    const size_t queued = size();
+    rotate( storage_.begin(), storage_.begin() + start, storage_.end() );
+    head_ = 0;
+    tail_ = queued;
+  }
+
+  return &storage_[ head_ & mask() ];
+}
+
+/* take length bytes from the front */
+void RingBuffer::pop( const size_t length )
+{
+  if ( length > size() ) {
+    throw runtime_error( "RingBuffer: pop past the end" );
+  }
+
+  head_ += length;
+}
+
+/* give back the storage, if nothing is queued and it has grown past limit */
+void RingBuffer::release( const size_t limit )
+{
+  if ( empty() and capacity() > limit ) {
+    vector<char>().swap( storage_ );
+    head_ = tail_ = 0;
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef RING_BUFFER_HH
+#define RING_BUFFER_HH
+
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+/* bytes queued in order, in one allocation that is reused as they are
+   taken from the front (and grows, by doubling, only when it is full).
+   The kernel can fill it directly (FileDescriptor::read_into) and drain
+   it directly (FileDescriptor::write_from). */
+class RingBuffer
+{
+private:
+  std::vector<char> storage_; /* empty, or a power of two in size */
+  size_t head_, tail_; /* bytes taken and bytes queued, ever (wrapped by the mask) */
+
+  size_t mask() const { return storage_.size() - 1; }
+
+public:
+  RingBuffer();
+
+  size_t size() const { return tail_ - head_; }
+  bool empty() const { return head_ == tail_; }
+  size_t capacity() const { return storage_.size(); }
+
+  /* queue bytes at the back */
+  void push( const char * const data, const size_t length );
+  void push( const std::string & data ) { push( data.data(), data.size() ); }
+
+  /* point runs at the queued bytes, in order (at most two runs, as the
+     bytes may wrap around the end of the storage); returns how many */
+  size_t readable( iovec ( & runs )[ 2 ] ) const;
+
+  /* take length bytes from the front */
+  void pop( const size_t length );
+
+  /* make room for at least needed more bytes */
+  void reserve( const size_t needed );
+
+  /* point runs at the free space after the queued bytes (at most two);
+     returns how many */
+  size_t writable( iovec ( & runs )[ 2 ] );
+
+  /* queue length bytes written into the free space */
+  void commit( const size_t length );
+
+  /* the first length queued bytes, moved if need be to lie in one piece
+     (e.g. to parse a message in place before popping it) */
+  const char * contiguous( const size_t length );
+
+  /* give back the storage, if nothing is queued and it has grown past limit */
+  void release( const size_t limit );
+};
+
+#endif /* RING_BUFFER_HH */
@@ -1,4 +1,11 @@
+#include <cstring>
+
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 
 #include "socket.hh"
 #include "util.hh"
@@ -75,18 +82,67 @@ void Socket::connect( const Address & address )
 				    address.size() ) );
 }
 
+/* largest datagram we are prepared to receive */
+static const size_t RECEIVE_MTU = 65536;
+
+/* make sure we got the whole datagram */
+static void check_received_flags( const msghdr & header )
+{
+  if ( header.msg_flags & MSG_TRUNC ) {
+    throw runtime_error( "recvfrom (oversized datagram)" );
+  } else if ( header.msg_flags ) {
+    throw runtime_error( "recvfrom (unhandled flag)" );
+  }
+}
+
+/* find the timestamp header (if there is one) */
+uint64_t UDPSocket::received_timestamp( msghdr & header )
+{
+  uint64_t timestamp = -1;
+
+  cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
+  while ( ts_hdr ) {
+    if ( ts_hdr->cmsg_level == SOL_SOCKET
+	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
+      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
+      timestamp = timestamp_us( *kernel_time );
+    } else if ( ts_hdr->cmsg_level == SOL_SOCKET
+		and ts_hdr->cmsg_type == SO_TIMESTAMPING ) {
+      /* the software timestamp is the first of three */
+      const scm_timestamping * const kernel_times
+	= reinterpret_cast<scm_timestamping *>( CMSG_DATA( ts_hdr ) );
+      timestamp = timestamp_us( kernel_times->ts[ 0 ] );
+    }
+    ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
+  }
+
+  return timestamp;
+}
+
+/* find the size of each datagram in a coalesced (GRO) receive */
+size_t UDPSocket::received_segment_size( msghdr & header )
+{
+  for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg; cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+    if ( cmsg->cmsg_level == SOL_UDP and cmsg->cmsg_type == UDP_GRO ) {
+      int segment_size;
+      memcpy( &segment_size, CMSG_DATA( cmsg ), sizeof( segment_size ) );
+      return segment_size;
+    }
+  }
+
+  return 0;
+}
+
 /* receive datagram and where it came from */
 UDPSocket::received_datagram UDPSocket::recv()
 {
-  static const ssize_t RECEIVE_MTU = 65536;
-
   /* receive source address, timestamp and payload */
   Address::raw datagram_source_address;
   msghdr header; zero( header );
   iovec msg_iovec; zero( msg_iovec );
 
   char msg_payload[ RECEIVE_MTU ];
-  char msg_control[ RECEIVE_MTU ];
+  char msg_control[ DatagramPool::CONTROL_SIZE ];
 
   /* prepare to get the source address */
   header.msg_name = &datagram_source_address;
@@ -108,30 +164,79 @@ UDPSocket::received_datagram UDPSocket::recv()
 
   register_read();
 
-  /* make sure we got the whole datagram */
-  if ( header.msg_flags & MSG_TRUNC ) {
-    throw runtime_error( "recvfrom (oversized datagram)" );
-  } else if ( header.msg_flags ) {
-    throw runtime_error( "recvfrom (unhandled flag)" );
+  check_received_flags( header );
+
+  received_datagram ret = { Address( datagram_source_address,
+				     header.msg_namelen ),
+			    received_timestamp( header ),
+			    string( msg_payload, recv_len ) };
+
+  return ret;
+}
+
+/* receive a batch of datagrams straight into caller-owned storage */
+size_t UDPSocket::recv_into( DatagramPool & pool )
+{
+  pool.prepare_to_receive();
+
+  /* block for the first datagram, then take whatever else is already queued */
+  const int count = SystemCall( "recvmmsg",
+				recvmmsg( fd_num(), &pool.headers_[ 0 ], pool.capacity(),
+					  MSG_WAITFORONE, nullptr ) );
+
+  register_read();
+
+  /* one view per datagram (several, for a coalesced GRO buffer) */
+  size_t views = 0;
+
+  for ( int i = 0; i < count; i++ ) {
+    msghdr & header = pool.headers_[ i ].msg_hdr;
+    check_received_flags( header );
+
+    const Address source( pool.addresses_[ i ], header.msg_namelen );
+    const uint64_t timestamp = received_timestamp( header );
+    const size_t length = pool.headers_[ i ].msg_len;
+    const size_t segment_size = received_segment_size( header );
+    char * const data = pool.slot( i );
+
+    size_t offset = 0;
+    do {
+      /* only a GRO buffer can need more views than there are slots (and then only once) */
+      if ( views == pool.datagrams_.size() ) {
+	pool.datagrams_.emplace_back( nullptr );
+      }
+
+      DatagramPool::Datagram & datagram = pool.datagrams_[ views++ ];
+      datagram.address = source;
+      datagram.timestamp = timestamp;
+      datagram.data = data + offset;
+      datagram.length = segment_size ? min( segment_size, length - offset ) : length;
+      offset += datagram.length;
+    } while ( offset < length );
   }
 
-  uint64_t timestamp = -1;
+  pool.size_ = views;
 
-  /* find the timestamp header (if there is one) */
-  cmsghdr *ts_hdr = CMSG_FIRSTHDR( &header );
-  while ( ts_hdr ) {
-    if ( ts_hdr->cmsg_level == SOL_SOCKET
-	 and ts_hdr->cmsg_type == SO_TIMESTAMPNS ) {
-      const timespec * const kernel_time = reinterpret_cast<timespec *>( CMSG_DATA( ts_hdr ) );
-      timestamp = timestamp_ms( *kernel_time );
-    }
-    ts_hdr = CMSG_NXTHDR( &header, ts_hdr );
+  return views;
+}
+
+/* receive a batch of datagrams with one call to recvmmsg */
+vector<UDPSocket::received_datagram> UDPSocket::recv_batch( const size_t max_datagrams )
+{
+  if ( not batch_pool_ or batch_pool_->capacity() != max_datagrams ) {
+    batch_pool_.reset( new DatagramPool( max_datagrams, RECEIVE_MTU ) );
   }
 
-  received_datagram ret = { Address( datagram_source_address,
-				     header.msg_namelen ),
-			    timestamp,
-			    string( msg_payload, recv_len ) };
+  recv_into( *batch_pool_ );
+
+  vector<received_datagram> ret;
+  ret.reserve( batch_pool_->size() );
+
+  for ( const auto & datagram : *batch_pool_ ) {
+    ret.push_back( { datagram.address,
+		     datagram.timestamp,
+		     string( datagram.data, datagram.length ) } );
+  }
 
   return ret;
 }
@@ -170,6 +275,93 @@ void UDPSocket::send( const string & payload )
   }
 }
 
+/* call sendmmsg until every datagram has been sent */
+void UDPSocket::send_all( mmsghdr * const headers, const size_t count )
+{
+  size_t sent = 0;
+  while ( sent < count ) {
+    const int batch_sent = SystemCall( "sendmmsg",
+				       sendmmsg( fd_num(), headers + sent, count - sent, 0 ) );
+
+    register_write();
+
+    for ( int i = 0; i < batch_sent; i++ ) {
+      const mmsghdr & header = headers[ sent + i ];
+
+      size_t length = 0;
+      for ( size_t j = 0; j < header.msg_hdr.msg_iovlen; j++ ) {
+	length += header.msg_hdr.msg_iov[ j ].iov_len;
+      }
+
+      if ( header.msg_len != length ) {
+	throw runtime_error( "datagram payload too big for sendmmsg()" );
+      }
+    }
+
+    sent += batch_sent;
+  }
+}
+
+/* send several datagrams to specified addresses */
+void UDPSocket::sendto_batch( const vector<pair<Address, string>> & datagrams )
+{
+  vector<iovec> msg_iovecs( datagrams.size() );
+  vector<mmsghdr> headers( datagrams.size() );
+
+  for ( size_t i = 0; i < datagrams.size(); i++ ) {
+    const Address & destination = datagrams[ i ].first;
+    const string & payload = datagrams[ i ].second;
+
+    zero( headers[ i ] );
+    msg_iovecs[ i ].iov_base = const_cast<char *>( payload.data() );
+    msg_iovecs[ i ].iov_len = payload.size();
+    headers[ i ].msg_hdr.msg_name = const_cast<sockaddr *>( &destination.to_sockaddr() );
+    headers[ i ].msg_hdr.msg_namelen = destination.size();
+    headers[ i ].msg_hdr.msg_iov = &msg_iovecs[ i ];
+    headers[ i ].msg_hdr.msg_iovlen = 1;
+  }
+
+  send_all( headers.data(), headers.size() );
+}
+
+/* send several datagrams to connected address */
+void UDPSocket::send_batch( const vector<string> & payloads )
+{
+  vector<iovec> msg_iovecs( payloads.size() );
+  vector<mmsghdr> headers( payloads.size() );
+
+  for ( size_t i = 0; i < payloads.size(); i++ ) {
+    zero( headers[ i ] );
+    msg_iovecs[ i ].iov_base = const_cast<char *>( payloads[ i ].data() );
+    msg_iovecs[ i ].iov_len = payloads[ i ].size();
+    headers[ i ].msg_hdr.msg_iov = &msg_iovecs[ i ];
+    headers[ i ].msg_hdr.msg_iovlen = 1;
+  }
+
+  send_all( headers.data(), headers.size() );
+}
+
+/* send the pool's occupied slots to their destination addresses */
+void UDPSocket::sendto_batch( DatagramPool & pool )
+{
+  pool.prepare_to_send( true );
+  send_all( pool.headers_.data(), pool.size() );
+}
+
+/* send the pool's occupied slots to connected address */
+void UDPSocket::send_batch( DatagramPool & pool )
+{
+  pool.prepare_to_send( false );
+  send_all( pool.headers_.data(), pool.size() );
+}
+
+/* send the pool's occupied slots to connected address, segmented by the kernel */
+void UDPSocket::send_batch_segmented( DatagramPool & pool )
+{
+  pool.prepare_to_send_segmented();
+  send_all( pool.headers_.data(), pool.message_count() );
+}
+
 /* mark the socket as listening for incoming connections */
 void TCPSocket::listen( const int backlog )
 {
@@ -183,6 +375,127 @@ TCPSocket TCPSocket::accept()
   return TCPSocket( FileDescriptor( SystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
 }
 
+/* accept a new connection, if one is waiting */
+unique_ptr<TCPSocket> TCPSocket::try_accept()
+{
+  const int fd = ::accept4( fd_num(), nullptr, nullptr, SOCK_NONBLOCK );
+  register_read();
+
+  /* (a connection reset while it waited is no longer waiting) */
+  if ( fd < 0 and (errno == EAGAIN or errno == EWOULDBLOCK or errno == ECONNABORTED) ) {
+    return nullptr;
+  }
+
+  unique_ptr<TCPSocket> ret( new TCPSocket( FileDescriptor( SystemCall( "accept4", fd ) ) ) );
+  ret->register_nonblocking();
+  return ret;
+}
+
+/* send part of a file without reading it into user space */
+size_t TCPSocket::send_file( FileDescriptor & file, const off_t offset, const size_t length )
+{
+  off_t position = offset;
+  size_t sent = 0;
+
+  while ( sent < length ) {
+    const ssize_t bytes_sent = sendfile( fd_num(), file.fd_num(), &position, length - sent );
+    register_write();
+
+    if ( bytes_sent < 0 and not blocking() and (errno == EAGAIN or errno == EWOULDBLOCK) ) {
+      break;
+    }
+
+    SystemCall( "sendfile", bytes_sent );
+    if ( bytes_sent == 0 ) {
+      break; /* the file ended */
+    }
+    sent += bytes_sent;
+
+    if ( not blocking() ) {
+      break;
+    }
+  }
+
+  return sent;
+}
+
+/* let sends leave from user memory without being copied */
+void TCPSocket::set_zerocopy()
+{
+  setsockopt( SOL_SOCKET, SO_ZEROCOPY, int( true ) );
+}
+
+/* send without copying, numbering the send for its completion */
+size_t TCPSocket::send_zerocopy( const char * const data, const size_t length )
+{
+  const ssize_t bytes_sent = ::send( fd_num(), data, length, MSG_ZEROCOPY );
+  register_write();
+
+  /* ENOBUFS: too much memory pinned by sends not yet complete */
+  if ( bytes_sent < 0 and (errno == ENOBUFS
+			   or (not blocking() and (errno == EAGAIN or errno == EWOULDBLOCK))) ) {
+    return 0;
+  }
+
+  SystemCall( "send", bytes_sent );
+  if ( bytes_sent > 0 ) {
+    zerocopy_sent_++;
+  }
+  return bytes_sent;
+}
+
+/* read zerocopy completions from the error queue without blocking */
+size_t TCPSocket::recv_zerocopy_completions()
+{
+  size_t completed = 0;
+
+  while ( true ) {
+    char control[ DatagramPool::CONTROL_SIZE ];
+    msghdr header;
+    zero( header );
+    header.msg_control = control;
+    header.msg_controllen = sizeof( control );
+
+    const ssize_t result = recvmsg( fd_num(), &header, MSG_ERRQUEUE | MSG_DONTWAIT );
+
+    /* an empty queue still counts as a read (the caller may have drained it already) */
+    register_read();
+
+    if ( result < 0 ) {
+      if ( errno != EAGAIN ) {
+	throw unix_error( "recvmsg" );
+      }
+
+      /* a pending socket error (e.g. a reset) isn't queued */
+      int error = 0;
+      socklen_t error_len = sizeof( error );
+      SystemCall( "getsockopt", getsockopt( fd_num(), SOL_SOCKET, SO_ERROR, &error, &error_len ) );
+      if ( error ) {
+	throw unix_error( "socket error", error );
+      }
+
+      return completed;
+    }
+
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg; cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+      if ( (cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR)
+	   or (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR) ) {
+	const sock_extended_err * const error
+	  = reinterpret_cast<sock_extended_err *>( CMSG_DATA( cmsg ) );
+	if ( error->ee_errno != 0 or error->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+	  throw unix_error( "socket error queue", error->ee_errno );
+	}
+
+	/* the sends numbered ee_info through ee_data are complete */
+	const uint32_t range = error->ee_data - error->ee_info + 1;
+	zerocopy_completed_ += range;
+	completed += range;
+	zerocopy_copied_ |= error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+      }
+    }
+  }
+}
+
 /* set socket option */
 template <typename option_type>
 void Socket::setsockopt( const int level, const int option, const option_type & option_value )
@@ -197,8 +510,150 @@ void Socket::set_reuseaddr()
   setsockopt( SOL_SOCKET, SO_REUSEADDR, int( true ) );
 }
 
+/* let several sockets share the local address and port */
+void Socket::set_reuseport()
+{
+  setsockopt( SOL_SOCKET, SO_REUSEPORT, int( true ) );
+}
+
+/* prefer this socket (among a reuseport group) for traffic received on cpu */
+void Socket::set_incoming_cpu( const int cpu )
+{
+  setsockopt( SOL_SOCKET, SO_INCOMING_CPU, cpu );
+}
+
+/* steer the reuseport group's traffic by receiving CPU */
+void Socket::set_reuseport_cpu_steering( const vector<int> & socket_cpus )
+{
+  if ( socket_cpus.empty() ) {
+    throw runtime_error( "reuseport group must have at least one socket" );
+  }
+
+  if ( 2 * socket_cpus.size() + 3 > BPF_MAXINSNS ) {
+    throw runtime_error( "reuseport group is too large to steer by CPU" );
+  }
+
+  /* A = receiving CPU; if A == socket_cpus[ i ] return i (for each i);
+     A %= group size; return A */
+  vector<sock_filter> code;
+  code.push_back( { BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t( SKF_AD_OFF + SKF_AD_CPU ) } );
+  for ( size_t i = 0; i < socket_cpus.size(); i++ ) {
+    code.push_back( { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, uint32_t( socket_cpus[ i ] ) } );
+    code.push_back( { BPF_RET | BPF_K, 0, 0, uint32_t( i ) } );
+  }
+  code.push_back( { BPF_ALU | BPF_MOD | BPF_K, 0, 0, uint32_t( socket_cpus.size() ) } );
+  code.push_back( { BPF_RET | BPF_A, 0, 0, 0 } );
+
+  sock_fprog program;
+  program.len = code.size();
+  program.filter = code.data();
+  setsockopt( SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, program );
+}
+
 /* turn on timestamps on receipt */
 void UDPSocket::set_timestamps()
 {
   setsockopt( SOL_SOCKET, SO_TIMESTAMPNS, int( true ) );
 }
+
+/* cap the rate at which the kernel sends */
+void Socket::set_max_pacing_rate( const uint64_t bytes_per_second )
+{
+  setsockopt( SOL_SOCKET, SO_MAX_PACING_RATE,
+	      bytes_per_second ? bytes_per_second : ~uint64_t( 0 ) );
+}
+
+/* let datagrams carry departure times */
+void UDPSocket::set_txtime()
+{
+  sock_txtime config;
+  zero( config );
+  config.clockid = CLOCK_MONOTONIC;
+  setsockopt( SOL_SOCKET, SO_TXTIME, config );
+}
+
+/* let the kernel coalesce received datagrams (UDP GRO) */
+void UDPSocket::set_gro()
+{
+  setsockopt( SOL_UDP, UDP_GRO, int( true ) );
+}
+
+/* turn on kernel timestamps on receipt and on transmission */
+void UDPSocket::set_timestamping()
+{
+  /* software timestamps, with transmit timestamps tagged by a per-datagram
+     counter (OPT_ID) and sent back without the datagram itself (OPT_TSONLY) */
+  setsockopt( SOL_SOCKET, SO_TIMESTAMPING,
+	      int( SOF_TIMESTAMPING_SOFTWARE
+		   | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+		   | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY ) );
+}
+
+/* read transmit timestamps from the error queue without blocking */
+size_t UDPSocket::recv_tx_timestamps( tx_timestamp * const timestamps, const size_t max_timestamps )
+{
+  const static size_t MAX_BATCH = 32;
+
+  mmsghdr headers[ MAX_BATCH ];
+  char controls[ MAX_BATCH ][ DatagramPool::CONTROL_SIZE ];
+
+  const size_t batch = min( max_timestamps, MAX_BATCH );
+  for ( size_t i = 0; i < batch; i++ ) {
+    zero( headers[ i ] );
+    headers[ i ].msg_hdr.msg_control = controls[ i ];
+    headers[ i ].msg_hdr.msg_controllen = sizeof( controls[ i ] );
+  }
+
+  const int count = recvmmsg( fd_num(), headers, batch, MSG_ERRQUEUE | MSG_DONTWAIT, nullptr );
+
+  /* an empty queue still counts as a read (the caller may have drained it already) */
+  register_read();
+
+  if ( count < 0 ) {
+    if ( errno != EAGAIN ) {
+      throw unix_error( "recvmmsg" );
+    }
+
+    /* a pending socket error (e.g. ICMP port unreachable) isn't queued */
+    int error = 0;
+    socklen_t error_len = sizeof( error );
+    SystemCall( "getsockopt", getsockopt( fd_num(), SOL_SOCKET, SO_ERROR, &error, &error_len ) );
+    if ( error ) {
+      throw unix_error( "socket error", error );
+    }
+
+    return 0;
+  }
+
+  size_t found = 0;
+  for ( int i = 0; i < count; i++ ) {
+    msghdr & header = headers[ i ].msg_hdr;
+
+    bool have_id = false, have_timestamp = false;
+    tx_timestamp & entry = timestamps[ found ];
+
+    for ( cmsghdr * cmsg = CMSG_FIRSTHDR( &header ); cmsg; cmsg = CMSG_NXTHDR( &header, cmsg ) ) {
+      if ( cmsg->cmsg_level == SOL_SOCKET and cmsg->cmsg_type == SO_TIMESTAMPING ) {
+	const scm_timestamping * const kernel_times
+	  = reinterpret_cast<scm_timestamping *>( CMSG_DATA( cmsg ) );
+	entry.timestamp = timestamp_us( kernel_times->ts[ 0 ] );
+	have_timestamp = true;
+      } else if ( (cmsg->cmsg_level == SOL_IP and cmsg->cmsg_type == IP_RECVERR)
+		  or (cmsg->cmsg_level == SOL_IPV6 and cmsg->cmsg_type == IPV6_RECVERR) ) {
+	const sock_extended_err * const error
+	  = reinterpret_cast<sock_extended_err *>( CMSG_DATA( cmsg ) );
+	if ( error->ee_errno != ENOMSG or error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+	  throw unix_error( "socket error queue", error->ee_errno );
+	}
+	entry.id = error->ee_data;
+	have_id = true;
+      }
+    }
+
+    if ( have_id and have_timestamp ) {
+      found++;
+    }
+  }
+
+  return found;
+}
@@ -2,9 +2,12 @@
 #define SOCKET_HH
 
 #include <functional>
+#include <memory>
+#include <vector>
 
 #include "address.hh"
 #include "file_descriptor.hh"
+#include "datagram_pool.hh"
 
 /* class for network sockets (UDP, TCP, etc.) */
 class Socket : public FileDescriptor
@@ -38,13 +41,38 @@ public:
 
   /* allow local address to be reused sooner, at the cost of some robustness */
   void set_reuseaddr();
+
+  /* let several sockets bind the same address and port, with the kernel
+     spreading incoming datagrams (or connections) across them by flow hash */
+  void set_reuseport();
+
+  /* among a reuseport group, prefer this socket for traffic the kernel
+     receives on cpu (Linux 6.2 or later; earlier kernels ignore it) */
+  void set_incoming_cpu( const int cpu );
+
+  /* give this socket's reuseport group a classic BPF program that picks,
+     for traffic the kernel receives on cpu, the first socket (in order of
+     binding) whose entry in socket_cpus is cpu, or if there is none, the
+     (cpu mod group size)th socket; socket_cpus has one entry per socket */
+  void set_reuseport_cpu_steering( const std::vector<int> & socket_cpus );
+
+  /* cap the rate at which the kernel sends (enforced by the fq qdisc);
+     zero means no cap */
+  void set_max_pacing_rate( const uint64_t bytes_per_second );
 };
 
 /* UDP socket */
 class UDPSocket : public Socket
 {
+private:
+  /* scratch space for recv_batch (allocated on first use) */
+  std::unique_ptr<DatagramPool> batch_pool_;
+
+  /* call sendmmsg until every datagram has been sent */
+  void send_all( mmsghdr * const headers, const size_t count );
+
 public:
-  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ) {}
+  UDPSocket() : Socket( AF_INET6, SOCK_DGRAM ), batch_pool_() {}
 
   struct received_datagram {
     Address source_address;
@@ -55,31 +83,120 @@ public:
   /* receive datagram, timestamp, and where it came from */
   received_datagram recv();
 
+  /* receive up to max_datagrams with one syscall
+     (blocks until at least one datagram is available) */
+  std::vector<received_datagram> recv_batch( const size_t max_datagrams = 32 );
+
+  /* receive up to pool.capacity() datagrams directly into the pool's slots
+     with one syscall (blocks until at least one datagram is available) */
+  size_t recv_into( DatagramPool & pool );
+
   /* send datagram to specified address */
   void sendto( const Address & peer, const std::string & payload );
 
   /* send datagram to connected address */
   void send( const std::string & payload );
 
+  /* send several datagrams to specified addresses with as few syscalls as possible */
+  void sendto_batch( const std::vector<std::pair<Address, std::string>> & datagrams );
+
+  /* send several datagrams to connected address with as few syscalls as possible */
+  void send_batch( const std::vector<std::string> & payloads );
+
+  /* send the pool's occupied slots to their addresses / to connected address */
+  void sendto_batch( DatagramPool & pool );
+  void send_batch( DatagramPool & pool );
+
+  /* send the pool's occupied slots to connected address, handing each run of
+     equal-size datagrams to the kernel as one buffer to segment (UDP GSO) */
+  void send_batch_segmented( DatagramPool & pool );
+
+  /* let datagrams carry departure times (CLOCK_MONOTONIC) for the
+     kernel to hold them until (enforced by the fq or etf qdisc) */
+  void set_txtime();
+
+  /* let the kernel coalesce received datagrams into one buffer (UDP GRO);
+     recv_into() splits them back apart */
+  void set_gro();
+
   /* turn on timestamps on receipt */
   void set_timestamps();
+
+  /* turn on kernel timestamps on receipt and on transmission (read back from
+     the error queue, each tagged with the datagram's index among those sent
+     since this call) */
+  void set_timestamping();
+
+  struct tx_timestamp {
+    uint32_t id; /* index of the datagram among those sent since set_timestamping() */
+    uint64_t timestamp; /* when the datagram left the host (microseconds) */
+  };
+
+  /* read up to max_timestamps transmit timestamps from the error queue
+     without blocking; returns how many were read */
+  size_t recv_tx_timestamps( tx_timestamp * const timestamps, const size_t max_timestamps );
+
+  /* find the kernel receive timestamp (in microseconds) in a received message's ancillary data */
+  static uint64_t received_timestamp( msghdr & header );
+
+  /* find the size of each datagram in a coalesced (GRO) receive, or 0 */
+  static size_t received_segment_size( msghdr & header );
 };
 
 /* TCP socket */
 class TCPSocket : public Socket
 {
 private:
+  /* zerocopy sends made, and reported complete by the kernel */
+  uint32_t zerocopy_sent_, zerocopy_completed_;
+  bool zerocopy_copied_;
+
   /* private constructor used by accept() */
-  TCPSocket( FileDescriptor && fd ) : Socket( std::move( fd ), AF_INET6, SOCK_STREAM ) {}
+  TCPSocket( FileDescriptor && fd )
+    : Socket( std::move( fd ), AF_INET6, SOCK_STREAM ),
+      zerocopy_sent_( 0 ), zerocopy_completed_( 0 ), zerocopy_copied_( false ) {}
 
 public:
-  TCPSocket() : Socket( AF_INET6, SOCK_STREAM ) {}
+  TCPSocket()
+    : Socket( AF_INET6, SOCK_STREAM ),
+      zerocopy_sent_( 0 ), zerocopy_completed_( 0 ), zerocopy_copied_( false ) {}
 
   /* mark the socket as listening for incoming connections */
   void listen( const int backlog = 16 );
 
   /* accept a new incoming connection */
   TCPSocket accept();
+
+  /* on a non-blocking listener: accept a new connection, itself
+     non-blocking, or return nullptr if none is waiting */
+  std::unique_ptr<TCPSocket> try_accept();
+
+  /* send length bytes of file from offset without reading them into
+     user space (sendfile); returns how many were sent, which on a
+     blocking socket is all of them unless the file ends first (and on a
+     non-blocking one, what the kernel took, maybe 0) */
+  size_t send_file( FileDescriptor & file, const off_t offset, const size_t length );
+
+  /* let sends leave from user memory without being copied into the
+     kernel (SO_ZEROCOPY; Linux 4.14 or later) */
+  void set_zerocopy();
+
+  /* send from data without copying it (MSG_ZEROCOPY), which must then
+     stay as it is until the kernel reports the send complete; returns
+     how many bytes were sent (0 if the socket's buffer or the kernel's
+     allowance for pinned memory is full: read completions, then retry) */
+  size_t send_zerocopy( const char * const data, const size_t length );
+
+  /* read zerocopy completions from the error queue without blocking
+     (e.g. from a Poller Error action on the socket); returns how many
+     sends they covered */
+  size_t recv_zerocopy_completions();
+
+  /* zerocopy sends not yet reported complete (their memory is still in use) */
+  uint32_t zerocopy_pending() const { return zerocopy_sent_ - zerocopy_completed_; }
+
+  /* did the kernel copy the data after all (as it does over loopback)? */
+  bool zerocopy_copied() const { return zerocopy_copied_; }
 };
 
 #endif /* SOCKET_HH */
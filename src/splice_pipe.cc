@@ -0,0 +1,81 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "splice_pipe.hh"
+#include "util.hh"
+
+using namespace std;
+
+/* the pipe's two ends, as [read, write] */
+static pair<int, int> make_pipe()
+{
+  int fds[ 2 ];
+  SystemCall( "pipe2", pipe2( fds, O_CLOEXEC ) );
+  return make_pair( fds[ 0 ], fds[ 1 ] );
+}
+
+SplicePipe::SplicePipe( const size_t capacity )
+  : SplicePipe( make_pipe(), capacity )
+{}
+
+SplicePipe::SplicePipe( const pair<int, int> & fds, const size_t capacity )
+  : read_end_( fds.first ),
+    write_end_( fds.second ),
+    buffered_( 0 ),
+    capacity_( SystemCall( "fcntl F_SETPIPE_SZ",
+			   fcntl( write_end_.fd_num(), F_SETPIPE_SZ, int( capacity ) ) ) )
+{}
+
+/* splice flags for moving bytes to or from fd */
+static unsigned int splice_flags( const FileDescriptor & fd )
+{
+  return SPLICE_F_MOVE | (fd.blocking() ? 0 : SPLICE_F_NONBLOCK);
+}
+
+/* move bytes from "from" into the pipe */
+size_t SplicePipe::fill( FileDescriptor & from, const size_t limit )
+{
+  const size_t room = min( limit, capacity_ - buffered_ );
+  if ( room == 0 ) {
+    return 0;
+  }
+
+  const ssize_t bytes_moved = splice( from.fd_num(), nullptr, write_end_.fd_num(), nullptr,
+				      room, splice_flags( from ) );
+  from.register_read();
+
+  if ( bytes_moved < 0 and errno == EAGAIN ) {
+    return 0;
+  }
+
+  if ( SystemCall( "splice", bytes_moved ) == 0 ) {
+    from.set_eof();
+  }
+
+  buffered_ += bytes_moved;
+  return bytes_moved;
+}
+
+/* move what the pipe holds to "to" */
+size_t SplicePipe::drain( FileDescriptor & to )
+{
+  size_t total_moved = 0;
+
+  while ( buffered_ > 0 ) {
+    const ssize_t bytes_moved = splice( read_end_.fd_num(), nullptr, to.fd_num(), nullptr,
+					buffered_, splice_flags( to ) );
+    to.register_write();
+
+    if ( bytes_moved < 0 and errno == EAGAIN ) {
+      break;
+    }
+
+    SystemCall( "splice", bytes_moved );
+    buffered_ -= bytes_moved;
+    total_moved += bytes_moved;
+  }
+
+  return total_moved;
+}
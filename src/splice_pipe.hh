@@ -0,0 +1,44 @@
+#ifndef SPLICE_PIPE_HH
+#define SPLICE_PIPE_HH
+
+#include <cstdint>
+#include <utility>
+
+#include "file_descriptor.hh"
+
+/* a kernel pipe used as the buffer between two file descriptors (e.g.,
+   the two sockets of a proxy): splice() moves bytes into it and out of
+   it by reference to the kernel's pages, so they never pass through
+   user space */
+class SplicePipe
+{
+private:
+  FileDescriptor read_end_, write_end_;
+
+  /* bytes in the pipe, and the most it holds */
+  size_t buffered_, capacity_;
+
+  SplicePipe( const std::pair<int, int> & fds, const size_t capacity );
+
+public:
+  /* the kernel may round capacity up (to a power of two pages), or
+     refuse to go above /proc/sys/fs/pipe-max-size */
+  SplicePipe( const size_t capacity = DEFAULT_CAPACITY );
+
+  /* move up to limit bytes from "from" into the pipe; returns how many
+     (0 at EOF, which is then set on "from", or if a non-blocking "from"
+     has nothing). A blocking "from" waits if the pipe is full, so drain
+     it first. */
+  size_t fill( FileDescriptor & from, const size_t limit = SIZE_MAX );
+
+  /* move what the pipe holds to "to"; returns how many bytes (on a
+     non-blocking "to", what it would take, maybe 0) */
+  size_t drain( FileDescriptor & to );
+
+  size_t buffered() const { return buffered_; }
+  size_t capacity() const { return capacity_; }
+
+  const static size_t DEFAULT_CAPACITY = 1024 * 1024;
+};
+
+#endif /* SPLICE_PIPE_HH */
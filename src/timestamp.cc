@@ -1,36 +1,210 @@
+#include <algorithm>
 #include <ctime>
 
+#include "config.h"
 #include "timestamp.hh"
 #include "util.hh"
 
-/* nanoseconds per millisecond */
-static const uint64_t MILLION = 1000000;
+#ifdef HAVE_TSC_CLOCK
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+/* nanoseconds per microsecond and per millisecond */
+static const uint64_t THOUSAND = 1000;
+static const uint64_t MILLION = 1000 * THOUSAND;
 
 /* nanoseconds per second */
 static const uint64_t BILLION = 1000 * MILLION;
 
 /* helper functions */
-static timespec current_time()
+static uint64_t current_time_ns( const clockid_t clock )
 {
   timespec ret;
-  SystemCall( "clock_gettime", clock_gettime( CLOCK_REALTIME, &ret ) );
-  return ret;
+  SystemCall( "clock_gettime", clock_gettime( clock, &ret ) );
+  return ret.tv_sec * BILLION + ret.tv_nsec;
+}
+
+/* CLOCK_MONOTONIC at the start of the program (set as the program
+   starts, rather than at its first use, so no kernel timestamp on the
+   program's sockets can come before it) */
+static const uint64_t EPOCH = current_time_ns( CLOCK_MONOTONIC );
+
+static uint64_t epoch_ns()
+{
+  return EPOCH;
 }
 
-static uint64_t timestamp_ms_raw( const timespec & ts )
+uint64_t timestamp_epoch_ns()
 {
-  const uint64_t nanos = ts.tv_sec * BILLION + ts.tv_nsec;
-  return nanos / MILLION;
+  return epoch_ns();
+}
+
+#ifdef HAVE_TSC_CLOCK
+__extension__ typedef unsigned __int128 uint128;
+
+/* is the TSC invariant (constant rate, running in every C-state)? */
+static bool invariant_tsc()
+{
+  unsigned int eax, ebx, ecx, edx;
+  if ( not __get_cpuid( 0x80000007, &eax, &ebx, &ecx, &edx ) ) {
+    return false;
+  }
+  return edx & (1 << 8);
+}
+
+static const bool TSC_USABLE = invariant_tsc();
+
+/* CLOCK_MONOTONIC and the TSC read at (nearly) the same moment: the
+   tightest of a few tries, with the TSC taken halfway through it */
+struct ClockPair
+{
+  uint64_t ns, tsc;
+
+  static ClockPair read()
+  {
+    ClockPair ret { 0, 0 };
+    uint64_t narrowest = UINT64_MAX;
+    for ( unsigned int i = 0; i < 3; i++ ) {
+      const uint64_t before = __rdtsc();
+      const uint64_t ns = current_time_ns( CLOCK_MONOTONIC );
+      const uint64_t after = __rdtsc();
+      if ( after - before < narrowest ) {
+	narrowest = after - before;
+	ret = { ns, before + narrowest / 2 };
+      }
+    }
+    return ret;
+  }
+};
+
+/* the clocks at the start of the program, which the TSC's rate is
+   measured from */
+static const ClockPair START = ClockPair::read();
+
+/* TSC ticks converted to nanoseconds with a fixed-point multiplier.
+
+   The rate is measured against CLOCK_MONOTONIC over the whole time since
+   the start of the program, and measured again (in each thread) once a
+   stamp is as far from the last measurement as that was from the start,
+   up to a second. A clock pair is read within a few tens of nanoseconds,
+   so the rate is off by well under a part per million after the first
+   second, and a stamp drifts from CLOCK_MONOTONIC (and so from kernel
+   timestamps and SO_TXTIME departures) by at most about a microsecond
+   before it is brought back. A stamp that has fallen behind is stepped
+   forward; one that has run ahead is slowed over the next interval
+   instead, so stamps stay monotonic within a thread.
+
+   For the first CALIBRATION_NS of the program, when the rate could not
+   be measured well, CLOCK_MONOTONIC is read directly. */
+class TSCClock
+{
+private:
+  static const unsigned int SHIFT = 32;
+  static const uint64_t CALIBRATION_NS = 10 * MILLION;
+  static const uint64_t MAX_RECALIBRATION_NS = BILLION;
+
+  uint64_t base_tsc_, base_ns_, multiplier_, recalibration_ticks_;
+
+  uint64_t recalibrate()
+  {
+    const ClockPair now = ClockPair::read();
+    const uint64_t uptime_ns = now.ns - START.ns;
+    if ( uptime_ns < CALIBRATION_NS ) {
+      return now.ns;
+    }
+
+    const uint64_t estimate_ns = base_ns_ + ((uint128( now.tsc - base_tsc_ ) * multiplier_) >> SHIFT);
+    base_tsc_ = now.tsc;
+    base_ns_ = max( now.ns, estimate_ns );
+
+    /* the next interval's ticks, and the nanoseconds to count over them
+       (fewer, by however far ahead of CLOCK_MONOTONIC this clock is) */
+    const uint64_t interval_ns = min( uptime_ns, MAX_RECALIBRATION_NS );
+    recalibration_ticks_ = uint128( now.tsc - START.tsc ) * interval_ns / uptime_ns;
+    const uint64_t ahead_ns = min( base_ns_ - now.ns, interval_ns / 2 );
+    multiplier_ = (uint128( interval_ns - ahead_ns ) << SHIFT) / recalibration_ticks_;
+
+    return base_ns_;
+  }
+
+public:
+  constexpr TSCClock()
+    : base_tsc_( 0 ), base_ns_( 0 ), multiplier_( 0 ), recalibration_ticks_( 0 )
+  {}
+
+  uint64_t ns()
+  {
+    const uint64_t ticks = __rdtsc() - base_tsc_;
+    if ( ticks >= recalibration_ticks_ ) {
+      return recalibrate();
+    }
+    return base_ns_ + ((uint128( ticks ) * multiplier_) >> SHIFT);
+  }
+};
+#endif
+
+/* monotonic nanoseconds (not relative to the epoch) */
+static uint64_t monotonic_ns()
+{
+#ifdef HAVE_TSC_CLOCK
+  static thread_local TSCClock tsc;
+  if ( TSC_USABLE ) {
+    return tsc.ns();
+  }
+#endif
+
+  return current_time_ns( CLOCK_MONOTONIC );
+}
+
+/* Current time since the start of the program */
+uint64_t timestamp_ns()
+{
+  const uint64_t epoch = epoch_ns();
+  return monotonic_ns() - epoch;
+}
+
+uint64_t timestamp_us()
+{
+  return timestamp_ns() / THOUSAND;
 }
 
-/* Current time in milliseconds since the start of the program */
 uint64_t timestamp_ms()
 {
-  return timestamp_ms( current_time() );
+  return timestamp_ns() / MILLION;
+}
+
+/* the realtime clock's offset from the monotonic clock, looked up again
+   once the timestamps being converted are a second away from the last
+   lookup (so a step of the realtime clock is soon caught up with) */
+static uint64_t realtime_offset_ns( const uint64_t realtime_ns )
+{
+  static thread_local uint64_t offset = 0, looked_up_at = 0;
+
+  const int64_t since_lookup = realtime_ns - looked_up_at;
+  if ( looked_up_at == 0 or since_lookup > int64_t( BILLION ) or since_lookup < -int64_t( BILLION ) ) {
+    looked_up_at = current_time_ns( CLOCK_REALTIME );
+    offset = looked_up_at - current_time_ns( CLOCK_MONOTONIC );
+  }
+
+  return offset;
+}
+
+/* Convert a CLOCK_REALTIME timespec to the same timescale */
+uint64_t timestamp_ns( const timespec & ts )
+{
+  const uint64_t realtime_ns = ts.tv_sec * BILLION + ts.tv_nsec;
+  return realtime_ns - realtime_offset_ns( realtime_ns ) - epoch_ns();
+}
+
+uint64_t timestamp_us( const timespec & ts )
+{
+  return timestamp_ns( ts ) / THOUSAND;
 }
 
 uint64_t timestamp_ms( const timespec & ts )
 {
-  const static uint64_t EPOCH = timestamp_ms_raw( current_time() );
-  return timestamp_ms_raw( ts ) - EPOCH;
+  return timestamp_ns( ts ) / MILLION;
 }
@@ -4,8 +4,20 @@
 #include <ctime>
 #include <cstdint>
 
-/* Current time in milliseconds since the start of the program */
+/* Current time since the start of the program, from CLOCK_MONOTONIC
+   (or a calibrated TSC, if configured with --enable-tsc-clock) */
+uint64_t timestamp_ns();
+uint64_t timestamp_us();
 uint64_t timestamp_ms();
+
+/* CLOCK_MONOTONIC at the start of the program (timestamp_ns() plus this
+   is an absolute CLOCK_MONOTONIC time, e.g. for SO_TXTIME) */
+uint64_t timestamp_epoch_ns();
+
+/* Convert a CLOCK_REALTIME timespec (e.g. a kernel receive timestamp)
+   to the same timescale */
+uint64_t timestamp_ns( const timespec & ts );
+uint64_t timestamp_us( const timespec & ts );
 uint64_t timestamp_ms( const timespec & ts );
 
 #endif /* TIMESTAMP_HH */